@@ -165,6 +165,16 @@
 #define UNUSED(var) /*@unused@*/ var
 #endif
 
+/** hint the CPU to start loading the cache line at addr for reading
+ *  (YF_PREFETCH) or writing (YF_PREFETCH_W); no-ops where unsupported */
+#ifdef __GNUC__
+#define YF_PREFETCH(addr)   __builtin_prefetch((addr), 0, 3)
+#define YF_PREFETCH_W(addr) __builtin_prefetch((addr), 1, 3)
+#else
+#define YF_PREFETCH(addr)
+#define YF_PREFETCH_W(addr)
+#endif
+
 
 #ifdef __CYGWIN__
 const char *
@@ -176,6 +176,11 @@ typedef struct yfPBuf_st {
 #endif /* if defined(YAF_ENABLE_P0F) || defined(YAF_ENABLE_FPEXPORT) */
     /** Length of payload available in captured payload buffer. */
     size_t               paylen;
+    /**
+     * Start of the paylen bytes of packet data. Points at payload below
+     * when the packet was copied, or straight into capture memory when the
+     * packet was decoded by yfDecodeBatchToPBuf(); read-only either way. */
+    const uint8_t       *paydata;
     /**
      * Captured payload buffer. Note that this in a convenience field;
      * the actual field is larger than one byte. */
@@ -319,6 +324,7 @@ yfDecodeCtxFree(
  *                 to contain pbuflen bytes.
  * @param pbuf     Packet buffer to decode packet into. Will contain copies of
  *                 all packet data and payload; this buffer is durable.
+ *                 Its paydata points at its own payload.
  * @return TRUE on success (a packet of the required type was decoded and
  *         all the decode structures are valid), FALSE otherwise. Failures
  *         are counted in the decode statistics which can be logged with the
@@ -334,6 +340,48 @@ yfDecodeToPBuf(
     size_t           pbuflen,
     yfPBuf_t        *pbuf);
 
+/** Largest number of packets a capture loop hands to yfDecodeBatchToPBuf() */
+#define YF_DECODE_BATCH 16
+
+/**
+ * Decode a vector of packets into packet buffers. This is equivalent to
+ * calling yfDecodeToPBuf() on each packet in turn, but starts loading the
+ * headers of the next packet and the next packet buffer into the cache
+ * while the current one is decoded, which hides most of the memory latency
+ * when the packets come straight from a capture ring or mapped file.
+ *
+ * Packet buffers of packets which fail to decode are marked invalid by a
+ * zero ptime, exactly as yfDecodeToPBuf() does.
+ *
+ * Unlike yfDecodeToPBuf(), packet data is not copied into the packet
+ * buffers; their paydata points into the packets instead, and the flow
+ * table copies out only the payload a flow still needs. The packets
+ * MUST therefore stay valid until the packet buffers have been passed to
+ * yfFlowPBuf(), which holds for capture rings and mapped files as long as
+ * the packet buffer ring is drained before the memory is released.
+ *
+ * @param ctx       Decode context obtained from yfDecodeCtxAlloc().
+ * @param count     Number of packets in the vectors.
+ * @param pkts      Pointers to the packets to decode.
+ * @param caplens   Captured length of each packet.
+ * @param ptimes    Observation time of each packet in epoch milliseconds.
+ * @param fraginfos Fragment information structure for each packet, or NULL
+ *                  if the caller does not require fragment information.
+ * @param pbuflen   Total length of each packet buffer; see yfDecodeToPBuf().
+ * @param pbufs     Packet buffers to decode the packets into.
+ * @return the number of packets that decoded successfully.
+ */
+size_t
+yfDecodeBatchToPBuf(
+    yfDecodeCtx_t    *ctx,
+    size_t            count,
+    const uint8_t    *pkts[],
+    const size_t      caplens[],
+    const uint64_t    ptimes[],
+    yfIPFragInfo_t    fraginfos[],
+    size_t            pbuflen,
+    yfPBuf_t         *pbufs[]);
+
 /**
  * Utility call to convert a struct timeval (as returned from pcap) into a
  * 64-bit epoch millisecond timestamp suitable for use with yfDecodeToPBuf.
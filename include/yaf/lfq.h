@@ -0,0 +1,137 @@
+/*
+ *  Copyright 2023 Carnegie Mellon University
+ *  See license information in LICENSE.txt.
+ */
+/**
+ *  @internal
+ *
+ *  lfq.h
+ *  Bounded lock-free pointer queue
+ *
+ *  ------------------------------------------------------------------------
+ *  Authors: CERT Network Situational Awareness Group
+ *  ------------------------------------------------------------------------
+ *  @DISTRIBUTION_STATEMENT_BEGIN@
+ *  YAF 3.0.0
+ *
+ *  Copyright 2023 Carnegie Mellon University.
+ *
+ *  NO WARRANTY. THIS CARNEGIE MELLON UNIVERSITY AND SOFTWARE ENGINEERING
+ *  INSTITUTE MATERIAL IS FURNISHED ON AN "AS-IS" BASIS. CARNEGIE MELLON
+ *  UNIVERSITY MAKES NO WARRANTIES OF ANY KIND, EITHER EXPRESSED OR IMPLIED,
+ *  AS TO ANY MATTER INCLUDING, BUT NOT LIMITED TO, WARRANTY OF FITNESS FOR
+ *  PURPOSE OR MERCHANTABILITY, EXCLUSIVITY, OR RESULTS OBTAINED FROM USE OF
+ *  THE MATERIAL. CARNEGIE MELLON UNIVERSITY DOES NOT MAKE ANY WARRANTY OF
+ *  ANY KIND WITH RESPECT TO FREEDOM FROM PATENT, TRADEMARK, OR COPYRIGHT
+ *  INFRINGEMENT.
+ *
+ *  Licensed under a GNU GPL 2.0-style license, please see LICENSE.txt or
+ *  contact permission@sei.cmu.edu for full terms.
+ *
+ *  [DISTRIBUTION STATEMENT A] This material has been approved for public
+ *  release and unlimited distribution.  Please see Copyright notice for
+ *  non-US Government use and distribution.
+ *
+ *  GOVERNMENT PURPOSE RIGHTS – Software and Software Documentation
+ *  Contract No.: FA8702-15-D-0002
+ *  Contractor Name: Carnegie Mellon University
+ *  Contractor Address: 4500 Fifth Avenue, Pittsburgh, PA 15213
+ *
+ *  The Government's rights to use, modify, reproduce, release, perform,
+ *  display, or disclose this software are restricted by paragraph (b)(2) of
+ *  the Rights in Noncommercial Computer Software and Noncommercial Computer
+ *  Software Documentation clause contained in the above identified
+ *  contract. No restrictions apply after the expiration date shown
+ *  above. Any reproduction of the software or portions thereof marked with
+ *  this legend must also reproduce the markings.
+ *
+ *  This Software includes and/or makes use of Third-Party Software each
+ *  subject to its own license.
+ *
+ *  DM23-2317
+ *  @DISTRIBUTION_STATEMENT_END@
+ *  ------------------------------------------------------------------------
+ */
+
+/**
+ *  @file
+ *  Bounded lock-free queue of pointers.  Any number of threads may push
+ *  and pop concurrently; each cell carries a sequence number that tells a
+ *  pusher when the cell is free and a popper when it is filled, so neither
+ *  side ever takes a lock or waits for the other.  A full queue refuses a
+ *  push rather than growing, leaving the caller to decide how to apply
+ *  backpressure.
+ */
+
+/* idem hack */
+#ifndef _YAF_LFQ_H_
+#define _YAF_LFQ_H_
+#include <yaf/autoinc.h>
+
+struct lfqQueue_st;
+typedef struct lfqQueue_st lfqQueue_t;
+
+/**
+ *  Allocate an empty queue.
+ *
+ *  @param capacity  number of pointers the queue holds, rounded up to a
+ *                   power of two
+ *  @return a new queue
+ */
+lfqQueue_t *
+lfqAlloc(
+    size_t   capacity);
+
+/**
+ *  Free a queue.  Pointers still queued are not freed.
+ *
+ *  @param q  queue to free
+ */
+void
+lfqFree(
+    lfqQueue_t  *q);
+
+/**
+ *  Add a pointer to the tail of a queue.
+ *
+ *  @param q     queue to push onto
+ *  @param item  pointer to push; must not be NULL
+ *  @return TRUE if pushed, FALSE if the queue was full
+ */
+gboolean
+lfqPush(
+    lfqQueue_t  *q,
+    void        *item);
+
+/**
+ *  Take the pointer at the head of a queue.
+ *
+ *  @param q  queue to pop from
+ *  @return the pointer, or NULL if the queue was empty
+ */
+void *
+lfqPop(
+    lfqQueue_t  *q);
+
+/**
+ *  Get the number of pointers in a queue.  With other threads pushing and
+ *  popping this is only a snapshot.
+ *
+ *  @param q  queue to query
+ *  @return number of pointers queued
+ */
+size_t
+lfqCount(
+    const lfqQueue_t  *q);
+
+/**
+ *  Get the number of pointers a queue holds.
+ *
+ *  @param q  queue to query
+ *  @return capacity of the queue
+ */
+size_t
+lfqCapacity(
+    const lfqQueue_t  *q);
+
+#endif /* ifndef _YAF_LFQ_H_ */
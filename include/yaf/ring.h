@@ -71,10 +71,30 @@ rgaAlloc(
     size_t   elt_sz,
     size_t   cap);
 
+rgaRing_t *
+rgaAllocVar(
+    size_t   elt_sz,
+    size_t   cap);
+
 void
 rgaFree(
     rgaRing_t  *ring);
 
+uint8_t *
+rgaReserveHead(
+    rgaRing_t  *ring,
+    size_t      len);
+
+void
+rgaCommitHead(
+    rgaRing_t  *ring,
+    size_t      len);
+
+void
+rgaCommitHeadData(
+    rgaRing_t  *ring,
+    size_t      len);
+
 uint8_t *
 rgaNextHead(
     rgaRing_t  *ring);
@@ -95,30 +115,46 @@ size_t
 rgaPeak(
     rgaRing_t  *ring);
 
-#ifdef YAF_RING_THREAD
+/*
+ *  Threaded rings hold fixed size elements passed from one producer thread
+ *  to one consumer thread without locks.  The producer reserves free
+ *  elements at the head, fills them, and releases them to the consumer;
+ *  the consumer reserves filled elements at the tail, processes them, and
+ *  releases them back.  Reserving may wait, spinning first and then
+ *  sleeping, until the other side releases some or the ring is
+ *  interrupted; after an interrupt the consumer still gets what was
+ *  released before it.  The single-threaded calls above must not be used
+ *  on a threaded ring, except rgaCount() and rgaPeak().
+ */
 
 rgaRing_t *
 rgaAllocThreaded(
     size_t   elt_sz,
     size_t   cap);
 
-uint8_t *
-rgaWaitHead(
-    rgaRing_t  *ring);
+size_t
+rgaReserveHeadN(
+    rgaRing_t  *ring,
+    uint8_t    *elts[],
+    size_t      n,
+    gboolean    wait);
 
 void
-rgaReleaseHead(
+rgaReleaseHeadN(
     rgaRing_t  *ring,
-    size_t      rsv);
+    size_t      n);
 
-uint8_t *
-rgaWaitTail(
-    rgaRing_t  *ring);
+size_t
+rgaReserveTailN(
+    rgaRing_t  *ring,
+    uint8_t    *elts[],
+    size_t      n,
+    gboolean    wait);
 
 void
-rgaReleaseTail(
+rgaReleaseTailN(
     rgaRing_t  *ring,
-    size_t      rsv);
+    size_t      n);
 
 void
 rgaSetInterrupt(
@@ -128,5 +164,4 @@ void
 rgaClearInterrupt(
     rgaRing_t  *ring);
 
-#endif /* ifdef YAF_RING_THREAD */
 #endif /* ifndef _YAF_RING_H_ */
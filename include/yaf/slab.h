@@ -0,0 +1,194 @@
+/*
+ *  Copyright 2023 Carnegie Mellon University
+ *  See license information in LICENSE.txt.
+ */
+/**
+ *  @internal
+ *
+ *  slab.h
+ *  Size-class slab allocator
+ *
+ *  ------------------------------------------------------------------------
+ *  Authors: CERT Network Situational Awareness Group
+ *  ------------------------------------------------------------------------
+ *  @DISTRIBUTION_STATEMENT_BEGIN@
+ *  YAF 3.0.0
+ *
+ *  Copyright 2023 Carnegie Mellon University.
+ *
+ *  NO WARRANTY. THIS CARNEGIE MELLON UNIVERSITY AND SOFTWARE ENGINEERING
+ *  INSTITUTE MATERIAL IS FURNISHED ON AN "AS-IS" BASIS. CARNEGIE MELLON
+ *  UNIVERSITY MAKES NO WARRANTIES OF ANY KIND, EITHER EXPRESSED OR IMPLIED,
+ *  AS TO ANY MATTER INCLUDING, BUT NOT LIMITED TO, WARRANTY OF FITNESS FOR
+ *  PURPOSE OR MERCHANTABILITY, EXCLUSIVITY, OR RESULTS OBTAINED FROM USE OF
+ *  THE MATERIAL. CARNEGIE MELLON UNIVERSITY DOES NOT MAKE ANY WARRANTY OF
+ *  ANY KIND WITH RESPECT TO FREEDOM FROM PATENT, TRADEMARK, OR COPYRIGHT
+ *  INFRINGEMENT.
+ *
+ *  Licensed under a GNU GPL 2.0-style license, please see LICENSE.txt or
+ *  contact permission@sei.cmu.edu for full terms.
+ *
+ *  [DISTRIBUTION STATEMENT A] This material has been approved for public
+ *  release and unlimited distribution.  Please see Copyright notice for
+ *  non-US Government use and distribution.
+ *
+ *  GOVERNMENT PURPOSE RIGHTS – Software and Software Documentation
+ *  Contract No.: FA8702-15-D-0002
+ *  Contractor Name: Carnegie Mellon University
+ *  Contractor Address: 4500 Fifth Avenue, Pittsburgh, PA 15213
+ *
+ *  The Government's rights to use, modify, reproduce, release, perform,
+ *  display, or disclose this software are restricted by paragraph (b)(2) of
+ *  the Rights in Noncommercial Computer Software and Noncommercial Computer
+ *  Software Documentation clause contained in the above identified
+ *  contract. No restrictions apply after the expiration date shown
+ *  above. Any reproduction of the software or portions thereof marked with
+ *  this legend must also reproduce the markings.
+ *
+ *  This Software includes and/or makes use of Third-Party Software each
+ *  subject to its own license.
+ *
+ *  DM23-2317
+ *  @DISTRIBUTION_STATEMENT_END@
+ *  ------------------------------------------------------------------------
+ */
+
+/**
+ *  @file
+ *  Size-class slab allocator.  An arena hands out zeroed blocks from
+ *  per-size-class free lists carved out of large, optionally hugepage
+ *  backed, chunks, and accounts the bytes in use per subsystem.  An arena
+ *  is not thread safe; each flow table owns one.
+ */
+
+/* idem hack */
+#ifndef _YAF_SLAB_H_
+#define _YAF_SLAB_H_
+#include <yaf/autoinc.h>
+
+/**
+ *  Subsystems whose slab memory is accounted separately.
+ */
+typedef enum slbSubsys_en {
+    /** Flow nodes */
+    SLB_FLOW = 0,
+    /** Captured payload and payload boundaries */
+    SLB_PAYLOAD,
+    /** Extended flow statistics (--flow-stats) */
+    SLB_STATS,
+    /** Application labeling and DPI flow contexts */
+    SLB_DPI,
+    /** Packet banners for --fpexport */
+    SLB_FPEXPORT,
+    /** Number of subsystems */
+    SLB_SUBSYS_COUNT
+} slbSubsys_t;
+
+struct slbArena_st;
+typedef struct slbArena_st slbArena_t;
+
+/**
+ *  Allocate an empty slab arena.
+ *
+ *  @param hugepages  if TRUE, back the arena with huge pages where the
+ *                    system has them available
+ *  @return a new arena
+ */
+slbArena_t *
+slbArenaAlloc(
+    gboolean   hugepages);
+
+/**
+ *  Free a slab arena and every block allocated from it.
+ *
+ *  @param arena  arena to free
+ */
+void
+slbArenaFree(
+    slbArena_t  *arena);
+
+/**
+ *  Allocate a zeroed block of `sz` bytes, accounted to `subsys`.
+ *
+ *  @param arena   arena to allocate from
+ *  @param subsys  subsystem to account the block to
+ *  @param sz      size of the block
+ *  @return the block
+ */
+void *
+slbAlloc0(
+    slbArena_t   *arena,
+    slbSubsys_t   subsys,
+    size_t        sz);
+
+/**
+ *  Return a block to the arena.  `subsys` and `sz` must be those it was
+ *  allocated with.
+ *
+ *  @param arena   arena the block came from
+ *  @param subsys  subsystem the block is accounted to
+ *  @param sz      size of the block
+ *  @param p       the block
+ */
+void
+slbFree(
+    slbArena_t   *arena,
+    slbSubsys_t   subsys,
+    size_t        sz,
+    void         *p);
+
+/**
+ *  Get the number of bytes a subsystem has allocated and not freed,
+ *  including size class rounding.
+ *
+ *  @param arena   arena to query
+ *  @param subsys  subsystem to query
+ *  @return bytes in use
+ */
+size_t
+slbInUse(
+    const slbArena_t  *arena,
+    slbSubsys_t        subsys);
+
+/**
+ *  Get the number of bytes all subsystems have allocated and not freed.
+ *
+ *  @param arena   arena to query
+ *  @return bytes in use
+ */
+size_t
+slbInUseTotal(
+    const slbArena_t  *arena);
+
+/**
+ *  Get the most bytes a subsystem has had in use at one time.
+ *
+ *  @param arena   arena to query
+ *  @param subsys  subsystem to query
+ *  @return peak bytes in use
+ */
+size_t
+slbPeak(
+    const slbArena_t  *arena,
+    slbSubsys_t        subsys);
+
+/**
+ *  Get the number of bytes an arena has mapped from the system.
+ *
+ *  @param arena   arena to query
+ *  @return bytes mapped
+ */
+size_t
+slbMapped(
+    const slbArena_t  *arena);
+
+/**
+ *  Log the per-subsystem accounting of an arena at debug level.
+ *
+ *  @param arena   arena to log
+ */
+void
+slbDumpStats(
+    const slbArena_t  *arena);
+
+#endif /* ifndef _YAF_SLAB_H_ */
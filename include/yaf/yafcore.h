@@ -367,12 +367,12 @@ typedef struct yfFlowVal_st {
 
 #ifdef YAF_MPLS
 typedef struct yfMPLSNode_st {
-    /** Flow Key Hash Tables */
-    GHashTable  *tab;
+    /** Flow index of the flows carrying these labels */
+    struct yfFlowIndex_st  *tab;
     /** TOP 3 MPLS Labels */
-    uint32_t     mpls_label[YAF_MAX_MPLS_LABELS];
+    uint32_t                mpls_label[YAF_MAX_MPLS_LABELS];
     /** number of mpls nodes hash table */
-    int          tab_count;
+    int                     tab_count;
 } yfMPLSNode_t;
 #endif /* ifdef YAF_MPLS */
 
@@ -391,16 +391,13 @@ typedef struct yfMPTCPFlow_st {
 
 
 /**
- * A YAF flow. Joins a flow key with forward and reverse flow values in time.
- *
- * @note if you edit the layout of this structure, you must make a
- * corresponding edit of the yfFlowIPv4_t structure in yaftab.c
+ * Per-flow state that most flows never need: hook contexts, MAC addresses,
+ * the per-flow pcap file, the MPLS node, MPTCP options, and nDPI labels.
+ * It is kept out of yfFlow_t so that the fields the flow table touches on
+ * every packet fit in fewer cache lines, and is only allocated for a flow
+ * once a feature stores something in it.
  */
-typedef struct yfFlow_st {
-    /** Flow start time in epoch milliseconds */
-    uint64_t        stime;
-    /** Flow end time in epoch milliseconds */
-    uint64_t        etime;
+typedef struct yfFlowCold_st {
 #ifdef YAF_ENABLE_HOOKS
     /**
      * Hook flow context array.  Used by extensions to store per-flow state.
@@ -408,6 +405,42 @@ typedef struct yfFlow_st {
      */
     void           *hfctx[YAF_MAX_HOOKS];
 #endif
+    /** Pcap File Ptr */
+    pcap_dumper_t  *pcap;
+#ifdef YAF_MPLS
+    /** MPLS Node that contains this flow */
+    yfMPLSNode_t   *mpls;
+#endif
+    /** MPTCP Flow */
+    yfMPTCPFlow_t   mptcp;
+#ifdef YAF_ENABLE_NDPI
+    uint16_t        ndpi_master;
+    uint16_t        ndpi_sub;
+    /** nDPI has identified the flow and is not run on it again */
+    uint8_t         ndpi_done;
+#endif
+    /** Keep track of number of pcap files for this flow */
+    uint8_t         pcap_serial;
+    /** Pcap File "ID" so we know when to make entries in metadata file */
+    uint8_t         pcap_file_no;
+    /** src Mac Address */
+    uint8_t         sourceMacAddr[ETHERNET_MAC_ADDR_LENGTH];
+    /** destination Mac Address */
+    uint8_t         destinationMacAddr[ETHERNET_MAC_ADDR_LENGTH];
+} yfFlowCold_t;
+
+/**
+ * A YAF flow. Joins a flow key with forward and reverse flow values in time.
+ *
+ * @note The flow key must remain the last member. The flow table allocates
+ * IPv4 flows without the bytes of the key that only IPv6 addresses use, and
+ * checks at compile time that nothing else lies in them.
+ */
+typedef struct yfFlow_st {
+    /** Flow start time in epoch milliseconds */
+    uint64_t        stime;
+    /** Flow end time in epoch milliseconds */
+    uint64_t        etime;
     /*
      * Reverse flow delta start time in milliseconds. Equivalent to initial
      * packet round-trip time; useful for decomposing biflows into uniflows.
@@ -416,35 +449,19 @@ typedef struct yfFlow_st {
 #ifdef YAF_ENABLE_APPLABEL
     /** Application label for this flow */
     uint16_t        appLabel;
-    /** The ypDPIFlowCtx_t for this flow */
-    void           *dpictx;
-#endif /* ifdef YAF_ENABLE_APPLABEL */
-#ifdef YAF_ENABLE_NDPI
-    uint16_t        ndpi_master;
-    uint16_t        ndpi_sub;
 #endif
     /** Flow termination reason (YAF_END_ macros, per IPFIX standard) */
     uint8_t         reason;
-    /** Keep track of number of pcap files for this flow */
-    uint8_t         pcap_serial;
-    /** src Mac Address */
-    uint8_t         sourceMacAddr[ETHERNET_MAC_ADDR_LENGTH];
-    /** destination Mac Address */
-    uint8_t         destinationMacAddr[ETHERNET_MAC_ADDR_LENGTH];
-    /** Pcap File "ID" so we know when to make entries in metadata file */
-    uint8_t         pcap_file_no;
     /** non empty packet directions, 1, or 0 **/
     uint8_t         pktdir;
     /** reverse ToS  (fwd in flowKey) */
     uint8_t         rtos;
-    /** Pcap File Ptr */
-    pcap_dumper_t  *pcap;
-#ifdef YAF_MPLS
-    /** MPLS Node that contains this flow */
-    yfMPLSNode_t   *mpls;
+#ifdef YAF_ENABLE_APPLABEL
+    /** The ypDPIFlowCtx_t for this flow */
+    void           *dpictx;
 #endif
-    /** MPTCP Flow */
-    yfMPTCPFlow_t   mptcp;
+    /** Rarely used state; NULL until a feature needs it */
+    yfFlowCold_t   *cold;
     /** Forward value */
     yfFlowVal_t     val;
     /** Reverse value */
@@ -469,7 +486,8 @@ yfAlignmentCheck(
 /**
  * Prepare a static flow buffer for use with yaf_flow_read(). Call this before
  * the first yaf_flow_read() call; subsequent reads do not need initialization.
- * This is used to prepare storage for payload information.
+ * This is used to prepare storage for payload information, and allocates
+ * the flow's cold state to hold MAC addresses and other rarely used fields.
  *
  * @param flow  a yfFlow_t to initialize
  */
@@ -479,7 +497,7 @@ yfFlowPrepare(
 
 /**
  * Clean up after a static flow buffer prepared by yfFlowPrepare.
- * This is used to free storage for payload information.
+ * This is used to free storage for payload information and cold state.
  *
  * @param flow  a yfFlow_t to free
  */
@@ -553,7 +571,7 @@ yfWriterForSpec(
 gboolean
 yfWriteOptionsDataFlows(
     void      *yfContext,
-    uint32_t   pcap_drop,
+    uint64_t   pcap_drop,
     GTimer    *timer,
     GError   **err);
 
@@ -574,7 +592,7 @@ yfWriteOptionsDataFlows(
 gboolean
 yfWriteStatsFlow(
     void      *yfContext,
-    uint32_t   pcap_drop,
+    uint64_t   pcap_drop,
     GTimer    *timer,
     GError   **err);
 
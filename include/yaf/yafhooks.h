@@ -255,8 +255,8 @@ yfHookFlowClose(
  * each flow captured by yaf at the time of flow creation.
  *
  * @param flow the pointer to the flow context state structure, but
- * more importantly contains the array of pointers (hfctx) which
- * hold the plugin context state
+ * more importantly its cold state contains the array of pointers (hfctx)
+ * which hold the plugin context state
  * @param yfctx pointer to the yaf ctx which contains configuration specifics
  * for this instance of yaf
  *
@@ -358,6 +358,17 @@ void
 yfHookFreeLists(
     yfFlow_t  *flow);
 
+/**
+ * Returns the number of plugins hooked in. Every flow passed to the other
+ * yfHook functions while this is nonzero must have its cold state, which
+ * holds the plugin context pointers, allocated.
+ *
+ * @return number of plugins hooked in
+ */
+unsigned int
+yfHookCount(
+    void);
+
 
 /*
  *  The following are the prototypes of the functions that must be defined for
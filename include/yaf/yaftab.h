@@ -121,6 +121,13 @@
 #include <yaf/yafcore.h>
 #include <yaf/decode.h>
 
+/**
+ *  Number of packets yfFlowPBufBatch() hashes and prefetches ahead of
+ *  processing them; longer arrays passed to it are taken in chunks of this
+ *  many packets.
+ */
+#define YF_PBUF_BATCH 32
+
 
 /**
  *  A flow table. Opaque. Create with yfFlowTabAlloc() and free with
@@ -128,6 +135,33 @@
  */
 typedef struct yfFlowTab_st yfFlowTab_t;
 
+/**
+ *  A checkpoint of the active flows of one or more flow tables, for a
+ *  restart that picks them up where they were left.  Opaque.  Create with
+ *  yfCheckpointAlloc() and finish with yfCheckpointFree().
+ */
+typedef struct yfCheckpoint_st yfCheckpoint_t;
+
+/**
+ *  A timeout profile for the flows it matches, replacing the flow table's
+ *  idle and active timeouts.  A rule matches either on `applabel`, once a
+ *  flow has that application label, or on `proto` and, for TCP and UDP,
+ *  on `port` as the source or destination port.  An applabel rule
+ *  wins over a port rule, and a port rule over a protocol-only rule.
+ */
+typedef struct yfFlowTimeoutRule_st {
+    /** Idle timeout in milliseconds; 0 keeps the flow table's. */
+    uint64_t   idle_ms;
+    /** Active timeout in milliseconds; 0 keeps the flow table's. */
+    uint64_t   active_ms;
+    /** Application label to match, or 0 to match on `proto` and `port`. */
+    uint16_t   applabel;
+    /** Transport port to match, or 0 to match every port of `proto`. */
+    uint16_t   port;
+    /** IP protocol to match. */
+    uint8_t    proto;
+} yfFlowTimeoutRule_t;
+
 /**
  *  Configuration settings used to initalize the flow table in
  *  yfFlowTabAlloc().
@@ -158,6 +192,23 @@ typedef struct yfFlowTabConfig_st {
      *  and export.
      */
     uint32_t   max_payload;
+    /**
+     *  Memory budget in bytes for the flow table's flows, payload, DPI
+     *  contexts, flow statistics, and index.  Past fixed fractions of the
+     *  budget, new flows capture less payload, then new flows get no DPI
+     *  context, then flows are closed early with YAF_END_RESOURCE.  A value
+     *  of 0 disables the budget.
+     */
+    uint64_t   max_memory;
+    /**
+     *  Number of entries in the pre-flow table, which holds the first packet
+     *  of each new flow until the flow sees a second packet in either
+     *  direction, so that single-packet flows such as scans never take a
+     *  full flow node until they are exported.  Only packets with no
+     *  captured payload are held.  Rounded up to a power of two.  A value
+     *  of 0 disables the pre-flow table.
+     */
+    uint32_t   preflow_size;
 
     /**
      *  If not NULL, and `ndpi` is TRUE, use the provided protocol file to
@@ -192,6 +243,22 @@ typedef struct yfFlowTabConfig_st {
      *  independent flows.
      */
     uint16_t   udp_uniflow_port;
+    /**
+     *  Timeout profiles for matching flows, an array of
+     *  yfFlowTimeoutRule_t, or NULL for none.  Up to 255 rules are used.
+     */
+    GArray    *timeout_rules;
+    /**
+     *  Idle timeout in milliseconds for TCP flows that have seen only SYNs
+     *  and no reverse packets, if shorter than the flow's own.  A value of
+     *  0 disables it.
+     */
+    uint64_t   tcp_syn_ms;
+    /**
+     *  Idle timeout in milliseconds for TCP flows once either side has sent
+     *  a FIN, if shorter than the flow's own.  A value of 0 disables it.
+     */
+    uint64_t   tcp_fin_ms;
 
     /**
      *  If TRUE, then the payload, as limited by max_payload, is sent through
@@ -220,6 +287,11 @@ typedef struct yfFlowTabConfig_st {
      *  transport headers) for external fingerprinting
      */
     gboolean   fpexport_mode;
+    /**
+     *  If TRUE, back the flow table's slab allocator with huge pages,
+     *  falling back to transparent huge pages when none are reserved.
+     */
+    gboolean   hugepages;
     /**
      *  If TRUE, collect and export source and destination Mac Addresses.
      */
@@ -333,6 +405,39 @@ yfGetFlowTabStats(
     uint32_t     *peak,
     uint32_t     *flush);
 
+/**
+ * yfGetFlowTabMemStats
+ * Get counts of the flows the memory budget has affected, for export
+ *
+ * @param flowtab
+ * @param shrunk number of flows created with reduced payload capture
+ * @param nodpi number of flows created without a DPI context
+ * @param evicted number of flows closed early to free memory
+ */
+void
+yfGetFlowTabMemStats(
+    yfFlowTab_t  *flowtab,
+    uint64_t     *shrunk,
+    uint64_t     *nodpi,
+    uint64_t     *evicted);
+
+/**
+ * Hash a flow key so that the key and its reverse hash to the same value.
+ * Software load balancers can use this to keep both directions of a biflow
+ * on the same worker; it is the hash the flow table indexes flows by.  The
+ * hash is keyed with a random key chosen when the first flow table is
+ * allocated, so it differs from run to run and must not be stored.
+ *
+ * @param key     flow key to hash
+ * @param no_vlan TRUE to leave the VLAN out of the hash, as when the flow
+ *                table is configured with no_vlan_in_key
+ * @return 64-bit hash of the flow key
+ */
+uint64_t
+yfFlowKeyHashSymmetric(
+    const yfFlowKey_t  *key,
+    gboolean            no_vlan);
+
 /**
  * Add a decoded packet buffer to a given flow table. Adds the packet to
  * the flow to which it belongs, creating a new flow if necessary. Causes
@@ -350,12 +455,38 @@ yfFlowPBuf(
     size_t        pbuflen,
     yfPBuf_t     *pbuf);
 
+/**
+ * Add several decoded packet buffers to a given flow table, in order, as if
+ * by calling yfFlowPBuf() on each. The flow keys of all the packets are
+ * hashed first and the flow table memory each will touch is prefetched, so
+ * that the cache misses of one packet's lookup overlap the processing of the
+ * packets before it. This pays off once the flow table outgrows the cache;
+ * on a table that fits in it, a batch costs slightly more than the same
+ * packets passed to yfFlowPBuf() one at a time.
+ *
+ * @param flowtab   flow table to add the packets to
+ * @param pbuflen   size of each packet buffer in pbufs
+ * @param pbufs     packet buffers containing decoded packets to add
+ * @param count     number of packet buffers in pbufs
+ */
+void
+yfFlowPBufBatch(
+    yfFlowTab_t  *flowtab,
+    size_t        pbuflen,
+    yfPBuf_t     *pbufs[],
+    size_t        count);
+
 /**
  * Flush closed flows in the given flow table to the given IPFIX Message
  * Buffer. Causes any idle flows to time out, removing them from the active
  * flow table; also enforces the flow table's resource limit. If close is
  * TRUE, additionally closes all active flows and flushes as well.
  *
+ * If the context has an export queue, the closed flows are pushed onto it
+ * for an export thread to write with yfFlowTabExportFlow() instead, and
+ * the fbuf is not touched.  Flows that do not fit wait for the next flush;
+ * when closing, or when too many are waiting, this waits for room.
+ *
  * @param yfContext YAF thread context structure, holds pointers for the
  *                  flowtable from which to flush flows and the fbuf, the
  *                  destination to which the flows should be flushed
@@ -369,6 +500,125 @@ yfFlowTabFlush(
     gboolean   close,
     GError   **err);
 
+/**
+ * Write a closed flow taken from an export queue filled by
+ * yfFlowTabFlush(), then hand it back to the flow table it came from,
+ * which frees it at its next flush or when it is freed.  Every flow taken
+ * from the queue must be passed here exactly once, even if it is not
+ * written.
+ *
+ * @param yfContext YAF context holding the fbuf to write to
+ * @param exflow    flow taken from the export queue
+ * @param write     FALSE to hand the flow back without writing it
+ * @param err       An error description pointer
+ * @return TRUE on success, FALSE if writing the flow failed.
+ */
+gboolean
+yfFlowTabExportFlow(
+    void      *yfContext,
+    void      *exflow,
+    gboolean   write,
+    GError   **err);
+
+/**
+ * Get the end time of a closed flow taken from an export queue, before it
+ * is passed to yfFlowTabExportFlow().
+ *
+ * @param exflow    flow taken from the export queue
+ * @return flow end time in milliseconds
+ */
+uint64_t
+yfFlowTabExportTime(
+    const void  *exflow);
+
+/**
+ * Allocate a checkpoint to be written to a file.  Nothing is written
+ * unless yfCheckpointRequest() is called before the flow tables are
+ * flushed with close set; each of them then moves its active flows into
+ * the checkpoint instead of closing them.
+ *
+ * @param path  file to write the checkpoint to
+ * @return a new checkpoint
+ */
+yfCheckpoint_t *
+yfCheckpointAlloc(
+    const char  *path);
+
+/**
+ * Request that the flow tables write their active flows to a checkpoint
+ * when they are closed.  Safe to call from a signal handler.
+ *
+ * @param ckpt  a checkpoint allocated by yfCheckpointAlloc()
+ */
+void
+yfCheckpointRequest(
+    yfCheckpoint_t  *ckpt);
+
+/**
+ * Finish and free a checkpoint.  If any flows were written to it, the
+ * file is completed and moved into place under the path it was allocated
+ * with; a partial file is never left there.
+ *
+ * @param ckpt  a checkpoint allocated by yfCheckpointAlloc()
+ * @param err   An error description pointer
+ * @return TRUE on success, FALSE if the checkpoint could not be written.
+ */
+gboolean
+yfCheckpointFree(
+    yfCheckpoint_t  *ckpt,
+    GError         **err);
+
+/**
+ * Restore the active flows in a checkpoint file into newly allocated flow
+ * tables, then remove the file.  With more than one flow table, each flow
+ * goes to the table that packets of the flow would go to when dispatched
+ * by yfFlowKeyHashSymmetric().  The checkpoint must have been written by
+ * the same build of yaf with the same flow key settings; the flows get
+ * the payload capture, timeouts, and statistics of the running
+ * configuration.  A missing file is not an error.
+ *
+ * @param flowtabs  the flow tables to restore into
+ * @param count     number of flow tables
+ * @param path      checkpoint file
+ * @param err       An error description pointer
+ * @return TRUE on success, FALSE if the checkpoint is unreadable or does
+ *         not match this yaf.
+ */
+gboolean
+yfFlowTabRestore(
+    yfFlowTab_t  **flowtabs,
+    uint32_t       count,
+    const char    *path,
+    GError       **err);
+
+/**
+ * Keep the packet clock of a flow table running while a live capture sees
+ * no packets, so that idle and active flows still time out on a quiet
+ * link.  The clock runs on from the time of the last packet by the time
+ * elapsed on the monotonic system clock, a little behind so that packets
+ * still in capture buffers are not rejected as out of sequence.  Call
+ * this only for live capture, each time the capture waits for packets and
+ * times out, before flushing the flow table.
+ *
+ * @param flowtab a flow table
+ */
+void
+yfFlowTabAdvanceClock(
+    yfFlowTab_t  *flowtab);
+
+/**
+ * Move the packet clock of a flow table on to a later packet time, as seen
+ * by another flow table sharing the same packets.  Packets older than the
+ * clock are then out of sequence here too.
+ *
+ * @param flowtab a flow table
+ * @param ptime   packet time to move the clock to, if later
+ */
+void
+yfFlowTabAdvanceClockTo(
+    yfFlowTab_t  *flowtab,
+    uint64_t      ptime);
+
 /**
  * Get the current packet clock from a flow table.
  *
@@ -122,6 +122,15 @@ AC_DEFUN([YAF_AC_WRITE_SUMMARY],[
     * PFRING support:               NO"
     fi
 
+    if test "x$afpacket" = xtrue
+    then
+       YF_BUILD_CONF="$YF_BUILD_CONF
+    * AF_PACKET support:            YES"
+    else
+       YF_BUILD_CONF="$YF_BUILD_CONF
+    * AF_PACKET support:            NO"
+    fi
+
     if test "x$nfeapi" = xtrue
     then
        YF_BUILD_CONF="$YF_BUILD_CONF
@@ -467,6 +467,10 @@ struct yfDecodeCtx_st {
     gboolean   gremode;
     GArray    *vxlanports;
     GArray    *geneveports;
+    /* Untagged or single-tagged Ethernet carrying plain TCP/UDP over IP
+     * takes yfDecodeFastPath(); set when no tunnel decoding is on */
+    gboolean   fastpath;
+    uint64_t   fastpath_count;
     /* Statistics */
     struct stats_tag {
         uint32_t   fail_l2hdr;
@@ -1866,21 +1870,201 @@ yfDecodeIP(
 }
 
 
+#if defined(YAF_ENABLE_P0F) || defined(YAF_ENABLE_FPEXPORT)
 /**
- * yfDecodeToPBuf
+ * yfDecodeHeaderVal
+ *
+ * Keep a copy of the start of the IP/{TCP|UDP} headers for p0f and
+ * fingerprint export.
  *
+ */
+static void
+yfDecodeHeaderVal(
+    yfPBuf_t       *pbuf,
+    const uint8_t  *pkt,
+    size_t          caplen)
+{
+    memcpy(pbuf->headerVal, pkt,
+           sizeof(pbuf->headerVal) < caplen ? sizeof(pbuf->headerVal) - 1 :
+           caplen);
+    pbuf->headerLen = sizeof(pbuf->headerVal) < caplen ?
+        sizeof(pbuf->headerVal) - 1 : caplen;
+}
+
+
+#endif /* if defined(YAF_ENABLE_P0F) || defined(YAF_ENABLE_FPEXPORT) */
+
+/**
+ * yfDecodeFastPath
  *
+ * Straight-line decode of the common case: Ethernet with at most one
+ * 802.1Q tag, carrying an unfragmented IPv4 packet without options or an
+ * IPv6 packet without extension headers, carrying a complete TCP or UDP
+ * header.  Fills in the same key, layer 2, TCP and fragment information
+ * as yfDecodeL2() and yfDecodeIP() would.
+ *
+ * Nothing is counted here.  Every packet that is not exactly the common
+ * case returns NULL before any length or type check can fail, and the
+ * caller then decodes it again with the general decoder, which counts
+ * any failure.  The checks are ordered so such packets leave after as few
+ * of them as possible, as they pay for the attempt on top of the general
+ * decode.  Returns a pointer to the payload otherwise.
  *
  */
-gboolean
-yfDecodeToPBuf(
+static const uint8_t *
+yfDecodeFastPath(
+    yfDecodeCtx_t   *ctx,
+    size_t          *caplen,
+    const uint8_t   *pkt,
+    yfFlowKey_t     *key,
+    uint32_t        *iplen,
+    yfTCPInfo_t     *tcpinfo,
+    yfIPFragInfo_t  *fraginfo,
+    yfL2Info_t      *l2info)
+{
+    const yfHdrIPv4_t *iph;
+    const yfHdrIPv6_t *ip6h;
+    const yfHdrTcp_t  *tcph;
+    size_t             len = *caplen;
+    size_t             l2hlen = 14;
+    size_t             l3hlen;
+    size_t             l4hlen;
+    uint16_t           vlan = 0;
+    uint16_t           type;
+    uint16_t           ipoff = 0;
+    uint8_t            proto;
+
+    if (len < 14 + 40) {
+        return NULL;
+    }
+
+    type = g_ntohs(((const yfHdrEn10Mb_t *)pkt)->type);
+    if (type == YF_TYPE_8021Q) {
+        vlan = YF_VLAN_TAG(pkt + 14);
+        type = g_ntohs(((const yfHdr1qShim_t *)(pkt + 14))->type);
+        l2hlen += 4;
+    }
+
+    if (ctx->reqtype && ctx->reqtype != type) {
+        return NULL;
+    }
+
+    /* Layer 3: the general decoder caps the capture at the datagram */
+    if (type == YF_TYPE_IPv4) {
+        iph = (const yfHdrIPv4_t *)(pkt + l2hlen);
+        if (iph->ip_hl != 5 || iph->ip_v != 4) {
+            return NULL;
+        }
+        ipoff = g_ntohs(iph->ip_off);
+        if (ipoff & (YF_IP4_OFFMASK | YF_IP4_MF)) {
+            return NULL;
+        }
+        l3hlen = 20;
+        proto = iph->ip_p;
+        *iplen = g_ntohs(iph->ip_len);
+    } else if (type == YF_TYPE_IPv6) {
+        ip6h = (const yfHdrIPv6_t *)(pkt + l2hlen);
+        l3hlen = 40;
+        proto = ip6h->ip6_nxt;
+        *iplen = g_ntohs(ip6h->ip6_plen) + l3hlen;
+    } else {
+        return NULL;
+    }
+
+    len -= l2hlen;
+    if (len > *iplen) {
+        len = *iplen;
+    }
+
+    /* Layer 4 */
+    if (proto == YF_PROTO_TCP) {
+        if (len < l3hlen + sizeof(yfHdrTcp_t)) {
+            return NULL;
+        }
+        tcph = (const yfHdrTcp_t *)(pkt + l2hlen + l3hlen);
+        l4hlen = tcph->th_off * 4;
+        if (l4hlen < sizeof(yfHdrTcp_t) || len < l3hlen + l4hlen) {
+            return NULL;
+        }
+    } else if (proto == YF_PROTO_UDP) {
+        if (len < l3hlen + sizeof(yfHdrUdp_t)) {
+            return NULL;
+        }
+        l4hlen = sizeof(yfHdrUdp_t);
+        tcph = NULL;
+    } else {
+        return NULL;
+    }
+
+    /* It's the common case; nothing below can fail */
+    memset(l2info, 0, sizeof(*l2info));
+    memcpy(l2info->smac, ((const yfHdrEn10Mb_t *)pkt)->smac, 6);
+    memcpy(l2info->dmac, ((const yfHdrEn10Mb_t *)pkt)->dmac, 6);
+    l2info->vlan_tag = vlan;
+    l2info->l2hlen = l2hlen;
+    key->layer2Id = 0;
+    key->vlanId = vlan;
+    pkt += l2hlen;
+
+    if (type == YF_TYPE_IPv4) {
+        key->version = 4;
+        key->addr.v4.sip = g_ntohl(iph->ip_src);
+        key->addr.v4.dip = g_ntohl(iph->ip_dst);
+        key->tos = iph->ip_tos;
+        if (fraginfo) {
+            fraginfo->offset = ipoff;
+        }
+    } else {
+        memcpy(key->addr.v6.sip, &(ip6h->ip6_src), 16);
+        memcpy(key->addr.v6.dip, &(ip6h->ip6_dst), 16);
+        key->version = 6;
+        key->tos = YF_VCF6_CLASS(ip6h);
+    }
+    key->proto = proto;
+    if (fraginfo) {
+        fraginfo->frag = 0;
+    }
+    pkt += l3hlen;
+    len -= l3hlen;
+
+    if (tcph) {
+        key->sp = g_ntohs(tcph->th_sport);
+        key->dp = g_ntohs(tcph->th_dport);
+        tcpinfo->seq = g_ntohl(tcph->th_seq);
+        tcpinfo->flags = tcph->th_flags;
+        memset(&(tcpinfo->mptcp), 0, sizeof(yfMPTCPInfo_t));
+        if (l4hlen > sizeof(yfHdrTcp_t)) {
+            yfDecodeTCPOptions(pkt + sizeof(yfHdrTcp_t), &len,
+                               tcpinfo, l4hlen);
+        }
+    } else {
+        key->sp = g_ntohs(((const yfHdrUdp_t *)pkt)->uh_sport);
+        key->dp = g_ntohs(((const yfHdrUdp_t *)pkt)->uh_dport);
+    }
+
+    ++(ctx->fastpath_count);
+    *caplen = len - l4hlen;
+    return pkt + l4hlen;
+}
+
+
+/**
+ * yfDecodePBuf
+ *
+ * Decode a packet into a packet buffer; if zerocopy is set, the payload
+ * is referenced in place instead of copied into the packet buffer.
+ *
+ */
+static gboolean
+yfDecodePBuf(
     yfDecodeCtx_t   *ctx,
     uint64_t         ptime,
     size_t           caplen,
     const uint8_t   *pkt,
     yfIPFragInfo_t  *fraginfo,
     size_t           pbuflen,
-    yfPBuf_t        *pbuf)
+    yfPBuf_t        *pbuf,
+    gboolean         zerocopy)
 {
     uint16_t       type;
     yfFlowKey_t   *key = &(pbuf->key);
@@ -1890,6 +2074,7 @@ yfDecodeToPBuf(
  *    &(pbuf->l2info) : NULL;*/
     yfL2Info_t    *l2info = &(pbuf->l2info);
     const uint8_t *ipTcpHeaderStart = NULL;
+    const uint8_t *l4;
     size_t         capb4l2 = caplen;
 
     /* Zero packet buffer time (mark it not yet valid) */
@@ -1909,6 +2094,18 @@ yfDecodeToPBuf(
                 (SIZE_T_CAST)pbuflen, (SIZE_T_CAST)YF_PBUFLEN_NOL2INFO);
     }
 
+    if (ctx->fastpath &&
+        (l4 = yfDecodeFastPath(ctx, &caplen, pkt, key, iplen,
+                               tcpinfo, fraginfo, l2info)))
+    {
+#if defined(YAF_ENABLE_P0F) || defined(YAF_ENABLE_FPEXPORT)
+        yfDecodeHeaderVal(pbuf, pkt + l2info->l2hlen,
+                          capb4l2 - l2info->l2hlen);
+#endif
+        pkt = l4;
+        goto decoded;
+    }
+
     /* Unwrap layer 2 headers */
     if (!(pkt = yfDecodeL2(ctx, &caplen, pkt, &type, l2info))) {
         return FALSE;
@@ -1923,13 +2120,8 @@ yfDecodeToPBuf(
     }
 
 #if defined(YAF_ENABLE_P0F) || defined(YAF_ENABLE_FPEXPORT)
-    /* mark the beginning of the IP/{TCP|UDP} headers */
-    memcpy(pbuf->headerVal, pkt,
-           sizeof(pbuf->headerVal) < caplen ? sizeof(pbuf->headerVal) - 1 :
-           caplen);
-    pbuf->headerLen = sizeof(pbuf->headerVal) < caplen ?
-        sizeof(pbuf->headerVal) - 1 : caplen;
-#endif /* if defined(YAF_ENABLE_P0F) || defined(YAF_ENABLE_FPEXPORT) */
+    yfDecodeHeaderVal(pbuf, pkt, caplen);
+#endif
     /* Now we should have an IP packet. Decode it. */
     if (!(pkt = yfDecodeIP(ctx, type, &caplen, pkt, key, iplen,
                            tcpinfo, fraginfo)))
@@ -1937,6 +2129,8 @@ yfDecodeToPBuf(
         return FALSE;
     }
 
+  decoded:
+
     /* Copy ctime into packet buffer */
     pbuf->ptime = ptime;
 
@@ -1945,19 +2139,93 @@ yfDecodeToPBuf(
 
     caplen = caplen + pbuf->allHeaderLen;
 
-    /* Copy payload if available */
-    if (pbuflen > YF_PBUFLEN_BASE) {
+    /* Copy payload if available, or just point at it */
+    if (pbuflen >= YF_PBUFLEN_BASE) {
         pbuf->paylen = pbuflen - YF_PBUFLEN_BASE;
         if (pbuf->paylen > caplen) {
             pbuf->paylen = caplen;
         }
-        memcpy(pbuf->payload, ipTcpHeaderStart, pbuf->paylen);
+        if (zerocopy) {
+            pbuf->paydata = ipTcpHeaderStart;
+        } else {
+            memcpy(pbuf->payload, ipTcpHeaderStart, pbuf->paylen);
+            pbuf->paydata = pbuf->payload;
+        }
     }
 
     return TRUE;
 }
 
 
+/**
+ * yfDecodeToPBuf
+ *
+ *
+ *
+ */
+gboolean
+yfDecodeToPBuf(
+    yfDecodeCtx_t   *ctx,
+    uint64_t         ptime,
+    size_t           caplen,
+    const uint8_t   *pkt,
+    yfIPFragInfo_t  *fraginfo,
+    size_t           pbuflen,
+    yfPBuf_t        *pbuf)
+{
+    return yfDecodePBuf(ctx, ptime, caplen, pkt, fraginfo, pbuflen, pbuf,
+                        FALSE);
+}
+
+
+/**
+ * yfDecodeBatchToPBuf
+ *
+ * Decode a vector of packets without copying them, prefetching the link
+ * and network headers of the following packet and the start of its
+ * packet buffer before decoding the current one.
+ *
+ */
+size_t
+yfDecodeBatchToPBuf(
+    yfDecodeCtx_t    *ctx,
+    size_t            count,
+    const uint8_t    *pkts[],
+    const size_t      caplens[],
+    const uint64_t    ptimes[],
+    yfIPFragInfo_t    fraginfos[],
+    size_t            pbuflen,
+    yfPBuf_t         *pbufs[])
+{
+    size_t i;
+    size_t ok = 0;
+
+    if (count) {
+        YF_PREFETCH(pkts[0]);
+        YF_PREFETCH_W(pbufs[0]);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (i + 1 < count) {
+            /* L2 plus IP headers usually straddle the first two lines */
+            YF_PREFETCH(pkts[i + 1]);
+            YF_PREFETCH(pkts[i + 1] + 64);
+            YF_PREFETCH_W(pbufs[i + 1]);
+            YF_PREFETCH_W((uint8_t *)pbufs[i + 1] + 64);
+        }
+
+        if (yfDecodePBuf(ctx, ptimes[i], caplens[i], pkts[i],
+                         fraginfos ? &(fraginfos[i]) : NULL,
+                         pbuflen, pbufs[i], TRUE))
+        {
+            ++ok;
+        }
+    }
+
+    return ok;
+}
+
+
 /**
  * yfDecodeCtxAlloc
  *
@@ -1985,6 +2253,14 @@ yfDecodeCtxAlloc(
     ctx->geneveports = geneveports;
     ctx->pcap_caplist = 0;
 
+    /* GRE never reaches the fast path, but tunnels over UDP would */
+    ctx->fastpath = (!vxlanports && !geneveports);
+#ifdef DLT_EN10MB
+    ctx->fastpath = ctx->fastpath && (datalink == DLT_EN10MB);
+#else
+    ctx->fastpath = FALSE;
+#endif
+
     /* Done */
     return ctx;
 }
@@ -2096,6 +2372,12 @@ yfDecodeDumpStats(
     /* fail_l3total = ctx->stats.fail_l3type + ctx->stats.fail_arptype + */
     /*                ctx->stats.fail_8023type + ctx->stats.fail_lldptype; */
 
+    if (ctx->fastpath && packetTotal) {
+        g_debug("Decoded %"PRIu64" packets on the Ethernet fast path: "
+                "(%3.2f%%)", ctx->fastpath_count,
+                ((double)(ctx->fastpath_count) / (double)(packetTotal) * 100));
+    }
+
     if (fail_total) {
         g_debug("Rejected %u packets during decode: (%3.2f%%)",
                 fail_total,
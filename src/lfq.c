@@ -0,0 +1,205 @@
+/*
+ *  Copyright 2023 Carnegie Mellon University
+ *  See license information in LICENSE.txt.
+ */
+/*
+ *  lfq.c
+ *  Bounded lock-free pointer queue
+ *
+ *  ------------------------------------------------------------------------
+ *  Authors: CERT Network Situational Awareness Group
+ *  ------------------------------------------------------------------------
+ *  @DISTRIBUTION_STATEMENT_BEGIN@
+ *  YAF 3.0.0
+ *
+ *  Copyright 2023 Carnegie Mellon University.
+ *
+ *  NO WARRANTY. THIS CARNEGIE MELLON UNIVERSITY AND SOFTWARE ENGINEERING
+ *  INSTITUTE MATERIAL IS FURNISHED ON AN "AS-IS" BASIS. CARNEGIE MELLON
+ *  UNIVERSITY MAKES NO WARRANTIES OF ANY KIND, EITHER EXPRESSED OR IMPLIED,
+ *  AS TO ANY MATTER INCLUDING, BUT NOT LIMITED TO, WARRANTY OF FITNESS FOR
+ *  PURPOSE OR MERCHANTABILITY, EXCLUSIVITY, OR RESULTS OBTAINED FROM USE OF
+ *  THE MATERIAL. CARNEGIE MELLON UNIVERSITY DOES NOT MAKE ANY WARRANTY OF
+ *  ANY KIND WITH RESPECT TO FREEDOM FROM PATENT, TRADEMARK, OR COPYRIGHT
+ *  INFRINGEMENT.
+ *
+ *  Licensed under a GNU GPL 2.0-style license, please see LICENSE.txt or
+ *  contact permission@sei.cmu.edu for full terms.
+ *
+ *  [DISTRIBUTION STATEMENT A] This material has been approved for public
+ *  release and unlimited distribution.  Please see Copyright notice for
+ *  non-US Government use and distribution.
+ *
+ *  GOVERNMENT PURPOSE RIGHTS – Software and Software Documentation
+ *  Contract No.: FA8702-15-D-0002
+ *  Contractor Name: Carnegie Mellon University
+ *  Contractor Address: 4500 Fifth Avenue, Pittsburgh, PA 15213
+ *
+ *  The Government's rights to use, modify, reproduce, release, perform,
+ *  display, or disclose this software are restricted by paragraph (b)(2) of
+ *  the Rights in Noncommercial Computer Software and Noncommercial Computer
+ *  Software Documentation clause contained in the above identified
+ *  contract. No restrictions apply after the expiration date shown
+ *  above. Any reproduction of the software or portions thereof marked with
+ *  this legend must also reproduce the markings.
+ *
+ *  This Software includes and/or makes use of Third-Party Software each
+ *  subject to its own license.
+ *
+ *  DM23-2317
+ *  @DISTRIBUTION_STATEMENT_END@
+ *  ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <yaf/lfq.h>
+
+/* keeps the two ends of the queue off each other's cache line */
+#define LFQ_CACHE_LINE  64
+
+typedef struct lfqCell_st {
+    /* position the cell is next pushed at, or that position plus one once
+     * it is filled and can be popped */
+    uint64_t   seq;
+    void      *item;
+} lfqCell_t;
+
+struct lfqQueue_st {
+    lfqCell_t  *cells;
+    uint64_t    mask;
+    uint8_t     pad0[LFQ_CACHE_LINE - sizeof(lfqCell_t *) - sizeof(uint64_t)];
+    /* next position to push at */
+    uint64_t    head;
+    uint8_t     pad1[LFQ_CACHE_LINE - sizeof(uint64_t)];
+    /* next position to pop from */
+    uint64_t    tail;
+    uint8_t     pad2[LFQ_CACHE_LINE - sizeof(uint64_t)];
+};
+
+
+lfqQueue_t *
+lfqAlloc(
+    size_t   capacity)
+{
+    lfqQueue_t *q;
+    size_t      cap = 2;
+    size_t      i;
+
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+
+    q = g_slice_new0(lfqQueue_t);
+    q->cells = g_new0(lfqCell_t, cap);
+    q->mask = cap - 1;
+    for (i = 0; i < cap; i++) {
+        q->cells[i].seq = i;
+    }
+
+    return q;
+}
+
+
+void
+lfqFree(
+    lfqQueue_t  *q)
+{
+    g_free(q->cells);
+    g_slice_free(lfqQueue_t, q);
+}
+
+
+gboolean
+lfqPush(
+    lfqQueue_t  *q,
+    void        *item)
+{
+    lfqCell_t *cell;
+    uint64_t   pos = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+    uint64_t   seq;
+    int64_t    dif;
+
+    for (;;) {
+        cell = &(q->cells[pos & q->mask]);
+        seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+        dif = (int64_t)(seq - pos);
+        if (dif == 0) {
+            /* the cell is free; claim the position */
+            if (__atomic_compare_exchange_n(&(q->head), &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        } else if (dif < 0) {
+            /* the cell still holds the item from a lap ago */
+            return FALSE;
+        } else {
+            /* another pusher took this position */
+            pos = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->item = item;
+    __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+
+void *
+lfqPop(
+    lfqQueue_t  *q)
+{
+    lfqCell_t *cell;
+    uint64_t   pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+    uint64_t   seq;
+    int64_t    dif;
+    void      *item;
+
+    for (;;) {
+        cell = &(q->cells[pos & q->mask]);
+        seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+        dif = (int64_t)(seq - (pos + 1));
+        if (dif == 0) {
+            /* the cell is filled; claim the position */
+            if (__atomic_compare_exchange_n(&(q->tail), &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        } else if (dif < 0) {
+            /* nothing pushed at this position yet */
+            return NULL;
+        } else {
+            /* another popper took this position */
+            pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+        }
+    }
+
+    item = cell->item;
+    /* free the cell for the push one lap from now */
+    __atomic_store_n(&(cell->seq), pos + q->mask + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
+
+
+size_t
+lfqCount(
+    const lfqQueue_t  *q)
+{
+    uint64_t tail = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+
+    return (head > tail) ? (size_t)(head - tail) : 0;
+}
+
+
+size_t
+lfqCapacity(
+    const lfqQueue_t  *q)
+{
+    return (size_t)(q->mask + 1);
+}
@@ -53,6 +53,56 @@
 
 #define _YAF_SOURCE_
 #include <yaf/ring.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* variable-length records: a size_t header holding the record length,
+ * including the header and padding, then the record itself */
+#define RGA_VAR_HDR         sizeof(size_t)
+#define RGA_VAR_LEN(_len_) \
+    (RGA_VAR_HDR + (((_len_) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1)))
+/* header flag marking a record rgaNextTail() skips over */
+#define RGA_VAR_DATA        0x1
+/* header value telling the consumer the next record is at base */
+#define RGA_VAR_WRAP        0
+
+/* threaded rings: a waiting side spins between RGA_SPIN_MIN and
+ * RGA_SPIN_MAX times before it sleeps, adapting to how long its waits
+ * turn out to be */
+#define RGA_SPIN_MIN        64
+#define RGA_SPIN_MAX        16384
+/* microseconds to sleep per wait where there is no futex */
+#define RGA_SLEEP_US        50
+#define RGA_CACHE_LINE      64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RGA_CPU_RELAX()     __builtin_ia32_pause()
+#else
+#define RGA_CPU_RELAX()
+#endif
+
+/* one side of a threaded ring; the head side is the producer's and the
+ * tail side the consumer's.  Each side writes only its own, which sits
+ * on a cache line of its own. */
+typedef struct rgaSide_st {
+    /* elements released to the other side, free running */
+    uint64_t   pos;
+    /* elements reserved by this side, free running */
+    uint64_t   rsv;
+    /* the other side's pos when last looked at */
+    uint64_t   other;
+    /* bumped on every release; the other side sleeps on it */
+    uint32_t   seq;
+    /* nonzero while this side sleeps on the other side's seq */
+    uint32_t   sleeping;
+    /* spins before sleeping */
+    uint32_t   spin;
+    uint8_t    pad[RGA_CACHE_LINE - 3 * sizeof(uint64_t) -
+                   3 * sizeof(uint32_t)];
+} rgaSide_t;
 
 struct rgaRing_st {
     size_t     elt_sz;
@@ -65,12 +115,16 @@ struct rgaRing_st {
     uint8_t   *end;
     uint8_t   *head;
     uint8_t   *tail;
-#ifdef YAF_RING_THREAD
-    GMutex    *mtx;
-    GCond     *cnd_zero;
-    GCond     *cnd_full;
+    /* variable-length ring; records are packed between base and limit */
+    gboolean   var;
+    uint8_t   *limit;
+    /* threaded ring; elements are at (pos & mask) * elt_sz from base */
+    gboolean   threaded;
+    uint64_t   mask;
     uint32_t   interrupt;
-#endif /* ifdef YAF_RING_THREAD */
+    uint8_t    pad[RGA_CACHE_LINE];
+    rgaSide_t  hside;
+    rgaSide_t  tside;
 };
 
 /**
@@ -111,30 +165,65 @@ rgaAlloc(
 }
 
 
-#ifdef YAF_RING_THREAD
 /**
- * rgaAllocThreaded
+ * rgaAllocVar
  *
  *
  *
  */
 rgaRing_t *
-rgaAllocThreaded(
+rgaAllocVar(
     size_t   elt_sz,
     size_t   cap)
 {
-    rgaRing_t *ring = rgaAlloc(elt_sz, cap);
+    rgaRing_t *ring = NULL;
+    size_t     base_sz = RGA_VAR_LEN(elt_sz) * cap;
+
+    ring = g_slice_new0(rgaRing_t);
 
-    /* allocate mutex and conditions */
-    ring->mtx = g_mutex_new();
-    ring->cnd_zero = g_cond_new();
-    ring->cnd_full = g_cond_new();
+    /* room for cap records of the largest size */
+    ring->base = g_slice_alloc0(base_sz);
+    ring->limit = ring->base + base_sz;
+    ring->end = ring->limit;
+    ring->head = ring->tail = ring->base;
+
+    ring->elt_sz = elt_sz;
+    ring->cap = cap;
+    ring->var = TRUE;
 
     return ring;
 }
 
 
-#endif /* ifdef YAF_RING_THREAD */
+/**
+ * rgaAllocThreaded
+ *
+ * Allocate a ring of fixed size elements that one producer thread and
+ * one consumer thread share without locks, through the rgaReserve and
+ * rgaRelease calls.  The capacity is rounded up to a power of two.
+ *
+ */
+rgaRing_t *
+rgaAllocThreaded(
+    size_t   elt_sz,
+    size_t   cap)
+{
+    rgaRing_t *ring = NULL;
+    size_t     pcap = 2;
+
+    while (pcap < cap) {
+        pcap <<= 1;
+    }
+
+    ring = rgaAlloc(elt_sz, pcap);
+    ring->threaded = TRUE;
+    ring->mask = pcap - 1;
+    ring->hside.spin = RGA_SPIN_MIN;
+    ring->tside.spin = RGA_SPIN_MIN;
+
+    return ring;
+}
+
 
 /**
  * rgaFree
@@ -148,22 +237,11 @@ rgaFree(
 {
     size_t base_sz;
 
-    base_sz = ring->elt_sz * ring->cap;
-
-#ifdef YAF_RING_THREAD
-    /* free conditions and mutex if present */
-    if (ring->cnd_zero) {
-        g_cond_free(ring->cnd_zero);
-    }
-
-    if (ring->cnd_full) {
-        g_cond_free(ring->cnd_full);
-    }
-
-    if (ring->mtx) {
-        g_mutex_free(ring->mtx);
+    if (ring->var) {
+        base_sz = ring->limit - ring->base;
+    } else {
+        base_sz = ring->elt_sz * ring->cap;
     }
-#endif /* ifdef YAF_RING_THREAD */
 
     /* free buffer */
     g_slice_free1(base_sz, ring->base);
@@ -185,6 +263,14 @@ rgaNextHead(
 {
     uint8_t *head;
 
+    /* a whole element on a variable-length ring */
+    if (ring->var) {
+        if ((head = rgaReserveHead(ring, ring->elt_sz))) {
+            rgaCommitHead(ring, ring->elt_sz);
+        }
+        return head;
+    }
+
     /* return null if buffer full */
     if (ring->count >= (ring->cap - ring->trsv)) {
         return NULL;
@@ -210,62 +296,121 @@ rgaNextHead(
 }
 
 
-#ifdef YAF_RING_THREAD
 /**
- * rgaNextHead
- *
+ * rgaReserveHead
  *
+ * Return space for a record of up to len bytes at the head of the ring
+ * without adding it; rgaCommitHead() adds it.
  *
  */
 uint8_t *
-rgaNextHead(
-    rgaRing_t  *ring)
+rgaReserveHead(
+    rgaRing_t  *ring,
+    size_t      len)
 {
-    uint8_t *head = NULL;
+    size_t need = RGA_VAR_LEN(len);
 
-    g_mutex_lock(ring->mtx);
-    while (!ring->interrupt && ((head = rgaNextHead(ring)) == NULL)) {
-        g_cond_wait(ring->cnd_full, ring->mtx);
+    if (!ring->var) {
+        if (len > ring->elt_sz || ring->count >= (ring->cap - ring->trsv)) {
+            return NULL;
+        }
+        return ring->head;
     }
-    if (ring->interrupt) {
-        head = NULL;
-        goto end;
+
+    if (ring->count >= ring->cap ||
+        (ring->count && ring->head == ring->tail))
+    {
+        return NULL;
     }
-    if (++(ring->hrsv) > ring->cap) {
-        ring->hrsv = ring->cap;
+
+    /* start over at the front of an empty ring to keep it cache hot */
+    if (ring->count == 0) {
+        ring->head = ring->tail = ring->base;
+    }
+
+    if (ring->head >= ring->tail) {
+        if ((size_t)(ring->limit - ring->head) < need) {
+            /* no room before the end; wrap if the front is free */
+            if ((size_t)(ring->tail - ring->base) < need) {
+                return NULL;
+            }
+            *((size_t *)ring->head) = RGA_VAR_WRAP;
+            ring->head = ring->base;
+        }
+    } else if ((size_t)(ring->tail - ring->head) < need) {
+        return NULL;
     }
-    g_cond_signal(ring->cnd_zero);
-  end:
-    g_mutex_unlock(ring->mtx);
-    return head;
-}
 
+    return ring->head + RGA_VAR_HDR;
+}
 
-#endif /* ifdef YAF_RING_THREAD */
 
-#ifdef YAF_RING_THREAD
 /**
- * rgaReleaseHead
+ * rgaCommitVar
  *
  *
  *
  */
+static void
+rgaCommitVar(
+    rgaRing_t  *ring,
+    size_t      len,
+    size_t      flags)
+{
+    size_t need = RGA_VAR_LEN(len);
+
+    *((size_t *)ring->head) = need | flags;
+    ring->head += need;
+    if (ring->head == ring->limit) {
+        ring->head = ring->base;
+    }
+
+    ++(ring->count);
+    if (ring->count > ring->peak) {
+        ring->peak = ring->count;
+    }
+}
+
+
+/**
+ * rgaCommitHead
+ *
+ * Add the record last returned by rgaReserveHead(), trimmed to len
+ * bytes, to the ring.
+ *
+ */
 void
-rgaReleaseHead(
+rgaCommitHead(
     rgaRing_t  *ring,
-    size_t      rsv)
+    size_t      len)
 {
-    g_mutex_lock(ring->mtx);
-    if (rsv > ring->hrsv) {
-        rsv = ring->hrsv;
+    if (!ring->var) {
+        rgaNextHead(ring);
+        return;
     }
-    ring->hrsv -= rsv;
-    g_cond_signal(ring->cnd_full);
-    g_mutex_unlock(ring->mtx);
+
+    rgaCommitVar(ring, len, 0);
 }
 
 
-#endif /* ifdef YAF_RING_THREAD */
+/**
+ * rgaCommitHeadData
+ *
+ * Add the record last returned by rgaReserveHead() as data only: the
+ * consumer never sees it, but it stays in place until the consumer has
+ * moved past it.
+ *
+ */
+void
+rgaCommitHeadData(
+    rgaRing_t  *ring,
+    size_t      len)
+{
+    g_assert(ring->var);
+
+    rgaCommitVar(ring, len, RGA_VAR_DATA);
+}
+
 
 /**
  * rgaNextTail
@@ -278,6 +423,27 @@ rgaNextTail(
     rgaRing_t  *ring)
 {
     uint8_t *tail;
+    size_t   hdr;
+
+    /* variable-length rings skip wraps and data records */
+    if (ring->var) {
+        while (ring->count > ring->hrsv) {
+            if (*((size_t *)ring->tail) == RGA_VAR_WRAP) {
+                ring->tail = ring->base;
+            }
+            hdr = *((size_t *)ring->tail);
+            tail = ring->tail + RGA_VAR_HDR;
+            ring->tail += hdr & ~RGA_VAR_DATA;
+            if (ring->tail == ring->limit) {
+                ring->tail = ring->base;
+            }
+            --(ring->count);
+            if (!(hdr & RGA_VAR_DATA)) {
+                return tail;
+            }
+        }
+        return NULL;
+    }
 
     /* return null if buffer empty */
     if (ring->count <= ring->hrsv) {
@@ -301,85 +467,296 @@ rgaNextTail(
 }
 
 
-#ifdef YAF_RING_THREAD
 /**
- * rgaWaitTail
+ * rgaSideSleep
  *
+ * Sleep until the seq of the other side moves on from `seq`.  Without
+ * a futex, sleep briefly instead.
+ *
+ */
+static void
+rgaSideSleep(
+    uint32_t  *seqp,
+    uint32_t   seq)
+{
+#ifdef __linux__
+    syscall(SYS_futex, seqp, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+#else
+    (void)seqp;
+    (void)seq;
+    g_usleep(RGA_SLEEP_US);
+#endif
+}
+
+
+/**
+ * rgaSideWake
  *
+ * Wake the other side, sleeping on the seq of this one.
  *
  */
-uint8_t *
-rgaWaitTail(
-    rgaRing_t  *ring)
+static void
+rgaSideWake(
+    uint32_t  *seqp)
+{
+#ifdef __linux__
+    syscall(SYS_futex, seqp, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void)seqp;
+#endif
+}
+
+
+/**
+ * rgaSideLast
+ *
+ * Look at the other side once more after seeing the ring interrupted.
+ * The interrupt came after anything the other side released before it,
+ * but the look that found nothing may have come before those releases.
+ *
+ */
+static uint64_t
+rgaSideLast(
+    rgaSide_t  *self,
+    rgaSide_t  *other,
+    uint64_t    off)
 {
-    uint8_t *tail = NULL;
+    self->other = __atomic_load_n(&(other->pos), __ATOMIC_ACQUIRE);
+
+    return self->other + off - self->rsv;
+}
+
+
+/**
+ * rgaSideWait
+ *
+ * Return how many more elements `self` may reserve: up to `off` past
+ * the pos of the other side.  If none and asked to wait, spin, then
+ * sleep, until the other side releases some or the ring is interrupted.
+ * An interrupted wait still returns what was released before the
+ * interrupt, so the consumer can drain the ring; 0 once there is none.
+ * The spin doubles when spinning was enough and halves when it was not.
+ *
+ */
+static uint64_t
+rgaSideWait(
+    rgaRing_t  *ring,
+    rgaSide_t  *self,
+    rgaSide_t  *other,
+    uint64_t    off,
+    gboolean    wait)
+{
+    uint64_t avail;
+    uint32_t seq, i;
+
+    /* the other side only moves forward; look again when the last look
+     * is used up */
+    if ((avail = self->other + off - self->rsv)) {
+        return avail;
+    }
+    self->other = __atomic_load_n(&(other->pos), __ATOMIC_ACQUIRE);
+    if ((avail = self->other + off - self->rsv) || !wait) {
+        return avail;
+    }
 
-    g_mutex_lock(ring->mtx);
-    while (!ring->interrupt && ((tail = rgaNextTail(ring)) == NULL)) {
-        g_cond_wait(ring->cnd_zero, ring->mtx);
+    for (i = 0; i < self->spin; i++) {
+        RGA_CPU_RELAX();
+        self->other = __atomic_load_n(&(other->pos), __ATOMIC_ACQUIRE);
+        if ((avail = self->other + off - self->rsv)) {
+            if (self->spin < RGA_SPIN_MAX) {
+                self->spin <<= 1;
+            }
+            return avail;
+        }
+        if (__atomic_load_n(&(ring->interrupt), __ATOMIC_ACQUIRE)) {
+            return rgaSideLast(self, other, off);
+        }
     }
-    if (ring->interrupt) {
-        tail = NULL;
-        goto end;
+
+    if (self->spin > RGA_SPIN_MIN) {
+        self->spin >>= 1;
     }
-    if (++(ring->trsv) >= ring->cap) {
-        ring->trsv = ring->cap;
+
+    /* announce the sleep before looking a last time, so that the other
+     * side either sees it and wakes us or released before the look */
+    for (;;) {
+        seq = __atomic_load_n(&(other->seq), __ATOMIC_SEQ_CST);
+        __atomic_store_n(&(self->sleeping), 1, __ATOMIC_SEQ_CST);
+        self->other = __atomic_load_n(&(other->pos), __ATOMIC_SEQ_CST);
+        avail = self->other + off - self->rsv;
+        if (avail) {
+            __atomic_store_n(&(self->sleeping), 0, __ATOMIC_RELAXED);
+            return avail;
+        }
+        if (__atomic_load_n(&(ring->interrupt), __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&(self->sleeping), 0, __ATOMIC_RELAXED);
+            return rgaSideLast(self, other, off);
+        }
+        rgaSideSleep(&(other->seq), seq);
+        __atomic_store_n(&(self->sleeping), 0, __ATOMIC_RELAXED);
     }
-    g_cond_signal(ring->cnd_full);
-  end:
-    g_mutex_unlock(ring->mtx);
-    return tail;
 }
 
 
-#endif /* ifdef YAF_RING_THREAD */
+/**
+ * rgaSideReserve
+ *
+ * Reserve the next n elements of a side, filling elts with them.
+ *
+ */
+static size_t
+rgaSideReserve(
+    rgaRing_t  *ring,
+    rgaSide_t  *self,
+    uint8_t    *elts[],
+    size_t      n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        elts[i] = ring->base + ((self->rsv + i) & ring->mask) * ring->elt_sz;
+    }
+    self->rsv += n;
+
+    return n;
+}
+
+
+/**
+ * rgaSideRelease
+ *
+ * Hand the oldest n reserved elements of a side to the other side,
+ * waking it if it sleeps.
+ *
+ */
+static void
+rgaSideRelease(
+    rgaSide_t  *self,
+    rgaSide_t  *other,
+    size_t      n)
+{
+    if (n > self->rsv - self->pos) {
+        n = self->rsv - self->pos;
+    }
+
+    __atomic_store_n(&(self->pos), self->pos + n, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&(self->seq), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(other->sleeping), __ATOMIC_SEQ_CST)) {
+        rgaSideWake(&(self->seq));
+    }
+}
+
 
-#ifdef YAF_RING_THREAD
 /**
- * rgaReleaseTail
+ * rgaReserveHeadN
+ *
+ * Producer: reserve up to n free elements at the head of a threaded
+ * ring, filling elts with them.  If wait is TRUE and none are free,
+ * wait for the consumer.  Returns the number reserved; 0 if none are
+ * free and wait is FALSE, or the ring was interrupted and none are.
  *
+ */
+size_t
+rgaReserveHeadN(
+    rgaRing_t  *ring,
+    uint8_t    *elts[],
+    size_t      n,
+    gboolean    wait)
+{
+    uint64_t avail;
+
+    avail = rgaSideWait(ring, &(ring->hside), &(ring->tside), ring->cap,
+                        wait);
+
+    return rgaSideReserve(ring, &(ring->hside), elts, MIN(n, avail));
+}
+
+
+/**
+ * rgaReleaseHeadN
  *
+ * Producer: hand the oldest n elements reserved at the head, now
+ * filled, to the consumer.
  *
  */
 void
-rgaReleaseTail(
+rgaReleaseHeadN(
     rgaRing_t  *ring,
-    size_t      rsv)
+    size_t      n)
 {
-    g_mutex_lock(ring->mtx);
-    if (rsv > ring->trsv) {
-        rsv = ring->trsv;
+    size_t count;
+
+    rgaSideRelease(&(ring->hside), &(ring->tside), n);
+
+    count = ring->hside.pos - __atomic_load_n(&(ring->tside.pos),
+                                              __ATOMIC_RELAXED);
+    if (count > ring->peak) {
+        ring->peak = count;
     }
-    ring->trsv -= rsv;
-    g_cond_signal(ring->cnd_zero);
-    g_mutex_unlock(ring->mtx);
 }
 
 
-#endif /* ifdef YAF_RING_THREAD */
+/**
+ * rgaReserveTailN
+ *
+ * Consumer: reserve up to n filled elements at the tail of a threaded
+ * ring, filling elts with them.  If wait is TRUE and none are filled,
+ * wait for the producer.  Returns the number reserved; 0 if none are
+ * filled and wait is FALSE, or the ring was interrupted and none are.
+ *
+ */
+size_t
+rgaReserveTailN(
+    rgaRing_t  *ring,
+    uint8_t    *elts[],
+    size_t      n,
+    gboolean    wait)
+{
+    uint64_t avail;
+
+    avail = rgaSideWait(ring, &(ring->tside), &(ring->hside), 0, wait);
+
+    return rgaSideReserve(ring, &(ring->tside), elts, MIN(n, avail));
+}
+
+
+/**
+ * rgaReleaseTailN
+ *
+ * Consumer: hand the oldest n elements reserved at the tail, now
+ * processed, back to the producer.
+ *
+ */
+void
+rgaReleaseTailN(
+    rgaRing_t  *ring,
+    size_t      n)
+{
+    rgaSideRelease(&(ring->tside), &(ring->hside), n);
+}
+
 
-#ifdef YAF_RING_THREAD
 /**
  * rgaSetInterrupt
  *
- *
+ * Make every wait on a threaded ring return at once until the interrupt
+ * is cleared, waking both sides.  A reserve still gets what the other
+ * side released before the interrupt, so the consumer can drain the ring
+ * and then sees 0.
  *
  */
 void
 rgaSetInterrupt(
     rgaRing_t  *ring)
 {
-    g_mutex_lock(ring->mtx);
-    ++(ring->interrupt);
-    g_cond_broadcast(ring->cnd_zero);
-    g_cond_broadcast(ring->cnd_full);
-    g_mutex_unlock(ring->mtx);
+    __atomic_add_fetch(&(ring->interrupt), 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&(ring->hside.seq), 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&(ring->tside.seq), 1, __ATOMIC_SEQ_CST);
+    rgaSideWake(&(ring->hside.seq));
+    rgaSideWake(&(ring->tside.seq));
 }
 
 
-#endif /* ifdef YAF_RING_THREAD */
-
-#ifdef YAF_RING_THREAD
 /**
  * rgaClearInterrupt
  *
@@ -390,14 +767,10 @@ void
 rgaClearInterrupt(
     rgaRing_t  *ring)
 {
-    g_mutex_lock(ring->mtx);
-    --(ring->interrupt);
-    g_mutex_unlock(ring->mtx);
+    __atomic_sub_fetch(&(ring->interrupt), 1, __ATOMIC_SEQ_CST);
 }
 
 
-#endif /* ifdef YAF_RING_THREAD */
-
 /**
  * rgaCount
  *
@@ -408,6 +781,11 @@ size_t
 rgaCount(
     rgaRing_t  *ring)
 {
+    if (ring->threaded) {
+        return (size_t)(__atomic_load_n(&(ring->hside.pos), __ATOMIC_RELAXED) -
+                        __atomic_load_n(&(ring->tside.pos), __ATOMIC_RELAXED));
+    }
+
     return ring->count;
 }
 
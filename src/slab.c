@@ -0,0 +1,417 @@
+/*
+ *  Copyright 2023 Carnegie Mellon University
+ *  See license information in LICENSE.txt.
+ */
+/*
+ *  slab.c
+ *  Size-class slab allocator
+ *
+ *  ------------------------------------------------------------------------
+ *  Authors: CERT Network Situational Awareness Group
+ *  ------------------------------------------------------------------------
+ *  @DISTRIBUTION_STATEMENT_BEGIN@
+ *  YAF 3.0.0
+ *
+ *  Copyright 2023 Carnegie Mellon University.
+ *
+ *  NO WARRANTY. THIS CARNEGIE MELLON UNIVERSITY AND SOFTWARE ENGINEERING
+ *  INSTITUTE MATERIAL IS FURNISHED ON AN "AS-IS" BASIS. CARNEGIE MELLON
+ *  UNIVERSITY MAKES NO WARRANTIES OF ANY KIND, EITHER EXPRESSED OR IMPLIED,
+ *  AS TO ANY MATTER INCLUDING, BUT NOT LIMITED TO, WARRANTY OF FITNESS FOR
+ *  PURPOSE OR MERCHANTABILITY, EXCLUSIVITY, OR RESULTS OBTAINED FROM USE OF
+ *  THE MATERIAL. CARNEGIE MELLON UNIVERSITY DOES NOT MAKE ANY WARRANTY OF
+ *  ANY KIND WITH RESPECT TO FREEDOM FROM PATENT, TRADEMARK, OR COPYRIGHT
+ *  INFRINGEMENT.
+ *
+ *  Licensed under a GNU GPL 2.0-style license, please see LICENSE.txt or
+ *  contact permission@sei.cmu.edu for full terms.
+ *
+ *  [DISTRIBUTION STATEMENT A] This material has been approved for public
+ *  release and unlimited distribution.  Please see Copyright notice for
+ *  non-US Government use and distribution.
+ *
+ *  GOVERNMENT PURPOSE RIGHTS – Software and Software Documentation
+ *  Contract No.: FA8702-15-D-0002
+ *  Contractor Name: Carnegie Mellon University
+ *  Contractor Address: 4500 Fifth Avenue, Pittsburgh, PA 15213
+ *
+ *  The Government's rights to use, modify, reproduce, release, perform,
+ *  display, or disclose this software are restricted by paragraph (b)(2) of
+ *  the Rights in Noncommercial Computer Software and Noncommercial Computer
+ *  Software Documentation clause contained in the above identified
+ *  contract. No restrictions apply after the expiration date shown
+ *  above. Any reproduction of the software or portions thereof marked with
+ *  this legend must also reproduce the markings.
+ *
+ *  This Software includes and/or makes use of Third-Party Software each
+ *  subject to its own license.
+ *
+ *  DM23-2317
+ *  @DISTRIBUTION_STATEMENT_END@
+ *  ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <yaf/slab.h>
+#include <sys/mman.h>
+
+/* chunks are mapped from the system a huge page at a time */
+#define SLB_CHUNK_SZ        (2 * 1024 * 1024)
+/* offset of the first block in a chunk, past the chunk header */
+#define SLB_CHUNK_HDR       64
+/* classes every SLB_QUANTUM bytes up to SLB_SMALL_MAX, then four per
+ * doubling up to SLB_LARGE_MAX; larger blocks come from malloc */
+#define SLB_QUANTUM         16
+#define SLB_SMALL_MAX       256
+#define SLB_LARGE_MAX       (64 * 1024)
+#define SLB_SMALL_CLASSES   (SLB_SMALL_MAX / SLB_QUANTUM)
+#define SLB_CLASS_COUNT     (SLB_SMALL_CLASSES + 4 * 8)
+/* a size class takes at least this much of a chunk at a time */
+#define SLB_RUN_MIN         (64 * 1024)
+
+typedef struct slbChunk_st {
+    struct slbChunk_st  *next;
+    size_t               len;
+} slbChunk_t;
+
+typedef struct slbClass_st {
+    /* freed blocks, linked through their first word */
+    void     *free;
+    /* unused remainder of the class's current run */
+    uint8_t  *run;
+    uint8_t  *run_end;
+} slbClass_t;
+
+struct slbArena_st {
+    slbClass_t   classes[SLB_CLASS_COUNT];
+    slbChunk_t  *chunks;
+    /* unused remainder of the newest chunk */
+    uint8_t     *chunk_cur;
+    uint8_t     *chunk_end;
+    size_t       mapped;
+    size_t       in_use[SLB_SUBSYS_COUNT];
+    size_t       peak[SLB_SUBSYS_COUNT];
+    /* sum of in_use[] */
+    size_t       total;
+    gboolean     hugepages;
+};
+
+static const char *slb_subsys_names[SLB_SUBSYS_COUNT] = {
+    "flow", "payload", "flow stats", "dpi", "fpexport"
+};
+
+
+/**
+ * slbClassOf
+ *
+ * Find the size class for a block of `sz` bytes, and the size of the
+ * blocks in that class.
+ *
+ */
+static inline unsigned int
+slbClassOf(
+    size_t   sz,
+    size_t  *csz)
+{
+    unsigned int k;
+    size_t       m;
+
+    if (sz <= SLB_SMALL_MAX) {
+        m = (sz + SLB_QUANTUM - 1) / SLB_QUANTUM;
+        if (m == 0) {
+            m = 1;
+        }
+        *csz = m * SLB_QUANTUM;
+        return m - 1;
+    }
+
+    /* sz is in (2^k, 2^(k+1)]; split that range in four */
+    k = g_bit_storage(sz - 1) - 1;
+    m = (sz - 1) >> (k - 2);
+    *csz = (m + 1) << (k - 2);
+    return SLB_SMALL_CLASSES + (k - 8) * 4 + (m - 4);
+}
+
+
+/**
+ * slbChunkMap
+ *
+ * Map a new chunk of at least `len` bytes from the system and make it
+ * the arena's current chunk.
+ *
+ */
+static void
+slbChunkMap(
+    slbArena_t  *arena,
+    size_t       len)
+{
+    slbChunk_t *chunk = MAP_FAILED;
+
+    len = (len + SLB_CHUNK_SZ - 1) & ~((size_t)SLB_CHUNK_SZ - 1);
+
+#ifdef MAP_HUGETLB
+    if (arena->hugepages) {
+        chunk = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (chunk == MAP_FAILED) {
+        chunk = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            g_error("Could not map %zu bytes for the slab allocator: %s",
+                    len, strerror(errno));
+        }
+#ifdef MADV_HUGEPAGE
+        /* no reserved huge pages; ask for transparent ones instead */
+        if (arena->hugepages) {
+            madvise(chunk, len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    chunk->len = len;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->mapped += len;
+
+    arena->chunk_cur = (uint8_t *)chunk + SLB_CHUNK_HDR;
+    arena->chunk_end = (uint8_t *)chunk + len;
+}
+
+
+/**
+ * slbRunRefill
+ *
+ * Give a size class a new run of blocks from the current chunk, mapping
+ * a new chunk if the current one cannot hold a block of the class.
+ *
+ */
+static void
+slbRunRefill(
+    slbArena_t  *arena,
+    slbClass_t  *cls,
+    size_t       csz)
+{
+    size_t avail = arena->chunk_end - arena->chunk_cur;
+    size_t len = MAX(SLB_RUN_MIN, 4 * csz);
+
+    if (avail < csz) {
+        slbChunkMap(arena, len + SLB_CHUNK_HDR);
+        avail = arena->chunk_end - arena->chunk_cur;
+    }
+
+    len = MIN(len, avail);
+    len -= len % csz;
+
+    cls->run = arena->chunk_cur;
+    cls->run_end = cls->run + len;
+    arena->chunk_cur += len;
+}
+
+
+/**
+ * slbAccount
+ *
+ *
+ */
+static inline void
+slbAccount(
+    slbArena_t   *arena,
+    slbSubsys_t   subsys,
+    size_t        sz)
+{
+    arena->in_use[subsys] += sz;
+    arena->total += sz;
+    if (arena->in_use[subsys] > arena->peak[subsys]) {
+        arena->peak[subsys] = arena->in_use[subsys];
+    }
+}
+
+
+/**
+ * slbArenaAlloc
+ *
+ *
+ */
+slbArena_t *
+slbArenaAlloc(
+    gboolean   hugepages)
+{
+    slbArena_t *arena = g_slice_new0(slbArena_t);
+
+    arena->hugepages = hugepages;
+
+    return arena;
+}
+
+
+/**
+ * slbArenaFree
+ *
+ *
+ */
+void
+slbArenaFree(
+    slbArena_t  *arena)
+{
+    slbChunk_t *chunk, *next;
+
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        munmap(chunk, chunk->len);
+    }
+
+    g_slice_free(slbArena_t, arena);
+}
+
+
+/**
+ * slbAlloc0
+ *
+ *
+ */
+void *
+slbAlloc0(
+    slbArena_t   *arena,
+    slbSubsys_t   subsys,
+    size_t        sz)
+{
+    slbClass_t *cls;
+    size_t      csz;
+    void       *p;
+
+    if (sz > SLB_LARGE_MAX) {
+        slbAccount(arena, subsys, sz);
+        return g_malloc0(sz);
+    }
+
+    cls = &(arena->classes[slbClassOf(sz, &csz)]);
+    slbAccount(arena, subsys, csz);
+
+    if ((p = cls->free)) {
+        cls->free = *((void **)p);
+        memset(p, 0, sz);
+        return p;
+    }
+
+    /* fresh blocks come straight from the mapping and are still zero */
+    if (cls->run == cls->run_end) {
+        slbRunRefill(arena, cls, csz);
+    }
+    p = cls->run;
+    cls->run += csz;
+
+    return p;
+}
+
+
+/**
+ * slbFree
+ *
+ *
+ */
+void
+slbFree(
+    slbArena_t   *arena,
+    slbSubsys_t   subsys,
+    size_t        sz,
+    void         *p)
+{
+    slbClass_t *cls;
+    size_t      csz;
+
+    if (!p) {
+        return;
+    }
+
+    if (sz > SLB_LARGE_MAX) {
+        arena->in_use[subsys] -= sz;
+        arena->total -= sz;
+        g_free(p);
+        return;
+    }
+
+    cls = &(arena->classes[slbClassOf(sz, &csz)]);
+    arena->in_use[subsys] -= csz;
+    arena->total -= csz;
+
+    *((void **)p) = cls->free;
+    cls->free = p;
+}
+
+
+/**
+ * slbInUse
+ *
+ *
+ */
+size_t
+slbInUse(
+    const slbArena_t  *arena,
+    slbSubsys_t        subsys)
+{
+    return arena->in_use[subsys];
+}
+
+
+/**
+ * slbInUseTotal
+ *
+ *
+ */
+size_t
+slbInUseTotal(
+    const slbArena_t  *arena)
+{
+    return arena->total;
+}
+
+
+/**
+ * slbPeak
+ *
+ *
+ */
+size_t
+slbPeak(
+    const slbArena_t  *arena,
+    slbSubsys_t        subsys)
+{
+    return arena->peak[subsys];
+}
+
+
+/**
+ * slbMapped
+ *
+ *
+ */
+size_t
+slbMapped(
+    const slbArena_t  *arena)
+{
+    return arena->mapped;
+}
+
+
+/**
+ * slbDumpStats
+ *
+ *
+ */
+void
+slbDumpStats(
+    const slbArena_t  *arena)
+{
+    unsigned int i;
+
+    g_debug("  Slab allocator mapped %zu bytes%s.", arena->mapped,
+            arena->hugepages ? " (huge pages requested)" : "");
+    for (i = 0; i < SLB_SUBSYS_COUNT; i++) {
+        if (arena->peak[i]) {
+            g_debug("    %-10s %zu bytes in use, %zu peak.",
+                    slb_subsys_names[i], arena->in_use[i], arena->peak[i]);
+        }
+    }
+}
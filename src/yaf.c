@@ -64,6 +64,8 @@
 #include "yafcap.h"
 #include "yafstat.h"
 #include "yafctx.h"
+#include "yafshard.h"
+#include "yafexport.h"
 #ifdef YAF_ENABLE_DAG
 #include "yafdag.h"
 #endif
@@ -76,6 +78,9 @@
 #ifdef YAF_ENABLE_PFRING
 #include "yafpfring.h"
 #endif
+#ifdef YAF_ENABLE_AFPACKET
+#include "yafafpacket.h"
+#endif
 #ifdef YAF_ENABLE_APPLABEL
 #include "yafdpi.h"
 #endif
@@ -98,6 +103,7 @@ static char      *yaf_config_file = NULL;
 static int        yaf_opt_rotate = 0;
 static int        yaf_opt_stats = 300;
 static gboolean   yaf_opt_no_tombstone = FALSE;
+static gboolean   yaf_opt_export_thread = FALSE;
 static int        yaf_opt_configured_id = 0;
 static uint64_t   yaf_rotate_ms = 0;
 static gboolean   yaf_opt_caplist_mode = FALSE;
@@ -111,13 +117,25 @@ static char      *yaf_tmp_file = NULL;
 static int        yaf_opt_udp_temp_timeout = 600;
 static int        yaf_live_type = 0;
 static gboolean   yaf_opt_promisc = FALSE;
+#ifdef YAF_ENABLE_AFPACKET
+static int        yaf_opt_workers = 1;
+#endif
 static gboolean   yaf_opt_no_template_metadata = FALSE;
 static gboolean   yaf_opt_no_element_metadata = FALSE;
 
 /* GOption managed flow table options */
 static int      yaf_opt_idle = 300;
 static int      yaf_opt_active = 1800;
+/* set only from the Lua config */
+static GArray  *yaf_timeout_rules = NULL;
+static int      yaf_opt_tcp_syn_timeout = 0;
+static int      yaf_opt_tcp_fin_timeout = 0;
 static int      yaf_opt_max_flows = 0;
+static int      yaf_opt_max_memory = 0;
+static int      yaf_opt_preflow = 0;
+static char    *yaf_checkpoint_file = NULL;
+static yfCheckpoint_t *yaf_checkpoint = NULL;
+static int      yaf_opt_flow_shards = 1;
 static int      yaf_opt_max_payload = 0;
 static int      yaf_opt_payload_export = 0;
 #ifdef YAF_ENABLE_APPLABEL
@@ -158,6 +176,7 @@ static int64_t  yaf_opt_ingress_int = 0;
 static int64_t  yaf_opt_egress_int = 0;
 static int64_t  yaf_opt_observation_domain = 0;
 static gboolean yaf_novlan_in_key;
+static gboolean yaf_opt_hugepages = FALSE;
 /* GOption managed fragment table options */
 static int      yaf_opt_max_frags = 0;
 static gboolean yaf_opt_nofrag = FALSE;
@@ -260,7 +279,8 @@ static AirOptionEntry yaf_optent_core[] = {
               "file"),
     AF_OPTION("live", 'P', 0, AF_OPT_TYPE_STRING, &yaf_config.livetype,
               AF_OPTION_WRAP "Capture from interface in -i; type is"
-              AF_OPTION_WRAP "[pcap], dag, napatech, netronome, pfring, zc",
+              AF_OPTION_WRAP "[pcap], afpacket, dag, napatech, netronome, pfring,"
+              AF_OPTION_WRAP "zc",
               "type"),
     AF_OPTION("filter", 'F', 0, AF_OPT_TYPE_STRING, &yaf_config.bpf_expr,
               AF_OPTION_WRAP "Set BPF filtering expression",
@@ -270,7 +290,8 @@ static AirOptionEntry yaf_optent_core[] = {
               "Read ordered list of input files from file in -i", NULL),
 #ifdef YAF_ENABLE_ZLIB
     AF_OPTION("decompress", 0, 0, AF_OPT_TYPE_STRING, &yaf_tmp_file,
-              AF_OPTION_WRAP "Specify decompression file directory [$TMPDIR]",
+              AF_OPTION_WRAP "Ignored; compressed input is decompressed in"
+              AF_OPTION_WRAP "memory",
               "dir"),
 #endif
     AF_OPTION("rotate", 'R', 0, AF_OPT_TYPE_INT, &yaf_opt_rotate,
@@ -287,6 +308,11 @@ static AirOptionEntry yaf_optent_core[] = {
     AF_OPTION("promisc-off", 0, 0, AF_OPT_TYPE_NONE, &yaf_opt_promisc,
               AF_OPTION_WRAP "Do not put the interface in promiscuous mode",
               NULL),
+#ifdef YAF_ENABLE_AFPACKET
+    AF_OPTION("workers", 0, 0, AF_OPT_TYPE_INT, &yaf_opt_workers,
+              AF_OPTION_WRAP "Spread --live afpacket capture over n threads [1]",
+              "n"),
+#endif
     AF_OPTION("noerror", 0, 0, AF_OPT_TYPE_NONE, &yaf_config.noerror,
               AF_OPTION_WRAP "Do not error out on single PCAP file issue"
               AF_OPTION_WRAP "with multiple inputs", NULL),
@@ -334,8 +360,22 @@ static AirOptionEntry yaf_optent_flow[] = {
               AF_OPTION_WRAP "Set active flow timeout [1800, 30m]",
               "sec"),
     AF_OPTION("max-flows", 0, 0, AF_OPT_TYPE_INT, &yaf_opt_max_flows,
-              AF_OPTION_WRAP "Set maximum size of flow table [0]",
+              AF_OPTION_WRAP "Set maximum size of flow table, divided"
+              AF_OPTION_WRAP "evenly among flow shards [0]",
               "flows"),
+    AF_OPTION("max-memory", 0, 0, AF_OPT_TYPE_INT, &yaf_opt_max_memory,
+              AF_OPTION_WRAP "Set flow table memory budget, divided"
+              AF_OPTION_WRAP "evenly among flow shards or workers [0]",
+              "MB"),
+    AF_OPTION("preflow", 0, 0, AF_OPT_TYPE_INT, &yaf_opt_preflow,
+              AF_OPTION_WRAP "Hold first packets of new flows in a table"
+              AF_OPTION_WRAP "of this size until a second packet, divided"
+              AF_OPTION_WRAP "evenly among flow shards [0]",
+              "entries"),
+    AF_OPTION("checkpoint", 0, 0, AF_OPT_TYPE_STRING, &yaf_checkpoint_file,
+              AF_OPTION_WRAP "Restore active flows from this file, and save"
+              AF_OPTION_WRAP "them to it when stopped by a signal",
+              "file"),
     AF_OPTION("udp-temp-timeout", 0, 0, AF_OPT_TYPE_INT,
               &yaf_opt_udp_temp_timeout,
               AF_OPTION_WRAP "Set UDP template timeout period [600, 10m]",
@@ -346,6 +386,12 @@ static AirOptionEntry yaf_optent_flow[] = {
     AF_OPTION("no-vlan-in-key", 0, 0, AF_OPT_TYPE_NONE, &yaf_novlan_in_key,
               AF_OPTION_WRAP
               "Do not use the VLAN in the flow key hash calculation", NULL),
+    AF_OPTION("hugepages", 0, 0, AF_OPT_TYPE_NONE, &yaf_opt_hugepages,
+              AF_OPTION_WRAP "Allocate flow table memory from huge pages",
+              NULL),
+    AF_OPTION("flow-shards", 0, 0, AF_OPT_TYPE_INT, &yaf_opt_flow_shards,
+              AF_OPTION_WRAP "Spread the flow table over n threads [1]",
+              "n"),
 #ifdef YAF_MPLS
     AF_OPTION("no-mpls", 0, 0, AF_OPT_TYPE_NONE,
               &yaf_opt_no_mpls,
@@ -359,6 +405,9 @@ static AirOptionEntry yaf_optent_flow[] = {
 static AirOptionEntry yaf_optent_exp[] = {
     AF_OPTION("no-output", 0, 0, AF_OPT_TYPE_NONE, &yaf_config.no_output,
               AF_OPTION_WRAP "Turn off IPFIX export", NULL),
+    AF_OPTION("export-thread", 0, 0, AF_OPT_TYPE_NONE, &yaf_opt_export_thread,
+              AF_OPTION_WRAP "Write flow records from a thread of their own",
+              NULL),
     AF_OPTION("no-stats", 0, 0, AF_OPT_TYPE_NONE, &yaf_config.nostats,
               AF_OPTION_WRAP "Turn off stats option records IPFIX export",
               NULL),
@@ -653,6 +702,14 @@ yfVersionString(
                            "YES"
 #else
                            "NO"
+#endif
+                           );
+    g_string_append_printf(resultString, "    * %-32s  %s\n",
+                           "AF_PACKET support:",
+#ifdef YAF_ENABLE_AFPACKET
+                           "YES"
+#else
+                           "NO"
 #endif
                            );
     g_string_append_printf(resultString, "    * %-32s  %s\n",
@@ -1009,6 +1066,9 @@ yfLuaLoadConfig(
 
     yaf_config.livetype = yfLuaGetStrField(L, "type");
     yf_lua_checktablebool("force_read_all", yaf_opt_force_read_all);
+#ifdef YAF_ENABLE_AFPACKET
+    yf_lua_gettableint("workers", yaf_opt_workers);
+#endif
 #if defined(YAF_ENABLE_DAG_SEPARATE_INTERFACES) || defined(YAF_ENABLE_SEPARATE_INTERFACES)
     yf_lua_checktablebool("export_interface", yaf_config.exportInterface);
 #endif
@@ -1049,6 +1109,7 @@ yfLuaLoadConfig(
 
     yf_lua_getnum("stats", yaf_opt_stats);
     yf_lua_getbool("no_tombstone", yaf_opt_no_tombstone);
+    yf_lua_getbool("export_thread", yaf_opt_export_thread);
     yf_lua_getnum("tombstone_configured_id", yaf_opt_configured_id);
     yf_lua_getbool("no_element_metadata", yaf_opt_no_element_metadata);
     yf_lua_getbool("no_template_metadata", yaf_opt_no_template_metadata);
@@ -1056,9 +1117,16 @@ yfLuaLoadConfig(
     yf_lua_getnum("egress", yaf_opt_egress_int);
     yf_lua_getnum("obdomain", yaf_config.odid);
     yf_lua_getnum("maxflows", yaf_opt_max_flows);
+    yf_lua_getnum("maxmemory", yaf_opt_max_memory);
+    yf_lua_getnum("preflow", yaf_opt_preflow);
+    yf_lua_getstr("checkpoint", yaf_checkpoint_file);
+    yf_lua_getbool("hugepages", yaf_opt_hugepages);
+    yf_lua_getnum("flow_shards", yaf_opt_flow_shards);
     yf_lua_getnum("maxfrags", yaf_opt_max_frags);
     yf_lua_getnum("idle_timeout", yaf_opt_idle);
     yf_lua_getnum("active_timeout", yaf_opt_active);
+    yf_lua_getnum("tcp_syn_timeout", yaf_opt_tcp_syn_timeout);
+    yf_lua_getnum("tcp_fin_timeout", yaf_opt_tcp_fin_timeout);
     yf_lua_getnum("maxpayload", yaf_opt_max_payload);
     yf_lua_getnum("maxexport", yaf_opt_payload_export);
     yf_lua_getbool("export_payload", yaf_opt_payload_export_on);
@@ -1219,6 +1287,55 @@ yfLuaLoadConfig(
     }
 #endif /* ifdef YAF_ENABLE_HOOKS */
 
+    /* timeout profiles */
+    lua_getglobal(L, "timeouts");
+    if (!lua_isnil(L, -1)) {
+        yfFlowTimeoutRule_t rule;
+        int   i, len;
+        int   proto, port, applabel, idle, active;
+
+        if (!lua_istable(L, -1)) {
+            air_opterr("timeouts is not a valid table. Should be in the "
+                       "form: timeouts = {{proto=17, port=53, idle=30}, "
+                       "{applabel=53, idle=30, active=600}}");
+        }
+        len = yfLuaGetLen(L, -1);
+        yaf_timeout_rules = g_array_sized_new(FALSE, TRUE, sizeof(rule), len);
+        for (i = 1; i <= len; i++) {
+            lua_rawgeti(L, -1, i);
+            if (lua_istable(L, -1)) {
+                proto = port = applabel = idle = active = 0;
+                yf_lua_gettableint("proto", proto);
+                yf_lua_gettableint("port", port);
+                yf_lua_gettableint("applabel", applabel);
+                yf_lua_gettableint("idle", idle);
+                yf_lua_gettableint("active", active);
+                if (proto < 0 || proto > UINT8_MAX ||
+                    port < 0 || port > UINT16_MAX ||
+                    applabel < 0 || applabel > UINT16_MAX ||
+                    idle < 0 || active < 0)
+                {
+                    air_opterr("timeouts entry %d has a value out of range",
+                               i);
+                }
+                if (!proto && !applabel) {
+                    air_opterr("timeouts entry %d needs a proto or an "
+                               "applabel", i);
+                }
+                memset(&rule, 0, sizeof(rule));
+                rule.proto = proto;
+                rule.port = port;
+                rule.applabel = applabel;
+                rule.idle_ms = (uint64_t)idle * 1000;
+                rule.active_ms = (uint64_t)active * 1000;
+                g_array_append_val(yaf_timeout_rules, rule);
+            }
+            lua_pop(L, 1);
+        }
+        /* Finished with the table */
+        lua_pop(L, 1);
+    }
+
     /* Use these ports to trigger VxLAN or Geneve decoding */
     yfLuaGetSaveTablePort(L, "vxlan_ports", yaf_opt_vxlan_ports);
     yfLuaGetSaveTablePort(L, "geneve_ports", yaf_opt_geneve_ports);
@@ -1581,6 +1698,17 @@ yfParseOptions(
             }
 #endif /* ifdef YAF_ENABLE_PFRINGZC */
 #endif /* ifdef YAF_ENABLE_PFRING */
+#ifdef YAF_ENABLE_AFPACKET
+        } else if (strncmp(yaf_config.livetype, "afpacket", 8) == 0) {
+            /* live capture via AF_PACKET TPACKET_V3 ring (--live=afpacket) */
+            yaf_liveopen_fn = (yfLiveOpen_fn)yfAfPacketOpenLive;
+            yaf_loop_fn = (yfLoop_fn)yfAfPacketMain;
+            yaf_close_fn = (yfClose_fn)yfAfPacketClose;
+            if (yaf_config.pcapdir) {
+                g_warning("WARNING: --pcap not valid for --live afpacket");
+                yaf_config.pcapdir = NULL;
+            }
+#endif /* ifdef YAF_ENABLE_AFPACKET */
         } else {
             /* unsupported live capture type */
             air_opterr("Unsupported live capture type %s", yaf_config.livetype);
@@ -1766,8 +1894,83 @@ yfParseOptions(
 
     if (yaf_opt_promisc) {
         yfSetPromiscMode(0);
+#ifdef YAF_ENABLE_AFPACKET
+        yfAfPacketSetPromiscMode(0);
+#endif
+    }
+
+#ifdef YAF_ENABLE_AFPACKET
+    if (yaf_opt_workers < 1) {
+        air_opterr("--workers must be at least 1");
+    }
+    if (yaf_opt_workers > 1) {
+        if (yaf_liveopen_fn != (yfLiveOpen_fn)yfAfPacketOpenLive) {
+            air_opterr("--workers requires --live afpacket");
+        }
+#ifdef YAF_ENABLE_HOOKS
+        if (pluginName) {
+            air_opterr("--workers is not supported with plugins");
+        }
+#endif
+        yfAfPacketSetWorkers(yaf_opt_workers);
+    }
+#endif /* ifdef YAF_ENABLE_AFPACKET */
+
+    if (yaf_opt_flow_shards < 1) {
+        air_opterr("--flow-shards must be at least 1");
+    }
+    if (yaf_opt_flow_shards > 1) {
+#ifdef YAF_ENABLE_AFPACKET
+        if (yaf_opt_workers > 1) {
+            air_opterr("--flow-shards cannot be used with --workers");
+        }
+#endif
+        if (yaf_config.pcapdir) {
+            air_opterr("--flow-shards is not supported with --pcap");
+        }
+#ifdef YAF_ENABLE_HOOKS
+        if (pluginName) {
+            air_opterr("--flow-shards is not supported with plugins");
+        }
+#endif
+        /* the export thread merges the flows of the shards by end time */
+        yaf_opt_export_thread = TRUE;
     }
 
+    /* the pre-flow table keeps only what a flow takes from a packet with
+     * no payload; the flow table would not use it with these anyway */
+    if (yaf_opt_preflow) {
+        gboolean preflow = (!yaf_config.mpls_mode && yaf_opt_idle &&
+                            !yaf_opt_force_read_all &&
+                            !yaf_opt_p0fprint_mode && !yaf_opt_fpExport_mode &&
+                            !yaf_config.pcapdir && !yaf_pcap_meta_file);
+#ifdef YAF_ENABLE_HOOKS
+        if (pluginName) {
+            preflow = FALSE;
+        }
+#endif
+        if (!preflow) {
+            g_warning("The pre-flow table cannot be used with plugins, MPLS, "
+                      "pcap output, p0f or fpexport, --force-read-all, or "
+                      "an idle timeout of 0; ignoring --preflow.");
+            yaf_opt_preflow = 0;
+        }
+    }
+
+#ifdef YAF_ENABLE_AFPACKET
+    /* the kernel picks the worker of a flow, so a restored flow could not
+     * be put where its packets will go */
+    if (yaf_checkpoint_file && yaf_opt_workers > 1) {
+        air_opterr("--checkpoint cannot be used with --workers");
+    }
+#endif
+
+#ifdef YAF_ENABLE_HOOKS
+    if (yaf_opt_export_thread && pluginName) {
+        air_opterr("--export-thread is not supported with plugins");
+    }
+#endif
+
     if (yaf_daemon) {
         yfDaemonize();
     }
@@ -2039,7 +2242,7 @@ yfQuit(
     int   s)
 {
     (void)s;
-    yaf_quit++;
+    g_atomic_int_inc(&yaf_quit);
 
 #ifdef YAF_ENABLE_PFRING
     yfPfRingBreakLoop(NULL);
@@ -2047,6 +2250,22 @@ yfQuit(
 }
 
 
+/**
+ * yfCheckpointQuit
+ *
+ * quits, writing the active flows to the checkpoint rather than closing
+ * them.
+ *
+ */
+static void
+yfCheckpointQuit(
+    int   s)
+{
+    yfCheckpointRequest(yaf_checkpoint);
+    yfQuit(s);
+}
+
+
 /**
  *
  *
@@ -2059,21 +2278,34 @@ yfQuitInit(
     void)
 {
     struct sigaction sa, osa;
+    /* with a checkpoint, a shutdown saves the active flows for the next
+     * yaf instead of closing them */
+    void (*quit)(int) = yaf_checkpoint ? yfCheckpointQuit : yfQuit;
 
     /* install quit flag handlers */
-    sa.sa_handler = yfQuit;
+    sa.sa_handler = quit;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;
     if (sigaction(SIGINT, &sa, &osa)) {
         g_error("sigaction(SIGINT) failed: %s", strerror(errno));
     }
 
-    sa.sa_handler = yfQuit;
+    sa.sa_handler = quit;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;
     if (sigaction(SIGTERM, &sa, &osa)) {
         g_error("sigaction(SIGTERM) failed: %s", strerror(errno));
     }
+
+    /* and to quit for a restart, as above */
+    if (yaf_checkpoint) {
+        sa.sa_handler = yfCheckpointQuit;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        if (sigaction(SIGUSR2, &sa, &osa)) {
+            g_error("sigaction(SIGUSR2) failed: %s", strerror(errno));
+        }
+    }
 }
 
 
@@ -2094,6 +2326,9 @@ main(
     int         datalink;
     gboolean    loop_ok = TRUE;
     yfFlowTabConfig_t flowtab_config;
+#ifdef YAF_ENABLE_AFPACKET
+    uint32_t    i;
+#endif
 
     memset(&flowtab_config, 0, sizeof(flowtab_config));
 
@@ -2116,7 +2351,11 @@ main(
     /* record yaf start time */
     ctx.yaf_start_time = time(NULL) * 1000;
 
-    /* Set up quit handler */
+    /* Set up the checkpoint, and quit handlers */
+    if (yaf_checkpoint_file) {
+        yaf_checkpoint = yfCheckpointAlloc(yaf_checkpoint_file);
+        ctx.ckpt = yaf_checkpoint;
+    }
     yfQuitInit();
 
     /* open interface if we're doing live capture */
@@ -2210,7 +2449,7 @@ main(
     }
 
     /* Allocate a packet ring. */
-    ctx.pbufring = rgaAlloc(ctx.pbuflen, 128);
+    ctx.pbufring = rgaAllocVar(ctx.pbuflen, 128);
 
     /* Set up decode context */
     ctx.dectx = yfDecodeCtxAlloc(datalink,
@@ -2222,7 +2461,18 @@ main(
     /* Set up flow table */
     flowtab_config.active_ms = yaf_opt_active * 1000;
     flowtab_config.idle_ms = yaf_opt_idle * 1000;
+    flowtab_config.timeout_rules = yaf_timeout_rules;
+    flowtab_config.tcp_syn_ms = (uint64_t)yaf_opt_tcp_syn_timeout * 1000;
+    flowtab_config.tcp_fin_ms = (uint64_t)yaf_opt_tcp_fin_timeout * 1000;
     flowtab_config.max_flows = yaf_opt_max_flows;
+    flowtab_config.max_memory = (uint64_t)yaf_opt_max_memory * 1024 * 1024;
+    flowtab_config.preflow_size = yaf_opt_preflow;
+#ifdef YAF_ENABLE_AFPACKET
+    /* the budget is for the whole process; each worker enforces its share */
+    if (yaf_opt_workers > 1) {
+        flowtab_config.max_memory /= yaf_opt_workers;
+    }
+#endif
     flowtab_config.max_payload = yaf_opt_max_payload;
     flowtab_config.udp_uniflow_port = yaf_opt_udp_uniflow_port;
 
@@ -2234,6 +2484,7 @@ main(
     flowtab_config.mac_mode = yaf_opt_mac_mode;
     flowtab_config.mpls_mode = yaf_config.mpls_mode;
     flowtab_config.no_vlan_in_key = yaf_novlan_in_key;
+    flowtab_config.hugepages = yaf_opt_hugepages;
     flowtab_config.silk_mode = yaf_opt_silk_mode;
     flowtab_config.flowstats_mode = yaf_opt_extra_stats_mode;
     flowtab_config.udp_multipkt_payload = yaf_opt_udp_max_payload;
@@ -2250,8 +2501,10 @@ main(
     flowtab_config.pcap_per_flow = yaf_config.pcap_per_flow;
     flowtab_config.pcap_stime = yaf_stime_search;
 
-    /* Set up flow table */
-    ctx.flowtab = yfFlowTabAlloc(&flowtab_config, yfctx);
+    /* Set up flow table, unless it is split into shards below */
+    if (yaf_opt_flow_shards <= 1) {
+        ctx.flowtab = yfFlowTabAlloc(&flowtab_config, yfctx);
+    }
 
     /* Set up fragment table - ONLY IF USER SAYS */
     if (!yaf_opt_nofrag) {
@@ -2260,6 +2513,65 @@ main(
                                      yaf_opt_max_payload);
     }
 
+    /* Start the export thread before the contexts that flush to it are
+     * copied from this one */
+    if (yaf_opt_export_thread) {
+        if (!yfExportStart(&ctx, yaf_opt_flow_shards, &err)) {
+            g_warning("Cannot start export thread: %s", err->message);
+            exit(1);
+        }
+    }
+
+#ifdef YAF_ENABLE_AFPACKET
+    /* Set up a context per capture worker.  The first worker uses the
+     * tables allocated above; the others get their own. */
+    if (yaf_opt_workers > 1) {
+        ctx.worker_count = yaf_opt_workers;
+        ctx.workers = g_new0(yfContext_t *, ctx.worker_count);
+        for (i = 0; i < ctx.worker_count; i++) {
+            ctx.workers[i] = g_new0(yfContext_t, 1);
+            *(ctx.workers[i]) = ctx;
+            ctx.workers[i]->parent = &ctx;
+            ctx.workers[i]->workers = NULL;
+            ctx.workers[i]->worker_count = 0;
+            if (i == 0) {
+                continue;
+            }
+            ctx.workers[i]->pbufring = rgaAllocVar(ctx.pbuflen, 128);
+            ctx.workers[i]->dectx = yfDecodeCtxAlloc(datalink,
+                                                     yaf_reqtype,
+                                                     yaf_opt_gre_mode,
+                                                     yaf_opt_vxlan_ports,
+                                                     yaf_opt_geneve_ports);
+            ctx.workers[i]->flowtab = yfFlowTabAlloc(&flowtab_config, yfctx);
+            if (ctx.fragtab) {
+                ctx.workers[i]->fragtab = yfFragTabAlloc(30000,
+                                                         yaf_opt_max_frags,
+                                                         yaf_opt_max_payload);
+            }
+        }
+    }
+#endif /* ifdef YAF_ENABLE_AFPACKET */
+
+    /* Start the flow table shards, each with a flow table of its own */
+    if (yaf_opt_flow_shards > 1) {
+        if (!yfShardStart(&ctx, yaf_opt_flow_shards, &flowtab_config, yfctx,
+                          yaf_novlan_in_key, yaf_checkpoint_file, &err))
+        {
+            g_warning("Cannot start flow table shards: %s", err->message);
+            exit(1);
+        }
+    }
+
+    /* Pick up the flows a previous yaf left in its checkpoint; the shards
+     * have already done so for their own tables */
+    if (yaf_checkpoint_file && !ctx.shard_count) {
+        if (!yfFlowTabRestore(&ctx.flowtab, 1, yaf_checkpoint_file, &err)) {
+            g_warning("Cannot restore flows: %s", err->message);
+            g_clear_error(&err);
+        }
+    }
+
     /* We have a packet source, an output stream,
     * and all the tables we need. Run with it. */
 
@@ -2272,7 +2584,34 @@ main(
     /* Close packet source */
     yaf_close_fn(ctx.pktsrc);
 
-    /* Clean up! */
+    /* The flow tables have written the checkpoint, if they were asked to */
+    if (yaf_checkpoint) {
+        if (!yfCheckpointFree(yaf_checkpoint, &err)) {
+            g_warning("Cannot write checkpoint: %s", err->message);
+            g_clear_error(&err);
+        }
+        yaf_checkpoint = NULL;
+    }
+
+    /* Clean up!  The export thread goes first, handing back any flows it
+     * still has to the flow tables freed below. */
+    yfExportFree(&ctx);
+#ifdef YAF_ENABLE_AFPACKET
+    for (i = 0; i < ctx.worker_count; i++) {
+        if (i > 0) {
+            yfFlowTabFree(ctx.workers[i]->flowtab);
+            if (ctx.workers[i]->fragtab) {
+                yfFragTabFree(ctx.workers[i]->fragtab);
+            }
+            yfDecodeCtxFree(ctx.workers[i]->dectx);
+            rgaFree(ctx.workers[i]->pbufring);
+        }
+        g_clear_error(&(ctx.workers[i]->err));
+        g_free(ctx.workers[i]);
+    }
+    g_free(ctx.workers);
+#endif /* ifdef YAF_ENABLE_AFPACKET */
+    yfShardFree(&ctx);
     if (ctx.flowtab) {
         yfFlowTabFree(ctx.flowtab);
     }
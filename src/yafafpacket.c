@@ -0,0 +1,1096 @@
+/*
+ *  Copyright 2006-2023 Carnegie Mellon University
+ *  See license information in LICENSE.txt.
+ */
+/*
+ *  yafafpacket.c
+ *  YAF AF_PACKET (TPACKET_V3) live input support
+ *
+ *  ------------------------------------------------------------------------
+ *  Authors: CERT Network Situational Awareness Group
+ *  ------------------------------------------------------------------------
+ *  @DISTRIBUTION_STATEMENT_BEGIN@
+ *  YAF 3.0.0
+ *
+ *  Copyright 2023 Carnegie Mellon University.
+ *
+ *  NO WARRANTY. THIS CARNEGIE MELLON UNIVERSITY AND SOFTWARE ENGINEERING
+ *  INSTITUTE MATERIAL IS FURNISHED ON AN "AS-IS" BASIS. CARNEGIE MELLON
+ *  UNIVERSITY MAKES NO WARRANTIES OF ANY KIND, EITHER EXPRESSED OR IMPLIED,
+ *  AS TO ANY MATTER INCLUDING, BUT NOT LIMITED TO, WARRANTY OF FITNESS FOR
+ *  PURPOSE OR MERCHANTABILITY, EXCLUSIVITY, OR RESULTS OBTAINED FROM USE OF
+ *  THE MATERIAL. CARNEGIE MELLON UNIVERSITY DOES NOT MAKE ANY WARRANTY OF
+ *  ANY KIND WITH RESPECT TO FREEDOM FROM PATENT, TRADEMARK, OR COPYRIGHT
+ *  INFRINGEMENT.
+ *
+ *  Licensed under a GNU GPL 2.0-style license, please see LICENSE.txt or
+ *  contact permission@sei.cmu.edu for full terms.
+ *
+ *  [DISTRIBUTION STATEMENT A] This material has been approved for public
+ *  release and unlimited distribution.  Please see Copyright notice for
+ *  non-US Government use and distribution.
+ *
+ *  GOVERNMENT PURPOSE RIGHTS – Software and Software Documentation
+ *  Contract No.: FA8702-15-D-0002
+ *  Contractor Name: Carnegie Mellon University
+ *  Contractor Address: 4500 Fifth Avenue, Pittsburgh, PA 15213
+ *
+ *  The Government's rights to use, modify, reproduce, release, perform,
+ *  display, or disclose this software are restricted by paragraph (b)(2) of
+ *  the Rights in Noncommercial Computer Software and Noncommercial Computer
+ *  Software Documentation clause contained in the above identified
+ *  contract. No restrictions apply after the expiration date shown
+ *  above. Any reproduction of the software or portions thereof marked with
+ *  this legend must also reproduce the markings.
+ *
+ *  This Software includes and/or makes use of Third-Party Software each
+ *  subject to its own license.
+ *
+ *  DM23-2317
+ *  @DISTRIBUTION_STATEMENT_END@
+ *  ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <yaf/autoinc.h>
+
+#ifdef YAF_ENABLE_AFPACKET
+#include "yafout.h"
+#include "yafafpacket.h"
+#include "yafstat.h"
+#include "yaflush.h"
+#include <yaf/yafcore.h>
+#include <yaf/yaftab.h>
+#include <pcap.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+/* process the packet ring after this many packets */
+#define YAF_CAP_COUNT 64
+/* poll timeout in milliseconds; flush the flow table when it expires */
+#define YAF_AFPACKET_TIMEOUT 1000
+/* size of a single ring block, grown if a frame will not fit */
+#define YAF_AFPACKET_BLOCK_SIZE (1 << 20)
+/* number of blocks in the ring */
+#define YAF_AFPACKET_BLOCK_NR 64
+/* milliseconds before the kernel retires a partially filled block */
+#define YAF_AFPACKET_RETIRE_TOV 100
+/* length of an 802.1Q tag re-inserted ahead of the ethertype */
+#define YAF_AFPACKET_VLAN_TAG_LEN 4
+/* length of the Linux cooked header built ahead of a cooked packet */
+#define YAF_AFPACKET_SLL_HDR_LEN 16
+
+/* PACKET_FANOUT group mode: symmetric flow hash, defragment first */
+#define YAF_AFPACKET_FANOUT_MODE (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG)
+
+/* Statistics */
+static uint32_t yaf_stats_out = 0;
+static uint64_t yaf_drop = 0;
+static uint64_t yaf_freeze = 0;
+
+static int      yaf_promisc_mode = 1;
+static int      yaf_workers = 1;
+
+typedef struct yfAfPacketRing_st {
+    int                  fd;
+    /* DLT_EN10MB, or DLT_RAW or DLT_LINUX_SLL on a cooked socket */
+    int                  datalink;
+    uint8_t             *map;
+    size_t               map_len;
+    struct tpacket_req3  req;
+    unsigned int         cur_block;
+} yfAfPacketRing_t;
+
+struct yfAfPacketSource_st {
+    yfAfPacketRing_t    *rings;
+    unsigned int         ring_count;
+    int                  snaplen;
+};
+
+typedef struct yfAfPacketBatch_st {
+    const uint8_t       *pkts[YF_DECODE_BATCH];
+    size_t               caplens[YF_DECODE_BATCH];
+    uint64_t             ptimes[YF_DECODE_BATCH];
+    yfPBuf_t            *pbufs[YF_DECODE_BATCH];
+    size_t               count;
+} yfAfPacketBatch_t;
+
+typedef struct yfAfPacketWorker_st {
+    yfContext_t         *ctx;
+    yfAfPacketRing_t    *ring;
+    pthread_t            thread;
+    gboolean             ok;
+} yfAfPacketWorker_t;
+
+
+/**
+ * yfAfPacketFixCooked
+ *
+ * A cooked socket runs its filter on the packet from the network header
+ * on, without the Linux SLL header the filter was compiled against.
+ * Rewrite the program's absolute loads to match: loads past the header
+ * move back by its length, and loads of its packet type and protocol
+ * fields become the kernel's ancillary loads of the same values.
+ * Returns FALSE if the program reads any other part of the header.
+ *
+ */
+static gboolean
+yfAfPacketFixCooked(
+    struct bpf_program  *bpf)
+{
+    struct bpf_insn *insn;
+    u_int            i;
+
+    for (i = 0; i < bpf->bf_len; i++) {
+        insn = &(bpf->bf_insns[i]);
+        if (BPF_CLASS(insn->code) == BPF_LDX &&
+            BPF_MODE(insn->code) == BPF_MSH)
+        {
+            if (insn->k < YAF_AFPACKET_SLL_HDR_LEN) {
+                return FALSE;
+            }
+            insn->k -= YAF_AFPACKET_SLL_HDR_LEN;
+            continue;
+        }
+        if (BPF_CLASS(insn->code) != BPF_LD ||
+            BPF_MODE(insn->code) != BPF_ABS)
+        {
+            continue;
+        }
+        if (insn->k >= YAF_AFPACKET_SLL_HDR_LEN) {
+            insn->k -= YAF_AFPACKET_SLL_HDR_LEN;
+        } else if (insn->k == 0 && BPF_SIZE(insn->code) == BPF_H) {
+            insn->k = SKF_AD_OFF + SKF_AD_PKTTYPE;
+        } else if (insn->k == 14 && BPF_SIZE(insn->code) == BPF_H) {
+            insn->k = SKF_AD_OFF + SKF_AD_PROTOCOL;
+        } else {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+/**
+ * yfAfPacketSetFilter
+ *
+ * Compile a BPF expression for the ring's link type and attach it to the
+ * socket.  An empty expression compiles to a program that accepts every
+ * packet truncated to the snaplen, which keeps the kernel from copying
+ * more of each frame into the ring than yaf will decode.
+ *
+ */
+static gboolean
+yfAfPacketSetFilter(
+    int          fd,
+    int          datalink,
+    int          snaplen,
+    const char  *bpf_expr,
+    GError     **err)
+{
+    pcap_t            *pcap;
+    struct bpf_program bpf;
+    struct sock_fprog  fprog;
+    const char        *expr = bpf_expr ? bpf_expr : "";
+    gboolean           ok = TRUE;
+
+    pcap = pcap_open_dead(datalink, snaplen);
+    if (!pcap) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "couldn't allocate BPF compiler for expression %s", expr);
+        return FALSE;
+    }
+
+    if (pcap_compile(pcap, &bpf, expr, 1, 0) < 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
+                    "couldn't compile BPF expression %s: %s",
+                    expr, pcap_geterr(pcap));
+        pcap_close(pcap);
+        return FALSE;
+    }
+
+    if (datalink == DLT_LINUX_SLL && !yfAfPacketFixCooked(&bpf)) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
+                    "BPF expression %s tests link header fields a cooked "
+                    "AF_PACKET socket does not have", expr);
+        pcap_freecode(&bpf);
+        pcap_close(pcap);
+        return FALSE;
+    }
+
+    fprog.len = bpf.bf_len;
+    fprog.filter = (struct sock_filter *)bpf.bf_insns;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                   &fprog, sizeof(fprog)) < 0)
+    {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
+                    "couldn't attach BPF expression %s: %s",
+                    expr, strerror(errno));
+        ok = FALSE;
+    }
+
+    pcap_freecode(&bpf);
+    pcap_close(pcap);
+
+    return ok;
+}
+
+
+void
+yfAfPacketSetPromiscMode(
+    int   mode)
+{
+    yaf_promisc_mode = mode;
+}
+
+
+void
+yfAfPacketSetWorkers(
+    int   workers)
+{
+    yaf_workers = workers;
+}
+
+
+/**
+ * yfAfPacketLinkType
+ *
+ * Find the link type to capture the interface with from its ARPHRD
+ * hardware type.  Ethernet and loopback devices are captured with their
+ * link headers.  Devices that carry bare IP packets are captured from the
+ * network header, and everything else in cooked mode, with a Linux SLL
+ * header built ahead of each packet.
+ *
+ */
+static gboolean
+yfAfPacketLinkType(
+    const char  *ifname,
+    int         *datalink,
+    GError     **err)
+{
+    struct ifreq ifr;
+    int          fd;
+
+    fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't open AF_PACKET socket: %s", strerror(errno));
+        return FALSE;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    g_strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't get hardware type of %s: %s",
+                    ifname, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+    close(fd);
+
+    switch (ifr.ifr_hwaddr.sa_family) {
+      case ARPHRD_ETHER:
+      case ARPHRD_LOOPBACK:
+        *datalink = DLT_EN10MB;
+        break;
+      case ARPHRD_NONE:
+      case ARPHRD_PPP:
+      case ARPHRD_TUNNEL:
+      case ARPHRD_TUNNEL6:
+#ifdef ARPHRD_RAWIP
+      case ARPHRD_RAWIP:
+#endif
+        *datalink = DLT_RAW;
+        break;
+      default:
+        *datalink = DLT_LINUX_SLL;
+        break;
+    }
+
+    g_debug("Capturing %s (hardware type %u) as link type %s",
+            ifname, ifr.ifr_hwaddr.sa_family,
+            pcap_datalink_val_to_name(*datalink));
+
+    return TRUE;
+}
+
+
+/**
+ * yfAfPacketRingClose
+ *
+ * Unmap a ring and close its socket.
+ *
+ */
+static void
+yfAfPacketRingClose(
+    yfAfPacketRing_t  *ring)
+{
+    if (ring->map != MAP_FAILED) {
+        munmap(ring->map, ring->map_len);
+        ring->map = MAP_FAILED;
+    }
+
+    if (ring->fd >= 0) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+
+/**
+ * yfAfPacketRingOpen
+ *
+ * Open a TPACKET_V3 socket on the interface, map its receive ring, and
+ * bind it.  Any link type but Ethernet gets a cooked socket, which hands
+ * over packets from their network header.  When fanout_id is non-negative
+ * the socket joins that fanout group, so the kernel spreads packets
+ * across every ring in the group by a hash that is the same in both
+ * directions of a flow.
+ *
+ */
+static gboolean
+yfAfPacketRingOpen(
+    yfAfPacketRing_t  *ring,
+    const char        *ifname,
+    unsigned int       ifindex,
+    int                datalink,
+    int                snaplen,
+    int                fanout_id,
+    GError           **err)
+{
+    struct sockaddr_ll  sll;
+    unsigned int        frame_size;
+    unsigned int        block_size;
+    int                 version = TPACKET_V3;
+    int                 reserve = YAF_AFPACKET_VLAN_TAG_LEN;
+    int                 fanout;
+
+    ring->map = MAP_FAILED;
+    ring->datalink = datalink;
+
+    /* room ahead of each packet for its cooked header */
+    if (datalink == DLT_LINUX_SLL) {
+        reserve = YAF_AFPACKET_SLL_HDR_LEN;
+    }
+
+    /* bind before any traffic is accepted, so open without a protocol */
+    ring->fd = socket(AF_PACKET,
+                      (datalink == DLT_EN10MB) ? SOCK_RAW : SOCK_DGRAM, 0);
+    if (ring->fd < 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't open AF_PACKET socket: %s", strerror(errno));
+        return FALSE;
+    }
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0)
+    {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Kernel does not support TPACKET_V3: %s",
+                    strerror(errno));
+        return FALSE;
+    }
+
+    /* leave headroom in each frame to restore a stripped VLAN tag, or to
+     * build a cooked header */
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_RESERVE,
+                   &reserve, sizeof(reserve)) < 0)
+    {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't reserve AF_PACKET frame headroom: %s",
+                    strerror(errno));
+        return FALSE;
+    }
+
+    /* truncate to snaplen in the kernel before the ring is live */
+    if (!yfAfPacketSetFilter(ring->fd, datalink, snaplen, NULL, err)) {
+        return FALSE;
+    }
+
+    frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + reserve + snaplen);
+    block_size = YAF_AFPACKET_BLOCK_SIZE;
+    while (block_size < frame_size) {
+        block_size <<= 1;
+    }
+
+    ring->req.tp_block_size = block_size;
+    ring->req.tp_block_nr = YAF_AFPACKET_BLOCK_NR;
+    ring->req.tp_frame_size = frame_size;
+    ring->req.tp_frame_nr = (block_size / frame_size) * YAF_AFPACKET_BLOCK_NR;
+    ring->req.tp_retire_blk_tov = YAF_AFPACKET_RETIRE_TOV;
+    ring->req.tp_sizeof_priv = 0;
+    ring->req.tp_feature_req_word = 0;
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING,
+                   &(ring->req), sizeof(ring->req)) < 0)
+    {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't allocate %u byte AF_PACKET ring: %s",
+                    block_size * YAF_AFPACKET_BLOCK_NR, strerror(errno));
+        return FALSE;
+    }
+
+    ring->map_len = (size_t)block_size * YAF_AFPACKET_BLOCK_NR;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't map AF_PACKET ring: %s", strerror(errno));
+        return FALSE;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+
+    if (bind(ring->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't bind to %s: %s", ifname, strerror(errno));
+        return FALSE;
+    }
+
+    if (fanout_id >= 0) {
+        fanout = (fanout_id & 0xffff) | (YAF_AFPACKET_FANOUT_MODE << 16);
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT,
+                       &fanout, sizeof(fanout)) < 0)
+        {
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Couldn't join AF_PACKET fanout group %d on %s: %s",
+                        fanout_id, ifname, strerror(errno));
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+yfAfPacketSource_t *
+yfAfPacketOpenLive(
+    const char  *ifname,
+    int          snaplen,
+    int         *datalink,
+    GError     **err)
+{
+    yfAfPacketSource_t *af = NULL;
+    struct packet_mreq  mreq;
+    unsigned int        ifindex;
+    unsigned int        i;
+    int                 fanout_id = -1;
+    int                 link;
+
+    ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't find interface %s: %s",
+                    ifname, strerror(errno));
+        return NULL;
+    }
+
+    if (!yfAfPacketLinkType(ifname, &link, err)) {
+        return NULL;
+    }
+
+    af = g_new0(yfAfPacketSource_t, 1);
+    af->snaplen = snaplen;
+    af->ring_count = (yaf_workers > 1) ? yaf_workers : 1;
+    af->rings = g_new0(yfAfPacketRing_t, af->ring_count);
+    for (i = 0; i < af->ring_count; i++) {
+        af->rings[i].fd = -1;
+        af->rings[i].map = MAP_FAILED;
+    }
+
+    /* fanout groups are per network namespace; the pid keeps concurrent
+     * yaf processes on the same interface out of each other's group */
+    if (af->ring_count > 1) {
+        fanout_id = getpid() & 0xffff;
+    }
+
+    for (i = 0; i < af->ring_count; i++) {
+        if (!yfAfPacketRingOpen(&(af->rings[i]), ifname, ifindex, link,
+                                snaplen, fanout_id, err))
+        {
+            goto err;
+        }
+    }
+
+    /* promiscuous mode is per interface, so one membership will do */
+    if (yaf_promisc_mode) {
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.mr_ifindex = ifindex;
+        mreq.mr_type = PACKET_MR_PROMISC;
+        if (setsockopt(af->rings[0].fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                       &mreq, sizeof(mreq)) < 0)
+        {
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Couldn't put %s in promiscuous mode: %s",
+                        ifname, strerror(errno));
+            goto err;
+        }
+    }
+
+    g_debug("Opened %u AF_PACKET TPACKET_V3 ring(s) on %s: "
+            "%u blocks of %u bytes each",
+            af->ring_count, ifname, af->rings[0].req.tp_block_nr,
+            af->rings[0].req.tp_block_size);
+
+    *datalink = link;
+
+    return af;
+
+  err:
+    yfAfPacketClose(af);
+    return NULL;
+}
+
+
+void
+yfAfPacketClose(
+    yfAfPacketSource_t  *af)
+{
+    unsigned int i;
+
+    for (i = 0; i < af->ring_count; i++) {
+        yfAfPacketRingClose(&(af->rings[i]));
+    }
+
+    g_free(af->rings);
+    g_free(af);
+}
+
+
+/**
+ * yfAfPacketUpdateStats
+ *
+ * The kernel resets its counters on every read, so accumulate them
+ * across all rings.  Only the thread that owns the output calls this.
+ *
+ */
+static void
+yfAfPacketUpdateStats(
+    yfAfPacketSource_t  *af)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t    len;
+    unsigned int i;
+
+    for (i = 0; i < af->ring_count; i++) {
+        len = sizeof(st);
+        if (getsockopt(af->rings[i].fd, SOL_PACKET, PACKET_STATISTICS,
+                       &st, &len) < 0)
+        {
+            g_debug("Error retrieving AF_PACKET stats: %s", strerror(errno));
+            continue;
+        }
+
+        yaf_drop += st.tp_drops;
+        yaf_freeze += st.tp_freeze_q_cnt;
+    }
+}
+
+
+/**
+ * yfAfPacketDecodeBatch
+ *
+ * Decode the frames gathered in the batch into their packet buffers.
+ * The packet buffers reference the frames in place, so the packet ring
+ * must be processed before the block holding them goes back to the
+ * kernel.
+ *
+ */
+static void
+yfAfPacketDecodeBatch(
+    yfContext_t        *ctx,
+    yfAfPacketBatch_t  *batch)
+{
+    if (!batch->count) {
+        return;
+    }
+
+    yfPBufDecodeBatch(ctx, batch->count, batch->pkts, batch->caplens,
+                      batch->ptimes, batch->pbufs);
+
+    batch->count = 0;
+}
+
+
+/**
+ * yfAfPacketCook
+ *
+ * Build the Linux SLL header of a packet from a cooked socket in the
+ * headroom ahead of it, from the address the kernel stored with the
+ * frame.  Returns the start of the header.
+ *
+ */
+static uint8_t *
+yfAfPacketCook(
+    struct tpacket3_hdr  *hdr,
+    uint8_t              *pkt)
+{
+    struct sockaddr_ll *sll;
+    uint16_t            v;
+
+    sll = (struct sockaddr_ll *)
+        ((uint8_t *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+    pkt -= YAF_AFPACKET_SLL_HDR_LEN;
+
+    v = htons(sll->sll_pkttype);
+    memcpy(pkt, &v, sizeof(v));
+    v = htons(sll->sll_hatype);
+    memcpy(pkt + 2, &v, sizeof(v));
+    v = htons(sll->sll_halen);
+    memcpy(pkt + 4, &v, sizeof(v));
+    memset(pkt + 6, 0, 8);
+    memcpy(pkt + 6, sll->sll_addr, MIN(sll->sll_halen, 8));
+    /* already in network byte order */
+    memcpy(pkt + 14, &(sll->sll_protocol), sizeof(sll->sll_protocol));
+
+    return pkt;
+}
+
+
+/**
+ * yfAfPacketHandle
+ *
+ * Add a single frame straight out of the ring to the decode batch,
+ * reserving its packet buffer.  The frame is only modified in place when
+ * the kernel has stripped an 802.1Q tag, which is written back into the
+ * reserved headroom so the decoder sees the packet as it was on the wire,
+ * or when it came from a cooked socket and needs its SLL header.
+ *
+ */
+static void
+yfAfPacketHandle(
+    yfContext_t          *ctx,
+    yfAfPacketRing_t     *ring,
+    yfAfPacketBatch_t    *batch,
+    struct tpacket3_hdr  *hdr)
+{
+    uint8_t        *pkt = (uint8_t *)hdr + hdr->tp_mac;
+    size_t          caplen = hdr->tp_snaplen;
+    uint16_t        tpid = ETH_P_8021Q;
+    size_t          n = batch->count;
+
+    if (ring->datalink == DLT_LINUX_SLL) {
+        pkt = yfAfPacketCook(hdr, pkt);
+        caplen += YAF_AFPACKET_SLL_HDR_LEN;
+    } else if (ring->datalink == DLT_EN10MB &&
+               (hdr->hv1.tp_vlan_tci ||
+                (hdr->tp_status & TP_STATUS_VLAN_VALID)) &&
+               caplen >= 2 * ETH_ALEN &&
+               hdr->tp_mac >= TPACKET3_HDRLEN + YAF_AFPACKET_VLAN_TAG_LEN)
+    {
+#ifdef TP_STATUS_VLAN_TPID_VALID
+        if (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) {
+            tpid = hdr->hv1.tp_vlan_tpid;
+        }
+#endif
+        pkt -= YAF_AFPACKET_VLAN_TAG_LEN;
+        memmove(pkt, pkt + YAF_AFPACKET_VLAN_TAG_LEN, 2 * ETH_ALEN);
+        *(uint16_t *)(pkt + 2 * ETH_ALEN) = htons(tpid);
+        *(uint16_t *)(pkt + 2 * ETH_ALEN + 2) = htons(hdr->hv1.tp_vlan_tci);
+        caplen += YAF_AFPACKET_VLAN_TAG_LEN;
+    }
+
+    /* get next spot in ring buffer; the payload stays in the frame */
+    batch->pbufs[n] = yfPBufNextRef(ctx);
+    g_assert(batch->pbufs[n]);
+
+    batch->pkts[n] = pkt;
+    batch->caplens[n] = caplen;
+    batch->ptimes[n] = ((uint64_t)hdr->tp_sec * 1000) +
+        (hdr->tp_nsec / 1000000);
+
+    if (++(batch->count) == YF_DECODE_BATCH) {
+        yfAfPacketDecodeBatch(ctx, batch);
+    }
+}
+
+
+/**
+ * yfAfPacketBlock
+ *
+ * Return the block descriptor at the head of the ring if the kernel has
+ * handed it to user space, or NULL if it is still being filled.
+ *
+ */
+static struct tpacket_block_desc *
+yfAfPacketBlock(
+    yfAfPacketRing_t  *ring)
+{
+    struct tpacket_block_desc *bd;
+
+    bd = (struct tpacket_block_desc *)
+        (ring->map + ((size_t)ring->cur_block * ring->req.tp_block_size));
+
+    if (!(__atomic_load_n(&(bd->hdr.bh1.block_status), __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER))
+    {
+        return NULL;
+    }
+
+    return bd;
+}
+
+
+/**
+ * yfAfPacketBlockDone
+ *
+ * Hand a consumed block back to the kernel.
+ *
+ */
+static void
+yfAfPacketBlockDone(
+    void  *data)
+{
+    struct tpacket_block_desc *bd = (struct tpacket_block_desc *)data;
+
+    __atomic_store_n(&(bd->hdr.bh1.block_status), TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+}
+
+
+/**
+ * yfAfPacketReleaseBlock
+ *
+ * Advance the ring head past a consumed block, handing the block back to
+ * the kernel once no packet buffer refers to it any more.
+ *
+ */
+static void
+yfAfPacketReleaseBlock(
+    yfContext_t                *ctx,
+    yfAfPacketRing_t           *ring,
+    struct tpacket_block_desc  *bd)
+{
+    yfPBufHold(ctx, yfAfPacketBlockDone, bd);
+    ring->cur_block = (ring->cur_block + 1) % ring->req.tp_block_nr;
+}
+
+
+/**
+ * yfAfPacketWriteStats
+ *
+ * Write a statistics record if the stats interval has elapsed.  With
+ * capture workers the record is merged across all of them, and is
+ * skipped until one of the workers has opened the output.
+ *
+ */
+static gboolean
+yfAfPacketWriteStats(
+    yfContext_t         *ctx,
+    yfAfPacketSource_t  *af,
+    GTimer              *stimer)
+{
+    gboolean ok = TRUE;
+
+    yfAfPacketUpdateStats(af);
+
+    if (ctx->cfg->nostats || g_timer_elapsed(stimer, NULL) <= ctx->cfg->stats)
+    {
+        return TRUE;
+    }
+
+    yfFlushOutputLock(ctx);
+    if (ctx->fbuf) {
+        ok = yfWriteOptionsDataFlows(ctx, yaf_drop, yfStatGetTimer(),
+                                     &(ctx->err));
+        if (ok) {
+            g_timer_start(stimer);
+            yaf_stats_out++;
+        }
+    }
+    yfFlushOutputUnlock(ctx);
+
+    return ok;
+}
+
+
+/**
+ * yfAfPacketLoop
+ *
+ * Read one ring until told to quit, decoding each block in place and
+ * feeding the flow table of the context.  The source is only passed by
+ * the context that owns the output, which then also takes care of the
+ * capture statistics; a capture worker passes NULL.
+ *
+ */
+static gboolean
+yfAfPacketLoop(
+    yfContext_t         *ctx,
+    yfAfPacketRing_t    *ring,
+    yfAfPacketSource_t  *af,
+    GTimer              *stimer)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *hdr;
+    yfAfPacketBatch_t   batch;
+    struct pollfd       pfd;
+    uint32_t            i;
+    uint32_t            pkts = 0;
+    int                 rv;
+
+    pfd.fd = ring->fd;
+    pfd.events = POLLIN | POLLERR;
+    batch.count = 0;
+
+    /* process input until we're done */
+    while (!g_atomic_int_get(&yaf_quit)) {
+        if (!(bd = yfAfPacketBlock(ring))) {
+            /* Nothing retired yet; wait for the kernel */
+            pfd.revents = 0;
+            rv = poll(&pfd, 1, YAF_AFPACKET_TIMEOUT);
+            if (rv < 0 && errno != EINTR) {
+                g_set_error(&(ctx->err), YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                            "Couldn't poll AF_PACKET socket: %s",
+                            strerror(errno));
+                return FALSE;
+            }
+            if (rv == 0) {
+                /* Live, no packet processed (timeout). Flush buffer */
+                if (af) {
+                    yfAfPacketUpdateStats(af);
+                }
+                if (!yfTimeOutFlush(ctx, yaf_drop,
+                                    &yaf_stats_out,
+                                    yfStatGetTimer(), stimer,
+                                    &(ctx->err)))
+                {
+                    return FALSE;
+                }
+            }
+            continue;
+        }
+
+        /* Walk the frames in the block, decoding in place */
+        hdr = (struct tpacket3_hdr *)
+            ((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+            yfAfPacketHandle(ctx, ring, &batch, hdr);
+            hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+
+            if (++pkts >= YAF_CAP_COUNT) {
+                pkts = 0;
+                yfAfPacketDecodeBatch(ctx, &batch);
+                if (!yfProcessPBufRing(ctx, &(ctx->err))) {
+                    yfAfPacketReleaseBlock(ctx, ring, bd);
+                    return FALSE;
+                }
+            }
+        }
+
+        /* the packet buffers point into the block, so they must be
+         * through the flow table before the kernel can reuse it; with
+         * flow table shards, that is once the shards are done with them */
+        yfAfPacketDecodeBatch(ctx, &batch);
+        pkts = 0;
+        if (!yfProcessPBufRing(ctx, &(ctx->err))) {
+            yfAfPacketReleaseBlock(ctx, ring, bd);
+            return FALSE;
+        }
+
+        yfAfPacketReleaseBlock(ctx, ring, bd);
+
+        if (af && !yfAfPacketWriteStats(ctx, af, stimer)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+/**
+ * yfAfPacketWorkerMain
+ *
+ * Thread body of a capture worker: run the worker's ring, then flush
+ * whatever is left in its flow table while the output is still open.
+ * Any failure stops the other workers as well.
+ *
+ */
+static void *
+yfAfPacketWorkerMain(
+    void  *arg)
+{
+    yfAfPacketWorker_t *worker = (yfAfPacketWorker_t *)arg;
+    yfContext_t        *wctx = worker->ctx;
+
+    worker->ok = yfAfPacketLoop(wctx, worker->ring, NULL, NULL);
+
+    if (worker->ok && wctx->exportq) {
+        /* may wait for the export thread, so not under the lock */
+        worker->ok = yfFlowTabFlush(wctx, TRUE, &(wctx->err));
+    } else if (worker->ok) {
+        yfFlushOutputLock(wctx);
+        if (wctx->fbuf) {
+            worker->ok = yfFlowTabFlush(wctx, TRUE, &(wctx->err));
+        }
+        yfFlushOutputUnlock(wctx);
+    }
+
+    if (!worker->ok) {
+        g_atomic_int_inc(&yaf_quit);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * yfAfPacketRunWorkers
+ *
+ * Run one capture worker thread per ring, each with its own decode
+ * context, fragment table and flow table, sharing the output of ctx
+ * under a lock.  The calling thread collects the capture statistics
+ * and writes the merged statistics records until the workers finish.
+ *
+ */
+static gboolean
+yfAfPacketRunWorkers(
+    yfContext_t         *ctx,
+    yfAfPacketSource_t  *af,
+    GTimer              *stimer)
+{
+    yfAfPacketWorker_t *workers;
+    pthread_mutex_t     outlock;
+    unsigned int        started = 0;
+    unsigned int        i;
+    gboolean            ok = TRUE;
+    int                 rv;
+
+    if (ctx->worker_count != af->ring_count) {
+        g_set_error(&(ctx->err), YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
+                    "Have %u capture workers for %u AF_PACKET rings",
+                    ctx->worker_count, af->ring_count);
+        return FALSE;
+    }
+
+    /* the export thread serializes the output, if there is one */
+    if (!ctx->outlock) {
+        pthread_mutex_init(&outlock, NULL);
+        ctx->outlock = &outlock;
+    }
+
+    workers = g_new0(yfAfPacketWorker_t, af->ring_count);
+    for (i = 0; i < af->ring_count; i++) {
+        workers[i].ctx = ctx->workers[i];
+        workers[i].ring = &(af->rings[i]);
+        rv = pthread_create(&(workers[i].thread), NULL,
+                            yfAfPacketWorkerMain, &(workers[i]));
+        if (rv != 0) {
+            g_set_error(&(ctx->err), YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Couldn't start capture worker %u: %s",
+                        i, strerror(rv));
+            ok = FALSE;
+            g_atomic_int_inc(&yaf_quit);
+            break;
+        }
+        started++;
+    }
+
+    while (!g_atomic_int_get(&yaf_quit)) {
+        g_usleep(YAF_AFPACKET_RETIRE_TOV * 1000);
+        if (!yfAfPacketWriteStats(ctx, af, stimer)) {
+            ok = FALSE;
+            g_atomic_int_inc(&yaf_quit);
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (!workers[i].ok && ok) {
+            g_propagate_error(&(ctx->err), workers[i].ctx->err);
+            workers[i].ctx->err = NULL;
+            ok = FALSE;
+        }
+    }
+
+    yfAfPacketUpdateStats(af);
+
+    g_free(workers);
+    if (ctx->outlock == &outlock) {
+        ctx->outlock = NULL;
+        pthread_mutex_destroy(&outlock);
+    }
+
+    return ok;
+}
+
+
+gboolean
+yfAfPacketMain(
+    yfContext_t  *ctx)
+{
+    gboolean            ok = TRUE;
+    yfAfPacketSource_t *af = (yfAfPacketSource_t *)ctx->pktsrc;
+    GTimer             *stimer = NULL;   /* to export stats */
+    unsigned int        i;
+
+    if (ctx->cfg->bpf_expr) {
+        for (i = 0; i < af->ring_count; i++) {
+            if (!yfAfPacketSetFilter(af->rings[i].fd, af->rings[i].datalink,
+                                     af->snaplen, ctx->cfg->bpf_expr,
+                                     &(ctx->err)))
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    if (!ctx->cfg->nostats) {
+        stimer = g_timer_new();
+    }
+
+    if (ctx->worker_count) {
+        ok = yfAfPacketRunWorkers(ctx, af, stimer);
+    } else {
+        ok = yfAfPacketLoop(ctx, &(af->rings[0]), af, stimer);
+        yfAfPacketUpdateStats(af);
+    }
+
+    if (!ctx->cfg->nostats) {
+        /* add one for final flush */
+        if (ok) {yaf_stats_out++;}
+        /* free timer */
+        g_timer_destroy(stimer);
+    }
+
+    /* Handle final flush */
+    return yfFinalFlush(ctx, ok, yaf_drop, yfStatGetTimer(),
+                        &(ctx->err));
+}
+
+
+void
+yfAfPacketDumpStats(
+    void)
+{
+    if (yaf_stats_out) {
+        g_debug("yaf Exported %u stats records.", yaf_stats_out);
+    }
+
+    if (yaf_drop) {
+        g_warning("Live capture device dropped %" PRIu64 " packets.", yaf_drop);
+    }
+
+    if (yaf_freeze) {
+        g_debug("AF_PACKET ring was full %" PRIu64 " times.", yaf_freeze);
+    }
+}
+
+
+#endif /* ifdef YAF_ENABLE_AFPACKET */
@@ -63,6 +63,19 @@
 #ifdef YAF_ENABLE_ZLIB
 #include <zlib.h>
 #endif
+#ifdef YAF_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef YAF_ENABLE_LZMA
+#include <lzma.h>
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #ifdef YAF_ENABLE_BIVIO
 #include <pcap-zcopy.h>
@@ -72,11 +85,42 @@
 #include "yaflush.h"
 #include "yafstat.h"
 
-#define YF_CHUNK 16384
-/*RFC 1950 */
-#define ZLIB_HEADER 0x9C78
-/* RFC 1952 */
-#define GZIP_HEADER 0x8B1F
+#if defined(YAF_ENABLE_ZLIB) || defined(YAF_ENABLE_ZSTD) || \
+    defined(YAF_ENABLE_LZMA)
+#define YF_ENABLE_DECOMPRESS 1
+#endif
+
+/* size of the buffers used to inflate a compressed capture file */
+#define YF_CHUNK (256 * 1024)
+/* size to grow the pipe between the inflate thread and libpcap to */
+#define YF_INFLATE_PIPE_SIZE (1024 * 1024)
+
+typedef enum yfCapCompress_en {
+    YF_COMPRESS_NONE,
+    YF_COMPRESS_ZLIB,
+    YF_COMPRESS_ZSTD,
+    YF_COMPRESS_XZ
+} yfCapCompress_t;
+
+/* state handed to an inflate thread, which frees it */
+typedef struct yfCapInflate_st {
+    FILE             *src;
+    int               fd;
+    yfCapCompress_t   type;
+    char             *path;
+} yfCapInflate_t;
+
+struct yfCapPrefetch_st;
+
+/* a pcapng interface, from its Interface Description Block */
+typedef struct yfCapNgIf_st {
+    uint16_t   linktype;
+    uint32_t   snaplen;
+    /* timestamp units per second (if_tsresol) */
+    uint64_t   units;
+    /* seconds to add to every timestamp (if_tsoffset) */
+    int64_t    tsoffset;
+} yfCapNgIf_t;
 
 struct yfCapSource_st {
     pcap_t    *pcap;
@@ -87,9 +131,44 @@ struct yfCapSource_st {
     gboolean   swap;
     gboolean   is_live;
     int        datalink;
+    /* classic pcap file mapped into memory, read in place of libpcap */
+    uint8_t   *map;
+    size_t     map_len;
+    size_t     map_off;
+    size_t     map_advised;
+    gboolean   map_swap;
+    gboolean   map_nsec;
+    gboolean   map_filter;
+    gboolean   map_failed;
+    struct bpf_program map_bpf;
+    char       map_errbuf[PCAP_ERRBUF_SIZE];
+    /* mapped file is pcapng; interfaces of the current section */
+    gboolean     ng;
+    gboolean     ng_swap;
+    yfCapNgIf_t *ng_ifs;
+    unsigned int ng_if_count;
+    /* interface of the packet being handled */
+    uint16_t   ifnum;
+    /* opens the next files of a --caplist ahead of the packet loop */
+    struct yfCapPrefetch_st *prefetch;
 };
 
+/* files of a --caplist opened ahead by the prefetch thread */
+typedef struct yfCapPrefetch_st {
+    pthread_t         thread;
+    pthread_mutex_t   mutex;
+    pthread_cond_t    cond;
+    /* opened yfCapSource_t, one per file, in list order */
+    GQueue           *ready;
+    const char       *bpf_expr;
+    GError           *err;
+    gboolean          done;
+    gboolean          stop;
+} yfCapPrefetch_t;
+
 static pcap_t    *yaf_pcap;
+/* pcap_compile() is not reentrant in older libpcap */
+static pthread_mutex_t yaf_bpf_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int        yaf_promisc_mode = 1;
 static GTimer    *timer_pcap_file = NULL;
 
@@ -105,6 +184,25 @@ static uint32_t   yaf_ifdrop = 0;
 #define YAF_CAP_COUNT   64
 
 #define PCAPNG_BLOCKTYPE 0x0A0D0D0A
+#define PCAPNG_BYTEORDER 0x1A2B3C4D
+/* pcapng block types read from a mapped file */
+#define PCAPNG_IDB       0x00000001
+#define PCAPNG_PB        0x00000002
+#define PCAPNG_SPB       0x00000003
+#define PCAPNG_EPB       0x00000006
+/* pcapng interface options */
+#define PCAPNG_OPT_TSRESOL  9
+#define PCAPNG_OPT_TSOFFSET 14
+
+/* classic pcap file magic numbers, microsecond and nanosecond */
+#define YF_PCAP_MAGIC       0xA1B2C3D4
+#define YF_PCAP_MAGIC_NSEC  0xA1B23C4D
+/* length of a classic pcap record header */
+#define YF_PCAP_RECHDR_LEN  16
+/* bytes of a mapped pcap file to ask the kernel to read ahead */
+#define YF_MAP_READAHEAD    (8 << 20)
+/* number of --caplist files to keep open ahead of the packet loop */
+#define YF_CAP_PREFETCH     4
 
 static gboolean
 yfCapCheckDatalink(
@@ -210,6 +308,12 @@ yfCapPcapNGCheck(
     uint32_t ng_magic;
     uint32_t block_len;
 
+    if (cs->pcapng) {
+        fclose(cs->pcapng);
+        cs->pcapng = NULL;
+    }
+    cs->swap = FALSE;
+
     /* check if this is a pcapng file */
     cs->pcapng = fopen(path, "r");
     if (!cs->pcapng) {
@@ -259,96 +363,378 @@ yfCapPcapNGCheck(
 }
 
 
-#ifdef YAF_ENABLE_ZLIB
-static FILE *
-yfCapFileDecompress(
-    FILE  *src,
-    char  *tmp_file_path)
+#ifdef YF_ENABLE_DECOMPRESS
+/**
+ * yfCapCompressType
+ *
+ * Identify the compression format of a file from its magic number.
+ *
+ */
+static yfCapCompress_t
+yfCapCompressType(
+    const uint8_t  *magic,
+    size_t          len)
 {
-    int           ret;
-    z_stream      strm;
-    unsigned int  leftover;
-    unsigned char in[YF_CHUNK];
-    unsigned char out[YF_CHUNK];
-    FILE         *dst = NULL;
-    int           fd;
-    char          tmpname[YF_CHUNK];
-    char          temp_suffix[] = ".XXXXXX";
-
-    /*allocate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-
-    if (tmp_file_path) {
-        snprintf(tmpname, YF_CHUNK, "%s/yf_def_tmp%s", tmp_file_path,
-                 temp_suffix);
-    } else if (getenv("TMPDIR")) {
-        const char *env = getenv("TMPDIR");
-        snprintf(tmpname, YF_CHUNK, "%s/yf_def_tmp%s", env, temp_suffix);
-    } else {
-        snprintf(tmpname, YF_CHUNK, "/tmp/yf_def_tmp%s", temp_suffix);
+#ifdef YAF_ENABLE_ZLIB
+    /* RFC 1952 (gzip) or RFC 1950 (zlib) */
+    if (len >= 2 && ((magic[0] == 0x1F && magic[1] == 0x8B) ||
+                     (magic[0] == 0x78 && magic[1] == 0x9C)))
+    {
+        return YF_COMPRESS_ZLIB;
+    }
+#endif
+#ifdef YAF_ENABLE_ZSTD
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 &&
+        magic[2] == 0x2F && magic[3] == 0xFD)
+    {
+        return YF_COMPRESS_ZSTD;
+    }
+#endif
+#ifdef YAF_ENABLE_LZMA
+    if (len >= 6 && memcmp(magic, "\xFD" "7zXZ\x00", 6) == 0) {
+        return YF_COMPRESS_XZ;
     }
+#endif
 
-    g_debug("Input file is compressed, attempting decompression ");
+    return YF_COMPRESS_NONE;
+}
 
-    fd = mkstemp(tmpname);
-    if (fd == -1) {
-        g_warning("Unable to open decompression tmp file '%s': %s",
-                  tmpname, strerror(errno));
-        return NULL;
-    } else {
-        dst = fdopen(fd, "wb+");
-        if (!dst) {
-            g_warning("Unable to open decompression tmp file '%s': %s",
-                      tmpname, strerror(errno));
-            return NULL;
+
+/**
+ * yfCapInflateWrite
+ *
+ * Write a block of inflated data to the pipe.  Fails once the reader
+ * has gone away, which is how the thread learns to stop early.
+ *
+ */
+static gboolean
+yfCapInflateWrite(
+    int            fd,
+    const uint8_t *buf,
+    size_t         len)
+{
+    ssize_t rv;
+
+    while (len) {
+        rv = write(fd, buf, len);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FALSE;
         }
+        buf += rv;
+        len -= rv;
     }
 
-    ret = inflateInit2(&strm, 16 + MAX_WBITS);
-    if (ret != Z_OK) {
-        return NULL;
+    return TRUE;
+}
+
+
+#ifdef YAF_ENABLE_ZLIB
+/**
+ * yfCapInflateZlib
+ *
+ * Inflate a gzip or zlib compressed file into the pipe.
+ *
+ */
+static gboolean
+yfCapInflateZlib(
+    yfCapInflate_t  *inf,
+    uint8_t         *in,
+    uint8_t         *out)
+{
+    z_stream strm;
+    int      ret = Z_OK;
+
+    memset(&strm, 0, sizeof(strm));
+    /* 32 lets zlib detect either a gzip or a zlib header */
+    if (inflateInit2(&strm, 32 + MAX_WBITS) != Z_OK) {
+        g_warning("Couldn't initialize decompression of %s", inf->path);
+        return FALSE;
     }
 
     do {
-        strm.avail_in = fread(in, 1, YF_CHUNK, src);
-        if (ferror(src)) {
-            (void)inflateEnd(&strm);
-            return NULL;
-        }
-
-        if (strm.avail_in == 0) {
+        strm.avail_in = fread(in, 1, YF_CHUNK, inf->src);
+        if (ferror(inf->src) || strm.avail_in == 0) {
             break;
         }
         strm.next_in = in;
 
         do {
+            /* a gzip file may hold several concatenated members */
+            if (ret == Z_STREAM_END) {
+                inflateReset(&strm);
+            }
             strm.avail_out = YF_CHUNK;
             strm.next_out = out;
-
             ret = inflate(&strm, Z_NO_FLUSH);
-            if (ret == Z_STREAM_ERROR) { return NULL; }
-            leftover = YF_CHUNK - strm.avail_out;
-            if (fwrite(out, 1, leftover, dst) != leftover || ferror(dst)) {
-                (void)inflateEnd(&strm);
-                return NULL;
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                g_warning("Error decompressing %s: %s", inf->path,
+                          strm.msg ? strm.msg : "invalid data");
+                inflateEnd(&strm);
+                return FALSE;
+            }
+            if (!yfCapInflateWrite(inf->fd, out, YF_CHUNK - strm.avail_out)) {
+                inflateEnd(&strm);
+                return FALSE;
             }
-        } while (strm.avail_out == 0);
-    } while (ret != Z_STREAM_END);
+        } while (strm.avail_out == 0 || strm.avail_in != 0);
+    } while (1);
+
+    inflateEnd(&strm);
+
+    return !ferror(inf->src);
+}
 
-    (void)inflateEnd(&strm);
 
-    rewind(dst);
-    unlink(tmpname);
+#endif /* ifdef YAF_ENABLE_ZLIB */
+
+#ifdef YAF_ENABLE_ZSTD
+/**
+ * yfCapInflateZstd
+ *
+ * Inflate a zstd compressed file into the pipe.
+ *
+ */
+static gboolean
+yfCapInflateZstd(
+    yfCapInflate_t  *inf,
+    uint8_t         *in,
+    uint8_t         *out)
+{
+    ZSTD_DStream  *zds;
+    ZSTD_inBuffer  zin;
+    ZSTD_outBuffer zout;
+    size_t         ret;
+    gboolean       ok = TRUE;
+
+    zds = ZSTD_createDStream();
+    if (!zds || ZSTD_isError(ZSTD_initDStream(zds))) {
+        g_warning("Couldn't initialize decompression of %s", inf->path);
+        ZSTD_freeDStream(zds);
+        return FALSE;
+    }
+
+    while (ok && (zin.size = fread(in, 1, YF_CHUNK, inf->src)) > 0) {
+        zin.src = in;
+        zin.pos = 0;
+        while (zin.pos < zin.size) {
+            zout.dst = out;
+            zout.size = YF_CHUNK;
+            zout.pos = 0;
+            ret = ZSTD_decompressStream(zds, &zout, &zin);
+            if (ZSTD_isError(ret)) {
+                g_warning("Error decompressing %s: %s", inf->path,
+                          ZSTD_getErrorName(ret));
+                ok = FALSE;
+                break;
+            }
+            if (!yfCapInflateWrite(inf->fd, out, zout.pos)) {
+                ok = FALSE;
+                break;
+            }
+        }
+    }
+
+    ZSTD_freeDStream(zds);
+
+    return ok && !ferror(inf->src);
+}
+
+
+#endif /* ifdef YAF_ENABLE_ZSTD */
+
+#ifdef YAF_ENABLE_LZMA
+/**
+ * yfCapInflateXz
+ *
+ * Inflate an xz compressed file into the pipe.
+ *
+ */
+static gboolean
+yfCapInflateXz(
+    yfCapInflate_t  *inf,
+    uint8_t         *in,
+    uint8_t         *out)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_action action = LZMA_RUN;
+    lzma_ret    ret;
+
+    if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+        g_warning("Couldn't initialize decompression of %s", inf->path);
+        return FALSE;
+    }
+
+    strm.next_out = out;
+    strm.avail_out = YF_CHUNK;
+
+    while (1) {
+        if (strm.avail_in == 0 && action == LZMA_RUN) {
+            strm.next_in = in;
+            strm.avail_in = fread(in, 1, YF_CHUNK, inf->src);
+            if (ferror(inf->src)) {
+                break;
+            }
+            if (feof(inf->src)) {
+                action = LZMA_FINISH;
+            }
+        }
+
+        ret = lzma_code(&strm, action);
+
+        if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
+            if (!yfCapInflateWrite(inf->fd, out, YF_CHUNK - strm.avail_out)) {
+                break;
+            }
+            strm.next_out = out;
+            strm.avail_out = YF_CHUNK;
+        }
+
+        if (ret == LZMA_STREAM_END) {
+            lzma_end(&strm);
+            return TRUE;
+        }
+        if (ret != LZMA_OK) {
+            g_warning("Error decompressing %s: lzma error %d",
+                      inf->path, (int)ret);
+            break;
+        }
+    }
+
+    lzma_end(&strm);
+
+    return FALSE;
+}
+
+
+#endif /* ifdef YAF_ENABLE_LZMA */
+
+/**
+ * yfCapInflateThread
+ *
+ * Body of the thread that inflates a compressed capture file into the
+ * pipe libpcap reads from, so decompression overlaps flow processing.
+ * Closing the pipe ends the stream; libpcap reports a short file as a
+ * truncated dump file.
+ *
+ */
+static void *
+yfCapInflateThread(
+    void  *arg)
+{
+    yfCapInflate_t *inf = (yfCapInflate_t *)arg;
+    uint8_t        *in = g_malloc(YF_CHUNK);
+    uint8_t        *out = g_malloc(YF_CHUNK);
+    sigset_t        sigs;
+
+    /* a closed reader must fail the write, not kill yaf */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    switch (inf->type) {
+#ifdef YAF_ENABLE_ZLIB
+      case YF_COMPRESS_ZLIB:
+        yfCapInflateZlib(inf, in, out);
+        break;
+#endif
+#ifdef YAF_ENABLE_ZSTD
+      case YF_COMPRESS_ZSTD:
+        yfCapInflateZstd(inf, in, out);
+        break;
+#endif
+#ifdef YAF_ENABLE_LZMA
+      case YF_COMPRESS_XZ:
+        yfCapInflateXz(inf, in, out);
+        break;
+#endif
+      default:
+        break;
+    }
+
+    close(inf->fd);
+    fclose(inf->src);
+    g_free(inf->path);
+    g_free(inf);
+    g_free(in);
+    g_free(out);
+
+    return NULL;
+}
+
+
+/**
+ * yfCapFileDecompress
+ *
+ * Start a thread that inflates src into a pipe and return the read end
+ * of the pipe as a stream for pcap_fopen_offline().  Takes ownership of
+ * src.
+ *
+ */
+static FILE *
+yfCapFileDecompress(
+    FILE             *src,
+    yfCapCompress_t   type,
+    const char       *path,
+    GError          **err)
+{
+    yfCapInflate_t *inf;
+    pthread_t       thread;
+    FILE           *dst;
+    int             pfd[2];
+    int             rv;
+
+    g_debug("Input file is compressed, decompressing in the background");
+
+    if (pipe(pfd) != 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't create decompression pipe: %s",
+                    strerror(errno));
+        fclose(src);
+        return NULL;
+    }
+
+#ifdef F_SETPIPE_SZ
+    /* let the inflate thread run further ahead of the packet loop */
+    fcntl(pfd[1], F_SETPIPE_SZ, YF_INFLATE_PIPE_SIZE);
+#endif
+
+    dst = fdopen(pfd[0], "rb");
+    if (!dst) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't open decompression pipe: %s", strerror(errno));
+        close(pfd[0]);
+        close(pfd[1]);
+        fclose(src);
+        return NULL;
+    }
+
+    inf = g_new0(yfCapInflate_t, 1);
+    inf->src = src;
+    inf->fd = pfd[1];
+    inf->type = type;
+    inf->path = g_strdup(path);
+
+    rv = pthread_create(&thread, NULL, yfCapInflateThread, inf);
+    if (rv != 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't start decompression thread: %s", strerror(rv));
+        fclose(dst);
+        close(pfd[1]);
+        fclose(src);
+        g_free(inf->path);
+        g_free(inf);
+        return NULL;
+    }
+    pthread_detach(thread);
 
     return dst;
 }
 
 
-#endif /* ifdef YAF_ENABLE_ZLIB */
+#endif /* ifdef YF_ENABLE_DECOMPRESS */
 
 static pcap_t *
 yfCapOpenFileInner(
@@ -371,41 +757,39 @@ yfCapOpenFileInner(
 
     pcap = pcap_open_offline(path, pcap_errbuf);
     if (!pcap) {
-#ifdef YAF_ENABLE_ZLIB
+#ifdef YF_ENABLE_DECOMPRESS
         FILE *tmp = fopen(path, "rb");
         FILE *out = NULL;
+        uint8_t magic[6];
+        size_t len;
+        yfCapCompress_t type = YF_COMPRESS_NONE;
+
         if (tmp) {
-            uint16_t header = 0;
-            fread(&header, 1, 2, tmp);
-            if ((header == ZLIB_HEADER) || (header == GZIP_HEADER)) {
-                rewind(tmp);
-                out = yfCapFileDecompress(tmp, tmp_file);
-                if (out) {
-                    pcap = pcap_fopen_offline(out, pcap_errbuf);
-                    fclose(tmp);
-                    if (!pcap) {
-                        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
-                                    "%s", pcap_errbuf);
-                        return NULL;
-                    }
-                } else {
-                    fclose(tmp);
-                    g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
-                                "File could not be decompressed.");
-                    return NULL;
-                }
-            } else {
-                fclose(tmp);
+            len = fread(magic, 1, sizeof(magic), tmp);
+            type = yfCapCompressType(magic, len);
+        }
+        if (type != YF_COMPRESS_NONE) {
+            rewind(tmp);
+            out = yfCapFileDecompress(tmp, type, path, err);
+            if (!out) {
+                return NULL;
+            }
+            pcap = pcap_fopen_offline(out, pcap_errbuf);
+            if (!pcap) {
+                fclose(out);
                 g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
                             "%s", pcap_errbuf);
                 return NULL;
             }
         } else {
-#endif /* ifdef YAF_ENABLE_ZLIB */
+            if (tmp) {
+                fclose(tmp);
+            }
+#endif /* ifdef YF_ENABLE_DECOMPRESS */
         g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
                     "%s", pcap_errbuf);
         return NULL;
-#ifdef YAF_ENABLE_ZLIB
+#ifdef YF_ENABLE_DECOMPRESS
     }
 #endif
     }
@@ -421,32 +805,489 @@ yfCapOpenFileInner(
 }
 
 
-yfCapSource_t *
-yfCapOpenFile(
-    const char  *path,
-    int         *datalink,
-    char        *tmp_file,
-    GError     **err)
-{
-    yfCapSource_t *cs;
+/**
+ * yfCapMapClose
+ *
+ * Unmap the current capture file, if it was mapped, and free the filter
+ * program used with the mapping.
+ *
+ */
+static void
+yfCapMapClose(
+    yfCapSource_t  *cs)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (cs->map) {
+        munmap(cs->map, cs->map_len);
+        cs->map = NULL;
+    }
+#endif
+    if (cs->map_filter) {
+        pcap_freecode(&(cs->map_bpf));
+        cs->map_filter = FALSE;
+    }
+    g_free(cs->ng_ifs);
+    cs->ng_ifs = NULL;
+    cs->ng_if_count = 0;
+    cs->ng = FALSE;
+    cs->map_failed = FALSE;
+}
+
+
+/**
+ * yfCapMapAdvise
+ *
+ * Ask the kernel to read the next part of a mapped file ahead of the
+ * packet loop.  The request is only renewed once half of the previous
+ * window has been consumed.
+ *
+ */
+static void
+yfCapMapAdvise(
+    yfCapSource_t  *cs)
+{
+#ifdef HAVE_MADVISE
+    static size_t pagesize = 0;
+    size_t        start;
+    size_t        len;
+
+    if (cs->map_off + (YF_MAP_READAHEAD / 2) < cs->map_advised) {
+        return;
+    }
+
+    if (!pagesize) {
+        pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    }
+
+    start = cs->map_off & ~(pagesize - 1);
+    len = MIN(YF_MAP_READAHEAD, cs->map_len - start);
+    madvise(cs->map + start, len, MADV_WILLNEED);
+    cs->map_advised = start + len;
+#endif /* ifdef HAVE_MADVISE */
+}
+
+
+/**
+ * yfCapMapOpen
+ *
+ * Map a pcap or pcapng file opened by libpcap so its records can be
+ * read in place.  Anything that is not a regular file (stdin, a pipe, a
+ * file too large for the address space) is left to libpcap, so a
+ * failure here is not an error.
+ *
+ */
+static void
+yfCapMapOpen(
+    yfCapSource_t  *cs)
+{
+#ifdef HAVE_SYS_MMAN_H
+    FILE       *fp;
+    struct stat st;
+    uint32_t    magic;
+    void       *map;
+
+    if (cs->is_live) {
+        return;
+    }
+
+    fp = pcap_file(cs->pcap);
+    if (!fp || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size < (off_t)sizeof(struct pcap_file_header))
+    {
+        return;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+               fileno(fp), 0);
+    if (map == MAP_FAILED) {
+        g_debug("Couldn't map %s, reading through libpcap: %s",
+                cs->last_filename, strerror(errno));
+        return;
+    }
+
+    cs->map = (uint8_t *)map;
+    cs->map_len = (size_t)st.st_size;
+
+    magic = *(uint32_t *)cs->map;
+    switch (magic) {
+      case PCAPNG_BLOCKTYPE:
+        /* the section header is read with the other blocks */
+        cs->ng = TRUE;
+        cs->map_off = 0;
+        break;
+      case YF_PCAP_MAGIC:
+      case YF_PCAP_MAGIC_NSEC:
+        cs->map_swap = FALSE;
+        break;
+      default:
+        yfSwapBytes((uint8_t *)&magic, sizeof(magic));
+        if (magic != YF_PCAP_MAGIC && magic != YF_PCAP_MAGIC_NSEC) {
+            /* a pcap variant with a different record header */
+            yfCapMapClose(cs);
+            return;
+        }
+        cs->map_swap = TRUE;
+        break;
+    }
+    if (!cs->ng) {
+        cs->map_nsec = (magic == YF_PCAP_MAGIC_NSEC);
+        cs->map_off = sizeof(struct pcap_file_header);
+    }
+    cs->map_advised = 0;
+
+#ifdef HAVE_MADVISE
+    madvise(cs->map, cs->map_len, MADV_SEQUENTIAL);
+#endif
+    yfCapMapAdvise(cs);
+#endif /* ifdef HAVE_SYS_MMAN_H */
+}
+
+
+yfCapSource_t *
+yfCapOpenFile(
+    const char  *path,
+    int         *datalink,
+    char        *tmp_file,
+    GError     **err)
+{
+    yfCapSource_t *cs;
+
+    cs = g_new0(yfCapSource_t, 1);
+    cs->pcap = yfCapOpenFileInner(path, datalink, tmp_file, err);
+    cs->is_live = FALSE;
+    cs->lfp = NULL;
+    cs->datalink = *datalink;
+    cs->tmp = tmp_file;
+    cs->last_filename = g_strdup(path);
+
+    if (!cs->pcap) {
+        g_free(cs->last_filename);
+        g_free(cs);
+        cs = NULL;
+    } else {
+        yfCapMapOpen(cs);
+        if (!cs->map) {
+            yfCapPcapNGCheck(cs, path);
+        }
+    }
+
+    return cs;
+}
+
+
+/**
+ * yfCapListPath
+ *
+ * Read the next file name from a --caplist file into cappath, skipping
+ * comments and blank lines.  Returns FALSE at the end of the list or on
+ * a read error, with err set to YAF_ERROR_EOF or YAF_ERROR_IO.
+ *
+ */
+static gboolean
+yfCapListPath(
+    FILE    *lfp,
+    char    *cappath,
+    GError **err)
+{
+    size_t cappath_len;
+
+    while (1) {
+        /* get the next line from the name list file */
+        if (!fgets(cappath, FILENAME_MAX, lfp)) {
+            if (feof(lfp)) {
+                g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_EOF,
+                            "End of pcap file list");
+            } else {
+                g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                            "Couldn't read pcap file list: %s", strerror(
+                                errno));
+            }
+            return FALSE;
+        }
+
+        /* ensure filename is null terminated */
+        cappath[FILENAME_MAX] = (char)0;
+
+        /* skip comments and blank lines */
+        if (cappath[0] == '\n' || cappath[0] == '#') {
+            continue;
+        }
+
+        /* remove trailing newline */
+        cappath_len = strlen(cappath);
+        if (cappath[cappath_len - 1] == '\n') {
+            cappath[cappath_len - 1] = (char)0;
+        }
+
+        return TRUE;
+    }
+}
+
+
+/**
+ * yfCapFileFree
+ *
+ * Close a file that was opened ahead by the prefetch thread but never
+ * handed to the packet loop.
+ *
+ */
+static void
+yfCapFileFree(
+    yfCapSource_t  *file)
+{
+    yfCapMapClose(file);
+    if (file->pcap) {
+        pcap_close(file->pcap);
+    }
+    if (file->pcapng) {
+        fclose(file->pcapng);
+    }
+    g_free(file->last_filename);
+    g_free(file);
+}
+
+
+/**
+ * yfCapPrefetchThread
+ *
+ * Body of the --caplist prefetch thread.  Keeps up to YF_CAP_PREFETCH
+ * files open ahead of the packet loop: each is opened and checked by
+ * libpcap, probed for pcapng, mapped, has the BPF filter compiled, and
+ * has its first part read into the page cache.  Cancellation is only
+ * enabled while waiting on the list file, which may be a pipe.
+ *
+ */
+static void *
+yfCapPrefetchThread(
+    void  *arg)
+{
+    yfCapSource_t   *cs = (yfCapSource_t *)arg;
+    yfCapPrefetch_t *pf = cs->prefetch;
+    yfCapSource_t   *file;
+    char             cappath[FILENAME_MAX + 1];
+    GError          *err = NULL;
+    gboolean         more;
+    int              datalink;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (1) {
+        pthread_mutex_lock(&pf->mutex);
+        while (!pf->stop && g_queue_get_length(pf->ready) >= YF_CAP_PREFETCH)
+        {
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+        }
+        if (pf->stop) {
+            pthread_mutex_unlock(&pf->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&pf->mutex);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        more = yfCapListPath(cs->lfp, cappath, &err);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (!more) {
+            pthread_mutex_lock(&pf->mutex);
+            pf->err = err;
+            pf->done = TRUE;
+            pthread_cond_broadcast(&pf->cond);
+            pthread_mutex_unlock(&pf->mutex);
+            break;
+        }
+
+        file = g_new0(yfCapSource_t, 1);
+        file->pcap = yfCapOpenFileInner(cappath, &datalink, cs->tmp, &err);
+        if (!file->pcap) {
+            g_warning("skipping pcap file %s due to error: %s.",
+                      cappath, err->message);
+            g_clear_error(&err);
+            g_free(file);
+            continue;
+        }
+        file->datalink = datalink;
+        file->last_filename = g_strdup(cappath);
+
+        yfCapMapOpen(file);
+        if (!file->map) {
+            yfCapPcapNGCheck(file, cappath);
+        }
+
+        if (pf->bpf_expr) {
+            pthread_mutex_lock(&yaf_bpf_mutex);
+            if (pcap_compile(file->pcap, &(file->map_bpf), pf->bpf_expr,
+                             1, 0) < 0)
+            {
+                g_warning("couldn't compile BPF expression %s for %s: %s",
+                          pf->bpf_expr, cappath, pcap_geterr(file->pcap));
+            } else {
+                file->map_filter = TRUE;
+            }
+            pthread_mutex_unlock(&yaf_bpf_mutex);
+        }
+
+#ifdef POSIX_FADV_WILLNEED
+        if (!file->map && pcap_file(file->pcap)) {
+            posix_fadvise(fileno(pcap_file(file->pcap)), 0,
+                          YF_MAP_READAHEAD, POSIX_FADV_WILLNEED);
+        }
+#endif
+
+        pthread_mutex_lock(&pf->mutex);
+        g_queue_push_tail(pf->ready, file);
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * yfCapPrefetchStart
+ *
+ * Start opening the rest of a --caplist in the background.  Called once
+ * the first file is open and its filter is set; the filter expression
+ * must outlive the capture source.
+ *
+ */
+static void
+yfCapPrefetchStart(
+    yfCapSource_t  *cs,
+    const char     *bpf_expr)
+{
+    yfCapPrefetch_t *pf;
+    int              rv;
+
+    pf = g_new0(yfCapPrefetch_t, 1);
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    pf->ready = g_queue_new();
+    pf->bpf_expr = bpf_expr;
+    cs->prefetch = pf;
+
+    rv = pthread_create(&pf->thread, NULL, yfCapPrefetchThread, cs);
+    if (rv != 0) {
+        g_warning("Couldn't start caplist prefetch thread: %s",
+                  strerror(rv));
+        cs->prefetch = NULL;
+        g_queue_free(pf->ready);
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->mutex);
+        g_free(pf);
+    }
+}
+
+
+/**
+ * yfCapPrefetchStop
+ *
+ * Stop the prefetch thread and close any files it opened ahead.
+ *
+ */
+static void
+yfCapPrefetchStop(
+    yfCapSource_t  *cs)
+{
+    yfCapPrefetch_t *pf = cs->prefetch;
+    yfCapSource_t   *file;
+
+    pthread_mutex_lock(&pf->mutex);
+    pf->stop = TRUE;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+
+    /* only interrupts a thread blocked reading the list file */
+    pthread_cancel(pf->thread);
+    pthread_join(pf->thread, NULL);
+
+    while ((file = g_queue_pop_head(pf->ready))) {
+        yfCapFileFree(file);
+    }
+    g_queue_free(pf->ready);
+    g_clear_error(&pf->err);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+    g_free(pf);
+    cs->prefetch = NULL;
+}
+
+
+/**
+ * yfCapPrefetchNext
+ *
+ * Take the next file opened by the prefetch thread, waiting for it if
+ * necessary, and make it the current file of the capture source.  The
+ * BPF filter is already compiled, so it is installed here.
+ *
+ */
+static gboolean
+yfCapPrefetchNext(
+    yfCapSource_t  *cs,
+    GError        **err)
+{
+    yfCapPrefetch_t *pf = cs->prefetch;
+    yfCapSource_t   *file;
+
+    while (1) {
+        pthread_mutex_lock(&pf->mutex);
+        while (g_queue_is_empty(pf->ready) && !pf->done) {
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+        }
+        file = g_queue_pop_head(pf->ready);
+        if (file) {
+            pthread_cond_broadcast(&pf->cond);
+        } else {
+            g_propagate_error(err, pf->err);
+            pf->err = NULL;
+            if (err && !*err) {
+                g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_EOF,
+                            "End of pcap file list");
+            }
+        }
+        pthread_mutex_unlock(&pf->mutex);
+
+        if (!file) {
+            return FALSE;
+        }
+
+        /* make sure the datalink matches all the others */
+        if (cs->datalink != file->datalink) {
+            g_warning("skipping pcap file %s due to mismatched "
+                      "datalink type %u (expecting %u).",
+                      file->last_filename, file->datalink, cs->datalink);
+            yfCapFileFree(file);
+            continue;
+        }
+
+        break;
+    }
 
-    cs = g_new0(yfCapSource_t, 1);
-    cs->pcap = yfCapOpenFileInner(path, datalink, tmp_file, err);
-    cs->is_live = FALSE;
-    cs->lfp = NULL;
-    cs->datalink = *datalink;
-    cs->tmp = tmp_file;
-    cs->last_filename = g_strdup(path);
+    if (cs->pcapng) {
+        fclose(cs->pcapng);
+    }
+    g_free(cs->last_filename);
 
-    if (!cs->pcap) {
-        g_free(cs->last_filename);
-        g_free(cs);
-        cs = NULL;
-    } else {
-        yfCapPcapNGCheck(cs, path);
+    /* everything but the state of the list itself comes from the file */
+    file->lfp = cs->lfp;
+    file->tmp = cs->tmp;
+    file->is_live = cs->is_live;
+    file->prefetch = cs->prefetch;
+    *cs = *file;
+    g_free(file);
+
+    /* a mapped file is filtered in yfCapMapDispatch() */
+    if (cs->map_filter && !cs->map) {
+        if (pcap_setfilter(cs->pcap, &(cs->map_bpf))) {
+            g_warning("couldn't set BPF expression %s for %s: %s",
+                      pf->bpf_expr, cs->last_filename,
+                      pcap_geterr(cs->pcap));
+        }
+        pcap_freecode(&(cs->map_bpf));
+        cs->map_filter = FALSE;
     }
 
-    return cs;
+    return TRUE;
 }
 
 
@@ -456,44 +1297,25 @@ yfCapFileListNext(
     GError        **err)
 {
     static char cappath[FILENAME_MAX + 1];
-    size_t cappath_len;
     int this_datalink;
 
     /* close the present pcap if necessary */
+    yfCapMapClose(cs);
     if (cs->pcap) {
         pcap_close(cs->pcap);
         cs->pcap = NULL;
     }
 
+    if (cs->prefetch) {
+        return yfCapPrefetchNext(cs, err);
+    }
+
     /* keep going until we get an actual opened pcap file */
     while (1) {
-        /* get the next line from the name list file */
-        if (!fgets(cappath, FILENAME_MAX, cs->lfp)) {
-            if (feof(cs->lfp)) {
-                g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_EOF,
-                            "End of pcap file list");
-            } else {
-                g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
-                            "Couldn't read pcap file list: %s", strerror(
-                                errno));
-            }
+        if (!yfCapListPath(cs->lfp, cappath, err)) {
             return FALSE;
         }
 
-        /* ensure filename is null terminated */
-        cappath[FILENAME_MAX] = (char)0;
-
-        /* skip comments and blank lines */
-        if (cappath[0] == '\n' || cappath[0] == '#') {
-            continue;
-        }
-
-        /* remove trailing newline */
-        cappath_len = strlen(cappath);
-        if (cappath[cappath_len - 1] == '\n') {
-            cappath[cappath_len - 1] = (char)0;
-        }
-
         /* we have what we think is a filename. try opening it. */
         cs->pcap = yfCapOpenFileInner(cappath, &this_datalink, cs->tmp, err);
         if (!cs->pcap) {
@@ -503,8 +1325,6 @@ yfCapFileListNext(
             continue;
         }
 
-        yfCapPcapNGCheck(cs, cappath);
-
         if (cs->last_filename) {
             g_free(cs->last_filename);
         }
@@ -523,6 +1343,10 @@ yfCapFileListNext(
         }
 
         /* We have a file. All is well. */
+        yfCapMapOpen(cs);
+        if (!cs->map) {
+            yfCapPcapNGCheck(cs, cappath);
+        }
         return TRUE;
     }
 }
@@ -586,19 +1410,32 @@ yfCapOpenFileList(
 
 static gboolean
 yfSetPcapFilter(
-    pcap_t      *pcap,
-    const char  *bpf_expr,
-    GError     **err)
+    yfCapSource_t  *cs,
+    const char     *bpf_expr,
+    GError        **err)
 {
+    pcap_t            *pcap = cs->pcap;
     struct bpf_program bpf;
 
     /* attach filter */
+    pthread_mutex_lock(&yaf_bpf_mutex);
     if (pcap_compile(pcap, &bpf, bpf_expr, 1, 0) < 0) {
+        pthread_mutex_unlock(&yaf_bpf_mutex);
         g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
                     "couldn't compile BPF expression %s: %s",
                     bpf_expr, pcap_geterr(pcap));
         return FALSE;
     }
+    pthread_mutex_unlock(&yaf_bpf_mutex);
+    if (cs->map) {
+        /* mapped files are filtered in yfCapMapDispatch() */
+        if (cs->map_filter) {
+            pcap_freecode(&(cs->map_bpf));
+        }
+        cs->map_bpf = bpf;
+        cs->map_filter = TRUE;
+        return TRUE;
+    }
     if (pcap_setfilter(pcap, &bpf) ) {
         g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
                     "couldn't compile BPF expression %s: %s",
@@ -663,6 +1500,10 @@ void
 yfCapClose(
     yfCapSource_t  *cs)
 {
+    if (cs->prefetch) {
+        yfCapPrefetchStop(cs);
+    }
+    yfCapMapClose(cs);
     if (cs->pcap) {
         pcap_close(cs->pcap);
     }
@@ -757,34 +1598,24 @@ yfCapPcapRotate(
 
 
 /**
- * yfCapHandle
- *
- * This is the function that gets the call back from the PCAP library
- * when a packet arrives; it does not get called directly from within
- * yaf.
+ * yfCapPrepPBuf
  *
- * @param ctx opaque pointer to PCAP, holds the YAF context for the capture
- * @param hdr PCAP capture details (time, packet length, capture length)
- * @param pkt pointer to the captured packet
+ * Fill in everything about a packet's buffer that does not come from
+ * decoding it: the pcap header, interface and file offset.  Writes the
+ * packet to the rolling pcap output as well.
  *
  */
 static void
-yfCapHandle(
+yfCapPrepPBuf(
     yfContext_t               *ctx,
+    yfPBuf_t                  *pbuf,
     const struct pcap_pkthdr  *hdr,
     const uint8_t             *pkt)
 {
-    yfPBuf_t *pbuf;
     yfCapSource_t *cs = (yfCapSource_t *)ctx->pktsrc;
 #ifdef YAF_ENABLE_BIVIO
     int iface = 0;
 #endif
-    yfIPFragInfo_t fraginfo_buf,
-                   *fraginfo = ctx->fragtab ?
-        &fraginfo_buf : NULL;
-    /* get next spot in ring buffer */
-    pbuf = (yfPBuf_t *)rgaNextHead(ctx->pbufring);
-    g_assert(pbuf);
 
     /* pcap-per-flow info to pass to decode */
     pbuf->pcap_hdr.ts = hdr->ts;
@@ -792,6 +1623,13 @@ yfCapHandle(
     pbuf->pcap_hdr.caplen = hdr->caplen;
     pbuf->pcapt = yaf_pcap;
 
+    /* interface from a pcapng file; 0 for everything else */
+    pbuf->ifnum = cs->ifnum;
+#if defined(YAF_ENABLE_DAG_SEPARATE_INTERFACES) || \
+    defined(YAF_ENABLE_SEPARATE_INTERFACES)
+    pbuf->key.netIf = (uint8_t)cs->ifnum;
+#endif
+
 #ifdef YAF_ENABLE_BIVIO
     iface = pcap_zcopy_get_origin(cs->pcap, pkt);
     if (iface < 0) {
@@ -813,26 +1651,459 @@ yfCapHandle(
     } else {
         ctx->pcap_offset += (16 + pbuf->pcap_hdr.caplen);
     }
+}
+
+
+/**
+ * yfCapHandle
+ *
+ * This is the function that gets the call back from the PCAP library
+ * when a packet arrives; it does not get called directly from within
+ * yaf.
+ *
+ * @param ctx opaque pointer to PCAP, holds the YAF context for the capture
+ * @param hdr PCAP capture details (time, packet length, capture length)
+ * @param pkt pointer to the captured packet
+ *
+ */
+static void
+yfCapHandle(
+    yfContext_t               *ctx,
+    const struct pcap_pkthdr  *hdr,
+    const uint8_t             *pkt)
+{
+    yfPBuf_t *pbuf;
+    yfIPFragInfo_t fraginfo_buf,
+                   *fraginfo = ctx->fragtab ?
+        &fraginfo_buf : NULL;
+
+    /* get next spot in ring buffer */
+    pbuf = yfPBufReserve(ctx);
+    g_assert(pbuf);
 
-    /* Decode packet into packet buffer */
-    if (!yfDecodeToPBuf(ctx->dectx,
-                        yfDecodeTimeval(&(hdr->ts)),
-                        hdr->caplen, pkt,
-                        fraginfo, ctx->pbuflen, pbuf))
+    yfCapPrepPBuf(ctx, pbuf, hdr, pkt);
+
+    /* Decode packet into packet buffer; failures are counted in dectx
+     * and leave the packet buffer marked invalid */
+    if (yfDecodeToPBuf(ctx->dectx,
+                       yfDecodeTimeval(&(hdr->ts)),
+                       hdr->caplen, pkt,
+                       fraginfo, ctx->pbuflen, pbuf))
     {
-        /* Couldn't decode packet; counted in dectx. Skip. */
-        return;
+        /* Handle fragmentation if necessary */
+        if (fraginfo && fraginfo->frag) {
+            yfDefragPBuf(ctx->fragtab, fraginfo,
+                         ctx->pbuflen, pbuf, pkt, hdr->caplen);
+        }
+    }
+
+    /* keep only as much of the buffer as was filled */
+    yfPBufCommit(ctx, pbuf);
+}
+
+
+/**
+ * yfCapMapU32
+ *
+ * Read a 32-bit pcapng field in the byte order of the current section.
+ *
+ */
+static uint32_t
+yfCapMapU32(
+    yfCapSource_t  *cs,
+    size_t          off)
+{
+    uint32_t v;
+
+    memcpy(&v, cs->map + off, sizeof(v));
+    if (cs->ng_swap) {
+        yfSwapBytes((uint8_t *)&v, sizeof(v));
     }
 
-    /* Handle fragmentation if necessary */
-    if (fraginfo && fraginfo->frag) {
-        if (!yfDefragPBuf(ctx->fragtab, fraginfo,
-                          ctx->pbuflen, pbuf, pkt, hdr->caplen))
+    return v;
+}
+
+
+/**
+ * yfCapMapU16
+ *
+ * Read a 16-bit pcapng field in the byte order of the current section.
+ *
+ */
+static uint16_t
+yfCapMapU16(
+    yfCapSource_t  *cs,
+    size_t          off)
+{
+    uint16_t v;
+
+    memcpy(&v, cs->map + off, sizeof(v));
+    if (cs->ng_swap) {
+        yfSwapBytes((uint8_t *)&v, sizeof(v));
+    }
+
+    return v;
+}
+
+
+/**
+ * yfCapMapNextPcap
+ *
+ * Read the classic pcap record at the current position of a mapped
+ * file.  Returns 1 with hdr and pkt set, or -1 on a truncated record.
+ *
+ */
+static int
+yfCapMapNextPcap(
+    yfCapSource_t       *cs,
+    struct pcap_pkthdr  *hdr,
+    const uint8_t      **pkt)
+{
+    uint32_t rec[4];
+    size_t   off = cs->map_off;
+    int      i;
+
+    if (cs->map_len - off < YF_PCAP_RECHDR_LEN) {
+        snprintf(cs->map_errbuf, sizeof(cs->map_errbuf),
+                 "truncated dump file; tried to read %u header bytes, "
+                 "only got %u", YF_PCAP_RECHDR_LEN,
+                 (unsigned int)(cs->map_len - off));
+        return -1;
+    }
+
+    memcpy(rec, cs->map + off, YF_PCAP_RECHDR_LEN);
+    if (cs->map_swap) {
+        for (i = 0; i < 4; i++) {
+            yfSwapBytes((uint8_t *)&rec[i], sizeof(uint32_t));
+        }
+    }
+
+    if (cs->map_len - off - YF_PCAP_RECHDR_LEN < rec[2]) {
+        snprintf(cs->map_errbuf, sizeof(cs->map_errbuf),
+                 "truncated dump file; tried to read %u captured bytes, "
+                 "only got %u", rec[2],
+                 (unsigned int)(cs->map_len - off - YF_PCAP_RECHDR_LEN));
+        return -1;
+    }
+
+    hdr->ts.tv_sec = rec[0];
+    hdr->ts.tv_usec = cs->map_nsec ? (rec[1] / 1000) : rec[1];
+    hdr->caplen = rec[2];
+    hdr->len = rec[3];
+    *pkt = cs->map + off + YF_PCAP_RECHDR_LEN;
+
+    cs->map_off = off + YF_PCAP_RECHDR_LEN + hdr->caplen;
+
+    return 1;
+}
+
+
+/**
+ * yfCapMapNgInterface
+ *
+ * Add the interface described by the Interface Description Block at off
+ * (of length blen) to the current section.
+ *
+ */
+static void
+yfCapMapNgInterface(
+    yfCapSource_t  *cs,
+    size_t          off,
+    uint32_t        blen)
+{
+    yfCapNgIf_t *nif;
+    size_t       opt = off + 16;
+    size_t       end = off + blen - 4;
+    uint16_t     code, len;
+    uint8_t      resol;
+    int64_t      tsoffset;
+    unsigned int i;
+
+    cs->ng_ifs = g_renew(yfCapNgIf_t, cs->ng_ifs, cs->ng_if_count + 1);
+    nif = &(cs->ng_ifs[cs->ng_if_count++]);
+    nif->linktype = yfCapMapU16(cs, off + 8);
+    nif->snaplen = yfCapMapU32(cs, off + 12);
+    nif->units = 1000000;
+    nif->tsoffset = 0;
+
+    while (opt + 4 <= end) {
+        code = yfCapMapU16(cs, opt);
+        len = yfCapMapU16(cs, opt + 2);
+        if (code == 0 || opt + 4 + len > end) {
+            break;
+        }
+        if (code == PCAPNG_OPT_TSRESOL && len >= 1) {
+            resol = cs->map[opt + 4];
+            nif->units = 1;
+            if (resol & 0x80) {
+                nif->units <<= MIN(resol & 0x7F, 63);
+            } else {
+                for (i = 0; i < MIN(resol, 19); i++) {
+                    nif->units *= 10;
+                }
+            }
+        } else if (code == PCAPNG_OPT_TSOFFSET && len >= 8) {
+            memcpy(&tsoffset, cs->map + opt + 4, sizeof(tsoffset));
+            if (cs->ng_swap) {
+                yfSwapBytes((uint8_t *)&tsoffset, sizeof(tsoffset));
+            }
+            nif->tsoffset = tsoffset;
+        }
+        /* options are padded to 32 bits */
+        opt += 4 + ((len + 3) & ~3);
+    }
+}
+
+
+/**
+ * yfCapMapNextNg
+ *
+ * Read the pcapng block at the current position of a mapped file.
+ * Section headers and interface descriptions are absorbed; packet
+ * blocks return 1 with hdr and pkt set and cs->ifnum set to the
+ * interface.  Any other block returns 0.  Returns -1 on a malformed or
+ * truncated block.
+ *
+ */
+static int
+yfCapMapNextNg(
+    yfCapSource_t       *cs,
+    struct pcap_pkthdr  *hdr,
+    const uint8_t      **pkt)
+{
+    size_t       off = cs->map_off;
+    size_t       avail = cs->map_len - off;
+    yfCapNgIf_t *nif;
+    uint32_t     type, blen, bom;
+    uint32_t     ifid;
+    uint32_t     caplen, len;
+    uint64_t     ts;
+    size_t       data;
+
+    if (avail < 12) {
+        snprintf(cs->map_errbuf, sizeof(cs->map_errbuf),
+                 "truncated pcapng file; %u bytes after last block",
+                 (unsigned int)avail);
+        return -1;
+    }
+
+    memcpy(&type, cs->map + off, sizeof(type));
+    if (type == PCAPNG_BLOCKTYPE) {
+        /* a new section; its byte order applies from here on */
+        memcpy(&bom, cs->map + off + 8, sizeof(bom));
+        if (bom == PCAPNG_BYTEORDER) {
+            cs->ng_swap = FALSE;
+        } else {
+            yfSwapBytes((uint8_t *)&bom, sizeof(bom));
+            if (bom != PCAPNG_BYTEORDER) {
+                snprintf(cs->map_errbuf, sizeof(cs->map_errbuf),
+                         "bad pcapng byte-order magic at offset %lu",
+                         (unsigned long)off);
+                return -1;
+            }
+            cs->ng_swap = TRUE;
+        }
+        cs->ng_if_count = 0;
+    }
+    type = yfCapMapU32(cs, off);
+    blen = yfCapMapU32(cs, off + 4);
+
+    if (blen < 12 || (blen & 3) || blen > avail) {
+        snprintf(cs->map_errbuf, sizeof(cs->map_errbuf),
+                 "truncated or corrupt pcapng block of length %u "
+                 "at offset %lu", blen, (unsigned long)off);
+        return -1;
+    }
+    cs->map_off = off + blen;
+
+    switch (type) {
+      case PCAPNG_IDB:
+        if (blen >= 20) {
+            yfCapMapNgInterface(cs, off, blen);
+        }
+        return 0;
+      case PCAPNG_EPB:
+      case PCAPNG_PB:
+        if (blen < 32) {
+            return 0;
+        }
+        if (type == PCAPNG_EPB) {
+            ifid = yfCapMapU32(cs, off + 8);
+        } else {
+            /* obsolete packet block: 16-bit interface, 16-bit drops */
+            ifid = yfCapMapU16(cs, off + 8);
+        }
+        ts = ((uint64_t)yfCapMapU32(cs, off + 12) << 32) |
+            yfCapMapU32(cs, off + 16);
+        caplen = yfCapMapU32(cs, off + 20);
+        len = yfCapMapU32(cs, off + 24);
+        data = off + 28;
+        if (caplen > blen - 32) {
+            snprintf(cs->map_errbuf, sizeof(cs->map_errbuf),
+                     "pcapng packet of %u bytes overruns its block "
+                     "at offset %lu", caplen, (unsigned long)off);
+            return -1;
+        }
+        if (ifid >= cs->ng_if_count) {
+            snprintf(cs->map_errbuf, sizeof(cs->map_errbuf),
+                     "pcapng packet for undescribed interface %u "
+                     "at offset %lu", ifid, (unsigned long)off);
+            return -1;
+        }
+        nif = &(cs->ng_ifs[ifid]);
+        hdr->ts.tv_sec = (time_t)((int64_t)(ts / nif->units) + nif->tsoffset);
+        if (nif->units >= 1000000) {
+            hdr->ts.tv_usec = (ts % nif->units) / (nif->units / 1000000);
+        } else {
+            hdr->ts.tv_usec = (ts % nif->units) * 1000000 / nif->units;
+        }
+        break;
+      case PCAPNG_SPB:
+        if (blen < 16 || cs->ng_if_count == 0) {
+            return 0;
+        }
+        ifid = 0;
+        nif = &(cs->ng_ifs[0]);
+        len = yfCapMapU32(cs, off + 8);
+        data = off + 12;
+        caplen = MIN(len, blen - 16);
+        if (nif->snaplen) {
+            caplen = MIN(caplen, nif->snaplen);
+        }
+        /* simple packet blocks carry no timestamp */
+        hdr->ts.tv_sec = 0;
+        hdr->ts.tv_usec = 0;
+        break;
+      default:
+        /* name resolution, statistics, custom blocks */
+        return 0;
+    }
+
+    /* all interfaces must share the datalink of the first */
+    if (nif->linktype != cs->ng_ifs[0].linktype) {
+        snprintf(cs->map_errbuf, sizeof(cs->map_errbuf),
+                 "pcapng interface %u has link type %u, expected %u",
+                 ifid, nif->linktype, cs->ng_ifs[0].linktype);
+        return -1;
+    }
+
+    hdr->caplen = caplen;
+    hdr->len = len;
+    *pkt = cs->map + data;
+    cs->ifnum = (uint16_t)ifid;
+
+    return 1;
+}
+
+
+/**
+ * yfCapMapDispatch
+ *
+ * Read up to cnt packets that pass the filter from a mapped pcap or
+ * pcapng file and decode them in batches of YF_DECODE_BATCH straight
+ * out of the mapping.  Like pcap_dispatch(), returns the number of
+ * packets handled, 0 at end of file, or -1 on a truncated record.  A
+ * record that fails after some packets were handled is reported on the
+ * next call, so those packets are processed before the caller can move
+ * on to the next file and unmap this one.
+ *
+ */
+static int
+yfCapMapDispatch(
+    yfContext_t    *ctx,
+    yfCapSource_t  *cs,
+    int             cnt)
+{
+    struct pcap_pkthdr hdr;
+    const uint8_t     *pkt;
+    const uint8_t     *pkts[YF_DECODE_BATCH];
+    size_t             caplens[YF_DECODE_BATCH];
+    uint64_t           ptimes[YF_DECODE_BATCH];
+    yfPBuf_t          *pbufs[YF_DECODE_BATCH];
+    size_t             batch = 0;
+    size_t             off;
+    int                n = 0;
+    int                rv = 0;
+
+    if (cs->map_failed) {
+        return -1;
+    }
+
+    while (n < cnt && cs->map_off < cs->map_len) {
+        off = cs->map_off;
+        if (cs->ng) {
+            rv = yfCapMapNextNg(cs, &hdr, &pkt);
+        } else {
+            rv = yfCapMapNextPcap(cs, &hdr, &pkt);
+        }
+        if (rv < 0) {
+            break;
+        }
+
+        yfCapMapAdvise(cs);
+
+        if (rv == 0) {
+            continue;
+        }
+
+        if (cs->map_filter &&
+            !pcap_offline_filter(&(cs->map_bpf), &hdr, pkt))
         {
-            /* No complete defragmented packet available. Skip. */
-            return;
+            continue;
+        }
+
+        /* the record offset is exact here, even when packets before it
+         * were filtered out; with rolling pcap export the offset is into
+         * the output file and is kept by yfCapPrepPBuf() */
+        if (!ctx->pcap) {
+            ctx->pcap_offset = off;
+        }
+
+        /* the packet buffer references the packet in the mapping, which
+         * must stay in place until the packet ring has been processed,
+         * and with flow table shards until yfPBufSync() */
+        pbufs[batch] = yfPBufNextRef(ctx);
+        g_assert(pbufs[batch]);
+        yfCapPrepPBuf(ctx, pbufs[batch], &hdr, pkt);
+        pkts[batch] = pkt;
+        caplens[batch] = hdr.caplen;
+        ptimes[batch] = yfDecodeTimeval(&(hdr.ts));
+        if (++batch == YF_DECODE_BATCH) {
+            yfPBufDecodeBatch(ctx, batch, pkts, caplens, ptimes, pbufs);
+            batch = 0;
         }
+        n++;
+    }
+
+    /* packets already reserved in the ring are decoded even on error */
+    if (batch) {
+        yfPBufDecodeBatch(ctx, batch, pkts, caplens, ptimes, pbufs);
+    }
+
+    if (rv < 0) {
+        cs->map_failed = TRUE;
+        return n ? n : -1;
+    }
+
+    return n;
+}
+
+
+/**
+ * yfCapGetErr
+ *
+ * Return the last read error for the capture source.
+ *
+ */
+static const char *
+yfCapGetErr(
+    yfCapSource_t  *cs)
+{
+    if (cs->map) {
+        return cs->map_errbuf;
     }
+
+    return pcap_geterr(cs->pcap);
 }
 
 
@@ -880,7 +2151,7 @@ yfCapMain(
                             &(ctx->err)))
         {
             ok = FALSE;
-            yaf_quit = TRUE;
+            g_atomic_int_set(&yaf_quit, TRUE);
         }
     }
 
@@ -896,24 +2167,35 @@ yfCapMain(
     }
 
     if (bp_filter) {
-        if (!yfSetPcapFilter(cs->pcap, bp_filter, &(ctx->err))) {
+        if (!yfSetPcapFilter(cs, bp_filter, &(ctx->err))) {
             return FALSE;
         }
     }
 
+    /* open the rest of the file list in the background */
+    if (cs->lfp) {
+        yfCapPrefetchStart(cs, bp_filter);
+    }
+
     /* process input until we're done */
-    while (!yaf_quit) {
+    while (!g_atomic_int_get(&yaf_quit)) {
         yaf_pcap = cs->pcap;
 
         /* Process some packets */
-        pcrv = pcap_dispatch(cs->pcap, YAF_CAP_COUNT,
-                             (pcap_handler)yfCapHandle, (void *)ctx);
+        if (cs->map) {
+            pcrv = yfCapMapDispatch(ctx, cs, YAF_CAP_COUNT);
+        } else {
+            pcrv = pcap_dispatch(cs->pcap, YAF_CAP_COUNT,
+                                 (pcap_handler)yfCapHandle, (void *)ctx);
+        }
 
         /* Handle the aftermath */
         if (pcrv == 0) {
             /* No packet available */
             if (cs->lfp) {
-                /* Advance to next capfile */
+                /* Advance to next capfile, once the flow table shards are
+                 * done with packets that refer to the mapping of this one */
+                yfPBufSync(ctx);
                 if (!yfCapFileListNext(cs, &(ctx->err))) {
                     if (!g_error_matches(ctx->err, YAF_ERROR_DOMAIN,
                                          YAF_ERROR_EOF))
@@ -925,8 +2207,8 @@ yfCapMain(
                     break;
                 }
                 /* new packet source, set the filter */
-                if (bp_filter) {
-                    yfSetPcapFilter(cs->pcap, bp_filter, &(ctx->err));
+                if (bp_filter && !cs->prefetch) {
+                    yfSetPcapFilter(cs, bp_filter, &(ctx->err));
                 }
                 yfDecodeResetOffset(ctx->dectx);
                 yfUpdateRollingPcapFile(ctx->flowtab, cs->last_filename);
@@ -957,15 +2239,16 @@ yfCapMain(
         } else if (pcrv < 0) {
             if (ctx->cfg->noerror && cs->lfp) {
                 g_warning("Couldn't read next pcap record from %s: %s",
-                          ctx->cfg->inspec, pcap_geterr(cs->pcap));
+                          ctx->cfg->inspec, yfCapGetErr(cs));
+                yfPBufSync(ctx);
                 if (!yfCapFileListNext(cs, &(ctx->err))) {
                     /* An error occurred reading packets. */
                     ok = FALSE;
                     break;
                 }
                 /* now that we have a new packet source, set the filter */
-                if (bp_filter) {
-                    yfSetPcapFilter(cs->pcap, bp_filter, &(ctx->err));
+                if (bp_filter && !cs->prefetch) {
+                    yfSetPcapFilter(cs, bp_filter, &(ctx->err));
                 }
                 yfDecodeResetOffset(ctx->dectx);
                 yfUpdateRollingPcapFile(ctx->flowtab, cs->last_filename);
@@ -979,13 +2262,13 @@ yfCapMain(
             } else {
                 if (ctx->cfg->noerror) {
                     g_warning("Couldn't read next pcap record from %s: %s",
-                              ctx->cfg->inspec, pcap_geterr(cs->pcap));
+                              ctx->cfg->inspec, yfCapGetErr(cs));
                     ok = TRUE;
                 } else {
                     /* An error occurred reading packets. */
                     g_set_error(&(ctx->err), YAF_ERROR_DOMAIN, YAF_ERROR_IO,
                                 "Couldn't read next pcap record from %s: %s",
-                                ctx->cfg->inspec, pcap_geterr(cs->pcap));
+                                ctx->cfg->inspec, yfCapGetErr(cs));
                     ok = FALSE;
                 }
                 break;
@@ -430,6 +430,9 @@ static yfTemplates_t yaf_tmpl;
 static uint8_t       yaf_ip6map_pfx[12] =
 { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
 
+/* cold state exported for flows that never needed any */
+static const yfFlowCold_t yf_flow_cold_none;
+
 /* Full YAF flow record. */
 typedef struct yfIpfixFlow_st {
     uint64_t                    flowStartMilliseconds;
@@ -984,10 +987,6 @@ void
 yfFlowPrepare(
     yfFlow_t  *flow)
 {
-#ifdef YAF_ENABLE_HOOKS
-    unsigned int loop;
-#endif
-
 #ifdef YAF_ENABLE_PAYLOAD
     flow->val.paylen = 0;
     flow->val.payload = NULL;
@@ -995,18 +994,13 @@ yfFlowPrepare(
     flow->rval.payload = NULL;
 #endif /* ifdef YAF_ENABLE_PAYLOAD */
 
-#ifdef YAF_ENABLE_HOOKS
-    for (loop = 0; loop < YAF_MAX_HOOKS; loop++) {
-        flow->hfctx[loop] = 0x0;
-    }
-#endif
-
 #ifdef YAF_ENABLE_DPI
     flow->dpictx = NULL;
 #endif
 
-    memset(flow->sourceMacAddr, 0, ETHERNET_MAC_ADDR_LENGTH);
-    memset(flow->destinationMacAddr, 0, ETHERNET_MAC_ADDR_LENGTH);
+    /* reading fills in MAC addresses and nDPI labels, so the flow always
+     * has its cold state */
+    flow->cold = g_slice_new0(yfFlowCold_t);
 }
 
 
@@ -1032,6 +1026,11 @@ yfFlowCleanup(
         flow->rval.payload = NULL;
     }
 #endif /* ifdef YAF_ENABLE_PAYLOAD */
+
+    if (flow->cold) {
+        g_slice_free(yfFlowCold_t, flow->cold);
+        flow->cold = NULL;
+    }
 }
 
 
@@ -1552,7 +1551,7 @@ yfWriterForSpec(
 gboolean
 yfWriteOptionsDataFlows(
     void      *yfContext,
-    uint32_t   pcap_drop,
+    uint64_t   pcap_drop,
     GTimer    *timer,
     GError   **err)
 {
@@ -1578,30 +1577,72 @@ yfWriteOptionsDataFlows(
 gboolean
 yfWriteStatsFlow(
     void      *yfContext,
-    uint32_t   pcap_drop,
+    uint64_t   pcap_drop,
     GTimer    *timer,
     GError   **err)
 {
     yfIpfixStats_t  rec;
     yfContext_t    *ctx = (yfContext_t *)yfContext;
+    yfContext_t   **workers = &ctx;
+    uint32_t        worker_count = 1;
     fBuf_t         *fbuf = ctx->fbuf;
     uint32_t        mask = 0x000000FF;
     char            buf[200];
+    uint64_t        packets, flows, rej_pkts;
+    uint64_t        shrunk, nodpi, evicted;
+    uint64_t        mem_shrunk = 0, mem_nodpi = 0, mem_evicted = 0;
+    uint32_t        peak, flush, expired, assembled;
     uint32_t        total_frags = 0;
+    uint32_t        i;
     static struct hostent *host;
     static uint32_t host_ip = 0;
 
-    yfGetFlowTabStats(ctx->flowtab, &(rec.packetTotalCount),
-                      &(rec.exportedFlowTotalCount),
-                      &(rec.notSentPacketTotalCount),
-                      &(rec.yafFlowTablePeakCount),
-                      &(rec.flowTableFlushEvents));
-    if (ctx->fragtab) {
-        yfGetFragTabStats(ctx->fragtab, &(rec.yafExpiredFragmentCount),
-                          &(rec.yafAssembledFragmentCount), &total_frags);
-    } else {
-        rec.yafExpiredFragmentCount = 0;
-        rec.yafAssembledFragmentCount = 0;
+    /* with multiple capture workers, report the sum of their tables */
+    if (ctx->worker_count) {
+        workers = ctx->workers;
+        worker_count = ctx->worker_count;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    for (i = 0; i < worker_count; i++) {
+        if (workers[i]->flowtab) {
+            yfGetFlowTabStats(workers[i]->flowtab, &packets, &flows,
+                              &rej_pkts, &peak, &flush);
+            rec.packetTotalCount += packets;
+            rec.exportedFlowTotalCount += flows;
+            rec.notSentPacketTotalCount += rej_pkts;
+            rec.yafFlowTablePeakCount += peak;
+            rec.flowTableFlushEvents += flush;
+            yfGetFlowTabMemStats(workers[i]->flowtab, &shrunk, &nodpi,
+                                 &evicted);
+            mem_shrunk += shrunk;
+            mem_nodpi += nodpi;
+            mem_evicted += evicted;
+        }
+
+        yfGetFragTabStats(workers[i]->fragtab, &expired, &assembled,
+                          &total_frags);
+        rec.yafExpiredFragmentCount += expired;
+        rec.yafAssembledFragmentCount += assembled;
+
+        /* Rejected/Ignored Packet Total Count from decode.c */
+        rec.ignoredPacketTotalCount += yfGetDecodeStats(workers[i]->dectx);
+    }
+
+    /* with flow table shards, report the sum of their tables */
+    for (i = 0; i < ctx->shard_count; i++) {
+        yfGetFlowTabStats(ctx->shards[i]->flowtab, &packets, &flows,
+                          &rej_pkts, &peak, &flush);
+        rec.packetTotalCount += packets;
+        rec.exportedFlowTotalCount += flows;
+        rec.notSentPacketTotalCount += rej_pkts;
+        rec.yafFlowTablePeakCount += peak;
+        rec.flowTableFlushEvents += flush;
+        yfGetFlowTabMemStats(ctx->shards[i]->flowtab, &shrunk, &nodpi,
+                             &evicted);
+        mem_shrunk += shrunk;
+        mem_nodpi += nodpi;
+        mem_evicted += evicted;
     }
 
     if (!fbuf) {
@@ -1622,9 +1663,6 @@ yfWriteStatsFlow(
         }
     }
 
-    /* Rejected/Ignored Packet Total Count from decode.c */
-    rec.ignoredPacketTotalCount = yfGetDecodeStats(ctx->dectx);
-
     /* Dropped packets - from yafcap.c & libpcap */
     rec.droppedPacketTotalCount = pcap_drop;
     rec.exporterIPv4Address = host_ip;
@@ -1647,6 +1685,11 @@ yfWriteStatsFlow(
             rec.droppedPacketTotalCount, rec.ignoredPacketTotalCount,
             rec.notSentPacketTotalCount, rec.yafExpiredFragmentCount,
             rec.yafAssembledFragmentCount);
+    if (mem_shrunk || mem_nodpi || mem_evicted) {
+        g_debug("YAF memory budget: Reduced Payload: %" PRIu64
+                " No DPI: %" PRIu64 " Evicted: %" PRIu64,
+                mem_shrunk, mem_nodpi, mem_evicted);
+    }
 
     /* Set Internal Template for Buffer to Options TID */
     if (!fBufSetInternalTemplate(fbuf, YAF_PROCESS_STATS_TID, err)) {
@@ -1763,14 +1806,15 @@ yfWriteFlow(
     yfFlow_t  *flow,
     GError   **err)
 {
-    yfIpfixFlow_t  rec;
-    uint32_t       wtid;
-    uint16_t       etid = 0;      /* extra templates */
-    gboolean       ok;
-    int32_t        temp = 0;
-    int            loop, count;
-    yfContext_t   *ctx = (yfContext_t *)yfContext;
-    fBuf_t        *fbuf = ctx->fbuf;
+    yfIpfixFlow_t       rec;
+    uint32_t            wtid;
+    uint16_t            etid = 0;      /* extra templates */
+    gboolean            ok;
+    int32_t             temp = 0;
+    int                 loop, count;
+    yfContext_t        *ctx = (yfContext_t *)yfContext;
+    fBuf_t             *fbuf = ctx->fbuf;
+    const yfFlowCold_t *cold = flow->cold ? flow->cold : &yf_flow_cold_none;
 
     if (ctx->cfg->no_output) {
         return TRUE;
@@ -1858,8 +1902,8 @@ yfWriteFlow(
 #endif /* ifdef YAF_ENABLE_APPLABEL */
 
 #ifdef YAF_ENABLE_NDPI
-    rec.ndpi_master = flow->ndpi_master;
-    rec.ndpi_sub = flow->ndpi_sub;
+    rec.ndpi_master = cold->ndpi_master;
+    rec.ndpi_sub = cold->ndpi_sub;
     wtid |= YTF_NDPI;
 #endif
 
@@ -1867,12 +1911,12 @@ yfWriteFlow(
     if (ctx->cfg->mpls_mode) {
         /* since the mpls label isn't defined as an integer in fixbuf, it's
          * not endian-converted on transcode, so we fix that here */
-        /*    temp = htonl(flow->mpls->mpls_label[0]) >> 8;*/
-        memcpy(rec.mpls_label1, &(flow->mpls->mpls_label[0]), 3);
-        /*temp = htonl(flow->mpls->mpls_label[1]) >> 8;*/
-        memcpy(rec.mpls_label2, &(flow->mpls->mpls_label[1]), 3);
-        /*temp = htonl(flow->mpls->mpls_label[2]) >> 8;*/
-        memcpy(rec.mpls_label3, &(flow->mpls->mpls_label[2]), 3);
+        /*    temp = htonl(cold->mpls->mpls_label[0]) >> 8;*/
+        memcpy(rec.mpls_label1, &(cold->mpls->mpls_label[0]), 3);
+        /*temp = htonl(cold->mpls->mpls_label[1]) >> 8;*/
+        memcpy(rec.mpls_label2, &(cold->mpls->mpls_label[1]), 3);
+        /*temp = htonl(cold->mpls->mpls_label[2]) >> 8;*/
+        memcpy(rec.mpls_label3, &(cold->mpls->mpls_label[2]), 3);
 
         wtid |= YTF_MPLS;
     }
@@ -1895,12 +1939,12 @@ yfWriteFlow(
         wtid |= YTF_TCP;
     }
 
-    if (flow->mptcp.token) {
-        rec.mptcpInitialDataSequenceNumber = flow->mptcp.idsn;
-        rec.mptcpReceiverToken = flow->mptcp.token;
-        rec.mptcpMaximumSegmentSize = flow->mptcp.mss;
-        rec.mptcpAddressId = flow->mptcp.addrid;
-        rec.mptcpFlags = flow->mptcp.flags;
+    if (cold->mptcp.token) {
+        rec.mptcpInitialDataSequenceNumber = cold->mptcp.idsn;
+        rec.mptcpReceiverToken = cold->mptcp.token;
+        rec.mptcpMaximumSegmentSize = cold->mptcp.mss;
+        rec.mptcpAddressId = cold->mptcp.addrid;
+        rec.mptcpFlags = cold->mptcp.flags;
         wtid |= YTF_MPTCP;
     }
 
@@ -1929,9 +1973,9 @@ yfWriteFlow(
 #endif
 
     if (ctx->cfg->macmode) {
-        memcpy(rec.sourceMacAddress, flow->sourceMacAddr,
+        memcpy(rec.sourceMacAddress, cold->sourceMacAddr,
                ETHERNET_MAC_ADDR_LENGTH);
-        memcpy(rec.destinationMacAddress, flow->destinationMacAddr,
+        memcpy(rec.destinationMacAddress, cold->destinationMacAddr,
                ETHERNET_MAC_ADDR_LENGTH);
         wtid |= YTF_MAC;
     }
@@ -2478,10 +2522,12 @@ yfReadFlow(
     flow->rval.entropy = rec.reverseEntropy;
 #endif /* ifdef YAF_ENABLE_ENTROPY */
 
-    memcpy(flow->sourceMacAddr, rec.sourceMacAddress,
-           ETHERNET_MAC_ADDR_LENGTH);
-    memcpy(flow->destinationMacAddr, rec.destinationMacAddress,
-           ETHERNET_MAC_ADDR_LENGTH);
+    if (flow->cold) {
+        memcpy(flow->cold->sourceMacAddr, rec.sourceMacAddress,
+               ETHERNET_MAC_ADDR_LENGTH);
+        memcpy(flow->cold->destinationMacAddr, rec.destinationMacAddress,
+               ETHERNET_MAC_ADDR_LENGTH);
+    }
 
 #ifdef YAF_ENABLE_PAYLOAD
     yfPayloadCopyIn(&rec.payload, &flow->val);
@@ -2684,8 +2730,10 @@ yfReadFlowExtended(
     flow->appLabel = rec.f.silkAppLabel;
 #endif
 #ifdef YAF_ENABLE_NDPI
-    flow->ndpi_master = rec.f.ndpi_master;
-    flow->ndpi_sub = rec.f.ndpi_sub;
+    if (flow->cold) {
+        flow->cold->ndpi_master = rec.f.ndpi_master;
+        flow->cold->ndpi_sub = rec.f.ndpi_sub;
+    }
 #endif
 
 #ifdef YAF_ENABLE_ENTROPY
@@ -2705,10 +2753,12 @@ yfReadFlowExtended(
     flow->rval.entropy = rec.f.reverseEntropy;
 #endif /* ifdef YAF_ENABLE_ENTROPY */
 
-    memcpy(flow->sourceMacAddr, rec.f.sourceMacAddress,
-           ETHERNET_MAC_ADDR_LENGTH);
-    memcpy(flow->destinationMacAddr, rec.f.destinationMacAddress,
-           ETHERNET_MAC_ADDR_LENGTH);
+    if (flow->cold) {
+        memcpy(flow->cold->sourceMacAddr, rec.f.sourceMacAddress,
+               ETHERNET_MAC_ADDR_LENGTH);
+        memcpy(flow->cold->destinationMacAddr, rec.f.destinationMacAddress,
+               ETHERNET_MAC_ADDR_LENGTH);
+    }
 
 #ifdef YAF_ENABLE_PAYLOAD
     yfPayloadCopyIn(&rec.f.payload, &flow->val);
@@ -2878,12 +2928,14 @@ yfPrintString(
     }
 #endif
 #ifdef YAF_ENABLE_NDPI
-    if (0 != flow->ndpi_master) {
-        if (flow->ndpi_sub) {
-            g_string_append_printf(rstr, " ndpi: %u[%u]", flow->ndpi_master,
-                                   flow->ndpi_sub);
+    if (flow->cold && 0 != flow->cold->ndpi_master) {
+        if (flow->cold->ndpi_sub) {
+            g_string_append_printf(rstr, " ndpi: %u[%u]",
+                                   flow->cold->ndpi_master,
+                                   flow->cold->ndpi_sub);
         } else {
-            g_string_append_printf(rstr, " ndpi: %u", flow->ndpi_master);
+            g_string_append_printf(rstr, " ndpi: %u",
+                                   flow->cold->ndpi_master);
         }
     }
 #endif /* ifdef YAF_ENABLE_NDPI */
@@ -2971,24 +3023,27 @@ yfPrintDelimitedString(
 
     if (yaft_mac) {
         for (loop = 0; loop < 6; loop++) {
-            g_string_append_printf(rstr, "%02x", flow->sourceMacAddr[loop]);
+            g_string_append_printf(rstr, "%02x", flow->cold ?
+                                   flow->cold->sourceMacAddr[loop] : 0);
             if (loop < 5) {
                 g_string_append_printf(rstr, ":");
             }
-            /* clear out mac addr for next flow */
-            flow->sourceMacAddr[loop] = 0;
         }
         g_string_append_printf(rstr, "%s", YF_PRINT_DELIM);
         for (loop = 0; loop < 6; loop++) {
-            g_string_append_printf(rstr, "%02x",
-                                   flow->destinationMacAddr[loop]);
+            g_string_append_printf(rstr, "%02x", flow->cold ?
+                                   flow->cold->destinationMacAddr[loop] : 0);
             if (loop < 5) {
                 g_string_append_printf(rstr, ":");
             }
-            /* clear out mac addr for next flow */
-            flow->destinationMacAddr[loop] = 0;
         }
         g_string_append_printf(rstr, "%s", YF_PRINT_DELIM);
+        /* clear out mac addrs for next flow */
+        if (flow->cold) {
+            memset(flow->cold->sourceMacAddr, 0, ETHERNET_MAC_ADDR_LENGTH);
+            memset(flow->cold->destinationMacAddr, 0,
+                   ETHERNET_MAC_ADDR_LENGTH);
+        }
     }
 
     /* print tcp flags */
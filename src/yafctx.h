@@ -59,7 +59,9 @@
 #include <yaf/yafrag.h>
 #include <yaf/decode.h>
 #include <yaf/ring.h>
+#include <yaf/lfq.h>
 #include <airframe/airlock.h>
+#include <pthread.h>
 
 typedef struct yfConfig_st {
     char              *inspec;
@@ -136,11 +138,34 @@ typedef struct yfContext_st {
     uint64_t        pcap_offset;
     /** Pcap Lock Buffer */
     AirLock         pcap_lock;
+    /** Context owning the output, when this context is a capture worker */
+    struct yfContext_st  *parent;
+    /** Capture worker contexts, when capture is spread across threads */
+    struct yfContext_st **workers;
+    /** Number of capture worker contexts; 0 when single-threaded */
+    uint32_t        worker_count;
+    /** Serializes output among capture workers; owned by the parent */
+    pthread_mutex_t *outlock;
+    /** Flow table shard contexts, when flows are spread across threads;
+     *  these replace the flow table of this context */
+    struct yfContext_st **shards;
+    /** Number of flow table shards; 0 when not sharded */
+    uint32_t        shard_count;
+    /** Shard threads and their queues, private to yafshard.c */
+    struct yfShardSet_st *shardset;
+    /** Closed flows for the export thread; NULL to write them inline */
+    lfqQueue_t     *exportq;
+    /** Export thread state, private to yafexport.c */
+    struct yfExport_st *exporter;
+    /** Checkpoint the flow tables write their active flows to when closed
+     *  for a restart; NULL if not enabled */
+    yfCheckpoint_t *ckpt;
 } yfContext_t;
 
 #define YF_CTX_INIT                                           \
     {NULL, NULL, 0, NULL, NULL, NULL, NULL, 0, AIR_LOCK_INIT, \
-     NULL, 0, 0, NULL, NULL, 0, AIR_LOCK_INIT}
+     NULL, 0, 0, NULL, NULL, 0, AIR_LOCK_INIT, NULL, NULL, 0, NULL, \
+     NULL, 0, NULL, NULL, NULL, NULL}
 
 /* global quit flag, defined in yaf.c */
 extern int yaf_quit;
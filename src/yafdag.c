@@ -272,7 +272,7 @@ yfDagMain(
     }
 
     /* process input until we're done */
-    while (!yaf_quit) {
+    while (!g_atomic_int_get(&yaf_quit)) {
         /* advance the stream if necessary */
         if ((cp >= ep) &&
             !(ep = dag_advance_stream(ds->fd, ds->stream, &cp)))
@@ -2021,7 +2021,8 @@ ydScanPayload(
 /**
  * ydAllocFlowContext
  *
- * Allocates the context structure for the DPI in a flow.
+ * Allocates the context structure for the DPI in a flow from the flow
+ * table's slab arena.
  *
  *
  * FIXME: This context is used for either applabel or DPI, and when yaftab.c
@@ -2032,13 +2033,15 @@ ydScanPayload(
  */
 void
 ydAllocFlowContext(
-    yfFlow_t  *flow)
+    yfFlow_t    *flow,
+    slbArena_t  *slab)
 {
     if (NULL == dpiyfctx || !dpiyfctx->dpiInitialized) {
         return;
     }
 
-    ypDPIFlowCtx_t *newFlowContext = g_slice_new0(ypDPIFlowCtx_t);
+    ypDPIFlowCtx_t *newFlowContext = slbAlloc0(slab, SLB_DPI,
+                                               sizeof(ypDPIFlowCtx_t));
     flow->dpictx = (void *)newFlowContext;
     newFlowContext->yfctx = dpiyfctx;
 
@@ -2049,8 +2052,9 @@ ydAllocFlowContext(
         newFlowContext->exbuf = NULL;
         /* TODO: Move this to places where it only gets alloc'd when we have
          * dpi */
-        newFlowContext->dpi = g_slice_alloc0(YAF_MAX_CAPTURE_FIELDS *
-                                             sizeof(yfDPIData_t));
+        newFlowContext->dpi = slbAlloc0(slab, SLB_DPI,
+                                        YAF_MAX_CAPTURE_FIELDS *
+                                        sizeof(yfDPIData_t));
     }
 #endif  /* YAF_ENABLE_DPI */
 }
@@ -2060,11 +2064,13 @@ ydAllocFlowContext(
  * flowFree
  *
  * @param flow pointer to the flow structure with the context information
+ * @param slab slab arena the context was allocated from
  *
  */
 void
 ydFreeFlowContext(
-    yfFlow_t  *flow)
+    yfFlow_t    *flow,
+    slbArena_t  *slab)
 {
     ypDPIFlowCtx_t *flowContext = (ypDPIFlowCtx_t *)(flow->dpictx);
 
@@ -2073,11 +2079,11 @@ ydFreeFlowContext(
     }
 
 #ifdef YAF_ENABLE_DPI
-    g_slice_free1((sizeof(yfDPIData_t) * YAF_MAX_CAPTURE_FIELDS),
-                  flowContext->dpi);
+    slbFree(slab, SLB_DPI, (sizeof(yfDPIData_t) * YAF_MAX_CAPTURE_FIELDS),
+            flowContext->dpi);
 #endif  /* YAF_ENABLE_DPI */
 
-    g_slice_free(ypDPIFlowCtx_t, flowContext);
+    slbFree(slab, SLB_DPI, sizeof(ypDPIFlowCtx_t), flowContext);
 }
 
 
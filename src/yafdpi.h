@@ -61,6 +61,7 @@
 #include <yaf/autoinc.h>
 #include <yaf/yafcore.h>
 #include <yaf/decode.h>
+#include <yaf/slab.h>
 
 
 /**
@@ -76,11 +77,13 @@ ydScanFlow(
 
 void
 ydAllocFlowContext(
-    yfFlow_t  *flow);
+    yfFlow_t    *flow,
+    slbArena_t  *slab);
 
 void
 ydFreeFlowContext(
-    yfFlow_t  *flow);
+    yfFlow_t    *flow,
+    slbArena_t  *slab);
 
 void
 ydInitDPI(
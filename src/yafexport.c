@@ -0,0 +1,418 @@
+/*
+ *  Copyright 2006-2023 Carnegie Mellon University
+ *  See license information in LICENSE.txt.
+ */
+/*
+ *  yafexport.c
+ *  YAF flow export thread
+ *
+ *  ------------------------------------------------------------------------
+ *  Authors: CERT Network Situational Awareness Group
+ *  ------------------------------------------------------------------------
+ *  @DISTRIBUTION_STATEMENT_BEGIN@
+ *  YAF 3.0.0
+ *
+ *  Copyright 2023 Carnegie Mellon University.
+ *
+ *  NO WARRANTY. THIS CARNEGIE MELLON UNIVERSITY AND SOFTWARE ENGINEERING
+ *  INSTITUTE MATERIAL IS FURNISHED ON AN "AS-IS" BASIS. CARNEGIE MELLON
+ *  UNIVERSITY MAKES NO WARRANTIES OF ANY KIND, EITHER EXPRESSED OR IMPLIED,
+ *  AS TO ANY MATTER INCLUDING, BUT NOT LIMITED TO, WARRANTY OF FITNESS FOR
+ *  PURPOSE OR MERCHANTABILITY, EXCLUSIVITY, OR RESULTS OBTAINED FROM USE OF
+ *  THE MATERIAL. CARNEGIE MELLON UNIVERSITY DOES NOT MAKE ANY WARRANTY OF
+ *  ANY KIND WITH RESPECT TO FREEDOM FROM PATENT, TRADEMARK, OR COPYRIGHT
+ *  INFRINGEMENT.
+ *
+ *  Licensed under a GNU GPL 2.0-style license, please see LICENSE.txt or
+ *  contact permission@sei.cmu.edu for full terms.
+ *
+ *  [DISTRIBUTION STATEMENT A] This material has been approved for public
+ *  release and unlimited distribution.  Please see Copyright notice for
+ *  non-US Government use and distribution.
+ *
+ *  GOVERNMENT PURPOSE RIGHTS – Software and Software Documentation
+ *  Contract No.: FA8702-15-D-0002
+ *  Contractor Name: Carnegie Mellon University
+ *  Contractor Address: 4500 Fifth Avenue, Pittsburgh, PA 15213
+ *
+ *  The Government's rights to use, modify, reproduce, release, perform,
+ *  display, or disclose this software are restricted by paragraph (b)(2) of
+ *  the Rights in Noncommercial Computer Software and Noncommercial Computer
+ *  Software Documentation clause contained in the above identified
+ *  contract. No restrictions apply after the expiration date shown
+ *  above. Any reproduction of the software or portions thereof marked with
+ *  this legend must also reproduce the markings.
+ *
+ *  This Software includes and/or makes use of Third-Party Software each
+ *  subject to its own license.
+ *
+ *  DM23-2317
+ *  @DISTRIBUTION_STATEMENT_END@
+ *  ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include "yafexport.h"
+#include "yafout.h"
+#include <yaf/yafcore.h>
+#include <yaf/yaftab.h>
+#include <pthread.h>
+
+/* closed flows the export queue holds */
+#define YF_EXPORT_QUEUE 16384
+/* closed flows written per hold of the output lock */
+#define YF_EXPORT_BATCH 256
+/* microseconds to sleep when the export queue is empty */
+#define YF_EXPORT_IDLE 1000
+/* idle sleeps a flow waits for the quiet sources before it goes anyway */
+#define YF_EXPORT_MERGE_WAIT 100
+
+/* a flow table feeding the export thread a queue of its own; the thread
+ * merges the sources by flow end time */
+typedef struct yfExportSource_st {
+    lfqQueue_t       *q;
+    /* the source has queued every flow it closes that ends by this time;
+     * UINT64_MAX once it is the only source or has stopped */
+    uint64_t          mark;
+    /* flow taken off the queue, waiting its turn, and its end time */
+    void             *head;
+    uint64_t          etime;
+} yfExportSource_t;
+
+typedef struct yfExport_st {
+    /* context owning the output */
+    yfContext_t      *ctx;
+    pthread_t         thread;
+    /* serializes output between the export thread and the capture side */
+    pthread_mutex_t   outlock;
+    gboolean          running;
+    /* set to stop the thread once the queue is empty */
+    int               stop;
+    /* write the flows still queued when stopping */
+    gboolean          drain;
+    gboolean          ok;
+    GError           *err;
+    yfExportSource_t *srcs;
+    uint32_t          src_count;
+    /* Statistics */
+    uint64_t          stat_flows;
+    uint64_t          stat_batches;
+    uint64_t          stat_idle;
+    uint64_t          stat_forced;
+    size_t            stat_peak;
+} yfExport_t;
+
+
+/**
+ * yfExportOpen
+ *
+ * Open the output if it is not, as when a rotation closed it and no
+ * packet has arrived since.  Called with the output lock held.
+ *
+ */
+static gboolean
+yfExportOpen(
+    yfExport_t  *ex)
+{
+    yfContext_t *ctx = ex->ctx;
+
+    if (ctx->fbuf || ctx->cfg->no_output) {
+        return TRUE;
+    }
+
+    ctx->fbuf = yfOutputOpen(ctx->cfg,
+                             ctx->cfg->lockmode ? &ctx->lockbuf : NULL,
+                             &(ex->err));
+    return (ctx->fbuf != NULL);
+}
+
+
+/**
+ * yfExportMerge
+ *
+ * Fill batch with up to YF_EXPORT_BATCH closed flows, earliest end time
+ * first across the sources.  A flow only goes once every source with
+ * nothing queued has marked that it will close no flow ending before
+ * it, unless force is set.  Returns the number of flows, and sets held
+ * if a flow had to wait, or would have but for force.
+ *
+ */
+static size_t
+yfExportMerge(
+    yfExport_t  *ex,
+    void        *batch[],
+    gboolean     force,
+    gboolean    *held)
+{
+    yfExportSource_t *src, *best;
+    uint64_t          bound, mark;
+    size_t            count = 0;
+    uint32_t          i;
+
+    *held = FALSE;
+
+    while (count < YF_EXPORT_BATCH) {
+        best = NULL;
+        bound = UINT64_MAX;
+        for (i = 0; i < ex->src_count; i++) {
+            src = &(ex->srcs[i]);
+            if (!src->head) {
+                /* read the mark first: it covers what was queued before */
+                mark = __atomic_load_n(&(src->mark), __ATOMIC_ACQUIRE);
+                if (!(src->head = lfqPop(src->q))) {
+                    bound = MIN(bound, mark);
+                    continue;
+                }
+                src->etime = yfFlowTabExportTime(src->head);
+            }
+            if (!best || src->etime < best->etime) {
+                best = src;
+            }
+        }
+
+        if (!best) {
+            break;
+        }
+        if (best->etime > bound) {
+            *held = TRUE;
+            if (!force) {
+                break;
+            }
+        }
+
+        batch[count++] = best->head;
+        best->head = NULL;
+    }
+
+    return count;
+}
+
+
+/**
+ * yfExportMain
+ *
+ * Thread body of the export thread: take closed flows off the export
+ * queues a batch at a time, merged by end time, and write them to the
+ * output.  A flow waits at most YF_EXPORT_MERGE_WAIT idle rounds for a
+ * quiet source.  After a failure, or when stopped without draining, it
+ * hands flows back to their flow tables without writing them, so that
+ * they are still freed.  A failure stops capture as well.
+ *
+ */
+static void *
+yfExportMain(
+    void  *arg)
+{
+    yfExport_t  *ex = (yfExport_t *)arg;
+    yfContext_t *ctx = ex->ctx;
+    void        *batch[YF_EXPORT_BATCH];
+    size_t       count, depth, i;
+    uint32_t     waits = 0;
+    gboolean     stop, write, held;
+
+    for (;;) {
+        /* read stop first: once it is set, nothing more gets queued */
+        stop = __atomic_load_n(&(ex->stop), __ATOMIC_ACQUIRE);
+
+        for (i = 0, depth = 0; i < ex->src_count; i++) {
+            depth += lfqCount(ex->srcs[i].q);
+        }
+        if (depth > ex->stat_peak) {
+            ex->stat_peak = depth;
+        }
+
+        /* once a flow has waited long enough, keep going until the
+         * quiet sources catch up */
+        count = yfExportMerge(ex, batch,
+                              stop || waits >= YF_EXPORT_MERGE_WAIT, &held);
+        if (!held) {
+            waits = 0;
+        } else if (!count) {
+            ++waits;
+        } else if (!stop && waits >= YF_EXPORT_MERGE_WAIT) {
+            ++(ex->stat_forced);
+        }
+
+        if (!count) {
+            if (stop) {
+                break;
+            }
+            ++(ex->stat_idle);
+            g_usleep(YF_EXPORT_IDLE);
+            continue;
+        }
+
+        write = ex->ok && (ex->drain || !stop);
+        if (write) {
+            pthread_mutex_lock(ctx->outlock);
+            if (!yfExportOpen(ex)) {
+                ex->ok = FALSE;
+                g_atomic_int_inc(&yaf_quit);
+            }
+        }
+
+        for (i = 0; i < count; i++) {
+            if (!yfFlowTabExportFlow(ctx, batch[i], ex->ok && write,
+                                     &(ex->err)))
+            {
+                ex->ok = FALSE;
+                g_atomic_int_inc(&yaf_quit);
+            }
+        }
+
+        if (write) {
+            pthread_mutex_unlock(ctx->outlock);
+        }
+
+        ex->stat_flows += count;
+        ++(ex->stat_batches);
+    }
+
+    return NULL;
+}
+
+
+gboolean
+yfExportStart(
+    yfContext_t  *ctx,
+    uint32_t      sources,
+    GError      **err)
+{
+    yfExport_t *ex;
+    uint32_t    i;
+    int         rv;
+
+    ex = g_new0(yfExport_t, 1);
+    ex->ctx = ctx;
+    ex->ok = TRUE;
+    pthread_mutex_init(&(ex->outlock), NULL);
+
+    /* a lone source has nothing to wait for; the others mark as they go */
+    ex->src_count = MAX(sources, 1);
+    ex->srcs = g_new0(yfExportSource_t, ex->src_count);
+    for (i = 0; i < ex->src_count; i++) {
+        ex->srcs[i].q = lfqAlloc(YF_EXPORT_QUEUE);
+    }
+    if (ex->src_count == 1) {
+        ex->srcs[0].mark = UINT64_MAX;
+    }
+
+    ctx->exportq = ex->srcs[0].q;
+    ctx->exporter = ex;
+    ctx->outlock = &(ex->outlock);
+
+    rv = pthread_create(&(ex->thread), NULL, yfExportMain, ex);
+    if (rv != 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't start export thread: %s", strerror(rv));
+        yfExportFree(ctx);
+        return FALSE;
+    }
+    ex->running = TRUE;
+
+    return TRUE;
+}
+
+
+gboolean
+yfExportStop(
+    yfContext_t  *ctx,
+    gboolean      drain,
+    GError      **err)
+{
+    yfExport_t *ex = ctx->exporter;
+
+    if (!ex || !ex->running) {
+        return TRUE;
+    }
+
+    /* the thread writes out (or hands back) the rest of the queues, then
+     * stops */
+    ex->drain = drain;
+    __atomic_store_n(&(ex->stop), 1, __ATOMIC_RELEASE);
+    pthread_join(ex->thread, NULL);
+    ex->running = FALSE;
+
+    if (!ex->ok) {
+        g_propagate_error(err, ex->err);
+        ex->err = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+lfqQueue_t *
+yfExportQueue(
+    yfContext_t  *ctx,
+    uint32_t      source)
+{
+    yfExport_t *ex = ctx->exporter;
+
+    g_assert(source < ex->src_count);
+
+    return ex->srcs[source].q;
+}
+
+
+void
+yfExportMark(
+    yfContext_t  *ctx,
+    uint32_t      source,
+    uint64_t      mark)
+{
+    yfExport_t *ex = ctx->exporter;
+
+    __atomic_store_n(&(ex->srcs[source].mark), mark, __ATOMIC_RELEASE);
+}
+
+
+void
+yfExportFree(
+    yfContext_t  *ctx)
+{
+    yfExport_t *ex = ctx->exporter;
+    uint32_t    i;
+
+    if (!ex) {
+        return;
+    }
+
+    yfExportStop(ctx, FALSE, NULL);
+
+    g_clear_error(&(ex->err));
+    pthread_mutex_destroy(&(ex->outlock));
+    for (i = 0; i < ex->src_count; i++) {
+        lfqFree(ex->srcs[i].q);
+    }
+    g_free(ex->srcs);
+    g_free(ex);
+
+    ctx->exportq = NULL;
+    ctx->exporter = NULL;
+    ctx->outlock = NULL;
+}
+
+
+void
+yfExportDumpStats(
+    yfContext_t  *ctx)
+{
+    yfExport_t *ex = ctx->exporter;
+
+    if (!ex) {
+        return;
+    }
+
+    g_debug("Export thread took %" PRIu64 " closed flows in %" PRIu64
+            " batches.",
+            ex->stat_flows, ex->stat_batches);
+    g_debug("  Maximum export queue depth %zu of %zu; idle %" PRIu64
+            " times.", ex->stat_peak,
+            lfqCapacity(ctx->exportq) * ex->src_count, ex->stat_idle);
+    if (ex->src_count > 1) {
+        g_debug("  Merged %u flow table shards; stopped waiting on a quiet "
+                "shard %" PRIu64 " times.", ex->src_count, ex->stat_forced);
+    }
+}
@@ -298,8 +298,8 @@ yfHookFlowPacket(
          ++loop, pluginIndex = pluginIndex->next)
     {
         (pluginIndex->ufptr.funcPtrs.flowPacket)(
-            (flow->hfctx)[loop], flow, val, pkt, caplen, iplen, tcpinfo,
-            l2info);
+            (flow->cold->hfctx)[loop], flow, val, pkt, caplen, iplen,
+            tcpinfo, l2info);
     }
     g_assert(loop == yaf_hooked);
 }
@@ -366,8 +366,8 @@ yfHookFlowClose(
          loop < yaf_hooked && pluginIndex != NULL;
          ++loop, pluginIndex = pluginIndex->next)
     {
-        if (pluginIndex->ufptr.funcPtrs.flowClose((flow->hfctx)[loop], flow)
-            == FALSE)
+        if (pluginIndex->ufptr.funcPtrs.flowClose(
+                (flow->cold->hfctx)[loop], flow) == FALSE)
         {
             return FALSE;
         }
@@ -385,8 +385,8 @@ yfHookFlowClose(
  *  allocate flow state information for each flow captured by yaf.
  *
  * @param flow the pointer to the flow context state structure, but more
- *        importantly in this case, it contains the array of pointers (hfctx)
- *        which hold the plugin context state
+ *        importantly in this case, its cold state contains the array of
+ *        pointers (hfctx) which hold the plugin context state
  *
  */
 void
@@ -402,7 +402,7 @@ yfHookFlowAlloc(
          ++loop, pluginIndex = pluginIndex->next)
     {
         (pluginIndex->ufptr.funcPtrs.flowAlloc)(
-            &((flow->hfctx)[loop]), flow, yfctx[loop]);
+            &((flow->cold->hfctx)[loop]), flow, yfctx[loop]);
     }
     g_assert(loop == yaf_hooked);
 }
@@ -428,7 +428,8 @@ yfHookFlowFree(
          loop < yaf_hooked && pluginIndex != NULL;
          ++loop, pluginIndex = pluginIndex->next)
     {
-        (pluginIndex->ufptr.funcPtrs.flowFree)((flow->hfctx)[loop], flow);
+        (pluginIndex->ufptr.funcPtrs.flowFree)(
+            (flow->cold->hfctx)[loop], flow);
     }
     g_assert(loop == yaf_hooked);
 }
@@ -580,7 +581,7 @@ yfHookFlowWrite(
          ++loop, pluginIndex = pluginIndex->next)
     {
         if (pluginIndex->ufptr.funcPtrs.flowWrite(
-                (flow->hfctx)[loop], rec, stml, flow, err) == FALSE)
+                (flow->cold->hfctx)[loop], rec, stml, flow, err) == FALSE)
         {
             return FALSE;
         }
@@ -742,7 +743,7 @@ yfHookGetTemplateCount(
          ++loop, pluginIndex = pluginIndex->next)
     {
         count += ((pluginIndex->ufptr.funcPtrs.getTemplateCount)(
-                      (flow->hfctx)[loop], flow));
+                      (flow->cold->hfctx)[loop], flow));
     }
     g_assert(loop == yaf_hooked);
     return count;
@@ -765,10 +766,24 @@ yfHookFreeLists(
          loop < yaf_hooked && pluginIndex != NULL;
          ++loop, pluginIndex = pluginIndex->next)
     {
-        (pluginIndex->ufptr.funcPtrs.freeLists)((flow->hfctx)[loop], flow);
+        (pluginIndex->ufptr.funcPtrs.freeLists)(
+            (flow->cold->hfctx)[loop], flow);
     }
     g_assert(loop == yaf_hooked);
 }
 
 
+/**
+ * yfHookCount
+ *
+ *  Returns the number of plugins hooked in.
+ */
+unsigned int
+yfHookCount(
+    void)
+{
+    return yaf_hooked;
+}
+
+
 #endif /* YAF_ENABLE_HOOKS */
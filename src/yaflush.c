@@ -55,8 +55,184 @@
 #include "yaflush.h"
 #include "yafout.h"
 #include "yafstat.h"
+#include "yafshard.h"
+#include "yafexport.h"
 #include <yaf/yafcore.h>
 
+void
+yfFlushOutputLock(
+    yfContext_t  *ctx)
+{
+    yfContext_t *octx = ctx->parent ? ctx->parent : ctx;
+
+    if (!octx->outlock) {
+        return;
+    }
+
+    pthread_mutex_lock(octx->outlock);
+
+    /* a worker adopts the output state of the context that owns it */
+    if (octx != ctx) {
+        ctx->fbuf = octx->fbuf;
+        ctx->last_rotate_ms = octx->last_rotate_ms;
+        ctx->lastUdpTempTime = octx->lastUdpTempTime;
+    }
+}
+
+
+void
+yfFlushOutputUnlock(
+    yfContext_t  *ctx)
+{
+    yfContext_t *octx = ctx->parent ? ctx->parent : ctx;
+
+    if (!octx->outlock) {
+        return;
+    }
+
+    /* hand any change to the output (open, rotate) back to the owner */
+    if (octx != ctx) {
+        octx->fbuf = ctx->fbuf;
+        octx->last_rotate_ms = ctx->last_rotate_ms;
+        octx->lastUdpTempTime = ctx->lastUdpTempTime;
+    }
+
+    pthread_mutex_unlock(octx->outlock);
+}
+
+
+yfPBuf_t *
+yfPBufReserve(
+    yfContext_t  *ctx)
+{
+    return (yfPBuf_t *)rgaReserveHead(ctx->pbufring, ctx->pbuflen);
+}
+
+
+void
+yfPBufCommit(
+    yfContext_t  *ctx,
+    yfPBuf_t     *pbuf)
+{
+    size_t len = ctx->pbuflen;
+
+    /* keep only the payload actually copied into the buffer */
+    if (len >= YF_PBUFLEN_BASE) {
+        len = YF_PBUFLEN_BASE;
+        if (pbuf->ptime && pbuf->paydata == pbuf->payload) {
+            len += pbuf->paylen;
+        }
+    }
+
+    rgaCommitHead(ctx->pbufring, len);
+}
+
+
+yfPBuf_t *
+yfPBufNextRef(
+    yfContext_t  *ctx)
+{
+    size_t   len = MIN(ctx->pbuflen, YF_PBUFLEN_BASE);
+    uint8_t *pbuf;
+
+    if ((pbuf = rgaReserveHead(ctx->pbufring, len))) {
+        rgaCommitHead(ctx->pbufring, len);
+    }
+
+    return (yfPBuf_t *)pbuf;
+}
+
+
+void
+yfPBufDecodeBatch(
+    yfContext_t     *ctx,
+    size_t           count,
+    const uint8_t   *pkts[],
+    const size_t     caplens[],
+    const uint64_t   ptimes[],
+    yfPBuf_t        *pbufs[])
+{
+    yfIPFragInfo_t fraginfos[YF_DECODE_BATCH];
+    yfPBuf_t      *full;
+    size_t         hdrlen = MIN(ctx->pbuflen, YF_PBUFLEN_BASE);
+    size_t         i;
+
+    g_assert(count <= YF_DECODE_BATCH);
+
+    yfDecodeBatchToPBuf(ctx->dectx, count, pkts, caplens, ptimes,
+                        ctx->fragtab ? fraginfos : NULL,
+                        ctx->pbuflen, pbufs);
+
+    if (!ctx->fragtab) {
+        return;
+    }
+
+    /* A reassembled packet needs room for its payload, which the packet
+     * buffer does not have; reassemble into a full size buffer at the
+     * head of the ring and keep that only as data for its payload. */
+    for (i = 0; i < count; i++) {
+        if (!pbufs[i]->ptime || !fraginfos[i].frag) {
+            continue;
+        }
+        full = yfPBufReserve(ctx);
+        g_assert(full);
+        memcpy(full, pbufs[i], hdrlen);
+        yfDefragPBuf(ctx->fragtab, &(fraginfos[i]), ctx->pbuflen, full,
+                     (uint8_t *)pkts[i], caplens[i]);
+        memcpy(pbufs[i], full, hdrlen);
+        if (full->ptime && hdrlen == YF_PBUFLEN_BASE &&
+            full->paydata == full->payload)
+        {
+            rgaCommitHeadData(ctx->pbufring,
+                              YF_PBUFLEN_BASE + full->paylen);
+        }
+    }
+}
+
+
+void
+yfPBufHold(
+    yfContext_t       *ctx,
+    yfPBufRelease_fn   release,
+    void              *data)
+{
+    /* the shards may still be reading packet buffers that refer to it;
+     * otherwise the ring has been processed and nothing does */
+    if (ctx->shard_count) {
+        yfShardHold(ctx, release, data);
+    } else {
+        release(data);
+    }
+}
+
+
+void
+yfPBufSync(
+    yfContext_t  *ctx)
+{
+    if (ctx->shard_count) {
+        yfShardSync(ctx);
+    }
+}
+
+
+/**
+ * yfFlushCurrentTime
+ *
+ * Current packet time of the context, for output rotation.
+ *
+ */
+static uint64_t
+yfFlushCurrentTime(
+    yfContext_t  *ctx)
+{
+    if (ctx->shard_count) {
+        return yfShardCurrentTime(ctx);
+    }
+    return yfFlowTabCurrentTime(ctx->flowtab);
+}
+
+
 gboolean
 yfProcessPBufRing(
     yfContext_t  *ctx,
@@ -64,14 +240,47 @@ yfProcessPBufRing(
 {
     AirLock  *lock = NULL;
     yfPBuf_t *pbuf = NULL;
+    yfPBuf_t *batch[YF_PBUF_BATCH];
+    size_t    count;
     gboolean  ok = TRUE;
     uint64_t  cur_time;
 
     /* point to lock buffer if we need it */
     if (ctx->cfg->lockmode) {
-        lock = &ctx->lockbuf;
+        lock = ctx->parent ? &ctx->parent->lockbuf : &ctx->lockbuf;
+    }
+
+    /* process packets from the ring buffer; this needs no output, so
+     * capture workers do it without holding the output lock */
+    if (ctx->shard_count) {
+        /* the dispatcher takes them from here, a frame at a time */
+        yfShardDispatch(ctx);
+    } else {
+        do {
+            /* Gather a batch of packets, skipping time zero packets
+             * (these are marked invalid) */
+            count = 0;
+            while (count < YF_PBUF_BATCH &&
+                   (pbuf = (yfPBuf_t *)rgaNextTail(ctx->pbufring)))
+            {
+                if (pbuf->ptime) {
+                    batch[count++] = pbuf;
+                }
+            }
+
+            /* Add the packets to the flow table */
+            yfFlowPBufBatch(ctx->flowtab, ctx->pbuflen, batch, count);
+        } while (pbuf);
+    }
+
+    /* Queue closed flows for the export thread; this needs no output
+     * either, and may wait for the export thread, which takes the lock */
+    if (ctx->exportq && ctx->flowtab && !yfFlowTabFlush(ctx, FALSE, err)) {
+        return FALSE;
     }
 
+    yfFlushOutputLock(ctx);
+
     /* Open output if we need to */
     if (!ctx->cfg->no_output) {
         if (!ctx->fbuf) {
@@ -85,26 +294,17 @@ yfProcessPBufRing(
     /* Dump statistics if requested */
     yfStatDumpLoop();
 
-    /* process packets from the ring buffer */
-    while ((pbuf = (yfPBuf_t *)rgaNextTail(ctx->pbufring))) {
-        /* Skip time zero packets (these are marked invalid) */
-        if (!pbuf->ptime) {
-            continue;
-        }
-
-        /* Add the packet to the flow table */
-        yfFlowPBuf(ctx->flowtab, ctx->pbuflen, pbuf);
-    }
-
-    /* Flush the flow table */
-    if (!yfFlowTabFlush(ctx, FALSE, err)) {
+    /* Flush the flow table; shards flush their own */
+    if (!ctx->exportq && ctx->flowtab &&
+        !yfFlowTabFlush(ctx, FALSE, err))
+    {
         ok = FALSE;
         goto end;
     }
 
     /* Close output file for rotation if necessary */
     if (ctx->cfg->rotate_ms) {
-        cur_time = yfFlowTabCurrentTime(ctx->flowtab);
+        cur_time = yfFlushCurrentTime(ctx);
         if (ctx->last_rotate_ms) {
             if (cur_time - ctx->last_rotate_ms > ctx->cfg->rotate_ms) {
                 yfOutputClose(ctx->fbuf, lock, TRUE);
@@ -121,14 +321,15 @@ yfProcessPBufRing(
     }
 
   end:
+    yfFlushOutputUnlock(ctx);
     return ok;
 }
 
 
-gboolean
-yfTimeOutFlush(
+static gboolean
+yfTimeOutFlushLocked(
     yfContext_t  *ctx,
-    uint32_t      pcap_drop,
+    uint64_t      pcap_drop,
     uint32_t     *total_stats,
     GTimer       *timer,       /* yaf process timer */
     GTimer       *stats_timer,       /* yaf stats output timer */
@@ -139,7 +340,7 @@ yfTimeOutFlush(
 
     /* point to lock buffer if we need it */
     if (ctx->cfg->lockmode) {
-        lock = &ctx->lockbuf;
+        lock = ctx->parent ? &ctx->parent->lockbuf : &ctx->lockbuf;
     }
 
     /* Open output if we need to */
@@ -154,12 +355,16 @@ yfTimeOutFlush(
     /* Dump statistics if requested */
     yfStatDumpLoop();
 
-    /* Flush the flow table */
-    if (!yfFlowTabFlush(ctx, FALSE, err)) {
+    /* Flush the flow table; shards flush their own */
+    if (!ctx->exportq && ctx->flowtab &&
+        !yfFlowTabFlush(ctx, FALSE, err))
+    {
         return FALSE;
     }
 
-    if (!ctx->cfg->nostats) {
+    /* with multiple capture workers, only the owner of the output writes
+     * the (merged) statistics record */
+    if (!ctx->cfg->nostats && !ctx->parent) {
         if (!stats_timer) {
             stats_timer = g_timer_new();
         }
@@ -180,7 +385,7 @@ yfTimeOutFlush(
 
     /* Close output file for rotation if necessary */
     if (ctx->cfg->rotate_ms) {
-        cur_time = yfFlowTabCurrentTime(ctx->flowtab);
+        cur_time = yfFlushCurrentTime(ctx);
         if (ctx->last_rotate_ms) {
             if (cur_time - ctx->last_rotate_ms > ctx->cfg->rotate_ms) {
                 yfOutputClose(ctx->fbuf, lock, TRUE);
@@ -196,11 +401,45 @@ yfTimeOutFlush(
 }
 
 
+gboolean
+yfTimeOutFlush(
+    yfContext_t  *ctx,
+    uint64_t      pcap_drop,
+    uint32_t     *total_stats,
+    GTimer       *timer,
+    GTimer       *stats_timer,
+    GError      **err)
+{
+    gboolean ok;
+
+    /* No packets arrived; keep the flow table clocks running so flows
+     * time out on a quiet link */
+    if (ctx->flowtab) {
+        yfFlowTabAdvanceClock(ctx->flowtab);
+    }
+    if (ctx->shard_count) {
+        yfShardTick(ctx);
+    }
+
+    /* Queue closed flows for the export thread, outside the lock */
+    if (ctx->exportq && ctx->flowtab && !yfFlowTabFlush(ctx, FALSE, err)) {
+        return FALSE;
+    }
+
+    yfFlushOutputLock(ctx);
+    ok = yfTimeOutFlushLocked(ctx, pcap_drop, total_stats, timer,
+                              stats_timer, err);
+    yfFlushOutputUnlock(ctx);
+
+    return ok;
+}
+
+
 gboolean
 yfFinalFlush(
     yfContext_t  *ctx,
     gboolean      ok,
-    uint32_t      pcap_drop,
+    uint64_t      pcap_drop,
     GTimer       *timer,
     GError      **err)
 {
@@ -213,11 +452,28 @@ yfFinalFlush(
         lock = &ctx->lockbuf;
     }
 
+    /* the flow table shards flush their flows as they stop */
+    if (ctx->shard_count && !yfShardStop(ctx, ok, ok ? err : NULL)) {
+        ok = FALSE;
+    }
+
+    /* queue the last flows and wait for the export thread to write them;
+     * it opens the output if a rotation left it closed */
+    if (ctx->exportq) {
+        if (ok && ctx->flowtab && !yfFlowTabFlush(ctx, TRUE, err)) {
+            ok = FALSE;
+        }
+        if (!yfExportStop(ctx, ok, ok ? err : NULL)) {
+            ok = FALSE;
+        }
+    }
+
     /* handle final flush and close */
     if (ctx->fbuf) {
         if (ok) {
             /* Flush flow buffer and close output file on successful exit */
-            frv = yfFlowTabFlush(ctx, TRUE, err);
+            frv = (ctx->flowtab && !ctx->exportq) ?
+                yfFlowTabFlush(ctx, TRUE, err) : TRUE;
             if (!ctx->cfg->nostats) {
                 srv = yfWriteOptionsDataFlows(ctx, pcap_drop, timer, err);
             }
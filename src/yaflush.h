@@ -57,6 +57,50 @@
 #include <yaf/autoinc.h>
 #include "yafctx.h"
 
+/* releases capture memory that packet buffers referred to */
+typedef void (*yfPBufRelease_fn)(
+    void  *data);
+
+void
+yfFlushOutputLock(
+    yfContext_t  *ctx);
+
+void
+yfFlushOutputUnlock(
+    yfContext_t  *ctx);
+
+yfPBuf_t *
+yfPBufReserve(
+    yfContext_t  *ctx);
+
+void
+yfPBufCommit(
+    yfContext_t  *ctx,
+    yfPBuf_t     *pbuf);
+
+yfPBuf_t *
+yfPBufNextRef(
+    yfContext_t  *ctx);
+
+void
+yfPBufDecodeBatch(
+    yfContext_t     *ctx,
+    size_t           count,
+    const uint8_t   *pkts[],
+    const size_t     caplens[],
+    const uint64_t   ptimes[],
+    yfPBuf_t        *pbufs[]);
+
+void
+yfPBufHold(
+    yfContext_t       *ctx,
+    yfPBufRelease_fn   release,
+    void              *data);
+
+void
+yfPBufSync(
+    yfContext_t  *ctx);
+
 gboolean
 yfProcessPBufRing(
     yfContext_t  *ctx,
@@ -65,7 +109,7 @@ yfProcessPBufRing(
 gboolean
 yfTimeOutFlush(
     yfContext_t  *ctx,
-    uint32_t      pcap_drop,
+    uint64_t      pcap_drop,
     uint32_t     *total_stats,
     GTimer       *timer,
     GTimer       *stats_timer,
@@ -75,7 +119,7 @@ gboolean
 yfFinalFlush(
     yfContext_t  *ctx,
     gboolean      ok,
-    uint32_t      pcap_drop,
+    uint64_t      pcap_drop,
     GTimer       *timer,
     GError      **err);
 
@@ -165,7 +165,7 @@ yfNFEMain(
     nfe_pc_start(ps->nfe_ring);
 
     /* process input until we're done */
-    while (!yaf_quit) {
+    while (!g_atomic_int_get(&yaf_quit)) {
         frame = (uint8_t *)nfe_pc_next_packet(ps->nfe_ring, &nfe_header);
         if (frame == (uint8_t *)NFE_PC_ERROR) {
             g_set_error(&(ctx->err), YAF_ERROR_DOMAIN, YAF_ERROR_IO,
@@ -175,7 +175,7 @@ yfNFEMain(
             break;
         } else if (frame == NULL) {
             /* Live, no packet processed (timeout). Flush buffer */
-            if (!yfTimeOutFlush(ctx, (uint32_t)yaf_nfe_dropped,
+            if (!yfTimeOutFlush(ctx, yaf_nfe_dropped,
                                 &yaf_stats_out, yfStatGetTimer(),
                                 stimer, &(ctx->err)))
             {
@@ -238,7 +238,7 @@ yfNFEMain(
             if (!ctx->cfg->nostats) {
                 if (g_timer_elapsed(stimer, NULL) > ctx->cfg->stats) {
                     yaf_nfe_dropped = nfe_pc_get_drop(ps->nfe_ring);
-                    if (!yfWriteOptionsDataFlows(ctx, (uint32_t)yaf_nfe_dropped,
+                    if (!yfWriteOptionsDataFlows(ctx, yaf_nfe_dropped,
                                                  yfStatGetTimer(), &(ctx->err)))
                     {
                         ok = FALSE;
@@ -265,7 +265,7 @@ yfNFEMain(
         g_timer_destroy(stimer);
     }
     /* Handle final flush */
-    return yfFinalFlush(ctx, ok, (uint32_t)yaf_nfe_dropped,
+    return yfFinalFlush(ctx, ok, yaf_nfe_dropped,
                         yfStatGetTimer(), &(ctx->err));
 }
 
@@ -301,16 +301,14 @@ yfPcapxMain(
     }
 
     /* process input until we're done */
-    while (!yaf_quit) {
+    while (!g_atomic_int_get(&yaf_quit)) {
         status = NT_NetRxGet(*(nt->netStream), &netBuf, 1000);
         if (status != NT_SUCCESS) {
             if (status == NT_STATUS_TRYAGAIN) {
                 continue;
             } else if (status == NT_STATUS_TIMEOUT) {
                 /* Live, no packet processed (timeout). Flush buffer */
-                if (!yfTimeOutFlush(ctx,
-                                    (uint32_t)(yaf_nt_dropped +
-                                               yaf_nt_dev_drop),
+                if (!yfTimeOutFlush(ctx, yaf_nt_dropped + yaf_nt_dev_drop,
                                     &yaf_stats_out, yfStatGetTimer(),
                                     stimer, &(ctx->err)))
                 {
@@ -402,8 +400,7 @@ yfPcapxMain(
         if (!ctx->cfg->nostats) {
             if (g_timer_elapsed(stimer, NULL) > ctx->cfg->stats) {
                 if (!yfWriteOptionsDataFlows(ctx,
-                                             (uint32_t)(yaf_nt_dropped +
-                                                        yaf_nt_dev_drop),
+                                             yaf_nt_dropped + yaf_nt_dev_drop,
                                              yfStatGetTimer(), &(ctx->err)))
                 {
                     ok = FALSE;
@@ -455,7 +452,7 @@ yfPcapxMain(
     }
 
     /* Handle final flush */
-    return yfFinalFlush(ctx, ok, (uint32_t)(yaf_nt_dropped + yaf_nt_dev_drop),
+    return yfFinalFlush(ctx, ok, yaf_nt_dropped + yaf_nt_dev_drop,
                         yfStatGetTimer(), &(ctx->err));
 }
 
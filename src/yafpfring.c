@@ -354,7 +354,7 @@ yfPfRingMain(
     gpf = pf->pf;
 
     /* process input until we're done */
-    while (!yaf_quit) {
+    while (!g_atomic_int_get(&yaf_quit)) {
         pfring_loop(pf->pf, (pfringProcesssPacket)yfPfRingHandle, (u_char *)ctx,
                     1);
 
@@ -424,7 +424,7 @@ yfPfRingZCMain(
     initial_drop = zc->stat.drop;
 
     /* process input until we're done */
-    while (!yaf_quit) {
+    while (!g_atomic_int_get(&yaf_quit)) {
         while (pfring_zc_recv_pkt(zc->queue, &zc->buffer, 1)) {
             /* get next spot in ring buffer */
             pbuf = (yfPBuf_t *)rgaNextHead(ctx->pbufring);
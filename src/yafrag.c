@@ -104,6 +104,11 @@ struct yfFragTabStats_st {
     uint32_t   stat_peak;
 };
 
+/* Counters read by yfGetFragTabStats may be read from another thread
+ * while the owner updates them */
+#define YF_FRAG_STAT_INC(s_) __atomic_fetch_add(&(s_), 1, __ATOMIC_RELAXED)
+#define YF_FRAG_STAT_GET(s_) __atomic_load_n(&(s_), __ATOMIC_RELAXED)
+
 struct yfFragTabStatsDescrip_st {
     const char  *name_frag;
     const char  *descrip_frag;
@@ -192,9 +197,9 @@ yfGetFragTabStats(
     uint32_t     *frags)
 {
     if (fragtab) {
-        *dropped = fragtab->stats.stat_dropped;
-        *assembled = fragtab->stats.stat_packets;
-        *frags = fragtab->stats.stat_frags;
+        *dropped = YF_FRAG_STAT_GET(fragtab->stats.stat_dropped);
+        *assembled = YF_FRAG_STAT_GET(fragtab->stats.stat_packets);
+        *frags = YF_FRAG_STAT_GET(fragtab->stats.stat_frags);
     } else {
         *dropped = 0;
         *assembled = 0;
@@ -386,10 +391,10 @@ yfFragRemoveNode(
     --(fragtab->count);
 
     if (drop) {
-        ++(fragtab->stats.stat_dropped);
+        YF_FRAG_STAT_INC(fragtab->stats.stat_dropped);
         yfFragNodeFree(fragtab, fn);
     } else {
-        ++(fragtab->stats.stat_packets);
+        YF_FRAG_STAT_INC(fragtab->stats.stat_packets);
         g_assert(fragtab->assembled == NULL);
         fragtab->assembled = fn;
     }
@@ -553,8 +558,8 @@ yfDefragPBuf(
     yfTCPInfo_t  *tcpinfo = &(pbuf->tcpinfo);
     yfL2Info_t   *l2info = (pbuflen >= YF_PBUFLEN_NOPAYLOAD) ?
         &(pbuf->l2info) : NULL;
-    uint8_t      *payload = (pbuflen >= YF_PBUFLEN_BASE) ?
-        pbuf->payload : NULL;
+    const uint8_t *payload = (pbuflen >= YF_PBUFLEN_BASE) ?
+        pbuf->paydata : NULL;
     size_t        paylen = (pbuflen >= YF_PBUFLEN_BASE) ?
         pbuf->paylen : 0;
     size_t        calc_l4;
@@ -607,7 +612,7 @@ yfDefragPBuf(
     /* add the fragment to the fragment node */
     yfFragAdd(fragtab, fn, fraginfo, pbuf->iplen, payload, paylen,
               pkt, hdrlen);
-    ++(fragtab->stats.stat_frags);
+    YF_FRAG_STAT_INC(fragtab->stats.stat_frags);
 
     calc_l4 = fn->payoff;
     /* move completed fragments to the assembled buffer */
@@ -645,6 +650,7 @@ yfDefragPBuf(
         /* Now stuff it in the packet buffer. */
         pbuf->paylen = paylen;
         memcpy(pbuf->payload, payload, paylen);
+        pbuf->paydata = pbuf->payload;
     }
 
     /* Copy other values from fragment node to packet buffer */
@@ -0,0 +1,809 @@
+/*
+ *  Copyright 2006-2023 Carnegie Mellon University
+ *  See license information in LICENSE.txt.
+ */
+/*
+ *  yafshard.c
+ *  YAF flow table sharding across worker threads
+ *
+ *  ------------------------------------------------------------------------
+ *  Authors: CERT Network Situational Awareness Group
+ *  ------------------------------------------------------------------------
+ *  @DISTRIBUTION_STATEMENT_BEGIN@
+ *  YAF 3.0.0
+ *
+ *  Copyright 2023 Carnegie Mellon University.
+ *
+ *  NO WARRANTY. THIS CARNEGIE MELLON UNIVERSITY AND SOFTWARE ENGINEERING
+ *  INSTITUTE MATERIAL IS FURNISHED ON AN "AS-IS" BASIS. CARNEGIE MELLON
+ *  UNIVERSITY MAKES NO WARRANTIES OF ANY KIND, EITHER EXPRESSED OR IMPLIED,
+ *  AS TO ANY MATTER INCLUDING, BUT NOT LIMITED TO, WARRANTY OF FITNESS FOR
+ *  PURPOSE OR MERCHANTABILITY, EXCLUSIVITY, OR RESULTS OBTAINED FROM USE OF
+ *  THE MATERIAL. CARNEGIE MELLON UNIVERSITY DOES NOT MAKE ANY WARRANTY OF
+ *  ANY KIND WITH RESPECT TO FREEDOM FROM PATENT, TRADEMARK, OR COPYRIGHT
+ *  INFRINGEMENT.
+ *
+ *  Licensed under a GNU GPL 2.0-style license, please see LICENSE.txt or
+ *  contact permission@sei.cmu.edu for full terms.
+ *
+ *  [DISTRIBUTION STATEMENT A] This material has been approved for public
+ *  release and unlimited distribution.  Please see Copyright notice for
+ *  non-US Government use and distribution.
+ *
+ *  GOVERNMENT PURPOSE RIGHTS – Software and Software Documentation
+ *  Contract No.: FA8702-15-D-0002
+ *  Contractor Name: Carnegie Mellon University
+ *  Contractor Address: 4500 Fifth Avenue, Pittsburgh, PA 15213
+ *
+ *  The Government's rights to use, modify, reproduce, release, perform,
+ *  display, or disclose this software are restricted by paragraph (b)(2) of
+ *  the Rights in Noncommercial Computer Software and Noncommercial Computer
+ *  Software Documentation clause contained in the above identified
+ *  contract. No restrictions apply after the expiration date shown
+ *  above. Any reproduction of the software or portions thereof marked with
+ *  this legend must also reproduce the markings.
+ *
+ *  This Software includes and/or makes use of Third-Party Software each
+ *  subject to its own license.
+ *
+ *  DM23-2317
+ *  @DISTRIBUTION_STATEMENT_END@
+ *  ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include "yafshard.h"
+#include "yafexport.h"
+#include <yaf/yafcore.h>
+#include <yaf/yaftab.h>
+#include <pthread.h>
+
+/* packet buffer records the ring of a frame holds */
+#define YF_SHARD_FRAME_RECS 256
+/* capture hands a frame to the dispatcher once it holds this many; a
+ * capture round adds at most half the ring */
+#define YF_SHARD_FRAME_FILL (YF_SHARD_FRAME_RECS / 2)
+/* frames capture has; it waits when all are with the dispatcher */
+#define YF_SHARD_FRAMES 16
+/* capture memory a frame holds before capture hands it off; capture has
+ * no more than about YF_SHARD_FRAMES times this out at once */
+#define YF_SHARD_FRAME_HOLDS 2
+/* packet buffers handed to a shard at a time */
+#define YF_SHARD_BATCH 64
+/* batches per shard; the dispatcher waits when a shard has them all */
+#define YF_SHARD_BATCHES 32
+/* a busy shard tries to flush its flow table after this many batches */
+#define YF_SHARD_FLUSH_BATCHES 8
+/* a shard that gets no packets is told the time once this many
+ * milliseconds of packet time have passed */
+#define YF_SHARD_STAMP_MS 1000
+
+typedef struct yfShardHold_st {
+    yfPBufRelease_fn   release;
+    void              *data;
+} yfShardHold_t;
+
+/* A frame is a packet ring capture fills and the dispatcher reads in
+ * place; the shards get pointers to its packet buffers, which may in
+ * turn refer to capture memory.  Capture takes a frame back once every
+ * shard is done with it, and only in the order it handed them over, so
+ * that the capture memory held by a frame is also done with by the
+ * frames before it. */
+typedef struct yfShardFrame_st {
+    rgaRing_t      *pbufs;
+    /* batches with packet buffers of the frame, plus one while the
+     * dispatcher reads it; done at 0 */
+    int             pending;
+    /* capture was quiet; run the clocks of the shards on */
+    gboolean        tick;
+    /* done with by the shards, but not yet taken back */
+    gboolean        done;
+    /* capture memory to release when the frame is taken back */
+    GArray         *holds;
+} yfShardFrame_t;
+
+typedef struct yfShardBatch_st {
+    /* number of packet buffers; an empty batch only tells the time */
+    uint32_t         count;
+    /* capture was quiet when the empty batch was sent */
+    gboolean         tick;
+    /* frame holding the packet buffers */
+    yfShardFrame_t  *frame;
+    /* time of the last packet dispatched when the batch was sent */
+    uint64_t         stamp;
+    yfPBuf_t        *pbufs[YF_SHARD_BATCH];
+} yfShardBatch_t;
+
+typedef struct yfShard_st {
+    struct yfShardSet_st  *set;
+    /* context of the shard, owning its flow table */
+    yfContext_t           *ctx;
+    /* export queue of the shard */
+    uint32_t               index;
+    pthread_t              thread;
+    /* batches waiting for the shard, and batches it is done with */
+    GAsyncQueue           *full;
+    GAsyncQueue           *empty;
+    /* batch the dispatcher is filling */
+    yfShardBatch_t        *cur;
+    /* stamp of the last batch the dispatcher sent, and of the last batch
+     * the shard has been through */
+    uint64_t               sent;
+    uint64_t               seen;
+    yfShardBatch_t         batches[YF_SHARD_BATCHES];
+    gboolean               started;
+    gboolean               ok;
+} yfShard_t;
+
+typedef struct yfShardSet_st {
+    yfShard_t        *shards;
+    uint32_t          count;
+    gboolean          no_vlan;
+    /* flush the flow tables when stopping */
+    gboolean          flush;
+    gboolean          running;
+    /* time of the last packet dispatched */
+    uint64_t          ptime;
+    /* packet ring of the context, given back when the shards are freed */
+    rgaRing_t        *pbufring;
+    yfShardFrame_t    frames[YF_SHARD_FRAMES];
+    /* frame capture is filling */
+    yfShardFrame_t   *cur;
+    /* frames with the dispatcher, oldest first, and frames to fill */
+    GQueue            inflight;
+    GQueue            idle;
+    /* frames the shards are done with */
+    GAsyncQueue      *done;
+    /* frames from capture to the dispatcher */
+    rgaRing_t        *handoff;
+    pthread_t         dispatcher;
+    gboolean          dispatching;
+} yfShardSet_t;
+
+/* queued in place of a batch to stop a shard */
+static yfShardBatch_t yf_shard_stop;
+
+
+/**
+ * yfShardFrameDone
+ *
+ * Drop one of the references to a frame, sending it back to capture
+ * with the last.
+ *
+ */
+static void
+yfShardFrameDone(
+    yfShardSet_t    *set,
+    yfShardFrame_t  *frame)
+{
+    if (g_atomic_int_dec_and_test(&(frame->pending))) {
+        g_async_queue_push(set->done, frame);
+    }
+}
+
+
+/**
+ * yfShardRelease
+ *
+ * Release the capture memory held by a frame.
+ *
+ */
+static void
+yfShardRelease(
+    yfShardFrame_t  *frame)
+{
+    yfShardHold_t *hold;
+    guint          i;
+
+    for (i = 0; i < frame->holds->len; i++) {
+        hold = &g_array_index(frame->holds, yfShardHold_t, i);
+        hold->release(hold->data);
+    }
+    g_array_set_size(frame->holds, 0);
+}
+
+
+/**
+ * yfShardRetire
+ *
+ * Take back the frames the shards are done with, waiting for one if
+ * wait is TRUE, and make ready to fill those not behind a frame still
+ * in use.
+ *
+ */
+static void
+yfShardRetire(
+    yfShardSet_t  *set,
+    gboolean       wait)
+{
+    yfShardFrame_t *frame;
+
+    if (wait) {
+        frame = g_async_queue_pop(set->done);
+        frame->done = TRUE;
+    }
+    while ((frame = g_async_queue_try_pop(set->done))) {
+        frame->done = TRUE;
+    }
+
+    while ((frame = g_queue_peek_head(&(set->inflight))) && frame->done) {
+        g_queue_pop_head(&(set->inflight));
+        yfShardRelease(frame);
+        frame->done = FALSE;
+        frame->tick = FALSE;
+        g_queue_push_tail(&(set->idle), frame);
+    }
+}
+
+
+/**
+ * yfShardHandOff
+ *
+ * Hand the frame capture has filled to the dispatcher and give capture
+ * the next, waiting for the shards to be done with one if need be.
+ *
+ */
+static void
+yfShardHandOff(
+    yfContext_t  *ctx,
+    gboolean      tick)
+{
+    yfShardSet_t   *set = ctx->shardset;
+    yfShardFrame_t *frame = set->cur;
+    uint8_t        *slot;
+
+    frame->tick = tick;
+    frame->pending = 1;
+    g_queue_push_tail(&(set->inflight), frame);
+
+    /* the handoff ring has room for every frame, so this never waits */
+    if (!rgaReserveHeadN(set->handoff, &slot, 1, TRUE)) {
+        g_error("YAF internal error: shard handoff ring overflow");
+    }
+    *((yfShardFrame_t **)slot) = frame;
+    rgaReleaseHeadN(set->handoff, 1);
+
+    yfShardRetire(set, FALSE);
+    while (g_queue_is_empty(&(set->idle))) {
+        yfShardRetire(set, TRUE);
+    }
+    set->cur = g_queue_pop_head(&(set->idle));
+    ctx->pbufring = set->cur->pbufs;
+}
+
+
+/**
+ * yfShardSend
+ *
+ * Hand the batch the dispatcher is filling for a shard over to it.
+ *
+ */
+static void
+yfShardSend(
+    yfShardSet_t  *set,
+    yfShard_t     *shard)
+{
+    shard->cur->stamp = set->ptime;
+    shard->sent = set->ptime;
+    g_async_queue_push(shard->full, shard->cur);
+    shard->cur = NULL;
+}
+
+
+/**
+ * yfShardStamp
+ *
+ * Tell a shard the time with an empty batch, if it has one to spare; a
+ * shard that has none is busy enough to be told soon anyway.
+ *
+ */
+static void
+yfShardStamp(
+    yfShardSet_t  *set,
+    yfShard_t     *shard,
+    gboolean       tick)
+{
+    if ((shard->cur = g_async_queue_try_pop(shard->empty))) {
+        shard->cur->count = 0;
+        shard->cur->tick = tick;
+        shard->cur->frame = NULL;
+        yfShardSend(set, shard);
+    }
+}
+
+
+/**
+ * yfShardDispatchFrame
+ *
+ * Hand the packet buffers of a frame to the shards in batches, both
+ * directions of a flow to the same shard.  The batches of a frame do
+ * not outlive it, so partial batches go at its end too.
+ *
+ */
+static void
+yfShardDispatchFrame(
+    yfShardSet_t    *set,
+    yfShardFrame_t  *frame)
+{
+    yfShard_t *shard;
+    yfPBuf_t  *pbuf;
+    uint32_t   i;
+
+    while ((pbuf = (yfPBuf_t *)rgaNextTail(frame->pbufs))) {
+        /* Skip time zero packets (these are marked invalid) */
+        if (!pbuf->ptime) {
+            continue;
+        }
+
+        i = ((uint32_t)yfFlowKeyHashSymmetric(&(pbuf->key), set->no_vlan) %
+             set->count);
+        shard = &(set->shards[i]);
+        if (!shard->cur) {
+            /* waits here while the shard is a full queue behind */
+            shard->cur = g_async_queue_pop(shard->empty);
+            shard->cur->tick = FALSE;
+            shard->cur->frame = frame;
+            g_atomic_int_inc(&(frame->pending));
+        }
+        shard->cur->pbufs[shard->cur->count++] = pbuf;
+        __atomic_store_n(&(set->ptime), pbuf->ptime, __ATOMIC_RELAXED);
+
+        if (shard->cur->count == YF_SHARD_BATCH) {
+            yfShardSend(set, shard);
+        }
+    }
+
+    for (i = 0; i < set->count; i++) {
+        shard = &(set->shards[i]);
+        if (shard->cur) {
+            yfShardSend(set, shard);
+        } else if (frame->tick ||
+                   shard->sent + YF_SHARD_STAMP_MS <= set->ptime)
+        {
+            yfShardStamp(set, shard, frame->tick);
+        }
+    }
+
+    yfShardFrameDone(set, frame);
+}
+
+
+/**
+ * yfShardDispatchMain
+ *
+ * Thread body of the dispatcher: take frames from capture until the
+ * handoff ring is interrupted and empty, then stop the shards.
+ *
+ */
+static void *
+yfShardDispatchMain(
+    void  *arg)
+{
+    yfShardSet_t   *set = (yfShardSet_t *)arg;
+    yfShardFrame_t *frame;
+    uint8_t        *slot;
+    uint32_t        i;
+
+    while (rgaReserveTailN(set->handoff, &slot, 1, TRUE)) {
+        frame = *((yfShardFrame_t **)slot);
+        rgaReleaseTailN(set->handoff, 1);
+        yfShardDispatchFrame(set, frame);
+    }
+
+    for (i = 0; i < set->count; i++) {
+        if (set->shards[i].started) {
+            g_async_queue_push(set->shards[i].full, &yf_shard_stop);
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * yfShardFlush
+ *
+ * Flush the flow table of a shard onto its export queue, then tell the
+ * export thread it has queued every flow it closes that ends by the
+ * last batch it has been through.  A failure stops capture as well.
+ *
+ */
+static gboolean
+yfShardFlush(
+    yfShard_t  *shard,
+    gboolean    close)
+{
+    yfContext_t *sctx = shard->ctx;
+
+    if (!yfFlowTabFlush(sctx, close, &(sctx->err))) {
+        g_atomic_int_inc(&yaf_quit);
+        return FALSE;
+    }
+    yfExportMark(sctx, shard->index, shard->seen);
+
+    return TRUE;
+}
+
+
+/**
+ * yfShardMain
+ *
+ * Thread body of a shard: run each batch through the flow table of the
+ * shard and flush it from time to time, until told to stop.  After a
+ * failure the shard keeps taking batches so that the dispatcher never
+ * waits on it and capture gets its frames back.
+ *
+ */
+static void *
+yfShardMain(
+    void  *arg)
+{
+    yfShard_t      *shard = (yfShard_t *)arg;
+    yfContext_t    *sctx = shard->ctx;
+    yfShardBatch_t *batch;
+    uint32_t        batches = 0;
+
+    for (;;) {
+        if (!(batch = g_async_queue_try_pop(shard->full))) {
+            /* caught up; flush while waiting for more */
+            if (shard->ok && batches) {
+                shard->ok = yfShardFlush(shard, FALSE);
+                batches = 0;
+            }
+            batch = g_async_queue_pop(shard->full);
+        }
+        if (batch == &yf_shard_stop) {
+            break;
+        }
+
+        if (shard->ok) {
+            if (batch->count) {
+                yfFlowPBufBatch(sctx->flowtab, sctx->pbuflen, batch->pbufs,
+                                batch->count);
+            } else {
+                /* the other shards have seen packets up to the stamp */
+                yfFlowTabAdvanceClockTo(sctx->flowtab, batch->stamp);
+                if (batch->tick) {
+                    /* capture is quiet; the flush below times flows out */
+                    yfFlowTabAdvanceClock(sctx->flowtab);
+                }
+            }
+            shard->seen = batch->stamp;
+            if (++batches >= YF_SHARD_FLUSH_BATCHES) {
+                shard->ok = yfShardFlush(shard, FALSE);
+                batches = 0;
+            }
+        }
+
+        if (batch->frame) {
+            yfShardFrameDone(shard->set, batch->frame);
+        }
+        batch->count = 0;
+        g_async_queue_push(shard->empty, batch);
+    }
+
+    if (shard->ok && shard->set->flush) {
+        shard->ok = yfShardFlush(shard, TRUE);
+    }
+    /* nothing more comes from this shard */
+    yfExportMark(sctx, shard->index, UINT64_MAX);
+
+    return NULL;
+}
+
+
+gboolean
+yfShardStart(
+    yfContext_t              *ctx,
+    uint32_t                  count,
+    const yfFlowTabConfig_t  *ftconfig,
+    void                    **yfctx,
+    gboolean                  no_vlan,
+    const char               *ckpt_path,
+    GError                  **err)
+{
+    yfShardSet_t     *set;
+    yfShard_t        *shard;
+    yfShardFrame_t   *frame;
+    yfContext_t      *sctx;
+    yfFlowTabConfig_t shardconfig = *ftconfig;
+    yfFlowTab_t     **flowtabs;
+    GError           *rerr = NULL;
+    uint32_t          i, j;
+    int               rv;
+
+    /* the export thread merges the output of the shards */
+    g_assert(ctx->exporter);
+
+    set = g_new0(yfShardSet_t, 1);
+    set->count = count;
+    set->no_vlan = no_vlan;
+    set->shards = g_new0(yfShard_t, count);
+
+    /* the flow, memory, and pre-flow limits are for the whole process;
+     * each shard enforces an even share of them on its own */
+    if (shardconfig.max_flows) {
+        shardconfig.max_flows = (shardconfig.max_flows + count - 1) / count;
+    }
+    shardconfig.max_memory /= count;
+    if (shardconfig.preflow_size) {
+        shardconfig.preflow_size =
+            (shardconfig.preflow_size + count - 1) / count;
+    }
+
+    ctx->shards = g_new0(yfContext_t *, count);
+    ctx->shard_count = count;
+    ctx->shardset = set;
+
+    /* capture fills frames in place of its packet ring */
+    set->pbufring = ctx->pbufring;
+    g_queue_init(&(set->inflight));
+    g_queue_init(&(set->idle));
+    for (i = 0; i < YF_SHARD_FRAMES; i++) {
+        frame = &(set->frames[i]);
+        frame->pbufs = rgaAllocVar(ctx->pbuflen, YF_SHARD_FRAME_RECS);
+        frame->holds = g_array_new(FALSE, FALSE, sizeof(yfShardHold_t));
+        g_queue_push_tail(&(set->idle), frame);
+    }
+    set->cur = g_queue_pop_head(&(set->idle));
+    ctx->pbufring = set->cur->pbufs;
+    set->done = g_async_queue_new();
+    set->handoff = rgaAllocThreaded(sizeof(yfShardFrame_t *),
+                                    YF_SHARD_FRAMES);
+
+    for (i = 0; i < count; i++) {
+        /* a shard has a flow table; it neither captures nor decodes */
+        sctx = g_new0(yfContext_t, 1);
+        *sctx = *ctx;
+        sctx->parent = ctx;
+        sctx->pbufring = NULL;
+        sctx->dectx = NULL;
+        sctx->fragtab = NULL;
+        sctx->workers = NULL;
+        sctx->worker_count = 0;
+        sctx->shards = NULL;
+        sctx->shard_count = 0;
+        sctx->shardset = NULL;
+        sctx->outlock = NULL;
+        sctx->exportq = yfExportQueue(ctx, i);
+        sctx->err = NULL;
+        sctx->flowtab = yfFlowTabAlloc(&shardconfig, yfctx);
+        ctx->shards[i] = sctx;
+
+        shard = &(set->shards[i]);
+        shard->set = set;
+        shard->ctx = sctx;
+        shard->index = i;
+        shard->ok = TRUE;
+        shard->full = g_async_queue_new();
+        shard->empty = g_async_queue_new();
+        for (j = 0; j < YF_SHARD_BATCHES; j++) {
+            g_async_queue_push(shard->empty, &(shard->batches[j]));
+        }
+    }
+
+    /* flows left in a checkpoint go into the shard tables before any shard
+     * thread is running */
+    if (ckpt_path) {
+        flowtabs = g_new(yfFlowTab_t *, count);
+        for (i = 0; i < count; i++) {
+            flowtabs[i] = ctx->shards[i]->flowtab;
+        }
+        if (!yfFlowTabRestore(flowtabs, count, ckpt_path, &rerr)) {
+            g_warning("Cannot restore flows: %s", rerr->message);
+            g_clear_error(&rerr);
+        }
+        g_free(flowtabs);
+    }
+
+    set->running = TRUE;
+    for (i = 0; i < count; i++) {
+        shard = &(set->shards[i]);
+        rv = pthread_create(&(shard->thread), NULL, yfShardMain, shard);
+        if (rv != 0) {
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Couldn't start flow table shard %u: %s",
+                        i, strerror(rv));
+            yfShardStop(ctx, FALSE, NULL);
+            return FALSE;
+        }
+        shard->started = TRUE;
+    }
+
+    rv = pthread_create(&(set->dispatcher), NULL, yfShardDispatchMain, set);
+    if (rv != 0) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't start flow table shard dispatcher: %s",
+                    strerror(rv));
+        yfShardStop(ctx, FALSE, NULL);
+        return FALSE;
+    }
+    set->dispatching = TRUE;
+
+    return TRUE;
+}
+
+
+void
+yfShardDispatch(
+    yfContext_t  *ctx)
+{
+    yfShardSet_t *set = ctx->shardset;
+
+    if (rgaCount(set->cur->pbufs) >= YF_SHARD_FRAME_FILL) {
+        yfShardHandOff(ctx, FALSE);
+    } else {
+        /* release what the shards are done with as soon as possible */
+        yfShardRetire(set, FALSE);
+    }
+}
+
+
+void
+yfShardTick(
+    yfContext_t  *ctx)
+{
+    yfShardSet_t *set = ctx->shardset;
+
+    /* the dispatcher tells idle shards capture is quiet; when every frame
+     * is in use, the shards are busy enough without */
+    yfShardRetire(set, FALSE);
+    if (rgaCount(set->cur->pbufs) || !g_queue_is_empty(&(set->idle))) {
+        yfShardHandOff(ctx, TRUE);
+    }
+}
+
+
+void
+yfShardHold(
+    yfContext_t       *ctx,
+    yfPBufRelease_fn   release,
+    void              *data)
+{
+    yfShardSet_t   *set = ctx->shardset;
+    yfShardFrame_t *frame = set->cur;
+    yfShardHold_t   hold;
+
+    /* the last frame with packet buffers holds it; frames are taken back
+     * in order, so it is done with once that one is */
+    if (!rgaCount(frame->pbufs)) {
+        if (!(frame = g_queue_peek_tail(&(set->inflight)))) {
+            release(data);
+            return;
+        }
+    }
+
+    hold.release = release;
+    hold.data = data;
+    g_array_append_val(frame->holds, hold);
+
+    /* capture has only so much memory to hold */
+    if (frame == set->cur && frame->holds->len >= YF_SHARD_FRAME_HOLDS) {
+        yfShardHandOff(ctx, FALSE);
+    }
+}
+
+
+void
+yfShardSync(
+    yfContext_t  *ctx)
+{
+    yfShardSet_t *set = ctx->shardset;
+
+    if (rgaCount(set->cur->pbufs) || set->cur->holds->len) {
+        yfShardHandOff(ctx, FALSE);
+    }
+    while (!g_queue_is_empty(&(set->inflight))) {
+        yfShardRetire(set, TRUE);
+    }
+}
+
+
+uint64_t
+yfShardCurrentTime(
+    yfContext_t  *ctx)
+{
+    return __atomic_load_n(&(ctx->shardset->ptime), __ATOMIC_RELAXED);
+}
+
+
+gboolean
+yfShardStop(
+    yfContext_t  *ctx,
+    gboolean      flush,
+    GError      **err)
+{
+    yfShardSet_t *set = ctx->shardset;
+    yfShard_t    *shard;
+    gboolean      ok = TRUE;
+    uint32_t      i;
+
+    if (!set || !set->running) {
+        return TRUE;
+    }
+
+    /* the dispatcher runs out the frames, then stops each shard, which
+     * runs out its queue, flushes, and stops */
+    set->flush = flush;
+    if (set->dispatching) {
+        if (rgaCount(set->cur->pbufs)) {
+            yfShardHandOff(ctx, FALSE);
+        }
+        rgaSetInterrupt(set->handoff);
+        pthread_join(set->dispatcher, NULL);
+        set->dispatching = FALSE;
+    } else {
+        for (i = 0; i < set->count; i++) {
+            if (set->shards[i].started) {
+                g_async_queue_push(set->shards[i].full, &yf_shard_stop);
+            }
+        }
+    }
+
+    for (i = 0; i < set->count; i++) {
+        shard = &(set->shards[i]);
+        if (!shard->started) {
+            continue;
+        }
+        pthread_join(shard->thread, NULL);
+        shard->started = FALSE;
+        if (!shard->ok && ok) {
+            g_propagate_error(err, shard->ctx->err);
+            shard->ctx->err = NULL;
+            ok = FALSE;
+        }
+    }
+
+    /* every frame is done with; release the capture memory they held */
+    while (!g_queue_is_empty(&(set->inflight))) {
+        yfShardRetire(set, TRUE);
+    }
+    yfShardRelease(set->cur);
+
+    set->running = FALSE;
+
+    return ok;
+}
+
+
+void
+yfShardFree(
+    yfContext_t  *ctx)
+{
+    yfShardSet_t *set = ctx->shardset;
+    yfShard_t    *shard;
+    uint32_t      i;
+
+    if (!set) {
+        return;
+    }
+
+    yfShardStop(ctx, FALSE, NULL);
+
+    for (i = 0; i < set->count; i++) {
+        shard = &(set->shards[i]);
+        yfFlowTabFree(shard->ctx->flowtab);
+        g_clear_error(&(shard->ctx->err));
+        g_free(shard->ctx);
+        g_async_queue_unref(shard->full);
+        g_async_queue_unref(shard->empty);
+    }
+
+    for (i = 0; i < YF_SHARD_FRAMES; i++) {
+        rgaFree(set->frames[i].pbufs);
+        g_array_free(set->frames[i].holds, TRUE);
+    }
+    g_queue_clear(&(set->inflight));
+    g_queue_clear(&(set->idle));
+    g_async_queue_unref(set->done);
+    rgaFree(set->handoff);
+    ctx->pbufring = set->pbufring;
+
+    g_free(set->shards);
+    g_free(set);
+
+    g_free(ctx->shards);
+    ctx->shards = NULL;
+    ctx->shard_count = 0;
+    ctx->shardset = NULL;
+}
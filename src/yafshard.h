@@ -0,0 +1,103 @@
+/*
+ *  Copyright 2006-2023 Carnegie Mellon University
+ *  See license information in LICENSE.txt.
+ */
+/*
+ *  yafshard.h
+ *  YAF flow table sharding across worker threads
+ *
+ *  ------------------------------------------------------------------------
+ *  Authors: CERT Network Situational Awareness Group
+ *  ------------------------------------------------------------------------
+ *  @DISTRIBUTION_STATEMENT_BEGIN@
+ *  YAF 3.0.0
+ *
+ *  Copyright 2023 Carnegie Mellon University.
+ *
+ *  NO WARRANTY. THIS CARNEGIE MELLON UNIVERSITY AND SOFTWARE ENGINEERING
+ *  INSTITUTE MATERIAL IS FURNISHED ON AN "AS-IS" BASIS. CARNEGIE MELLON
+ *  UNIVERSITY MAKES NO WARRANTIES OF ANY KIND, EITHER EXPRESSED OR IMPLIED,
+ *  AS TO ANY MATTER INCLUDING, BUT NOT LIMITED TO, WARRANTY OF FITNESS FOR
+ *  PURPOSE OR MERCHANTABILITY, EXCLUSIVITY, OR RESULTS OBTAINED FROM USE OF
+ *  THE MATERIAL. CARNEGIE MELLON UNIVERSITY DOES NOT MAKE ANY WARRANTY OF
+ *  ANY KIND WITH RESPECT TO FREEDOM FROM PATENT, TRADEMARK, OR COPYRIGHT
+ *  INFRINGEMENT.
+ *
+ *  Licensed under a GNU GPL 2.0-style license, please see LICENSE.txt or
+ *  contact permission@sei.cmu.edu for full terms.
+ *
+ *  [DISTRIBUTION STATEMENT A] This material has been approved for public
+ *  release and unlimited distribution.  Please see Copyright notice for
+ *  non-US Government use and distribution.
+ *
+ *  GOVERNMENT PURPOSE RIGHTS – Software and Software Documentation
+ *  Contract No.: FA8702-15-D-0002
+ *  Contractor Name: Carnegie Mellon University
+ *  Contractor Address: 4500 Fifth Avenue, Pittsburgh, PA 15213
+ *
+ *  The Government's rights to use, modify, reproduce, release, perform,
+ *  display, or disclose this software are restricted by paragraph (b)(2) of
+ *  the Rights in Noncommercial Computer Software and Noncommercial Computer
+ *  Software Documentation clause contained in the above identified
+ *  contract. No restrictions apply after the expiration date shown
+ *  above. Any reproduction of the software or portions thereof marked with
+ *  this legend must also reproduce the markings.
+ *
+ *  This Software includes and/or makes use of Third-Party Software each
+ *  subject to its own license.
+ *
+ *  DM23-2317
+ *  @DISTRIBUTION_STATEMENT_END@
+ *  ------------------------------------------------------------------------
+ */
+
+#ifndef _YAF_SHARD_H_
+#define _YAF_SHARD_H_
+
+#include <yaf/autoinc.h>
+#include "yafctx.h"
+#include "yaflush.h"
+
+gboolean
+yfShardStart(
+    yfContext_t              *ctx,
+    uint32_t                  count,
+    const yfFlowTabConfig_t  *ftconfig,
+    void                    **yfctx,
+    gboolean                  no_vlan,
+    const char               *ckpt_path,
+    GError                  **err);
+
+void
+yfShardDispatch(
+    yfContext_t  *ctx);
+
+void
+yfShardTick(
+    yfContext_t  *ctx);
+
+void
+yfShardHold(
+    yfContext_t       *ctx,
+    yfPBufRelease_fn   release,
+    void              *data);
+
+void
+yfShardSync(
+    yfContext_t  *ctx);
+
+uint64_t
+yfShardCurrentTime(
+    yfContext_t  *ctx);
+
+gboolean
+yfShardStop(
+    yfContext_t  *ctx,
+    gboolean      flush,
+    GError      **err);
+
+void
+yfShardFree(
+    yfContext_t  *ctx);
+
+#endif /* ifndef _YAF_SHARD_H_ */
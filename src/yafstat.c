@@ -57,6 +57,7 @@
 #include <yaf/yafrag.h>
 #include <yaf/decode.h>
 #include "yafcap.h"
+#include "yafexport.h"
 
 #ifdef YAF_ENABLE_NETRONOME
 #include "yafnfe.h"
@@ -70,6 +71,10 @@
 #include "yafdag.h"
 #endif
 
+#ifdef YAF_ENABLE_AFPACKET
+#include "yafafpacket.h"
+#endif
+
 #ifdef YAF_ENABLE_APPLABEL
 #include "yafdpi.h"
 #endif
@@ -114,16 +119,42 @@ static void
 yfStatDump(
     void)
 {
-    uint64_t numPackets;
-    uint32_t dropped, assembled, frags;
+    yfContext_t **workers = &statctx;
+    uint32_t      worker_count = 1;
+    uint64_t      numPackets = 0;
+    uint64_t     *workerPackets;
+    uint32_t      dropped, assembled, frags;
+    uint32_t      i;
+
+    /* with multiple capture workers, dump each worker's tables */
+    if (statctx->worker_count) {
+        workers = statctx->workers;
+        worker_count = statctx->worker_count;
+    }
+    workerPackets = g_new0(uint64_t, worker_count);
+
+    /* with flow table shards, dump each shard's table */
+    for (i = 0; i < statctx->shard_count; i++) {
+        workerPackets[0] += yfFlowDumpStats(statctx->shards[i]->flowtab,
+                                            yaf_fft);
+    }
 
-    numPackets = yfFlowDumpStats(statctx->flowtab, yaf_fft);
-    numPackets += yfGetDecodeStats(statctx->dectx);
-    yfGetFragTabStats(statctx->fragtab, &dropped, &assembled, &frags);
-    numPackets += (frags - assembled);
+    for (i = 0; i < worker_count; i++) {
+        if (workers[i]->flowtab) {
+            workerPackets[i] += yfFlowDumpStats(workers[i]->flowtab, yaf_fft);
+        }
+        workerPackets[i] += yfGetDecodeStats(workers[i]->dectx);
+        yfGetFragTabStats(workers[i]->fragtab, &dropped, &assembled, &frags);
+        workerPackets[i] += (frags - assembled);
+        numPackets += workerPackets[i];
+    }
     g_debug("YAF read %" PRIu64 " total packets", numPackets);
-    yfFragDumpStats(statctx->fragtab, numPackets);
-    yfDecodeDumpStats(statctx->dectx, numPackets);
+    for (i = 0; i < worker_count; i++) {
+        yfFragDumpStats(workers[i]->fragtab, workerPackets[i]);
+        yfDecodeDumpStats(workers[i]->dectx, workerPackets[i]);
+    }
+    g_free(workerPackets);
+    yfExportDumpStats(statctx);
     yfCapDumpStats();
 
 #ifdef YAF_ENABLE_NETRONOME
@@ -138,6 +169,9 @@ yfStatDump(
 #ifdef YAF_ENABLE_PFRING
     yfPfRingDumpStats();
 #endif
+#ifdef YAF_ENABLE_AFPACKET
+    yfAfPacketDumpStats();
+#endif
 #ifdef YAF_ENABLE_APPLABEL
     ydPrintApplabelTiming();
 #endif
@@ -57,6 +57,8 @@
 #include <airframe/daeconfig.h>
 #include <airframe/airutil.h>
 #include <yaf/picq.h>
+#include <yaf/lfq.h>
+#include <yaf/slab.h>
 #include <yaf/yaftab.h>
 #include <yaf/yafrag.h>
 #include "yafctx.h"
@@ -75,6 +77,9 @@
 
 #ifdef YAF_ENABLE_ENTROPY
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #endif
 
 #ifdef YAF_ENABLE_NDPI
@@ -85,12 +90,12 @@
  * YAF_MPLS:
  * If YAF was built with MPLS support, the MPLS labels are passed
  * to yfFlowPBuf, and the top 3 labels are hashed to create a key
- * into the Hash Table (flowtab->table).  The key retrieves a pointer
- * to a yfMPLSNode_t which contains a Hash Table, the MPLS labels, and
- * a counter.  This Hash Table is the new flow table.  The yfFlow_t struct
+ * into the Hash Table (flowtab->mpls_table).  The key retrieves a pointer
+ * to a yfMPLSNode_t which contains a flow index, the MPLS labels, and
+ * a counter.  This flow index is the new flow table.  The yfFlow_t struct
  * contains a pointer to the yfMPLSNode_t which contains a pointer to the
- * flow Hash Table that contains it.  Once the counter in the yfMPLSNode_t
- * is 0, the hash table is destroyed and the yfMPLSNode_t is freed.
+ * flow index that contains it.  Once the counter in the yfMPLSNode_t
+ * is 0, the flow index is destroyed and the yfMPLSNode_t is freed.
  */
 
 #ifndef YFDEBUG_FLOWTABLE
@@ -104,11 +109,48 @@
 #define YAF_STATE_FFINACK       0x00000040
 #define YAF_STATE_RFINACK       0x00000080
 #define YAF_STATE_FIN           0x000000F0
-#define YAF_STATE_ATO           0x00000100
 
 #define YF_FLUSH_DELAY 5000
 #define YF_MAX_CQ      2500
 
+/* On a quiet live link, the flow table clock runs this many milliseconds
+ * behind the time since the last packet, so that packets still in capture
+ * buffers, which can be up to a capture timeout old, are not taken for
+ * out of sequence. */
+#define YF_CLOCK_SLACK 2000
+
+/* With an export thread, a flow table has at most YF_EXPORT_MAX closed flows
+ * out with it at once.  When the export queue is full, closed flows wait on
+ * the close queue for the next flush until there are YF_EXPORT_CQ_LIMIT of
+ * them; past that, the flush waits for the export thread to catch up. */
+#define YF_EXPORT_MAX       4096
+#define YF_EXPORT_CQ_LIMIT  (16 * YF_MAX_CQ)
+/* microseconds to sleep while waiting on the export thread */
+#define YF_EXPORT_WAIT      100
+
+/* Expiry wheel geometry: four levels of 256 slots.  Level 0 slots are one
+ * millisecond wide and each level up is 256 times coarser, covering 2^32 ms
+ * (about 49 days).  YF_WHEEL_DUE is the list of expired flows. */
+#define YF_WHEEL_BITS   8
+#define YF_WHEEL_SLOTS  (1 << YF_WHEEL_BITS)
+#define YF_WHEEL_MASK   (YF_WHEEL_SLOTS - 1)
+#define YF_WHEEL_LEVELS 4
+#define YF_WHEEL_DUE    (YF_WHEEL_LEVELS * YF_WHEEL_SLOTS)
+
+/* Memory budget stages, in percent of max_memory in use: past SHRINK new
+ * flows capture 1/YF_MEM_SHRINK_DIV of max_payload, past NODPI new flows
+ * get no application labeling or DPI context, and past EVICT a flush
+ * closes flows, soonest to expire first, until usage falls to TARGET. */
+#define YF_MEM_SHRINK_PCT   75
+#define YF_MEM_NODPI_PCT    85
+#define YF_MEM_EVICT_PCT    95
+#define YF_MEM_TARGET_PCT   90
+#define YF_MEM_SHRINK_DIV   4
+
+/* Pre-flow table geometry: buckets of YF_PREFLOW_WAYS entries, picked by
+ * the low bits of the flow index hash */
+#define YF_PREFLOW_WAYS     4
+
 #define YAF_PCAP_META_ROTATE 45000000
 /* full path */
 #define YAF_PCAP_META_ROTATE_FP 23000000
@@ -116,6 +158,10 @@
 static int pcap_meta_num = 0;
 static int pcap_meta_read = 0;
 
+/* SipHash key for the flow index, chosen once per process */
+static uint64_t yf_flow_hash_key[2];
+static gboolean yf_flow_hash_keyed = FALSE;
+
 /* These constants define deprecated names for macro values.  They are defined
  * as constants since one cannot specify the deprecated attribute on macros.
  * They are declared 'extern' in yafcore.h. */
@@ -124,15 +170,22 @@ const uint16_t YAF_OUT_OF_SEQUENCE = YAF_ATTR_OUT_OF_SEQUENCE;
 const uint16_t YAF_MP_CAPABLE = YAF_ATTR_MP_CAPABLE;
 const uint16_t YAF_FRAGMENTS = YAF_ATTR_FRAGMENTS;
 
-/* Must keep yfFlowNodeIPv4_st in synch with this struct. */
 typedef struct yfFlowNode_st {
     /* previous node */
     struct yfFlowNode_st  *p;
     /* next node */
     struct yfFlowNode_st  *n;
-    /* FIXME: Nothing appears to reference the flowtab */
-    struct yfFlowTab_t    *flowtab;
-    uint32_t               state;
+    /* flow table the node belongs to, set when it goes to the export
+     * thread so that it comes back to be freed */
+    struct yfFlowTab_st   *flowtab;
+    uint8_t                state;
+    /* timeout profile, an index into the flow table's tprofs */
+    uint8_t                tprof;
+    /* expiry wheel slot holding this node */
+    uint16_t               wslot;
+    /* octets of payload to capture per direction; max_payload unless the
+     * flow was created under memory pressure */
+    uint32_t               paymax;
     yfFlow_t               f;
 } yfFlowNode_t;
 
@@ -142,80 +195,162 @@ typedef struct yfFlowQueue_st {
     yfFlowNode_t  *head;
 } yfFlowQueue_t;
 
+/* Timeouts of a timeout profile; profile 0 is the flow table's own */
+typedef struct yfFlowTimeout_st {
+    uint64_t   idle_ms;
+    uint64_t   active_ms;
+} yfFlowTimeout_t;
+
+/* The first packet of a flow, held in the pre-flow table until the flow
+ * sees a second packet in either direction.  Only packets with no captured
+ * payload are held, so this is everything the flow needs from it. */
+typedef struct yfPreFlow_st {
+    yfFlowKey_t   key;
+    uint64_t      ptime;
+    uint32_t      iplen;
+    /* transport payload length, captured or not */
+    uint32_t      datalen;
+    uint32_t      seq;
+    uint8_t       flags;
+    uint8_t       frag;
+    /* nonzero when the entry holds a packet */
+    uint8_t       used;
+    uint8_t       smac[ETHERNET_MAC_ADDR_LENGTH];
+    uint8_t       dmac[ETHERNET_MAC_ADDR_LENGTH];
+} yfPreFlow_t;
 
-#ifdef YAF_ENABLE_COMPACT_IP4
 /*
- * Compact IPv4 flow structures; allows the flow table to only allocate enough
- * space for IPv4 addresses for IPv4 flows. Requires the flow key to be the
- * last element of the flow, and the flow to be the last element of the
- * flow node. ALL CHANGES made to yfFlowKey_t and yfFlow_t in yafcore.h MUST
- * be reflected here or I'll not be held responsible for the results.
- */
-
-typedef struct yfFlowKeyIPv4_st {
-    uint16_t   sp;
-    uint16_t   dp;
-    uint8_t    proto;
-    uint8_t    version;
-    uint16_t   vlanId;
-    uint8_t    tos;
-#if defined(YAF_ENABLE_DAG_SEPARATE_INTERFACES) || defined(YAF_ENABLE_SEPARATE_INTERFACES)
-    uint8_t    netIf;
-#endif
-    uint32_t   layer2Id;
-    union {
-        struct {
-            uint32_t   sip;
-            uint32_t   dip;
-        } v4;
-    } addr;
-} yfFlowKeyIPv4_t;
-
-typedef struct yfFlowIPv4_st {
-    uint64_t          stime;
-    uint64_t          etime;
-#ifdef YAF_ENABLE_HOOKS
-    void             *hfctx[YAF_MAX_HOOKS];
-#endif
-    uint32_t          rdtime;
-#if defined(YAF_ENABLE_APPLABEL) || defined(YAF_ENABLE_NDPI)
-    uint16_t          appLabel;
-#endif
-#if defined(YAF_ENABLE_APPLABEL) || defined(YAF_ENABLE_DPI)
-    void             *dpictx;
-#endif
-#ifdef YAF_ENABLE_NDPI
-    uint16_t          ndpi_master;
-    uint16_t          ndpi_sub;
-#endif
-    uint8_t           reason;
-    uint8_t           pcap_serial;
-    uint8_t           sourceMacAddr[6];
-    uint8_t           destinationMacAddr[6];
-
-    uint8_t           pcap_file_no;
-    uint8_t           pktdir;
-    uint8_t           rtos;
-    pcap_dumper_t    *pcap;
-#ifdef YAF_MPLS
-    yfMPLSNode_t     *mpls;
-#endif
-    yfMPTCPFlow_t     mptcp;
-    yfFlowVal_t       val;
-    yfFlowVal_t       rval;
-    yfFlowKeyIPv4_t   key;
-} yfFlowIPv4_t;
-
-typedef struct yfFlowNodeIPv4_st {
-    struct yfFlowNodeIPv4_st  *p;
-    struct yfFlowNodeIPv4_st  *n;
-    struct yfFlowTab_t        *flowtab;
-    uint32_t                   state;
-    yfFlowIPv4_t               f;
-} yfFlowNodeIPv4_t;
+ * A checkpoint is a header followed by one record per active flow, each
+ * record followed by the payload and flow statistics it has, as flagged
+ * in its `extra`.  Records hold the flow as it is in memory, so only the
+ * build of yaf that wrote a checkpoint can read it; the header says which
+ * build that was, and the flow table modes that change flow keys.
+ */
+#define YF_CKPT_MAGIC       "YAFCKPT"
+#define YF_CKPT_VERSION     1
+
+/* build options the layout of a record depends on */
+#define YF_CKPT_BUILD_PAYLOAD   0x01
+#define YF_CKPT_BUILD_APPLABEL  0x02
+#define YF_CKPT_BUILD_MPLS      0x04
+#define YF_CKPT_BUILD_SEPIF     0x08
+#define YF_CKPT_BUILD_P0F       0x10
+#define YF_CKPT_BUILD_FPEXPORT  0x20
+#define YF_CKPT_BUILD_ENTROPY   0x40
+#define YF_CKPT_BUILD_NDPI      0x80
+#define YF_CKPT_BUILD_HOOKS     0x100
+
+/* what follows a record, and what it carries besides the flow */
+#define YF_CKPT_COLD            0x01
+#define YF_CKPT_MPLS            0x02
+#define YF_CKPT_VPAYLOAD        0x04
+#define YF_CKPT_RPAYLOAD        0x08
+#define YF_CKPT_VSTATS          0x10
+#define YF_CKPT_RSTATS          0x20
+/* state the record does not keep: the DPI context, nDPI labels, p0f and
+ * fingerprint captures, and plugin flow contexts */
+#define YF_CKPT_DPI             0x40
+#define YF_CKPT_HOOKS           0x80
+
+typedef struct yfCheckpointHeader_st {
+    char       magic[8];
+    uint32_t   version;
+    uint32_t   build;
+    uint32_t   flow_size;
+    uint32_t   stats_size;
+    uint32_t   bounds;
+    uint8_t    no_vlan_in_key;
+    uint8_t    mpls_mode;
+    uint8_t    pad[2];
+    /* latest packet time of the flow tables written */
+    uint64_t   ctime;
+    /* number of flow records */
+    uint64_t   count;
+} yfCheckpointHeader_t;
+
+typedef struct yfCheckpointFlow_st {
+    /* the flow; its pointers are not kept */
+    yfFlow_t       f;
+    /* the parts of the cold state worth keeping */
+    yfMPTCPFlow_t  mptcp;
+    uint32_t       mpls_label[YAF_MAX_MPLS_LABELS];
+    uint8_t        smac[ETHERNET_MAC_ADDR_LENGTH];
+    uint8_t        dmac[ETHERNET_MAC_ADDR_LENGTH];
+    uint8_t        state;
+    uint8_t        extra;
+} yfCheckpointFlow_t;
+
+/* typedef struct yfCheckpoint_st yfCheckpoint_t;   // include/yaf/yaftab.h */
+struct yfCheckpoint_st {
+    char                  *path;
+    /* written under this name, then renamed to `path` once complete */
+    char                  *tmppath;
+    FILE                  *fp;
+    /* flow tables flush from their own threads */
+    pthread_mutex_t        lock;
+    /* set from a signal handler */
+    volatile sig_atomic_t  requested;
+    /* the checkpoint could not be written; flows are closed as usual */
+    gboolean               failed;
+    yfCheckpointHeader_t   hdr;
+};
+
 
+#ifdef YAF_ENABLE_COMPACT_IP4
+/*
+ * Compact IPv4 flows; the flow table allocates an IPv4 flow node only up to
+ * the end of the IPv4 addresses in its key, leaving off the space only IPv6
+ * addresses use.  That requires the addresses to be the last member of the
+ * flow key, the key the last member of the flow, and the flow the last
+ * member of the flow node, which is checked here so that a layout change
+ * that breaks it fails to compile.
+ */
+#define YF_FLOWKEY_IPV4_SIZE                                            \
+    (offsetof(yfFlowKey_t, addr) + sizeof(((yfFlowKey_t *)0)->addr.v4))
+#define YF_FLOW_IPV4_SIZE                                               \
+    (offsetof(yfFlow_t, key) + YF_FLOWKEY_IPV4_SIZE)
+#define YF_FLOWNODE_IPV4_SIZE                                           \
+    (offsetof(yfFlowNode_t, f) + YF_FLOW_IPV4_SIZE)
+
+/* TRUE when nothing follows member M_ of T_ but padding */
+#define YF_IS_LAST_MEMBER(T_, M_)                                       \
+    (sizeof(T_) == ((offsetof(T_, M_) + sizeof(((T_ *)0)->M_)           \
+                     + G_ALIGNOF(T_) - 1) & ~(G_ALIGNOF(T_) - 1)))
+
+G_STATIC_ASSERT(YF_IS_LAST_MEMBER(yfFlowKey_t, addr));
+G_STATIC_ASSERT(YF_IS_LAST_MEMBER(yfFlow_t, key));
+G_STATIC_ASSERT(YF_IS_LAST_MEMBER(yfFlowNode_t, f));
 #endif /* ifdef YAF_ENABLE_COMPACT_IP4 */
 
+/*
+ * The fields every packet of a flow touches, and those the expiry wheel
+ * walks, are kept at the front of the flow node: the wheel links, state
+ * and times in its first cache line, the forward counters in the first
+ * two.  The reverse value follows the forward one with its counters
+ * first, and the key comes last for the sake of compact IPv4; yfFlowVal_t
+ * is public, so the reverse counters cannot be pulled ahead of the rest
+ * of the forward value.  A layout change that moves any of these fails
+ * to compile.
+ */
+#define YF_FLOWNODE_END(M_)                                             \
+    (offsetof(yfFlowNode_t, M_) + sizeof(((yfFlowNode_t *)0)->M_))
+
+G_STATIC_ASSERT(YF_FLOWNODE_END(p) <= 64);
+G_STATIC_ASSERT(YF_FLOWNODE_END(n) <= 64);
+G_STATIC_ASSERT(YF_FLOWNODE_END(state) <= 64);
+G_STATIC_ASSERT(YF_FLOWNODE_END(tprof) <= 64);
+G_STATIC_ASSERT(YF_FLOWNODE_END(wslot) <= 64);
+G_STATIC_ASSERT(YF_FLOWNODE_END(f.stime) <= 64);
+G_STATIC_ASSERT(YF_FLOWNODE_END(f.etime) <= 64);
+G_STATIC_ASSERT(YF_FLOWNODE_END(f.val.oct) <= 128);
+G_STATIC_ASSERT(YF_FLOWNODE_END(f.val.pkt) <= 128);
+G_STATIC_ASSERT(offsetof(yfFlowVal_t, oct) == 0);
+G_STATIC_ASSERT(offsetof(yfFlowVal_t, pkt) == sizeof(uint64_t));
+G_STATIC_ASSERT(offsetof(yfFlowNode_t, f.rval) ==
+                YF_FLOWNODE_END(f.val));
+G_STATIC_ASSERT(offsetof(yfFlowNode_t, f.key) ==
+                YF_FLOWNODE_END(f.rval));
+
 struct yfFlowTabStats_st {
     uint64_t   stat_octets;
     uint64_t   stat_packets;
@@ -224,44 +359,100 @@ struct yfFlowTabStats_st {
     uint64_t   stat_uniflows;
     uint32_t   stat_peak;
     uint32_t   stat_flush;
+    /* flushes that left closed flows behind because the export queue was
+     * full */
+    uint64_t   stat_export_deferred;
+    /* waits for room in the export queue */
+    uint64_t   stat_export_stalls;
+    /* flows created with reduced payload capture, without a DPI context,
+     * and closed early, to stay within max_memory */
+    uint64_t   stat_mem_shrunk;
+    uint64_t   stat_mem_nodpi;
+    uint64_t   stat_mem_evicted;
+    /* first packets held in the pre-flow table, then the entries promoted
+     * by a second packet, and those that left as single-packet flows */
+    uint64_t   stat_preflow_held;
+    uint64_t   stat_preflow_promoted;
+    uint64_t   stat_preflow_single;
 #ifdef YAF_MPLS
     uint32_t   max_mpls_labels;
     uint32_t   stat_mpls_labels;
 #endif
 };
 
+/* Counters read by yfGetFlowTabStats and yfGetFlowTabMemStats may be read
+ * from another thread while the owner updates them */
+#define YF_STAT_INC(s_)     __atomic_fetch_add(&(s_), 1, __ATOMIC_RELAXED)
+#define YF_STAT_ADD(s_, v_) __atomic_fetch_add(&(s_), (v_), __ATOMIC_RELAXED)
+#define YF_STAT_SET(s_, v_) __atomic_store_n(&(s_), (v_), __ATOMIC_RELAXED)
+#define YF_STAT_GET(s_)     __atomic_load_n(&(s_), __ATOMIC_RELAXED)
+
 /* typedef struct yfFlowTab_st yfFlowTab_t;   // include/yaf/yaftab.h */
 struct yfFlowTab_st {
     /* State */
     uint64_t                              ctime;
     uint64_t                              flushtime;
-    GHashTable                           *table;
+    struct yfFlowIndex_st                *table;
     GHashFunc                             hashfn;
-    GEqualFunc                            hashequalfn;
+    /* flow nodes and everything hanging off them */
+    slbArena_t                           *slab;
 #ifdef YAF_ENABLE_HOOKS
     /** Plugin context array for this yaf **/
     void                                **yfctx;
 #endif
 #ifdef YAF_MPLS
+    GHashTable                           *mpls_table;
     yfMPLSNode_t                         *cur_mpls_node;
 #endif
 #ifdef YAF_ENABLE_NDPI
     struct ndpi_detection_module_struct  *ndpi_struct;
 #endif
-    /* active flow queue */
-    yfFlowQueue_t                         aq;
+    /* active flows, filed by their next idle or active deadline */
+    yfFlowQueue_t                         wheel[YF_WHEEL_DUE + 1];
+    /* number of flows filed at each wheel level (not counting due) */
+    uint32_t                              wheel_count[YF_WHEEL_LEVELS];
+    /* time in milliseconds the wheel has been advanced to */
+    uint64_t                              wheel_time;
     /* closed flow queue */
     yfFlowQueue_t                         cq;
-    /* length of `aq` */
+    /* number of active flows */
     uint32_t                              count;
     /* length of `cq` */
     uint32_t                              cq_count;
+    /* closed flows the export thread has written and handed back */
+    lfqQueue_t                           *exdone;
+    /* closed flows with the export thread or on `exdone` */
+    uint32_t                              excount;
+    /* first packets of flows not yet in the index, if enabled */
+    yfPreFlow_t                          *preflow;
+    /* number of pre-flow buckets - 1 */
+    size_t                                preflow_mask;
+    /* time of the last pre-flow expiry scan */
+    uint64_t                              preflow_scantime;
+    /* packet time and monotonic time in milliseconds from which a quiet
+     * live capture runs the clock on, and the clock as last left */
+    uint64_t                              clock_ptime;
+    uint64_t                              clock_mono;
+    uint64_t                              clock_seen;
 
     /* Configuration */
     uint64_t                              active_ms;
     uint64_t                              idle_ms;
+    /* timeout profiles, and the profile index of each applabel, protocol,
+     * and protocol and port that has a rule (see yfFlowTimeoutKey) */
+    yfFlowTimeout_t                      *tprofs;
+    GHashTable                           *tprof_index;
+    uint64_t                              tcp_syn_ms;
+    uint64_t                              tcp_fin_ms;
     uint32_t                              max_flows;
     uint32_t                              max_payload;
+    uint64_t                              max_memory;
+    /* bytes in use at which each memory budget stage starts */
+    uint64_t                              mem_shrink;
+    uint64_t                              mem_nodpi;
+    uint64_t                              mem_evict;
+    /* bytes in use eviction brings the table back down to */
+    uint64_t                              mem_target;
 
     uint64_t                              pcap_search_flowkey;
     uint64_t                              pcap_search_stime;
@@ -282,6 +473,7 @@ struct yfFlowTab_st {
     gboolean                              fpexport_mode;
     gboolean                              macmode;
     gboolean                              mpls_mode;
+    gboolean                              no_vlan_in_key;
     gboolean                              p0f_mode;
     gboolean                              silkmode;
     gboolean                              udp_multipkt_payload;
@@ -314,11 +506,29 @@ yfGetFlowTabStats(
     uint32_t     *peak,
     uint32_t     *flush)
 {
-    *packets = flowtab->stats.stat_packets;
-    *flows = flowtab->stats.stat_flows;
-    *rej_pkts = flowtab->stats.stat_seqrej;
-    *peak = flowtab->stats.stat_peak;
-    *flush = flowtab->stats.stat_flush;
+    *packets = YF_STAT_GET(flowtab->stats.stat_packets);
+    *flows = YF_STAT_GET(flowtab->stats.stat_flows);
+    *rej_pkts = YF_STAT_GET(flowtab->stats.stat_seqrej);
+    *peak = YF_STAT_GET(flowtab->stats.stat_peak);
+    *flush = YF_STAT_GET(flowtab->stats.stat_flush);
+}
+
+
+/**
+ * yfGetFlowTabMemStats
+ *
+ *
+ */
+void
+yfGetFlowTabMemStats(
+    yfFlowTab_t  *flowtab,
+    uint64_t     *shrunk,
+    uint64_t     *nodpi,
+    uint64_t     *evicted)
+{
+    *shrunk = YF_STAT_GET(flowtab->stats.stat_mem_shrunk);
+    *nodpi = YF_STAT_GET(flowtab->stats.stat_mem_nodpi);
+    *evicted = YF_STAT_GET(flowtab->stats.stat_mem_evicted);
 }
 
 
@@ -628,6 +838,168 @@ yfFlowKeyEqualNoVlan(
 }
 
 
+/**
+ * yfFlowKeyEqualReverse
+ *
+ * compares flow key a with the reverse of flow key b, without
+ * building the reversed key
+ *
+ * @param
+ *
+ */
+static inline gboolean
+yfFlowKeyEqualReverse(
+    yfFlowKey_t  *a,
+    yfFlowKey_t  *b,
+    gboolean      novlan)
+{
+#ifdef YAF_ENABLE_DAG_SEPARATE_INTERFACES
+    if (a->netIf != b->netIf) {
+        return FALSE;
+    }
+#endif
+
+    if ((a->proto != b->proto) || (a->version != b->version)) {
+        return FALSE;
+    }
+    if (!novlan && ((a->vlanId ^ b->vlanId) & 0x0FFF)) {
+        return FALSE;
+    }
+    /* reversing an ICMP key leaves type and code in place */
+    if (a->proto == YF_PROTO_ICMP || a->proto == YF_PROTO_ICMP6) {
+        if ((a->sp != b->sp) || (a->dp != b->dp)) {
+            return FALSE;
+        }
+    } else if ((a->sp != b->dp) || (a->dp != b->sp)) {
+        return FALSE;
+    }
+
+    if (a->version == 4) {
+        return ((a->addr.v4.sip == b->addr.v4.dip) &&
+                (a->addr.v4.dip == b->addr.v4.sip));
+    } else if (a->version == 6) {
+        return ((memcmp(a->addr.v6.sip, b->addr.v6.dip, 16) == 0) &&
+                (memcmp(a->addr.v6.dip, b->addr.v6.sip, 16) == 0));
+    }
+    return FALSE;
+}
+
+
+#define YF_SIPROUND                                              \
+    do {                                                         \
+        v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0;        \
+        v0 = (v0 << 32) | (v0 >> 32);                            \
+        v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2;        \
+        v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0;        \
+        v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2;        \
+        v2 = (v2 << 32) | (v2 >> 32);                            \
+    } while (0)
+
+/**
+ * yfSipHash13
+ *
+ * SipHash-1-3 of `n` 64-bit words under the flow hash key.
+ *
+ */
+static inline uint64_t
+yfSipHash13(
+    const uint64_t  *m,
+    size_t           n)
+{
+    uint64_t v0 = yf_flow_hash_key[0] ^ UINT64_C(0x736f6d6570736575);
+    uint64_t v1 = yf_flow_hash_key[1] ^ UINT64_C(0x646f72616e646f6d);
+    uint64_t v2 = yf_flow_hash_key[0] ^ UINT64_C(0x6c7967656e657261);
+    uint64_t v3 = yf_flow_hash_key[1] ^ UINT64_C(0x7465646279746573);
+    uint64_t b = (uint64_t)(n * 8) << 56;
+    size_t   i;
+
+    for (i = 0; i < n; i++) {
+        v3 ^= m[i];
+        YF_SIPROUND;
+        v0 ^= m[i];
+    }
+
+    v3 ^= b;
+    YF_SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    YF_SIPROUND;
+    YF_SIPROUND;
+    YF_SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+/**
+ * yfFlowKeyHashSymmetric
+ *
+ * keyed hash function that gives a flow key and its reverse the same
+ * 64-bit hash, by ordering the two endpoints before hashing them with
+ * SipHash-1-3.  The key is chosen at random when the first flow table
+ * is allocated, so colliding flows cannot be crafted in advance.
+ *
+ */
+uint64_t
+yfFlowKeyHashSymmetric(
+    const yfFlowKey_t  *key,
+    gboolean            no_vlan)
+{
+    /* lo address, hi address, ports and everything else */
+    uint64_t m[5];
+    uint64_t shared;
+    uint32_t lo, hi;
+    uint16_t lop = key->sp, hip = key->dp;
+    gboolean icmp = (key->proto == YF_PROTO_ICMP ||
+                     key->proto == YF_PROTO_ICMP6);
+
+    shared = ((uint64_t)key->proto << 56) | ((uint64_t)key->version << 48);
+    if (!no_vlan) {
+        shared |= (uint64_t)(key->vlanId & 0x0FFF) << 32;
+    }
+#ifdef YAF_ENABLE_DAG_SEPARATE_INTERFACES
+    shared |= (uint64_t)key->netIf << 44;
+#endif
+
+    /* an endpoint is an address and port, except for ICMP, where the
+     * "ports" hold type and code, which do not change direction */
+    if (key->version == 4) {
+        lo = key->addr.v4.sip;
+        hi = key->addr.v4.dip;
+        if (lo > hi || (lo == hi && !icmp && lop > hip)) {
+            lo = key->addr.v4.dip;
+            hi = key->addr.v4.sip;
+            if (!icmp) {
+                lop = key->dp;
+                hip = key->sp;
+            }
+        }
+        m[0] = ((uint64_t)lo << 32) | hi;
+        m[1] = shared | ((uint32_t)lop << 16) | hip;
+        return yfSipHash13(m, 2);
+    }
+
+    /* any order of the endpoints that does not depend on direction will
+     * do, so compare the addresses as words rather than bytes */
+    memcpy(m, key->addr.v6.sip, 16);
+    memcpy(m + 2, key->addr.v6.dip, 16);
+    if (m[0] > m[2] ||
+        (m[0] == m[2] && (m[1] > m[3] ||
+                          (m[1] == m[3] && !icmp && lop > hip))))
+    {
+        memcpy(m, key->addr.v6.dip, 16);
+        memcpy(m + 2, key->addr.v6.sip, 16);
+        if (!icmp) {
+            lop = key->dp;
+            hip = key->sp;
+        }
+    }
+    m[4] = shared | ((uint32_t)lop << 16) | hip;
+    return yfSipHash13(m, 5);
+}
+
+
 /**
  * yfFlowKeyReverse
  *
@@ -683,7 +1055,7 @@ yfFlowKeyCopy(
 {
 #ifdef YAF_ENABLE_COMPACT_IP4
     if (src->version == 4) {
-        memcpy(dst, src, sizeof(yfFlowKeyIPv4_t));
+        memcpy(dst, src, YF_FLOWKEY_IPV4_SIZE);
     } else
 #endif  /* YAF_ENABLE_COMPACT_IP4 */
     {
@@ -691,1616 +1063,3156 @@ yfFlowKeyCopy(
     }
 }
 
-#if 0
+/*
+ * Flow index: an open-addressing table of flow node pointers, probed a
+ * group of YF_FLOWIDX_GROUP slots at a time.  A flow is indexed by its
+ * direction-independent hash, so a single probe finds it from either
+ * direction.  Each slot has a control byte in a separate contiguous array
+ * holding either a 7-bit tag taken from the flow's hash or one of the
+ * markers below.  A probe compares the tags of a whole group at once and
+ * only dereferences nodes whose tag matches, so most misses never leave
+ * the control array.  A probe ends at the first group that has an empty
+ * slot.
+ */
+#define YF_FLOWIDX_GROUP        16
+#define YF_FLOWIDX_EMPTY        0x80
+#define YF_FLOWIDX_DELETED      0xFE
+#define YF_FLOWIDX_MIN_GROUPS   64
+
+/* packets between loading a batched packet's index group and loading its
+ * flow node in yfFlowPBufBatch() */
+#define YF_PBUF_PREFETCH_AHEAD  4
+
+typedef struct yfFlowIndex_st {
+    /* allocation holding ctrl and slots, aligned to a cache line */
+    void           *mem;
+    uint8_t        *ctrl;
+    yfFlowNode_t  **slots;
+    /* number of groups - 1; number of groups is a power of 2 */
+    size_t          mask;
+    size_t          count;
+    size_t          deleted;
+    /* inserts into empty slots left before the index must grow */
+    size_t          growth;
+    gboolean        novlan;
+} yfFlowIndex_t;
+
+
 /**
- * yfFlowIncrementUniflow
+ * yfFlowIndexHash
  *
- * simple helper function to allow counting of unidirectional flows
- * (vs. captured biflows on the wire)
+ * Hash a flow key for the flow index; the same for both directions.
  *
  */
-static void
-yfFlowIncrementUniflow(
-    yfFlowTab_t  *flowtab)
+static inline uint64_t
+yfFlowIndexHash(
+    const yfFlowIndex_t  *idx,
+    yfFlowKey_t          *key)
 {
-    (flowtab->stats.stat_uniflows)++;
+    return yfFlowKeyHashSymmetric(key, idx->novlan);
 }
 
 
-#endif /* #if 0 */
-
-
-#if YFDEBUG_FLOWTABLE == 1
 /**
- * yfFlowDebug
- *
+ * yfFlowIndexMatch
  *
- * @param msg
- * @param flow
+ * Return a bitmask with bit N set when control byte N of the group at
+ * `ctrl` is `tag`.
  *
  */
-static void
-yfFlowDebug(
-    const char  *msg,
-    yfFlow_t    *flow)
+static inline uint32_t
+yfFlowIndexMatch(
+    const uint8_t  *ctrl,
+    uint8_t         tag)
 {
-    static GString *str = NULL;
+#ifdef __SSE2__
+    __m128i grp = _mm_load_si128((const __m128i *)ctrl);
 
-    if (!str) {
-        str = g_string_new(NULL);
-    }
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(grp, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t bits = 0;
+    unsigned int i;
 
-    g_string_printf(str, "%s ", msg);
-    yfPrintString(str, flow);
-    g_debug("%s", str->str);
+    for (i = 0; i < YF_FLOWIDX_GROUP; i++) {
+        if (ctrl[i] == tag) {
+            bits |= (1U << i);
+        }
+    }
+    return bits;
+#endif /* ifdef __SSE2__ */
 }
 
 
 /**
- * yfFlowTabVerifyIdleOrder
+ * yfFlowIndexMatchFree
  *
- *
- * @param flowtab
+ * Return a bitmask with bit N set when slot N of the group at `ctrl` is
+ * empty or deleted; those are the control bytes with the high bit set.
  *
  */
-static void
-yfFlowTabVerifyIdleOrder(
-    yfFlowTab_t  *flowtab)
+static inline uint32_t
+yfFlowIndexMatchFree(
+    const uint8_t  *ctrl)
 {
-    yfFlowNode_t *fn = NULL, *nfn = NULL;
-    uint64_t      end;
-    uint32_t      i;
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_load_si128((const __m128i *)ctrl));
+#else
+    uint32_t bits = 0;
+    unsigned int i;
 
-    /* rip through the active queue making sure end time strictly decreases */
-    for (fn = flowtab->aq.head, end = flowtab->aq.head->f.etime, i = 0;
-         fn; end = fn->f.etime, fn = nfn, ++i)
-    {
-        nfn = fn->p;
-        if (end < fn->f.etime) {
-            g_debug("Flow inversion in active table position %u; "
-                    "last end %llu, end %llu in flow:", i, end, fn->f.etime);
-            yfFlowDebug("iiv", &(fn->f));
+    for (i = 0; i < YF_FLOWIDX_GROUP; i++) {
+        if (ctrl[i] & 0x80) {
+            bits |= (1U << i);
         }
     }
+    return bits;
+#endif /* ifdef __SSE2__ */
 }
 
 
-#endif /* if YFDEBUG_FLOWTABLE == 1 */
-
-#ifdef YAF_MPLS
 /**
- * yfMPLSNodeFree
+ * yfFlowIndexInit
  *
- * Free table and struct when the last node associated with the
- * set of MPLS labels has been closed
+ * Allocate empty control and slot arrays for `ngroups` groups.
  *
  */
 static void
-yfMPLSNodeFree(
-    yfFlowTab_t   *flowtab,
-    yfMPLSNode_t  *mpls)
+yfFlowIndexInit(
+    yfFlowIndex_t  *idx,
+    size_t          ngroups)
 {
-    g_hash_table_remove(flowtab->table, mpls);
+    size_t cap = ngroups * YF_FLOWIDX_GROUP;
 
-    g_hash_table_destroy(mpls->tab);
-
-    g_slice_free(yfMPLSNode_t, mpls);
+    idx->mem = g_malloc(cap + cap * sizeof(yfFlowNode_t *) + 63);
+    idx->ctrl = (uint8_t *)(((uintptr_t)idx->mem + 63) & ~(uintptr_t)63);
+    idx->slots = (yfFlowNode_t **)(idx->ctrl + cap);
+    memset(idx->ctrl, YF_FLOWIDX_EMPTY, cap);
 
-    --(flowtab->stats.stat_mpls_labels);
+    idx->mask = ngroups - 1;
+    idx->count = 0;
+    idx->deleted = 0;
+    idx->growth = cap - cap / 8;
 }
-#endif /* ifdef YAF_MPLS */
 
 
 /**
- * yfFlowFree
- *
- * frees a flow (deallocates the memory and resets field
- * values to defaults) when the flow is no longer needed
+ * yfFlowIndexAlloc
  *
- * @param flowtab pointer to the flow table
- * @param fn node in the table to free
+ * Allocate a flow index sized to hold `hint` flows without growing.
  *
  */
-static void
-yfFlowFree(
-    yfFlowTab_t   *flowtab,
-    yfFlowNode_t  *fn)
+static yfFlowIndex_t *
+yfFlowIndexAlloc(
+    size_t     hint,
+    gboolean   novlan)
 {
-#ifdef YAF_ENABLE_PAYLOAD
-    /* free payload if present */
-    if (fn->f.val.payload) {
-        g_slice_free1(flowtab->max_payload, fn->f.val.payload);
-        g_slice_free1((sizeof(size_t) * YAF_MAX_PKT_BOUNDARY),
-                      fn->f.val.paybounds);
-    }
-    if (fn->f.rval.payload) {
-        g_slice_free1(flowtab->max_payload, fn->f.rval.payload);
-        g_slice_free1((sizeof(size_t) * YAF_MAX_PKT_BOUNDARY),
-                      fn->f.rval.paybounds);
-    }
-#endif /* ifdef YAF_ENABLE_PAYLOAD */
-#ifdef YAF_ENABLE_HOOKS
-    /* let the hook free its context */
-    yfHookFlowFree(&(fn->f));
-#endif
-
-#ifdef YAF_ENABLE_APPLABEL
-    ydFreeFlowContext(&(fn->f));
-#endif
-
-#ifdef YAF_ENABLE_FPEXPORT
-    /* if present free the banner grabs for OS fingerprinting */
-    if (fn->f.val.firstPacket) {
-        g_slice_free1(YFP_IPTCPHEADER_SIZE, fn->f.val.firstPacket);
-    }
-    if (fn->f.val.secondPacket) {
-        g_slice_free1(YFP_IPTCPHEADER_SIZE, fn->f.val.secondPacket);
-    }
-    if (fn->f.rval.firstPacket) {
-        g_slice_free1(YFP_IPTCPHEADER_SIZE, fn->f.rval.firstPacket);
-    }
-    if (fn->f.rval.secondPacket) {
-        g_slice_free1(YFP_IPTCPHEADER_SIZE, fn->f.rval.secondPacket);
-    }
-#endif /* ifdef YAF_ENABLE_FPEXPORT */
-#ifdef YAF_ENABLE_P0F
-    if (fn->f.val.osFingerprint) {
-        g_free(fn->f.val.osFingerprint);
-    }
-    if (fn->f.rval.osFingerprint) {
-        g_free(fn->f.rval.osFingerprint);
-    }
-#endif /* ifdef YAF_ENABLE_P0F */
+    yfFlowIndex_t *idx = g_new0(yfFlowIndex_t, 1);
+    size_t         ngroups = YF_FLOWIDX_MIN_GROUPS;
 
-    if (flowtab->flowstats_mode) {
-        if (fn->f.val.stats) {
-            g_slice_free(yfFlowStats_t, fn->f.val.stats);
-        }
-        if (fn->f.rval.stats) {
-            g_slice_free(yfFlowStats_t, fn->f.rval.stats);
-        }
+    while (ngroups * YF_FLOWIDX_GROUP * 7 / 8 < hint) {
+        ngroups <<= 1;
     }
 
-#ifdef YAF_MPLS
-    if (flowtab->mpls_mode) {
-        --(fn->f.mpls->tab_count);
-        if (fn->f.mpls->tab_count == 0) {
-            /* remove node */
-            yfMPLSNodeFree(flowtab, fn->f.mpls);
-        }
-    }
-#endif /* ifdef YAF_MPLS */
+    idx->novlan = novlan;
+    yfFlowIndexInit(idx, ngroups);
 
-    /* free flow */
-#ifdef YAF_ENABLE_COMPACT_IP4
-    if (fn->f.key.version == 4) {
-        g_slice_free(yfFlowNodeIPv4_t, (yfFlowNodeIPv4_t *)fn);
-    } else
-#endif  /* YAF_ENABLE_COMPACT_IP4 */
-    {
-        g_slice_free(yfFlowNode_t, fn);
-    }
+    return idx;
 }
 
+
 /**
- * yfFlowTick
- *
- * advances a flow to the head of the activity
- * queue so when flows get timed out, only the
- * bottom of the queue is examined
+ * yfFlowIndexFree
  *
- * @param flowtable pointer to the flow table
- * @param fn pointer to the flow node entry in the
- *        table
  *
  */
 static void
-yfFlowTick(
-    yfFlowTab_t   *flowtab,
-    yfFlowNode_t  *fn)
+yfFlowIndexFree(
+    yfFlowIndex_t  *idx)
 {
-    /* move flow node to head of queue */
-    if (flowtab->aq.head != fn) {
-        piqPick(&flowtab->aq, fn);
-        piqEnQ(&flowtab->aq, fn);
-    }
+    g_free(idx->mem);
+    g_free(idx);
 }
 
 
-#ifdef YAF_ENABLE_APPLABEL
 /**
- * yfFlowLabelApp
- *
- * when closing a flow out, if applabel is enabled, send
- * the flow payload through the labeling mechanism in order
- * to identify the protocol via payload inspection
+ * yfFlowIndexPlace
  *
- * @param flowtab pointer to the flow table
- * @param fn pointer to the flow node entry in the table
+ * Store `fn` in the first free slot on the probe sequence for `hash`.
+ * Does not check for space.
  *
  */
 static void
-yfFlowLabelApp(
-    yfFlowTab_t   *flowtab,
-    yfFlowNode_t  *fn)
+yfFlowIndexPlace(
+    yfFlowIndex_t  *idx,
+    yfFlowNode_t   *fn,
+    uint64_t        hash)
 {
-    /* If the app labeler is enabled, let it inspect the packet
-     * (for UDP & TCP packets anyway) */
-    if (flowtab->applabelmode == TRUE &&
-        ((fn->f.key.proto == 6) || (fn->f.key.proto == 17)))
+    size_t   group = (hash >> 7) & idx->mask;
+    size_t   step = 0;
+    size_t   slot;
+    uint32_t bits;
+
+    while (!(bits = yfFlowIndexMatchFree(
+                 idx->ctrl + group * YF_FLOWIDX_GROUP)))
     {
-        ydScanFlow(&(fn->f));
+        group = (group + ++step) & idx->mask;
+    }
+
+    slot = group * YF_FLOWIDX_GROUP + g_bit_nth_lsf(bits, -1);
+    if (idx->ctrl[slot] == YF_FLOWIDX_EMPTY) {
+        --(idx->growth);
     } else {
-        fn->f.appLabel = 0;
+        --(idx->deleted);
     }
+    idx->ctrl[slot] = (uint8_t)(hash >> 57);
+    idx->slots[slot] = fn;
+    ++(idx->count);
 }
-#endif /* ifdef YAF_ENABLE_APPLABEL */
 
 
-#ifdef YAF_ENABLE_ENTROPY
 /**
- * yfFlowDoEntropy
- *
- * when closing a flow and entropy calculation is enabled,
- * call this calculation to calculate the Shannon entropy
- * on the data stream
+ * yfFlowIndexResize
  *
- * @param flowtab pointer to the flow table
- * @param fn pointer to the flow node entry in the table
+ * Rebuild the index, doubling it if more than half of its usable space
+ * holds live flows; otherwise this just clears out deleted slots.
  *
  */
 static void
-yfFlowDoEntropy(
-    yfFlowTab_t   *flowtab,
-    yfFlowNode_t  *fn)
+yfFlowIndexResize(
+    yfFlowIndex_t  *idx)
 {
-    yfFlowVal_t *val;
-    uint32_t entropyDist[256];
-    double   entropyScratch;
-    double   logPaylen;
-    uint32_t loop;
-    int      fwd_rev;
+    yfFlowIndex_t old = *idx;
+    size_t        ngroups = idx->mask + 1;
+    size_t        cap = ngroups * YF_FLOWIDX_GROUP;
+    size_t        i;
 
-    /* if entropy is enabled, then we need to calculate it */
-    /* FIXME deglobalize */
-    if (!flowtab->entropymode) {
-        fn->f.val.entropy = 0;
-        fn->f.rval.entropy = 0;
-        return;
+    if (idx->count * 2 >= cap - cap / 8) {
+        ngroups <<= 1;
     }
 
-    /*
-     *  First loop through each octet of payload and increment the
-     *  entropyDist[] bin that corresponds to the octet.
-     *
-     *  Next compute the sum of these values across every bin:
-     *
-     *   ( bin[i] / SUM(bin[]) ) * log2( bin[i] / SUM(bin[]) )
-     *
-     *  where SUM(bin[]) is the payload length.  Using the properties of
-     *  logarithms: this can be changed to
-     *
-     *   SUM( ( bin[i] / paylen ) * ( log2(bin[i]) - log2(paylen) ) )
-     *
-     *  The division by paylen can be pulled outside the SUM():
-     *
-     *   SUM( bin[i] * ( log2(bin[i]) - log2(paylen) ) ) / paylen
-     *
-     *  Moving "/paylen" outside SUM() may affect result slightly: in testing,
-     *  of 364,385 entropy values computed in the data set, one value changed
-     *  from 103 to 104.
-     *
-     *  Finally, change the sign of the result, divide by 8 (bits per byte)
-     *  and multiply by 256 (to give a value in range 0 to 255).  This is
-     *  equivalent to:
-     *
-     *   -32.0 * SUM ( bin[i] * ( log2(bin[i]) - log2(paylen) ) ) / paylen
-     */
-
-    for (fwd_rev = 0; fwd_rev < 2; ++fwd_rev) {
-        val = ((0 == fwd_rev) ? &fn->f.val : &fn->f.rval);
+    yfFlowIndexInit(idx, ngroups);
 
-        if (val->paylen <= 1) {
-            val->entropy = 0;
-        } else {
-            logPaylen = log2((double)val->paylen);
-            entropyScratch = 0.0;
-            memset(entropyDist, 0, sizeof(entropyDist));
-            for (loop = 0; loop < val->paylen; loop++) {
-                entropyDist[val->payload[loop]]++;
-            }
-            for (loop = 0; loop < 256; loop++) {
-                if (entropyDist[loop] > 0) {
-                    entropyScratch +=
-                        ((double)entropyDist[loop] *
-                         (log2((double)entropyDist[loop]) - logPaylen));
-                }
-            }
-            val->entropy = (uint8_t)(entropyScratch * -32.0
-                                     / (double)val->paylen);
+    for (i = 0; i < cap; i++) {
+        if (!(old.ctrl[i] & 0x80)) {
+            yfFlowIndexPlace(idx, old.slots[i],
+                             yfFlowIndexHash(idx, &(old.slots[i]->f.key)));
         }
     }
-}
 
+    g_free(old.mem);
+}
 
-#endif /* ifdef YAF_ENABLE_ENTROPY */
 
 /**
- * yfFlowClose
- *
- * close a flow and remove it from the active list, it will get flushed
- * out based on another timer; record the reason for closing the flow:
- * (time out, session end, etc.)
+ * yfFlowIndexLookup
  *
- * @param flowtab pointer to the flow table
- * @param fn pointer to the flow node entry in the flow table
- * @param reason reason code for closing the flow
+ * Find the flow with key `key`, whose hash is `hash`, in either
+ * direction.  Sets `rev` when the flow was found by its reverse key.
  *
+ * @return the flow node, or NULL if there is none
  */
-static void
-yfFlowClose(
-    yfFlowTab_t   *flowtab,
-    yfFlowNode_t  *fn,
-    uint8_t        reason)
+static inline yfFlowNode_t *
+yfFlowIndexLookup(
+    const yfFlowIndex_t  *idx,
+    yfFlowKey_t          *key,
+    uint64_t              hash,
+    gboolean             *rev)
 {
-#ifdef YAF_MPLS
-    if (flowtab->mpls_mode) {
-        g_hash_table_remove(fn->f.mpls->tab, &(fn->f.key));
-    } else
-#endif
-    {
-        /* remove flow from table */
-        g_hash_table_remove(flowtab->table, &(fn->f.key));
+    size_t         group = (hash >> 7) & idx->mask;
+    size_t         step = 0;
+    uint8_t        tag = (uint8_t)(hash >> 57);
+    const uint8_t *ctrl;
+    yfFlowNode_t  *fn;
+    uint32_t       bits;
+
+    for (;;) {
+        ctrl = idx->ctrl + group * YF_FLOWIDX_GROUP;
+        for (bits = yfFlowIndexMatch(ctrl, tag); bits; bits &= bits - 1) {
+            fn = idx->slots[group * YF_FLOWIDX_GROUP + g_bit_nth_lsf(bits, -1)];
+            if (idx->novlan ? yfFlowKeyEqualNoVlan(key, &(fn->f.key))
+                : yfFlowKeyEqual(key, &(fn->f.key)))
+            {
+                *rev = FALSE;
+                return fn;
+            }
+            if (yfFlowKeyEqualReverse(key, &(fn->f.key), idx->novlan)) {
+                *rev = TRUE;
+                return fn;
+            }
+        }
+        if (yfFlowIndexMatch(ctrl, YF_FLOWIDX_EMPTY)) {
+            return NULL;
+        }
+        group = (group + ++step) & idx->mask;
     }
+}
 
-    /* store closure reason */
-    fn->f.reason &= ~YAF_END_MASK;
-    fn->f.reason |= reason;
 
-    /* remove flow from active queue */
-    piqPick(&flowtab->aq, fn);
+/**
+ * yfFlowIndexPrefetch
+ *
+ * Start loading the control bytes and slots of the group a lookup of a
+ * flow whose hash is `hash` probes first.
+ *
+ */
+static inline void
+yfFlowIndexPrefetch(
+    const yfFlowIndex_t  *idx,
+    uint64_t              hash)
+{
+    size_t group = (hash >> 7) & idx->mask;
 
-    /* move flow node to close queue */
-    piqEnQ(&flowtab->cq, fn);
+    YF_PREFETCH(idx->ctrl + group * YF_FLOWIDX_GROUP);
+    YF_PREFETCH(idx->slots + group * YF_FLOWIDX_GROUP);
+    YF_PREFETCH(idx->slots + group * YF_FLOWIDX_GROUP
+                + YF_FLOWIDX_GROUP / 2);
+}
 
-#ifdef YAF_ENABLE_PAYLOAD
 
-#ifdef YAF_ENABLE_APPLABEL
-    /* do application label processing if necessary */
-    if (flowtab->applabelmode) {
-        yfFlowLabelApp(flowtab, fn);
-    }
-#endif /* ifdef YAF_ENABLE_APPLABEL */
+/**
+ * yfFlowIndexPrefetchNode
+ *
+ * Start loading the first flow node in the first group probed for `hash`
+ * whose tag matches, which is the flow itself unless tags collide.  The
+ * group should already have been prefetched by yfFlowIndexPrefetch().
+ *
+ */
+static inline void
+yfFlowIndexPrefetchNode(
+    const yfFlowIndex_t  *idx,
+    uint64_t              hash)
+{
+    size_t   group = (hash >> 7) & idx->mask;
+    uint32_t bits;
 
-#ifdef YAF_ENABLE_ENTROPY
-    /* do entropy calculation if necessary */
-    if (flowtab->entropymode) {
-        yfFlowDoEntropy(flowtab, fn);
+    bits = yfFlowIndexMatch(idx->ctrl + group * YF_FLOWIDX_GROUP,
+                            (uint8_t)(hash >> 57));
+    if (bits) {
+        YF_PREFETCH(idx->slots[group * YF_FLOWIDX_GROUP +
+                               g_bit_nth_lsf(bits, -1)]);
     }
-#endif /* ifdef YAF_ENABLE_ENTROPY */
+}
 
-#ifdef YAF_ENABLE_HOOKS
-    yfHookFlowClose(&(fn->f));
-#endif
 
-#endif /* ifdef YAF_ENABLE_PAYLOAD */
+/**
+ * yfFlowIndexInsert
+ *
+ * Add `fn`, whose key hashes to `hash` and is not yet in the index.
+ *
+ */
+static void
+yfFlowIndexInsert(
+    yfFlowIndex_t  *idx,
+    yfFlowNode_t   *fn,
+    uint64_t        hash)
+{
+    if (idx->growth == 0) {
+        yfFlowIndexResize(idx);
+    }
 
-    /** count the flow in the close queue */
-    ++(flowtab->cq_count);
+    yfFlowIndexPlace(idx, fn, hash);
+}
 
-    /* count the flow as inactive */
-    --(flowtab->count);
 
-    if (flowtab->pcap_dir) {
-        if (fn->f.pcap) {
-            pcap_dump_flush(fn->f.pcap);
-            pcap_dump_close(fn->f.pcap);
+/**
+ * yfFlowIndexRemove
+ *
+ * Remove `fn` from the index.  Its slot becomes empty again if its group
+ * still has an empty slot, since no probe can then have passed over the
+ * group; otherwise it is marked deleted.
+ *
+ */
+static void
+yfFlowIndexRemove(
+    yfFlowIndex_t  *idx,
+    yfFlowNode_t   *fn)
+{
+    uint64_t hash = yfFlowIndexHash(idx, &(fn->f.key));
+    size_t   group = (hash >> 7) & idx->mask;
+    size_t   step = 0;
+    size_t   slot;
+    uint8_t *ctrl;
+    uint32_t bits;
+
+    for (;;) {
+        ctrl = idx->ctrl + group * YF_FLOWIDX_GROUP;
+        for (bits = yfFlowIndexMatch(ctrl, (uint8_t)(hash >> 57));
+             bits; bits &= bits - 1)
+        {
+            slot = group * YF_FLOWIDX_GROUP + g_bit_nth_lsf(bits, -1);
+            if (idx->slots[slot] == fn) {
+                if (yfFlowIndexMatch(ctrl, YF_FLOWIDX_EMPTY)) {
+                    idx->ctrl[slot] = YF_FLOWIDX_EMPTY;
+                    ++(idx->growth);
+                } else {
+                    idx->ctrl[slot] = YF_FLOWIDX_DELETED;
+                    ++(idx->deleted);
+                }
+                --(idx->count);
+                return;
+            }
+        }
+        if (yfFlowIndexMatch(ctrl, YF_FLOWIDX_EMPTY)) {
+            /* not in the index */
+            return;
         }
+        group = (group + ++step) & idx->mask;
     }
 }
 
 
-#ifdef YAF_ENABLE_PAYLOAD
+#if 0
 /**
- * yfActiveFlowCleanUp
+ * yfFlowIncrementUniflow
  *
- * clear out payload length to make way
- * for next packet payload
+ * simple helper function to allow counting of unidirectional flows
+ * (vs. captured biflows on the wire)
  *
  */
 static void
-yfActiveFlowCleanUp(
-    yfFlowTab_t   *flowtab,
-    yfFlowNode_t  *fn)
+yfFlowIncrementUniflow(
+    yfFlowTab_t  *flowtab)
 {
-    fn->f.val.paylen = 0;
-    fn->f.rval.paylen = 0;
+    YF_STAT_INC(flowtab->stats.stat_uniflows);
 }
 
 
-#endif /* ifdef YAF_ENABLE_PAYLOAD */
+#endif /* #if 0 */
+
+
+#if YFDEBUG_FLOWTABLE == 1
 /**
- * yfCloseActiveFlow
+ * yfFlowDebug
  *
- * close a flow and write it but keep it active
- * mainly for udp-uniflow option.
  *
- * @param flowtab pointer to the flow table
- * @param fn pointer to the flow node entry in the flow table
- * @param reason reason code for closing the flow
+ * @param msg
+ * @param flow
  *
  */
 static void
-yfCloseActiveFlow(
-    yfFlowTab_t    *flowtab,
-    yfFlowNode_t   *fn,
-    yfFlowVal_t    *val,
-    const uint8_t  *pkt,
-    uint32_t        paylen,
-    uint8_t         reason,
-    uint32_t        iplen)
+yfFlowDebug(
+    const char  *msg,
+    yfFlow_t    *flow)
 {
-    yfFlowNode_t *tfn;  /*temp flow to write*/
-    yfFlowVal_t  *valtemp;
+    static GString *str = NULL;
 
-#ifdef YAF_ENABLE_COMPACT_IP4
-    if (fn->f.key.version == 4) {
-        tfn = (yfFlowNode_t *)g_slice_dup(
-            yfFlowNodeIPv4_t, (yfFlowNodeIPv4_t *)fn);
-    } else
-#endif /* ifdef YAF_ENABLE_COMPACT_IP4 */
-    {
-        tfn = g_slice_dup(yfFlowNode_t, fn);
+    if (!str) {
+        str = g_string_new(NULL);
     }
 
-    if (&(fn->f.rval) == val) {
-        yfFlowKeyReverse(&(fn->f.key), &(tfn->f.key));
-        memcpy(&(tfn->f.val), val, sizeof(yfFlowVal_t));
-        tfn->f.key.tos = fn->f.rtos;
+    g_string_printf(str, "%s ", msg);
+    yfPrintString(str, flow);
+    g_debug("%s", str->str);
+}
+
+
+/**
+ * yfFlowTabVerifyWheel
+ *
+ *
+ * @param flowtab
+ *
+ */
+static void
+yfFlowTabVerifyWheel(
+    yfFlowTab_t  *flowtab)
+{
+    yfFlowNode_t *fn = NULL;
+    uint32_t      count[YF_WHEEL_LEVELS] = {0};
+    uint32_t      slot, total = 0;
+
+    /* rip through the wheel making sure every node knows its slot */
+    for (slot = 0; slot <= YF_WHEEL_DUE; slot++) {
+        for (fn = flowtab->wheel[slot].head; fn; fn = fn->p, ++total) {
+            if (fn->wslot != slot) {
+                g_debug("Flow in wheel slot %u thinks it is in slot %u:",
+                        slot, fn->wslot);
+                yfFlowDebug("iiv", &(fn->f));
+            }
+            if (slot != YF_WHEEL_DUE) {
+                ++count[slot >> YF_WHEEL_BITS];
+            }
+        }
+    }
+    for (slot = 0; slot < YF_WHEEL_LEVELS; slot++) {
+        if (count[slot] != flowtab->wheel_count[slot]) {
+            g_debug("Wheel level %u holds %u flows, counted %u",
+                    slot, count[slot], flowtab->wheel_count[slot]);
+        }
     }
+    if (total != flowtab->count) {
+        g_debug("Wheel holds %u flows, table counts %u",
+                total, flowtab->count);
+    }
+}
 
-    /*"Uniflow"*/
-    memset(&(tfn->f.rval), 0, sizeof(yfFlowVal_t));
 
-    /* Since we are creating a new node - we need to allocate
-     * hooks context for it */
-#ifdef YAF_ENABLE_HOOKS
-    /*Let the hook allocate its context */
-    yfHookFlowAlloc(&(tfn->f), flowtab->yfctx);
-#endif
+#endif /* if YFDEBUG_FLOWTABLE == 1 */
 
-#ifdef YAF_ENABLE_APPLABEL
-    ydAllocFlowContext(&(tfn->f));
-#endif
+#ifdef YAF_MPLS
+/**
+ * yfMPLSNodeFree
+ *
+ * Free table and struct when the last node associated with the
+ * set of MPLS labels has been closed
+ *
+ */
+static void
+yfMPLSNodeFree(
+    yfFlowTab_t   *flowtab,
+    yfMPLSNode_t  *mpls)
+{
+    g_hash_table_remove(flowtab->mpls_table, mpls);
 
-    tfn->f.rdtime = 0;
-    tfn->f.val.pkt = 1;
+    yfFlowIndexFree(mpls->tab);
 
-    /* octet count of only this flow! */
-    tfn->f.val.oct = iplen;
+    g_slice_free(yfMPLSNode_t, mpls);
 
-    /*Update start time of this flow - to now*/
-    tfn->f.stime = flowtab->ctime;
+    --(flowtab->stats.stat_mpls_labels);
+}
+#endif /* ifdef YAF_MPLS */
 
-    /* store closure reason - shouldn't have any other bits turned on */
-    tfn->f.reason &= ~YAF_END_MASK;
-    tfn->f.reason |= reason;
 
-    tfn->n = NULL;
-    tfn->p = NULL;
-    valtemp = &(tfn->f.val);
-    valtemp->stats = NULL;
-#ifdef YAF_ENABLE_PAYLOAD
-    valtemp->payload = NULL;
-
-    /* Short-circuit no payload capture */
-    if (flowtab->max_payload && paylen && pkt) {
-        valtemp->payload = g_slice_alloc0(flowtab->max_payload);
+/**
+ * yfFlowCold
+ *
+ * returns the cold state of a flow in the flow table, allocating it the
+ * first time a feature needs it
+ *
+ */
+static yfFlowCold_t *
+yfFlowCold(
+    yfFlowTab_t  *flowtab,
+    yfFlow_t     *flow)
+{
+    if (!flow->cold) {
+        flow->cold = slbAlloc0(flowtab->slab, SLB_FLOW, sizeof(yfFlowCold_t));
+    }
+    return flow->cold;
+}
 
-        /* truncate capture length to payload limit */
-        if (paylen > flowtab->max_payload) {
-            paylen = flowtab->max_payload;
-        }
 
-        /* only need 1 entry in paybounds */
-        valtemp->paybounds = (size_t *)g_slice_alloc0(sizeof(size_t) *
-                                                      YAF_MAX_PKT_BOUNDARY);
-        valtemp->paybounds[0] = paylen;
+/**
+ * yfFlowTabMemUsed
+ *
+ * bytes of the memory budget the flow table is using: everything in its
+ * slab arena plus its flow index.
+ *
+ */
+static size_t
+yfFlowTabMemUsed(
+    const yfFlowTab_t  *flowtab)
+{
+    size_t used = slbInUseTotal(flowtab->slab);
 
-        memcpy(valtemp->payload, pkt, paylen);
-        tfn->f.val.paylen = paylen;
+    if (flowtab->table) {
+        used += (flowtab->table->mask + 1) * YF_FLOWIDX_GROUP *
+            (1 + sizeof(yfFlowNode_t *));
     }
-#endif /* ifdef YAF_ENABLE_PAYLOAD */
-    /* move flow node to close queue */
-    piqEnQ(&flowtab->cq, tfn);
-
-#ifdef YAF_MPLS
-    if (flowtab->mpls_mode) {
-        /* Since yfFlowFree frees UDP uniflows, but they're never
-         * added to the mpls tables - we add one here, to account
-         * for subtracting it in yfflowfree */
-        ++(fn->f.mpls->tab_count);
+    if (flowtab->preflow) {
+        used += (flowtab->preflow_mask + 1) * YF_PREFLOW_WAYS *
+            sizeof(yfPreFlow_t);
     }
-#endif  /* YAF_MPLS */
 
-    ++(flowtab->cq_count);
+    return used;
+}
 
-#ifdef YAF_ENABLE_PAYLOAD
 
-#ifdef YAF_ENABLE_APPLABEL
-    /* do application label processing if necessary */
-    tfn->f.appLabel = 0;
-    if (flowtab->applabelmode) {
-        yfFlowLabelApp(flowtab, tfn);
-    }
+/**
+ * yfFlowMemAdmit
+ *
+ * sets the payload capture limit of a new flow node by how much of the
+ * memory budget is in use, and returns FALSE if the flow should not get a
+ * DPI context either.
+ *
+ */
+static gboolean
+yfFlowMemAdmit(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
+{
+    size_t used;
 
-    if (tfn->f.appLabel) {
-        /* store in ongoing flow */
-        fn->f.appLabel = tfn->f.appLabel;
+    fn->paymax = flowtab->max_payload;
+    if (!flowtab->max_memory) {
+        return TRUE;
     }
-#endif /* ifdef YAF_ENABLE_APPLABEL */
 
-#ifdef YAF_ENABLE_ENTROPY
-    /* do entropy calculation if necessary */
-    if (flowtab->entropymode) {
-        yfFlowDoEntropy(flowtab, tfn);
+    used = yfFlowTabMemUsed(flowtab);
+    if (used < flowtab->mem_shrink) {
+        return TRUE;
+    }
+    if (fn->paymax) {
+        fn->paymax /= YF_MEM_SHRINK_DIV;
+        YF_STAT_INC(flowtab->stats.stat_mem_shrunk);
     }
-#endif /* ifdef YAF_ENABLE_ENTROPY */
-
-#ifdef YAF_ENABLE_HOOKS
-    yfHookFlowClose(&(tfn->f));
-#endif
-
-    yfActiveFlowCleanUp(flowtab, fn);
-#endif /* ifdef YAF_ENABLE_PAYLOAD */
-}
-
 
-#ifdef YAF_ENABLE_NDPI
-/*  Define malloc and free functions to pass into ndpi.  */
-/*  FIXME: I do not think these are needed since recent versions of g_malloc()
- *  use malloc().  */
-static void *
-yf_ndpi_malloc(
-    unsigned long   size)
-{
-    return g_malloc(size);
-}
+    if (used < flowtab->mem_nodpi) {
+        return TRUE;
+    }
+    if (flowtab->applabelmode) {
+        YF_STAT_INC(flowtab->stats.stat_mem_nodpi);
+    }
 
-static void
-yf_ndpi_free(
-    void  *mem)
-{
-    g_free(mem);
+    return FALSE;
 }
-#endif /* YAF_ENABLE_NDPI */
 
 
 /**
- * yfFlowTabAlloc
+ * yfFlowFree
  *
- * allocate (preferably from the slab allocator) another entry
- * into the flow table for a new flow
+ * frees a flow (deallocates the memory and resets field
+ * values to defaults) when the flow is no longer needed
  *
+ * @param flowtab pointer to the flow table
+ * @param fn node in the table to free
  *
- * @return a pointer to the flow node entry in the flow table
  */
-yfFlowTab_t *
-yfFlowTabAlloc(
-    const yfFlowTabConfig_t  *ftconfig,
-    void                    **yfctx)
+static void
+yfFlowFree(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
 {
-    yfFlowTab_t *flowtab = g_slice_new0(yfFlowTab_t);
-
-    /* Copy the configuration */
-    flowtab->idle_ms = ftconfig->idle_ms;
-    flowtab->active_ms = ftconfig->active_ms;
-    flowtab->max_flows = ftconfig->max_flows;
-    flowtab->max_payload = ftconfig->max_payload;
-
-    flowtab->applabelmode = ftconfig->applabel_mode;
-    flowtab->entropymode = ftconfig->entropy_mode;
-    flowtab->flowstats_mode = ftconfig->flowstats_mode;
-    flowtab->force_read_all = ftconfig->force_read_all;
-    flowtab->fpexport_mode = ftconfig->fpexport_mode;
-    flowtab->macmode = ftconfig->mac_mode;
-    flowtab->mpls_mode = ftconfig->mpls_mode;
-    flowtab->p0f_mode = ftconfig->p0f_mode;
-    flowtab->pcap_index = ftconfig->pcap_index;
-    flowtab->silkmode = ftconfig->silk_mode;
-    flowtab->udp_multipkt_payload = ftconfig->udp_multipkt_payload;
-    flowtab->uniflow = ftconfig->uniflow_mode;
-
-    flowtab->udp_uniflow_port = ftconfig->udp_uniflow_port;
-
+#ifdef YAF_ENABLE_PAYLOAD
+    /* free payload if present */
+    if (fn->f.val.payload) {
+        slbFree(flowtab->slab, SLB_PAYLOAD, fn->paymax, fn->f.val.payload);
+        slbFree(flowtab->slab, SLB_PAYLOAD,
+                (sizeof(size_t) * YAF_MAX_PKT_BOUNDARY),
+                fn->f.val.paybounds);
+    }
+    if (fn->f.rval.payload) {
+        slbFree(flowtab->slab, SLB_PAYLOAD, fn->paymax, fn->f.rval.payload);
+        slbFree(flowtab->slab, SLB_PAYLOAD,
+                (sizeof(size_t) * YAF_MAX_PKT_BOUNDARY),
+                fn->f.rval.paybounds);
+    }
+#endif /* ifdef YAF_ENABLE_PAYLOAD */
 #ifdef YAF_ENABLE_HOOKS
-    flowtab->yfctx = yfctx;
+    /* let the hook free its context */
+    yfHookFlowFree(&(fn->f));
 #endif
 
-    if (ftconfig->pcap_per_flow) {
-        flowtab->pcap_dir = g_strdup(ftconfig->pcap_dir);
-    } else if (ftconfig->pcap_dir) {
-        flowtab->pcap_roll = g_string_new(NULL);
-    } else if (ftconfig->pcap_meta_file && flowtab->pcap_index) {
-        pcap_meta_read = -1;
-    } else if (ftconfig->pcap_meta_file) {
-        flowtab->pcap_roll = g_string_new(NULL);
-    }
+#ifdef YAF_ENABLE_APPLABEL
+    ydFreeFlowContext(&(fn->f), flowtab->slab);
+#endif
 
-    if (ftconfig->pcap_meta_file) {
-        if ((strlen(ftconfig->pcap_meta_file) == 1) &&
-            ftconfig->pcap_meta_file[0] == '-')
-        {
-            flowtab->pcap_meta = stdout;
-        } else {
-            flowtab->pcap_meta_name = g_strdup(ftconfig->pcap_meta_file);
-            yfRotatePcapMetaFile(flowtab);
-        }
+#ifdef YAF_ENABLE_FPEXPORT
+    /* if present free the banner grabs for OS fingerprinting */
+    if (fn->f.val.firstPacket) {
+        slbFree(flowtab->slab, SLB_FPEXPORT, YFP_IPTCPHEADER_SIZE,
+                fn->f.val.firstPacket);
     }
-    flowtab->pcap_maxfile = ftconfig->pcap_maxfile;
-
-    if (ftconfig->pcap_flowkey) {
-        flowtab->pcap_search_flowkey =
-            strtoull(ftconfig->pcap_flowkey, NULL, 10);
+    if (fn->f.val.secondPacket) {
+        slbFree(flowtab->slab, SLB_FPEXPORT, YFP_IPTCPHEADER_SIZE,
+                fn->f.val.secondPacket);
     }
-
-    if (ftconfig->pcap_stime) {
-        flowtab->pcap_search_stime = strtoull(ftconfig->pcap_stime, NULL, 10);
+    if (fn->f.rval.firstPacket) {
+        slbFree(flowtab->slab, SLB_FPEXPORT, YFP_IPTCPHEADER_SIZE,
+                fn->f.rval.firstPacket);
+    }
+    if (fn->f.rval.secondPacket) {
+        slbFree(flowtab->slab, SLB_FPEXPORT, YFP_IPTCPHEADER_SIZE,
+                fn->f.rval.secondPacket);
+    }
+#endif /* ifdef YAF_ENABLE_FPEXPORT */
+#ifdef YAF_ENABLE_P0F
+    if (fn->f.val.osFingerprint) {
+        g_free(fn->f.val.osFingerprint);
     }
+    if (fn->f.rval.osFingerprint) {
+        g_free(fn->f.rval.osFingerprint);
+    }
+#endif /* ifdef YAF_ENABLE_P0F */
 
-    if (ftconfig->no_vlan_in_key) {
-        flowtab->hashfn = (GHashFunc)yfFlowKeyHashNoVlan;
-        flowtab->hashequalfn = (GEqualFunc)yfFlowKeyEqualNoVlan;
-    } else {
-        flowtab->hashfn = (GHashFunc)yfFlowKeyHash;
-        flowtab->hashequalfn = (GEqualFunc)yfFlowKeyEqual;
+    if (flowtab->flowstats_mode) {
+        slbFree(flowtab->slab, SLB_STATS, sizeof(yfFlowStats_t),
+                fn->f.val.stats);
+        slbFree(flowtab->slab, SLB_STATS, sizeof(yfFlowStats_t),
+                fn->f.rval.stats);
     }
 
 #ifdef YAF_MPLS
     if (flowtab->mpls_mode) {
-        flowtab->table = g_hash_table_new((GHashFunc)yfMPLSHash,
-                                          (GEqualFunc)yfMPLSEqual);
-    } else
-#endif /* ifdef YAF_MPLS */
-    {
-        flowtab->table = g_hash_table_new(flowtab->hashfn,
-                                          flowtab->hashequalfn);
-    }
-
-#ifdef YAF_ENABLE_HOOKS
-    yfHookValidateFlowTab(flowtab->yfctx, flowtab->max_payload,
-                          flowtab->uniflow, flowtab->silkmode,
-                          flowtab->applabelmode, flowtab->entropymode,
-                          flowtab->p0f_mode,
-                          flowtab->fpexport_mode,
-                          flowtab->udp_multipkt_payload,
-                          flowtab->udp_uniflow_port);
-#endif /* ifdef YAF_ENABLE_HOOKS */
-
-#ifdef YAF_ENABLE_NDPI
-    if (ftconfig->ndpi) {
-        NDPI_PROTOCOL_BITMASK all;
-        set_ndpi_malloc(yf_ndpi_malloc);
-        set_ndpi_free(yf_ndpi_free);
-        flowtab->ndpi_struct = ndpi_init_detection_module();
-        if (flowtab->ndpi_struct == NULL) {
-            g_warning("Could not initialize NDPI");
-            return NULL;
+        --(fn->f.cold->mpls->tab_count);
+        if (fn->f.cold->mpls->tab_count == 0) {
+            /* remove node */
+            yfMPLSNodeFree(flowtab, fn->f.cold->mpls);
         }
+    }
+#endif /* ifdef YAF_MPLS */
 
-        NDPI_BITMASK_SET_ALL(all);
-        ndpi_set_protocol_detection_bitmask2(flowtab->ndpi_struct, &all);
-
-        if (ftconfig->ndpi_proto_file) {
-            ndpi_load_protocols_file(flowtab->ndpi_struct,
-                                     ftconfig->ndpi_proto_file);
-        }
+    if (fn->f.cold) {
+        slbFree(flowtab->slab, SLB_FLOW, sizeof(yfFlowCold_t), fn->f.cold);
     }
-#endif /* ifdef YAF_ENABLE_NDPI */
 
-    /* Done */
-    return flowtab;
+    /* free flow */
+#ifdef YAF_ENABLE_COMPACT_IP4
+    if (fn->f.key.version == 4) {
+        slbFree(flowtab->slab, SLB_FLOW, YF_FLOWNODE_IPV4_SIZE, fn);
+    } else
+#endif  /* YAF_ENABLE_COMPACT_IP4 */
+    {
+        slbFree(flowtab->slab, SLB_FLOW, sizeof(yfFlowNode_t), fn);
+    }
 }
 
-
 /**
- * yfFlowTabFree
+ * yfFlowExportReclaim
+ *
+ * frees the closed flows the export thread has handed back.
  *
- * free's the entry in the flow table for a given flow entry *
  */
-void
-yfFlowTabFree(
+static void
+yfFlowExportReclaim(
     yfFlowTab_t  *flowtab)
 {
-    yfFlowNode_t *fn = NULL, *nfn = NULL;
+    yfFlowNode_t *fn = NULL;
 
-    /* zip through the close queue freeing flows */
-    for (fn = flowtab->cq.head; fn; fn = nfn) {
-        nfn = fn->p;
-        yfFlowFree(flowtab, fn);
+    if (!flowtab->exdone) {
+        return;
     }
 
-    /* now do the same with the active queue */
-    for (fn = flowtab->aq.head; fn; fn = nfn) {
-        nfn = fn->p;
+    while ((fn = lfqPop(flowtab->exdone))) {
         yfFlowFree(flowtab, fn);
+        --(flowtab->excount);
     }
+}
 
-    /* Free GString */
-    if (flowtab->pcap_roll) {
-        g_string_free(flowtab->pcap_roll, TRUE);
-    }
 
-    if (flowtab->pcap_meta) {
-        long cp = ftell(flowtab->pcap_meta);
-        fseek(flowtab->pcap_meta, flowtab->pcap_last_offset, SEEK_SET);
-        fprintf(flowtab->pcap_meta, "%" PRIu64 "|%010ld\n",
-                flowtab->pcap_last_time, cp);
-        fclose(flowtab->pcap_meta);
-    }
-
-    /* free the key index table */
-    g_hash_table_destroy(flowtab->table);
-
-#ifdef YAF_ENABLE_NDPI
-    ndpi_exit_detection_module(flowtab->ndpi_struct);
-#endif
-
-    /* now free the flow table */
-    g_slice_free(yfFlowTab_t, flowtab);
-}
+/* key of a timeout rule in a flow table's tprof_index */
+#define yfFlowTimeoutKey(_applabel_, _proto_, _port_)                   \
+    GUINT_TO_POINTER((_applabel_) ? (0x1000000 | (_applabel_))          \
+                     : (((guint)(_proto_) << 16) | (_port_)))
 
-
-#ifdef YAF_MPLS
 /**
- * yfMPLSGetNode
+ * yfFlowTimeoutProfile
+ *
+ * finds the timeout profile of a flow with key `key` and application
+ * label `applabel`: that of a rule for the applabel, else for the protocol
+ * and either port, else for the protocol, else the flow table's own.
  *
- *  Finds an MPLS node entry in the MPLS table
- *  based on the labels in the MPLS header,
- *  creating it if needed, and updates
- *  `cur_mpls_node` on `flowtab`.
  */
-static yfMPLSNode_t *
-yfMPLSGetNode(
-    yfFlowTab_t  *flowtab,
-    yfL2Info_t   *l2info)
+static uint8_t
+yfFlowTimeoutProfile(
+    yfFlowTab_t        *flowtab,
+    const yfFlowKey_t  *key,
+    uint16_t            applabel)
 {
-    yfMPLSNode_t *mpls;
-    yfMPLSNode_t  key;
+    gpointer tprof;
 
-    memcpy(key.mpls_label, l2info->mpls_label, sizeof(uint32_t) * 3);
-
-    if ((mpls = g_hash_table_lookup(flowtab->table, &key))) {
-        flowtab->cur_mpls_node = mpls;
-        return mpls;
+    if (!flowtab->tprof_index) {
+        return 0;
     }
-
-    /* create new mpls node */
-    mpls = g_slice_new0(yfMPLSNode_t);
-
-    memcpy(mpls->mpls_label, l2info->mpls_label, sizeof(uint32_t) * 3);
-
-    mpls->tab = g_hash_table_new(flowtab->hashfn,
-                                 flowtab->hashequalfn);
-    flowtab->cur_mpls_node = mpls;
-
-    g_hash_table_insert(flowtab->table, mpls, mpls);
-
-    /* creation is 1, increment on #2 */
-    /*++(mpls->tab_count);*/
-
-    ++(flowtab->stats.stat_mpls_labels);
-    if (flowtab->stats.stat_mpls_labels > flowtab->stats.max_mpls_labels) {
-        flowtab->stats.max_mpls_labels = flowtab->stats.stat_mpls_labels;
+    if (applabel &&
+        (tprof = g_hash_table_lookup(flowtab->tprof_index,
+                                     yfFlowTimeoutKey(applabel, 0, 0))))
+    {
+        return GPOINTER_TO_UINT(tprof);
+    }
+    if (key->proto == YF_PROTO_TCP || key->proto == YF_PROTO_UDP) {
+        if ((tprof = g_hash_table_lookup(
+                 flowtab->tprof_index,
+                 yfFlowTimeoutKey(0, key->proto, key->dp))) ||
+            (tprof = g_hash_table_lookup(
+                 flowtab->tprof_index,
+                 yfFlowTimeoutKey(0, key->proto, key->sp))))
+        {
+            return GPOINTER_TO_UINT(tprof);
+        }
     }
+    tprof = g_hash_table_lookup(flowtab->tprof_index,
+                                yfFlowTimeoutKey(0, key->proto, 0));
 
-    return mpls;
+    return GPOINTER_TO_UINT(tprof);
 }
-#endif /* ifdef YAF_MPLS */
 
 
 /**
- * yfFlowGetNode
+ * yfFlowIdleMs
  *
- * finds a flow node entry in the flow table for
- * the appropriate key value given
+ * returns the idle timeout of a flow: that of its timeout profile, cut
+ * short for a TCP flow that has seen only a SYN or has seen a FIN.
  *
  */
-static yfFlowNode_t *
-yfFlowGetNode(
-    yfFlowTab_t  *flowtab,
-    yfFlowKey_t  *key,
-    yfFlowVal_t **valp)
+static inline uint64_t
+yfFlowIdleMs(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
 {
-    yfFlowKey_t   rkey;
-    yfFlowNode_t *fn;
-    GHashTable   *ht;
-
-#ifdef YAF_MPLS
-    if (flowtab->mpls_mode) {
-        ht = flowtab->cur_mpls_node->tab;
-    } else
-#endif  /* YAF_MPLS */
-    {
-        ht = flowtab->table;
-    }
-
-    /* Look for flow in table */
-    if ((fn = g_hash_table_lookup(ht, key))) {
-        /* Forward flow found. */
-        *valp = &(fn->f.val);
-        return fn;
-    }
+    uint64_t idle_ms = flowtab->tprofs[fn->tprof].idle_ms;
 
-    /* Okay. Check for reverse flow. */
-    yfFlowKeyReverse(key, &rkey);
-    if ((fn = g_hash_table_lookup(ht, &rkey))) {
-        /* Reverse flow found. */
-        *valp = &(fn->f.rval);
-        fn->f.rtos = key->tos;
-        return fn;
+    if (fn->f.key.proto != YF_PROTO_TCP) {
+        return idle_ms;
     }
-
-    /* Neither exists. Create a new flow and put it in the table. */
-#ifdef YAF_ENABLE_COMPACT_IP4
-    if (key->version == 4) {
-        fn = (yfFlowNode_t *)g_slice_new0(yfFlowNodeIPv4_t);
-    } else
-#endif  /* YAF_ENABLE_COMPACT_IP4 */
+    if (fn->state & YAF_STATE_FIN) {
+        if (flowtab->tcp_fin_ms && flowtab->tcp_fin_ms < idle_ms) {
+            return flowtab->tcp_fin_ms;
+        }
+    } else if (flowtab->tcp_syn_ms && flowtab->tcp_syn_ms < idle_ms &&
+               fn->f.rval.pkt == 0 && (fn->f.val.iflags & YF_TF_SYN) &&
+               !((fn->f.val.iflags | fn->f.val.uflags) & YF_TF_ACK))
     {
-        fn = g_slice_new0(yfFlowNode_t);
+        return flowtab->tcp_syn_ms;
     }
 
-    /* Copy key */
-    yfFlowKeyCopy(key, &(fn->f.key));
+    return idle_ms;
+}
 
-    /* set flow start time */
-    fn->f.stime = flowtab->ctime;
 
-    /* set flow end time as start time */
-    fn->f.etime = flowtab->ctime;
+/**
+ * yfFlowDeadline
+ *
+ * returns the time in milliseconds after which a flow expires, either
+ * by its idle timeout or by its active timeout, whichever comes first.
+ *
+ */
+static inline uint64_t
+yfFlowDeadline(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
+{
+    uint64_t idle = fn->f.etime + yfFlowIdleMs(flowtab, fn);
+    uint64_t active = fn->f.stime + flowtab->tprofs[fn->tprof].active_ms;
 
-    /* stuff the flow in the table */
-    g_hash_table_insert(ht, &(fn->f.key), fn);
+    return (active < idle) ? active : idle;
+}
 
-#ifdef YAF_MPLS
-    if (flowtab->mpls_mode) {
-        fn->f.mpls = flowtab->cur_mpls_node;
-        ++(flowtab->cur_mpls_node->tab_count);
-    }
-#endif  /* YAF_MPLS */
 
-    /* This is a forward flow */
-    *valp = &(fn->f.val);
+/**
+ * yfFlowWheelFile
+ *
+ * files an unlinked flow node on the expiry wheel by its current deadline.
+ * The slot is chosen by the highest bit group in which the expiry time
+ * differs from the wheel time; nodes that have already expired go on the
+ * due list.
+ *
+ */
+static void
+yfFlowWheelFile(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
+{
+    uint64_t when = yfFlowDeadline(flowtab, fn) + 1;
+    uint64_t now;
+    unsigned level;
 
-    /* Count it */
-    ++(flowtab->count);
-    if (flowtab->count > flowtab->stats.stat_peak) {
-        flowtab->stats.stat_peak = flowtab->count;
+    /* start the wheel at the time of the first flow */
+    if (!flowtab->wheel_time) {
+        flowtab->wheel_time = flowtab->ctime;
     }
+    now = flowtab->wheel_time;
 
-#ifdef YAF_ENABLE_HOOKS
-    /*Let the hook allocate its context */
-    yfHookFlowAlloc(&(fn->f), flowtab->yfctx);
-#endif
-
-
-#ifdef YAF_ENABLE_APPLABEL
-    ydAllocFlowContext(&(fn->f));
-#endif
+    if (when <= now) {
+        fn->wslot = YF_WHEEL_DUE;
+    } else {
+        level = (g_bit_storage(when ^ now) - 1) / YF_WHEEL_BITS;
+        if (level < YF_WHEEL_LEVELS) {
+            fn->wslot = ((level << YF_WHEEL_BITS) |
+                         ((when >> (level * YF_WHEEL_BITS)) & YF_WHEEL_MASK));
+        } else {
+            /* beyond the wheel; park in the last slot of the top level and
+             * refile when it comes around */
+            level = YF_WHEEL_LEVELS - 1;
+            fn->wslot = ((level << YF_WHEEL_BITS) |
+                         (((now >> (level * YF_WHEEL_BITS)) - 1) &
+                          YF_WHEEL_MASK));
+        }
+        ++(flowtab->wheel_count[level]);
+    }
 
-    /* All done */
-    return fn;
+    piqEnQ(&flowtab->wheel[fn->wslot], fn);
 }
 
+
 /**
- * yfRotatePcapMetaFile
+ * yfFlowWheelRemove
  *
- * rotate the pcap_meta_file
+ * unlinks a flow node from its expiry wheel slot.
  *
  */
-static gboolean
-yfRotatePcapMetaFile(
-    yfFlowTab_t  *flowtab)
+static void
+yfFlowWheelRemove(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
 {
-    GString *namebuf = g_string_new(NULL);
-
-    g_string_append_printf(namebuf, "%s", flowtab->pcap_meta_name);
-    air_time_g_string_append(namebuf, time(NULL), AIR_TIME_SQUISHED);
-    g_string_append_printf(namebuf, "_%05u.meta", pcap_meta_num);
-
-    /* close current pcap_meta file */
-    if (flowtab->pcap_meta) {
-        long cp = ftell(flowtab->pcap_meta);
-        fseek(flowtab->pcap_meta, flowtab->pcap_last_offset, SEEK_SET);
-        fprintf(flowtab->pcap_meta, "%" PRIu64 "|%010ld\n",
-                flowtab->pcap_last_time, cp);
-        if (fclose(flowtab->pcap_meta)) {
-            g_warning("Error (%d) Could not close current pcap "
-                      "meta file: %s", errno, strerror(errno));
-        }
-        g_debug("Rotating Pcap Meta File, opening %s", namebuf->str);
-    } else {
-        g_debug("Opening Pcap Meta File %s", namebuf->str);
+    piqPick(&flowtab->wheel[fn->wslot], fn);
+    if (fn->wslot != YF_WHEEL_DUE) {
+        --(flowtab->wheel_count[fn->wslot >> YF_WHEEL_BITS]);
     }
+}
 
-    flowtab->pcap_meta = fopen(namebuf->str, "w");
-    flowtab->pcap_last_offset = 0;
-    if (flowtab->pcap_meta == NULL) {
-        g_warning("Could not open new pcap meta file %s",
-                  namebuf->str);
-        g_warning("Error (%d): %s", errno, strerror(errno));
-        g_string_free(namebuf, TRUE);
-        return FALSE;
-    }
 
-    if (flowtab->ctime) {
-        fprintf(flowtab->pcap_meta, "%" PRIu64 "|0000000000\n", flowtab->ctime);
-        flowtab->pcap_last_time = flowtab->ctime;
-    }
+/**
+ * yfFlowWheelRefileSlot
+ *
+ * refiles every node in a wheel slot against the current wheel time.
+ * Packets only move a flow's end time forward, so a node may sit in a
+ * slot earlier than its real deadline; this is where it catches up.
+ *
+ */
+static void
+yfFlowWheelRefileSlot(
+    yfFlowTab_t  *flowtab,
+    uint32_t      slot)
+{
+    yfFlowNode_t *fn;
 
-    g_string_free(namebuf, TRUE);
-    pcap_meta_num++;
-    return TRUE;
+    while ((fn = piqDeQ(&flowtab->wheel[slot]))) {
+        --(flowtab->wheel_count[slot >> YF_WHEEL_BITS]);
+        yfFlowWheelFile(flowtab, fn);
+    }
 }
 
 
 /**
- * yfUpdateRollingPcapFile
- *
- * update the rolling pcap filename in the flowtab for meta output
+ * yfFlowWheelAdvance
  *
+ * advances the expiry wheel to `ctime`, cascading coarse slots down as
+ * their time arrives and moving expired nodes to the due list.  Runs of
+ * empty slots are skipped.
  *
  */
-void
-yfUpdateRollingPcapFile(
+static void
+yfFlowWheelAdvance(
     yfFlowTab_t  *flowtab,
-    char         *new_file_name)
+    uint64_t      ctime)
 {
-    if (flowtab->pcap_roll) {
-        g_string_printf(flowtab->pcap_roll, "%s", new_file_name);
-    }
+    uint64_t now;
+    unsigned level;
+    uint32_t idx;
+
+    while (flowtab->wheel_time < ctime) {
+        /* find the finest level with anything on it */
+        for (level = 0; level < YF_WHEEL_LEVELS; level++) {
+            if (flowtab->wheel_count[level]) {
+                break;
+            }
+        }
+        if (level == YF_WHEEL_LEVELS) {
+            flowtab->wheel_time = ctime;
+            break;
+        }
+        if (level > 0) {
+            /* nothing happens until that level's next slot comes up */
+            now = flowtab->wheel_time |
+                ((G_GUINT64_CONSTANT(1) << (level * YF_WHEEL_BITS)) - 1);
+            if (now >= ctime) {
+                flowtab->wheel_time = ctime;
+                break;
+            }
+            flowtab->wheel_time = now;
+        }
 
-    flowtab->pcap_file_no++;
+        now = ++(flowtab->wheel_time);
 
-    /* every 10 rolling pcaps change over the pcap meta file */
-    if (flowtab->pcap_meta_name && flowtab->stats.stat_packets) {
-        if (pcap_meta_read == -1) {
-            if ((flowtab->stats.stat_packets % YAF_PCAP_META_ROTATE) == 0) {
-                yfRotatePcapMetaFile(flowtab);
-            }
-        } else if ((flowtab->stats.stat_packets % YAF_PCAP_META_ROTATE_FP) ==
-                   0)
+        /* cascade coarser levels whose slot boundary this is */
+        for (level = 1;
+             level < YF_WHEEL_LEVELS &&
+             !(now & ((G_GUINT64_CONSTANT(1) << (level * YF_WHEEL_BITS)) - 1));
+             level++)
         {
-            yfRotatePcapMetaFile(flowtab);
+            idx = (now >> (level * YF_WHEEL_BITS)) & YF_WHEEL_MASK;
+            yfFlowWheelRefileSlot(flowtab, (level << YF_WHEEL_BITS) | idx);
         }
+
+        /* expire this millisecond */
+        yfFlowWheelRefileSlot(flowtab, now & YF_WHEEL_MASK);
     }
 }
 
 
 /**
- * yfWritePcap
+ * yfFlowWheelSlotAt
  *
- * write pcap to pcap-per-flow pcap file
+ * returns the `i`th wheel slot in expiry order, starting with the due
+ * list, for `i` from 0 through YF_WHEEL_DUE.  Within a slot the tail is
+ * the node filed earliest.
  *
- * @param flowtab
- * @param flow
- * @param key
- * @param pbuf
  */
-static void
-yfWritePcap(
+static uint32_t
+yfFlowWheelSlotAt(
     yfFlowTab_t  *flowtab,
-    yfFlow_t     *flow,
-    yfFlowKey_t  *key,
-    yfPBuf_t     *pbuf)
+    uint32_t      i)
 {
-    GString      *namebuf;
-    gboolean      fexists = FALSE;
-    yfFlowNode_t *node;
-    FILE         *pfile = NULL;
-    uint32_t      rem_ms;
-
-    if (flowtab->pcap_search_flowkey) {
-        if (flowtab->hashfn(key) == flowtab->pcap_search_flowkey) {
-            if (flowtab->pcap_search_stime) {
-                if (flow->stime != flowtab->pcap_search_stime) {
-                    return;
-                }
-            }
-        } else {
-            return;
-        }
+    unsigned level;
+    uint32_t cur;
 
-        if (flow->pcap == NULL) {
-            if (g_file_test(flowtab->pcap_dir, G_FILE_TEST_EXISTS)) {
-                pfile = fopen(flowtab->pcap_dir, "ab");
-                if (pfile == NULL) {
-                    g_warning("Pcap Create File Error: %s",
-                              pcap_geterr((pcap_t *)pbuf->pcapt));
-                    return;
-                }
-                /* need to append to pcap - libpcap doesn't have an append fn*/
-                flow->pcap = (pcap_dumper_t *)pfile;
-            } else {
-                flow->pcap = pcap_dump_open(pbuf->pcapt, flowtab->pcap_dir);
-            }
-            if (flow->pcap == NULL) {
-                g_warning("Pcap Create File Error: %s",
-                          pcap_geterr((pcap_t *)pbuf->pcapt));
-                return;
-            }
-        }
+    if (i == 0) {
+        return YF_WHEEL_DUE;
     }
+    --i;
+    level = i >> YF_WHEEL_BITS;
+    cur = (flowtab->wheel_time >> (level * YF_WHEEL_BITS)) & YF_WHEEL_MASK;
 
-    if (flow->pcap == NULL) {
-        namebuf = g_string_new(NULL);
-        rem_ms = (flow->stime % 1000);
-        rem_ms = (rem_ms > 1000) ? (rem_ms / 10) : rem_ms;
-        g_string_append_printf(namebuf, "%s/%03u", flowtab->pcap_dir,
-                               rem_ms);
-        g_mkdir(namebuf->str, 0777);
-        g_string_append_printf(namebuf, "/%u-", flowtab->hashfn(key));
-        air_time_g_string_append(namebuf, (flow->stime / 1000),
-                                 AIR_TIME_SQUISHED);
-        g_string_append_printf(namebuf, "_%d.pcap", flow->pcap_serial);
-        if (g_file_test(namebuf->str, G_FILE_TEST_EXISTS)) {
-            fexists = TRUE;
-            pfile = fopen(namebuf->str, "ab");
-            if (pfile == NULL) {
-                goto err;
-            }
-            /* need to append to pcap - libpcap doesn't have an append fn*/
-            flow->pcap = (pcap_dumper_t *)pfile;
-        } else {
-            flow->pcap = pcap_dump_open(pbuf->pcapt, namebuf->str);
-        }
+    return ((level << YF_WHEEL_BITS) |
+            ((cur + 1 + (i & YF_WHEEL_MASK)) & YF_WHEEL_MASK));
+}
 
-        if (flow->pcap == NULL) {
-            goto err;
-        }
 
-        g_string_free(namebuf, TRUE);
-    } else if (flowtab->pcap_maxfile) {
-        pfile = pcap_dump_file(flow->pcap);
+#ifdef YAF_ENABLE_APPLABEL
+/**
+ * yfFlowLabelApp
+ *
+ * when closing a flow out, if applabel is enabled, send
+ * the flow payload through the labeling mechanism in order
+ * to identify the protocol via payload inspection
+ *
+ * @param flowtab pointer to the flow table
+ * @param fn pointer to the flow node entry in the table
+ *
+ */
+static void
+yfFlowLabelApp(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
+{
+    /* If the app labeler is enabled, let it inspect the packet
+     * (for UDP & TCP packets anyway) */
+    if (flowtab->applabelmode == TRUE &&
+        ((fn->f.key.proto == 6) || (fn->f.key.proto == 17)))
+    {
+        ydScanFlow(&(fn->f));
+    } else {
+        fn->f.appLabel = 0;
+    }
+}
+#endif /* ifdef YAF_ENABLE_APPLABEL */
 
-        if ((ftell(pfile) > (long)flowtab->pcap_maxfile)) {
-            pcap_dump_flush(flow->pcap);
-            pcap_dump_close(flow->pcap);
-            flow->pcap_serial += 1;
-            namebuf = g_string_new(NULL);
-            rem_ms = (flow->stime % 1000);
-            rem_ms = (rem_ms > 1000) ? (rem_ms / 10) : rem_ms;
-            g_string_append_printf(namebuf, "%s/%03u", flowtab->pcap_dir,
-                                   rem_ms);
-            g_string_append_printf(namebuf, "/%u-", flowtab->hashfn(key));
-            air_time_g_string_append(namebuf, (flow->stime / 1000),
-                                     AIR_TIME_SQUISHED);
-            g_string_append_printf(namebuf, "_%d.pcap", flow->pcap_serial);
-            flow->pcap = pcap_dump_open(pbuf->pcapt, namebuf->str);
 
-            if (flow->pcap == NULL) {
-                goto err;
+#ifdef YAF_ENABLE_ENTROPY
+/**
+ * yfFlowDoEntropy
+ *
+ * when closing a flow and entropy calculation is enabled,
+ * call this calculation to calculate the Shannon entropy
+ * on the data stream
+ *
+ * @param flowtab pointer to the flow table
+ * @param fn pointer to the flow node entry in the table
+ *
+ */
+static void
+yfFlowDoEntropy(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
+{
+    yfFlowVal_t *val;
+    uint32_t entropyDist[256];
+    double   entropyScratch;
+    double   logPaylen;
+    uint32_t loop;
+    int      fwd_rev;
+
+    /* if entropy is enabled, then we need to calculate it */
+    /* FIXME deglobalize */
+    if (!flowtab->entropymode) {
+        fn->f.val.entropy = 0;
+        fn->f.rval.entropy = 0;
+        return;
+    }
+
+    /*
+     *  First loop through each octet of payload and increment the
+     *  entropyDist[] bin that corresponds to the octet.
+     *
+     *  Next compute the sum of these values across every bin:
+     *
+     *   ( bin[i] / SUM(bin[]) ) * log2( bin[i] / SUM(bin[]) )
+     *
+     *  where SUM(bin[]) is the payload length.  Using the properties of
+     *  logarithms: this can be changed to
+     *
+     *   SUM( ( bin[i] / paylen ) * ( log2(bin[i]) - log2(paylen) ) )
+     *
+     *  The division by paylen can be pulled outside the SUM():
+     *
+     *   SUM( bin[i] * ( log2(bin[i]) - log2(paylen) ) ) / paylen
+     *
+     *  Moving "/paylen" outside SUM() may affect result slightly: in testing,
+     *  of 364,385 entropy values computed in the data set, one value changed
+     *  from 103 to 104.
+     *
+     *  Finally, change the sign of the result, divide by 8 (bits per byte)
+     *  and multiply by 256 (to give a value in range 0 to 255).  This is
+     *  equivalent to:
+     *
+     *   -32.0 * SUM ( bin[i] * ( log2(bin[i]) - log2(paylen) ) ) / paylen
+     */
+
+    for (fwd_rev = 0; fwd_rev < 2; ++fwd_rev) {
+        val = ((0 == fwd_rev) ? &fn->f.val : &fn->f.rval);
+
+        if (val->paylen <= 1) {
+            val->entropy = 0;
+        } else {
+            logPaylen = log2((double)val->paylen);
+            entropyScratch = 0.0;
+            memset(entropyDist, 0, sizeof(entropyDist));
+            for (loop = 0; loop < val->paylen; loop++) {
+                entropyDist[val->payload[loop]]++;
             }
-            g_string_free(namebuf, TRUE);
+            for (loop = 0; loop < 256; loop++) {
+                if (entropyDist[loop] > 0) {
+                    entropyScratch +=
+                        ((double)entropyDist[loop] *
+                         (log2((double)entropyDist[loop]) - logPaylen));
+                }
+            }
+            val->entropy = (uint8_t)(entropyScratch * -32.0
+                                     / (double)val->paylen);
         }
     }
+}
 
-    pcap_dump((u_char *)flow->pcap, &(pbuf->pcap_hdr), pbuf->payload);
-    return;
-
-  err:
 
-    /* close pcap files for stale flows */
+#endif /* ifdef YAF_ENABLE_ENTROPY */
 
-    node = flowtab->aq.tail;
-    /* go until we have closed 1 */
-    while (node) {
-        if (node->f.pcap) {
-            pcap_dump_flush(node->f.pcap);
-            pcap_dump_close(node->f.pcap);
-            node->f.pcap = NULL;
-            break;
-        }
-        node = node->n;
+/**
+ * yfFlowClose
+ *
+ * close a flow and remove it from the active list, it will get flushed
+ * out based on another timer; record the reason for closing the flow:
+ * (time out, session end, etc.)
+ *
+ * @param flowtab pointer to the flow table
+ * @param fn pointer to the flow node entry in the flow table
+ * @param reason reason code for closing the flow
+ *
+ */
+static void
+yfFlowClose(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn,
+    uint8_t        reason)
+{
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        yfFlowIndexRemove(fn->f.cold->mpls->tab, fn);
+    } else
+#endif
+    {
+        /* remove flow from table */
+        yfFlowIndexRemove(flowtab->table, fn);
     }
 
-    /* if the file exists - use fopen */
-    if (fexists) {
-        pfile = fopen(namebuf->str, "ab");
-        if (pfile == NULL) {
-            g_string_free(namebuf, TRUE);
-            return;
-        }
-        flow->pcap = (pcap_dumper_t *)pfile;
-    } else {
-        flow->pcap = pcap_dump_open(pbuf->pcapt, namebuf->str);
+    /* store closure reason */
+    fn->f.reason &= ~YAF_END_MASK;
+    fn->f.reason |= reason;
+
+    /* remove flow from the expiry wheel */
+    yfFlowWheelRemove(flowtab, fn);
+
+    /* move flow node to close queue */
+    piqEnQ(&flowtab->cq, fn);
+
+#ifdef YAF_ENABLE_PAYLOAD
+
+#ifdef YAF_ENABLE_APPLABEL
+    /* do application label processing if necessary */
+    if (flowtab->applabelmode) {
+        yfFlowLabelApp(flowtab, fn);
     }
+#endif /* ifdef YAF_ENABLE_APPLABEL */
 
-    if (flow->pcap == NULL) {
-        g_warning("Pcap-per-flow Create File Error: %s",
-                  pcap_geterr((pcap_t *)pbuf->pcapt));
-        g_string_free(namebuf, TRUE);
-        return;
+#ifdef YAF_ENABLE_ENTROPY
+    /* do entropy calculation if necessary */
+    if (flowtab->entropymode) {
+        yfFlowDoEntropy(flowtab, fn);
     }
+#endif /* ifdef YAF_ENABLE_ENTROPY */
 
-    g_string_free(namebuf, TRUE);
-    pcap_dump((u_char *)flow->pcap, &(pbuf->pcap_hdr), pbuf->payload);
+#ifdef YAF_ENABLE_HOOKS
+    yfHookFlowClose(&(fn->f));
+#endif
+
+#endif /* ifdef YAF_ENABLE_PAYLOAD */
+
+    /** count the flow in the close queue */
+    ++(flowtab->cq_count);
+
+    /* count the flow as inactive */
+    --(flowtab->count);
+
+    if (flowtab->pcap_dir) {
+        if (fn->f.cold && fn->f.cold->pcap) {
+            pcap_dump_flush(fn->f.cold->pcap);
+            pcap_dump_close(fn->f.cold->pcap);
+        }
+    }
 }
 
 
+#ifdef YAF_ENABLE_PAYLOAD
 /**
- * yfWritePcapMetaIndex
+ * yfActiveFlowCleanUp
  *
+ * clear out payload length to make way
+ * for next packet payload
  *
  */
 static void
-yfWritePcapMetaIndex(
-    yfFlowTab_t  *flowtab,
-    gboolean      packets)
+yfActiveFlowCleanUp(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
 {
-    long     cp;
-    uint64_t count;
-    int      rotate = 10000;
-
-    if (packets) {
-        count = flowtab->stats.stat_packets;
-    } else {
-        count = flowtab->stats.stat_flows;
-        rotate = 5000;
-    }
+    fn->f.val.paylen = 0;
+    fn->f.rval.paylen = 0;
+}
 
-    if (flowtab->stats.stat_packets == 1) {
-        fprintf(flowtab->pcap_meta, "%" PRIu64 "|0000000000\n", flowtab->ctime);
-        flowtab->pcap_last_time = flowtab->ctime;
-    }
 
-    if (!count) {
-        return;
+#endif /* ifdef YAF_ENABLE_PAYLOAD */
+/**
+ * yfCloseActiveFlow
+ *
+ * close a flow and write it but keep it active
+ * mainly for udp-uniflow option.
+ *
+ * @param flowtab pointer to the flow table
+ * @param fn pointer to the flow node entry in the flow table
+ * @param reason reason code for closing the flow
+ *
+ */
+static void
+yfCloseActiveFlow(
+    yfFlowTab_t    *flowtab,
+    yfFlowNode_t   *fn,
+    yfFlowVal_t    *val,
+    const uint8_t  *pkt,
+    uint32_t        paylen,
+    uint8_t         reason,
+    uint32_t        iplen)
+{
+    yfFlowNode_t *tfn;  /*temp flow to write*/
+    yfFlowVal_t  *valtemp;
+
+#ifdef YAF_ENABLE_COMPACT_IP4
+    if (fn->f.key.version == 4) {
+        tfn = slbAlloc0(flowtab->slab, SLB_FLOW, YF_FLOWNODE_IPV4_SIZE);
+        memcpy(tfn, fn, YF_FLOWNODE_IPV4_SIZE);
+    } else
+#endif /* ifdef YAF_ENABLE_COMPACT_IP4 */
+    {
+        tfn = slbAlloc0(flowtab->slab, SLB_FLOW, sizeof(yfFlowNode_t));
+        memcpy(tfn, fn, sizeof(yfFlowNode_t));
+    }
+
+    /* the copy is not on the expiry wheel */
+    tfn->p = NULL;
+    tfn->n = NULL;
+
+    /* nor does it share the cold state */
+    if (fn->f.cold) {
+        tfn->f.cold = NULL;
+        memcpy(yfFlowCold(flowtab, &(tfn->f)), fn->f.cold,
+               sizeof(yfFlowCold_t));
+    }
+
+    if (&(fn->f.rval) == val) {
+        yfFlowKeyReverse(&(fn->f.key), &(tfn->f.key));
+        memcpy(&(tfn->f.val), val, sizeof(yfFlowVal_t));
+        tfn->f.key.tos = fn->f.rtos;
+    }
+
+    /*"Uniflow"*/
+    memset(&(tfn->f.rval), 0, sizeof(yfFlowVal_t));
+
+    /* Since we are creating a new node - we need to allocate
+     * hooks context for it */
+#ifdef YAF_ENABLE_HOOKS
+    /*Let the hook allocate its context */
+    yfHookFlowAlloc(&(tfn->f), flowtab->yfctx);
+#endif
+
+#ifdef YAF_ENABLE_APPLABEL
+    /* unless the flow it continues was created without one */
+    if (fn->f.dpictx) {
+        ydAllocFlowContext(&(tfn->f), flowtab->slab);
+    }
+#endif
+
+    tfn->f.rdtime = 0;
+    tfn->f.val.pkt = 1;
+
+    /* octet count of only this flow! */
+    tfn->f.val.oct = iplen;
+
+    /*Update start time of this flow - to now*/
+    tfn->f.stime = flowtab->ctime;
+
+    /* store closure reason - shouldn't have any other bits turned on */
+    tfn->f.reason &= ~YAF_END_MASK;
+    tfn->f.reason |= reason;
+
+    tfn->n = NULL;
+    tfn->p = NULL;
+    valtemp = &(tfn->f.val);
+    valtemp->stats = NULL;
+#ifdef YAF_ENABLE_PAYLOAD
+    valtemp->payload = NULL;
+
+    /* Short-circuit no payload capture */
+    if (tfn->paymax && paylen && pkt) {
+        valtemp->payload = slbAlloc0(flowtab->slab, SLB_PAYLOAD,
+                                     tfn->paymax);
+
+        /* truncate capture length to payload limit */
+        if (paylen > tfn->paymax) {
+            paylen = tfn->paymax;
+        }
+
+        /* only need 1 entry in paybounds */
+        valtemp->paybounds = (size_t *)slbAlloc0(
+            flowtab->slab, SLB_PAYLOAD, sizeof(size_t) * YAF_MAX_PKT_BOUNDARY);
+        valtemp->paybounds[0] = paylen;
+
+        memcpy(valtemp->payload, pkt, paylen);
+        tfn->f.val.paylen = paylen;
+    }
+#endif /* ifdef YAF_ENABLE_PAYLOAD */
+    /* move flow node to close queue */
+    piqEnQ(&flowtab->cq, tfn);
+
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        /* Since yfFlowFree frees UDP uniflows, but they're never
+         * added to the mpls tables - we add one here, to account
+         * for subtracting it in yfflowfree */
+        ++(fn->f.cold->mpls->tab_count);
+    }
+#endif  /* YAF_MPLS */
+
+    ++(flowtab->cq_count);
+
+#ifdef YAF_ENABLE_PAYLOAD
+
+#ifdef YAF_ENABLE_APPLABEL
+    /* do application label processing if necessary */
+    tfn->f.appLabel = 0;
+    if (flowtab->applabelmode) {
+        yfFlowLabelApp(flowtab, tfn);
+    }
+
+    if (tfn->f.appLabel) {
+        /* store in ongoing flow; a new label may change its timeouts */
+        if (fn->f.appLabel != tfn->f.appLabel) {
+            fn->tprof = yfFlowTimeoutProfile(flowtab, &(fn->f.key),
+                                             tfn->f.appLabel);
+            yfFlowWheelRemove(flowtab, fn);
+            yfFlowWheelFile(flowtab, fn);
+        }
+        fn->f.appLabel = tfn->f.appLabel;
+    }
+#endif /* ifdef YAF_ENABLE_APPLABEL */
+
+#ifdef YAF_ENABLE_ENTROPY
+    /* do entropy calculation if necessary */
+    if (flowtab->entropymode) {
+        yfFlowDoEntropy(flowtab, tfn);
+    }
+#endif /* ifdef YAF_ENABLE_ENTROPY */
+
+#ifdef YAF_ENABLE_HOOKS
+    yfHookFlowClose(&(tfn->f));
+#endif
+
+    yfActiveFlowCleanUp(flowtab, fn);
+#endif /* ifdef YAF_ENABLE_PAYLOAD */
+}
+
+
+#ifdef YAF_ENABLE_NDPI
+/*  Define malloc and free functions to pass into ndpi.  */
+/*  FIXME: I do not think these are needed since recent versions of g_malloc()
+ *  use malloc().  */
+static void *
+yf_ndpi_malloc(
+    unsigned long   size)
+{
+    return g_malloc(size);
+}
+
+static void
+yf_ndpi_free(
+    void  *mem)
+{
+    g_free(mem);
+}
+#endif /* YAF_ENABLE_NDPI */
+
+
+/**
+ * yfFlowTimeoutRulesLoad
+ *
+ * sets up the timeout profiles of a flow table: profile 0 from its own
+ * timeouts, and one per timeout rule, indexed by what the rule matches.
+ *
+ * @param flowtab pointer to the flow table
+ * @param rules array of yfFlowTimeoutRule_t, or NULL
+ *
+ */
+static void
+yfFlowTimeoutRulesLoad(
+    yfFlowTab_t   *flowtab,
+    const GArray  *rules)
+{
+    const yfFlowTimeoutRule_t *rule;
+    guint count = (rules) ? MIN(rules->len, UINT8_MAX) : 0;
+    guint i;
+
+    flowtab->tprofs = g_new0(yfFlowTimeout_t, count + 1);
+    flowtab->tprofs[0].idle_ms = flowtab->idle_ms;
+    flowtab->tprofs[0].active_ms = flowtab->active_ms;
+    if (!count) {
+        return;
+    }
+    if (rules->len > count) {
+        g_warning("Using the first %u of %u timeout rules", count,
+                  rules->len);
+    }
+
+    flowtab->tprof_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < count; i++) {
+        rule = &g_array_index(rules, yfFlowTimeoutRule_t, i);
+        flowtab->tprofs[i + 1].idle_ms =
+            (rule->idle_ms) ? rule->idle_ms : flowtab->idle_ms;
+        flowtab->tprofs[i + 1].active_ms =
+            (rule->active_ms) ? rule->active_ms : flowtab->active_ms;
+        /* the first rule for a match wins */
+        if (!g_hash_table_lookup(flowtab->tprof_index,
+                                 yfFlowTimeoutKey(rule->applabel,
+                                                  rule->proto, rule->port)))
+        {
+            g_hash_table_insert(flowtab->tprof_index,
+                                yfFlowTimeoutKey(rule->applabel,
+                                                 rule->proto, rule->port),
+                                GUINT_TO_POINTER(i + 1));
+        }
+    }
+}
+
+
+/**
+ * yfFlowTabAlloc
+ *
+ * allocate (preferably from the slab allocator) another entry
+ * into the flow table for a new flow
+ *
+ *
+ * @return a pointer to the flow node entry in the flow table
+ */
+yfFlowTab_t *
+yfFlowTabAlloc(
+    const yfFlowTabConfig_t  *ftconfig,
+    void                    **yfctx)
+{
+    yfFlowTab_t *flowtab = g_slice_new0(yfFlowTab_t);
+
+    /* Copy the configuration */
+    flowtab->idle_ms = ftconfig->idle_ms;
+    flowtab->active_ms = ftconfig->active_ms;
+    flowtab->tcp_syn_ms = ftconfig->tcp_syn_ms;
+    flowtab->tcp_fin_ms = ftconfig->tcp_fin_ms;
+    yfFlowTimeoutRulesLoad(flowtab, ftconfig->timeout_rules);
+    flowtab->max_flows = ftconfig->max_flows;
+    flowtab->max_payload = ftconfig->max_payload;
+    flowtab->max_memory = ftconfig->max_memory;
+    flowtab->mem_shrink = flowtab->max_memory / 100 * YF_MEM_SHRINK_PCT;
+    flowtab->mem_nodpi = flowtab->max_memory / 100 * YF_MEM_NODPI_PCT;
+    flowtab->mem_evict = flowtab->max_memory / 100 * YF_MEM_EVICT_PCT;
+    flowtab->mem_target = flowtab->max_memory / 100 * YF_MEM_TARGET_PCT;
+
+    flowtab->applabelmode = ftconfig->applabel_mode;
+    flowtab->entropymode = ftconfig->entropy_mode;
+    flowtab->flowstats_mode = ftconfig->flowstats_mode;
+    flowtab->force_read_all = ftconfig->force_read_all;
+    flowtab->fpexport_mode = ftconfig->fpexport_mode;
+    flowtab->macmode = ftconfig->mac_mode;
+    flowtab->mpls_mode = ftconfig->mpls_mode;
+    flowtab->p0f_mode = ftconfig->p0f_mode;
+    flowtab->pcap_index = ftconfig->pcap_index;
+    flowtab->silkmode = ftconfig->silk_mode;
+    flowtab->udp_multipkt_payload = ftconfig->udp_multipkt_payload;
+    flowtab->uniflow = ftconfig->uniflow_mode;
+
+    flowtab->udp_uniflow_port = ftconfig->udp_uniflow_port;
+
+    flowtab->slab = slbArenaAlloc(ftconfig->hugepages);
+
+#ifdef YAF_ENABLE_HOOKS
+    flowtab->yfctx = yfctx;
+#endif
+
+    if (ftconfig->pcap_per_flow) {
+        flowtab->pcap_dir = g_strdup(ftconfig->pcap_dir);
+    } else if (ftconfig->pcap_dir) {
+        flowtab->pcap_roll = g_string_new(NULL);
+    } else if (ftconfig->pcap_meta_file && flowtab->pcap_index) {
+        pcap_meta_read = -1;
+    } else if (ftconfig->pcap_meta_file) {
+        flowtab->pcap_roll = g_string_new(NULL);
+    }
+
+    if (ftconfig->pcap_meta_file) {
+        if ((strlen(ftconfig->pcap_meta_file) == 1) &&
+            ftconfig->pcap_meta_file[0] == '-')
+        {
+            flowtab->pcap_meta = stdout;
+        } else {
+            flowtab->pcap_meta_name = g_strdup(ftconfig->pcap_meta_file);
+            yfRotatePcapMetaFile(flowtab);
+        }
+    }
+    flowtab->pcap_maxfile = ftconfig->pcap_maxfile;
+
+    if (ftconfig->pcap_flowkey) {
+        flowtab->pcap_search_flowkey =
+            strtoull(ftconfig->pcap_flowkey, NULL, 10);
+    }
+
+    if (ftconfig->pcap_stime) {
+        flowtab->pcap_search_stime = strtoull(ftconfig->pcap_stime, NULL, 10);
+    }
+
+    /* key the flow index hash; shared by every flow table so that
+     * balancers and all tables agree */
+    if (!yf_flow_hash_keyed) {
+        yf_flow_hash_key[0] = ((uint64_t)g_random_int() << 32) |
+            g_random_int();
+        yf_flow_hash_key[1] = ((uint64_t)g_random_int() << 32) |
+            g_random_int();
+        yf_flow_hash_keyed = TRUE;
+    }
+
+    flowtab->no_vlan_in_key = ftconfig->no_vlan_in_key;
+    if (ftconfig->no_vlan_in_key) {
+        flowtab->hashfn = (GHashFunc)yfFlowKeyHashNoVlan;
+    } else {
+        flowtab->hashfn = (GHashFunc)yfFlowKeyHash;
+    }
+
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        flowtab->mpls_table = g_hash_table_new((GHashFunc)yfMPLSHash,
+                                               (GEqualFunc)yfMPLSEqual);
+    } else
+#endif /* ifdef YAF_MPLS */
+    {
+        flowtab->table = yfFlowIndexAlloc(flowtab->max_flows,
+                                          flowtab->no_vlan_in_key);
+    }
+
+    /* the pre-flow table keeps only what a flow takes from a packet with
+     * no payload, so it cannot be used when anything else wants to see
+     * the first packet of every flow; yaf warns about that when parsing
+     * its options */
+    if (ftconfig->preflow_size) {
+        gboolean preflow = (flowtab->table && flowtab->idle_ms &&
+                            !flowtab->force_read_all &&
+                            !flowtab->p0f_mode && !flowtab->fpexport_mode &&
+                            !flowtab->pcap_dir && !flowtab->pcap_roll &&
+                            !flowtab->pcap_meta);
+        size_t   buckets = 1;
+
+#ifdef YAF_ENABLE_HOOKS
+        if (yfHookCount()) {
+            preflow = FALSE;
+        }
+#endif
+        if (preflow) {
+            while (buckets * YF_PREFLOW_WAYS < ftconfig->preflow_size) {
+                buckets <<= 1;
+            }
+            flowtab->preflow = g_new0(yfPreFlow_t, buckets * YF_PREFLOW_WAYS);
+            flowtab->preflow_mask = buckets - 1;
+        }
+    }
+
+#ifdef YAF_ENABLE_HOOKS
+    yfHookValidateFlowTab(flowtab->yfctx, flowtab->max_payload,
+                          flowtab->uniflow, flowtab->silkmode,
+                          flowtab->applabelmode, flowtab->entropymode,
+                          flowtab->p0f_mode,
+                          flowtab->fpexport_mode,
+                          flowtab->udp_multipkt_payload,
+                          flowtab->udp_uniflow_port);
+#endif /* ifdef YAF_ENABLE_HOOKS */
+
+#ifdef YAF_ENABLE_NDPI
+    if (ftconfig->ndpi) {
+        NDPI_PROTOCOL_BITMASK all;
+        set_ndpi_malloc(yf_ndpi_malloc);
+        set_ndpi_free(yf_ndpi_free);
+        flowtab->ndpi_struct = ndpi_init_detection_module();
+        if (flowtab->ndpi_struct == NULL) {
+            g_warning("Could not initialize NDPI");
+            return NULL;
+        }
+
+        NDPI_BITMASK_SET_ALL(all);
+        ndpi_set_protocol_detection_bitmask2(flowtab->ndpi_struct, &all);
+
+        if (ftconfig->ndpi_proto_file) {
+            ndpi_load_protocols_file(flowtab->ndpi_struct,
+                                     ftconfig->ndpi_proto_file);
+        }
+    }
+#endif /* ifdef YAF_ENABLE_NDPI */
+
+    /* Done */
+    return flowtab;
+}
+
+
+/**
+ * yfFlowTabFree
+ *
+ * free's the entry in the flow table for a given flow entry *
+ */
+void
+yfFlowTabFree(
+    yfFlowTab_t  *flowtab)
+{
+    yfFlowNode_t *fn = NULL, *nfn = NULL;
+    uint32_t      slot;
+
+    /* free the flows the export thread handed back; it must be stopped */
+    yfFlowExportReclaim(flowtab);
+    if (flowtab->exdone) {
+        lfqFree(flowtab->exdone);
+    }
+
+    /* zip through the close queue freeing flows */
+    for (fn = flowtab->cq.head; fn; fn = nfn) {
+        nfn = fn->p;
+        yfFlowFree(flowtab, fn);
+    }
+
+    /* now do the same with every slot of the expiry wheel */
+    for (slot = 0; slot <= YF_WHEEL_DUE; slot++) {
+        for (fn = flowtab->wheel[slot].head; fn; fn = nfn) {
+            nfn = fn->p;
+            yfFlowFree(flowtab, fn);
+        }
+    }
+
+    /* Free GString */
+    if (flowtab->pcap_roll) {
+        g_string_free(flowtab->pcap_roll, TRUE);
+    }
+
+    if (flowtab->pcap_meta) {
+        long cp = ftell(flowtab->pcap_meta);
+        fseek(flowtab->pcap_meta, flowtab->pcap_last_offset, SEEK_SET);
+        fprintf(flowtab->pcap_meta, "%" PRIu64 "|%010ld\n",
+                flowtab->pcap_last_time, cp);
+        fclose(flowtab->pcap_meta);
+    }
+
+    /* free the key index table */
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        g_hash_table_destroy(flowtab->mpls_table);
+    } else
+#endif /* ifdef YAF_MPLS */
+    {
+        yfFlowIndexFree(flowtab->table);
+    }
+    g_free(flowtab->preflow);
+
+    g_free(flowtab->tprofs);
+    if (flowtab->tprof_index) {
+        g_hash_table_destroy(flowtab->tprof_index);
+    }
+
+#ifdef YAF_ENABLE_NDPI
+    ndpi_exit_detection_module(flowtab->ndpi_struct);
+#endif
+
+    /* the flows are all gone; release their memory to the system */
+    slbArenaFree(flowtab->slab);
+
+    /* now free the flow table */
+    g_slice_free(yfFlowTab_t, flowtab);
+}
+
+
+#ifdef YAF_MPLS
+/**
+ * yfMPLSGetNode
+ *
+ *  Finds an MPLS node entry in the MPLS table
+ *  based on the labels in the MPLS header,
+ *  creating it if needed, and updates
+ *  `cur_mpls_node` on `flowtab`.
+ */
+static yfMPLSNode_t *
+yfMPLSGetNode(
+    yfFlowTab_t  *flowtab,
+    yfL2Info_t   *l2info)
+{
+    yfMPLSNode_t *mpls;
+    yfMPLSNode_t  key;
+
+    memcpy(key.mpls_label, l2info->mpls_label, sizeof(uint32_t) * 3);
+
+    if ((mpls = g_hash_table_lookup(flowtab->mpls_table, &key))) {
+        flowtab->cur_mpls_node = mpls;
+        return mpls;
+    }
+
+    /* create new mpls node */
+    mpls = g_slice_new0(yfMPLSNode_t);
+
+    memcpy(mpls->mpls_label, l2info->mpls_label, sizeof(uint32_t) * 3);
+
+    mpls->tab = yfFlowIndexAlloc(0, flowtab->no_vlan_in_key);
+    flowtab->cur_mpls_node = mpls;
+
+    g_hash_table_insert(flowtab->mpls_table, mpls, mpls);
+
+    /* creation is 1, increment on #2 */
+    /*++(mpls->tab_count);*/
+
+    ++(flowtab->stats.stat_mpls_labels);
+    if (flowtab->stats.stat_mpls_labels > flowtab->stats.max_mpls_labels) {
+        flowtab->stats.max_mpls_labels = flowtab->stats.stat_mpls_labels;
+    }
+
+    return mpls;
+}
+#endif /* ifdef YAF_MPLS */
+
+
+/**
+ * yfFlowGetNode
+ *
+ * finds a flow node entry in the flow table for
+ * the appropriate key value given, whose flow index hash is `hash`
+ *
+ */
+static yfFlowNode_t *
+yfFlowGetNode(
+    yfFlowTab_t  *flowtab,
+    yfFlowKey_t  *key,
+    uint64_t      hash,
+    yfFlowVal_t **valp)
+{
+    yfFlowNode_t  *fn;
+    yfFlowIndex_t *ht;
+    gboolean       rev;
+
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        ht = flowtab->cur_mpls_node->tab;
+    } else
+#endif  /* YAF_MPLS */
+    {
+        ht = flowtab->table;
+    }
+
+    /* Look for flow in table, in either direction */
+    if ((fn = yfFlowIndexLookup(ht, key, hash, &rev))) {
+        if (!rev) {
+            /* Forward flow found. */
+            *valp = &(fn->f.val);
+        } else {
+            /* Reverse flow found. */
+            *valp = &(fn->f.rval);
+            fn->f.rtos = key->tos;
+        }
+        return fn;
+    }
+
+    /* Neither exists. Create a new flow and put it in the table. */
+#ifdef YAF_ENABLE_COMPACT_IP4
+    if (key->version == 4) {
+        fn = slbAlloc0(flowtab->slab, SLB_FLOW, YF_FLOWNODE_IPV4_SIZE);
+    } else
+#endif  /* YAF_ENABLE_COMPACT_IP4 */
+    {
+        fn = slbAlloc0(flowtab->slab, SLB_FLOW, sizeof(yfFlowNode_t));
+    }
+
+    /* Copy key */
+    yfFlowKeyCopy(key, &(fn->f.key));
+
+    /* set flow start time */
+    fn->f.stime = flowtab->ctime;
+
+    /* set flow end time as start time */
+    fn->f.etime = flowtab->ctime;
+
+    /* stuff the flow in the table */
+    yfFlowIndexInsert(ht, fn, hash);
+
+    /* and on the expiry wheel, by the timeouts that apply to it */
+    fn->tprof = yfFlowTimeoutProfile(flowtab, key, 0);
+    yfFlowWheelFile(flowtab, fn);
+
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        yfFlowCold(flowtab, &(fn->f))->mpls = flowtab->cur_mpls_node;
+        ++(flowtab->cur_mpls_node->tab_count);
+    }
+#endif  /* YAF_MPLS */
+
+    /* This is a forward flow */
+    *valp = &(fn->f.val);
+
+    /* Count it */
+    ++(flowtab->count);
+    if (flowtab->count > flowtab->stats.stat_peak) {
+        YF_STAT_SET(flowtab->stats.stat_peak, flowtab->count);
+    }
+
+#ifdef YAF_ENABLE_HOOKS
+    /*Let the hook allocate its context, which it keeps in the cold state */
+    if (yfHookCount()) {
+        yfFlowCold(flowtab, &(fn->f));
+    }
+    yfHookFlowAlloc(&(fn->f), flowtab->yfctx);
+#endif
+
+    /* capture and DPI for the new flow, as the memory budget allows */
+    if (yfFlowMemAdmit(flowtab, fn)) {
+#ifdef YAF_ENABLE_APPLABEL
+        ydAllocFlowContext(&(fn->f), flowtab->slab);
+#endif
+    }
+
+    /* All done */
+    return fn;
+}
+
+/**
+ * yfRotatePcapMetaFile
+ *
+ * rotate the pcap_meta_file
+ *
+ */
+static gboolean
+yfRotatePcapMetaFile(
+    yfFlowTab_t  *flowtab)
+{
+    GString *namebuf = g_string_new(NULL);
+
+    g_string_append_printf(namebuf, "%s", flowtab->pcap_meta_name);
+    air_time_g_string_append(namebuf, time(NULL), AIR_TIME_SQUISHED);
+    g_string_append_printf(namebuf, "_%05u.meta", pcap_meta_num);
+
+    /* close current pcap_meta file */
+    if (flowtab->pcap_meta) {
+        long cp = ftell(flowtab->pcap_meta);
+        fseek(flowtab->pcap_meta, flowtab->pcap_last_offset, SEEK_SET);
+        fprintf(flowtab->pcap_meta, "%" PRIu64 "|%010ld\n",
+                flowtab->pcap_last_time, cp);
+        if (fclose(flowtab->pcap_meta)) {
+            g_warning("Error (%d) Could not close current pcap "
+                      "meta file: %s", errno, strerror(errno));
+        }
+        g_debug("Rotating Pcap Meta File, opening %s", namebuf->str);
+    } else {
+        g_debug("Opening Pcap Meta File %s", namebuf->str);
+    }
+
+    flowtab->pcap_meta = fopen(namebuf->str, "w");
+    flowtab->pcap_last_offset = 0;
+    if (flowtab->pcap_meta == NULL) {
+        g_warning("Could not open new pcap meta file %s",
+                  namebuf->str);
+        g_warning("Error (%d): %s", errno, strerror(errno));
+        g_string_free(namebuf, TRUE);
+        return FALSE;
+    }
+
+    if (flowtab->ctime) {
+        fprintf(flowtab->pcap_meta, "%" PRIu64 "|0000000000\n", flowtab->ctime);
+        flowtab->pcap_last_time = flowtab->ctime;
+    }
+
+    g_string_free(namebuf, TRUE);
+    pcap_meta_num++;
+    return TRUE;
+}
+
+
+/**
+ * yfUpdateRollingPcapFile
+ *
+ * update the rolling pcap filename in the flowtab for meta output
+ *
+ *
+ */
+void
+yfUpdateRollingPcapFile(
+    yfFlowTab_t  *flowtab,
+    char         *new_file_name)
+{
+    if (flowtab->pcap_roll) {
+        g_string_printf(flowtab->pcap_roll, "%s", new_file_name);
+    }
+
+    flowtab->pcap_file_no++;
+
+    /* every 10 rolling pcaps change over the pcap meta file */
+    if (flowtab->pcap_meta_name && flowtab->stats.stat_packets) {
+        if (pcap_meta_read == -1) {
+            if ((flowtab->stats.stat_packets % YAF_PCAP_META_ROTATE) == 0) {
+                yfRotatePcapMetaFile(flowtab);
+            }
+        } else if ((flowtab->stats.stat_packets % YAF_PCAP_META_ROTATE_FP) ==
+                   0)
+        {
+            yfRotatePcapMetaFile(flowtab);
+        }
+    }
+}
+
+
+/**
+ * yfWritePcap
+ *
+ * write pcap to pcap-per-flow pcap file
+ *
+ * @param flowtab
+ * @param flow
+ * @param key
+ * @param pbuf
+ */
+static void
+yfWritePcap(
+    yfFlowTab_t  *flowtab,
+    yfFlow_t     *flow,
+    yfFlowKey_t  *key,
+    yfPBuf_t     *pbuf)
+{
+    GString      *namebuf;
+    yfFlowCold_t *cold;
+    gboolean      fexists = FALSE;
+    yfFlowNode_t *node;
+    FILE         *pfile = NULL;
+    uint32_t      rem_ms;
+    uint32_t      i;
+
+    if (flowtab->pcap_search_flowkey) {
+        if (flowtab->hashfn(key) == flowtab->pcap_search_flowkey) {
+            if (flowtab->pcap_search_stime) {
+                if (flow->stime != flowtab->pcap_search_stime) {
+                    return;
+                }
+            }
+        } else {
+            return;
+        }
+    }
+
+    cold = yfFlowCold(flowtab, flow);
+
+    if (flowtab->pcap_search_flowkey) {
+        if (cold->pcap == NULL) {
+            if (g_file_test(flowtab->pcap_dir, G_FILE_TEST_EXISTS)) {
+                pfile = fopen(flowtab->pcap_dir, "ab");
+                if (pfile == NULL) {
+                    g_warning("Pcap Create File Error: %s",
+                              pcap_geterr((pcap_t *)pbuf->pcapt));
+                    return;
+                }
+                /* need to append to pcap - libpcap doesn't have an append fn*/
+                cold->pcap = (pcap_dumper_t *)pfile;
+            } else {
+                cold->pcap = pcap_dump_open(pbuf->pcapt, flowtab->pcap_dir);
+            }
+            if (cold->pcap == NULL) {
+                g_warning("Pcap Create File Error: %s",
+                          pcap_geterr((pcap_t *)pbuf->pcapt));
+                return;
+            }
+        }
+    }
+
+    if (cold->pcap == NULL) {
+        namebuf = g_string_new(NULL);
+        rem_ms = (flow->stime % 1000);
+        rem_ms = (rem_ms > 1000) ? (rem_ms / 10) : rem_ms;
+        g_string_append_printf(namebuf, "%s/%03u", flowtab->pcap_dir,
+                               rem_ms);
+        g_mkdir(namebuf->str, 0777);
+        g_string_append_printf(namebuf, "/%u-", flowtab->hashfn(key));
+        air_time_g_string_append(namebuf, (flow->stime / 1000),
+                                 AIR_TIME_SQUISHED);
+        g_string_append_printf(namebuf, "_%d.pcap", cold->pcap_serial);
+        if (g_file_test(namebuf->str, G_FILE_TEST_EXISTS)) {
+            fexists = TRUE;
+            pfile = fopen(namebuf->str, "ab");
+            if (pfile == NULL) {
+                goto err;
+            }
+            /* need to append to pcap - libpcap doesn't have an append fn*/
+            cold->pcap = (pcap_dumper_t *)pfile;
+        } else {
+            cold->pcap = pcap_dump_open(pbuf->pcapt, namebuf->str);
+        }
+
+        if (cold->pcap == NULL) {
+            goto err;
+        }
+
+        g_string_free(namebuf, TRUE);
+    } else if (flowtab->pcap_maxfile) {
+        pfile = pcap_dump_file(cold->pcap);
+
+        if ((ftell(pfile) > (long)flowtab->pcap_maxfile)) {
+            pcap_dump_flush(cold->pcap);
+            pcap_dump_close(cold->pcap);
+            cold->pcap_serial += 1;
+            namebuf = g_string_new(NULL);
+            rem_ms = (flow->stime % 1000);
+            rem_ms = (rem_ms > 1000) ? (rem_ms / 10) : rem_ms;
+            g_string_append_printf(namebuf, "%s/%03u", flowtab->pcap_dir,
+                                   rem_ms);
+            g_string_append_printf(namebuf, "/%u-", flowtab->hashfn(key));
+            air_time_g_string_append(namebuf, (flow->stime / 1000),
+                                     AIR_TIME_SQUISHED);
+            g_string_append_printf(namebuf, "_%d.pcap", cold->pcap_serial);
+            cold->pcap = pcap_dump_open(pbuf->pcapt, namebuf->str);
+
+            if (cold->pcap == NULL) {
+                goto err;
+            }
+            g_string_free(namebuf, TRUE);
+        }
+    }
+
+    pcap_dump((u_char *)cold->pcap, &(pbuf->pcap_hdr), pbuf->paydata);
+    return;
+
+  err:
+
+    /* close pcap files for stale flows */
+
+    /* go until we have closed 1, soonest to expire first */
+    for (i = 0; i <= YF_WHEEL_DUE; i++) {
+        node = flowtab->wheel[yfFlowWheelSlotAt(flowtab, i)].tail;
+        while (node && !(node->f.cold && node->f.cold->pcap)) {
+            node = node->n;
+        }
+        if (node) {
+            pcap_dump_flush(node->f.cold->pcap);
+            pcap_dump_close(node->f.cold->pcap);
+            node->f.cold->pcap = NULL;
+            break;
+        }
+    }
+
+    /* if the file exists - use fopen */
+    if (fexists) {
+        pfile = fopen(namebuf->str, "ab");
+        if (pfile == NULL) {
+            g_string_free(namebuf, TRUE);
+            return;
+        }
+        cold->pcap = (pcap_dumper_t *)pfile;
+    } else {
+        cold->pcap = pcap_dump_open(pbuf->pcapt, namebuf->str);
+    }
+
+    if (cold->pcap == NULL) {
+        g_warning("Pcap-per-flow Create File Error: %s",
+                  pcap_geterr((pcap_t *)pbuf->pcapt));
+        g_string_free(namebuf, TRUE);
+        return;
+    }
+
+    g_string_free(namebuf, TRUE);
+    pcap_dump((u_char *)cold->pcap, &(pbuf->pcap_hdr), pbuf->paydata);
+}
+
+
+/**
+ * yfWritePcapMetaIndex
+ *
+ *
+ */
+static void
+yfWritePcapMetaIndex(
+    yfFlowTab_t  *flowtab,
+    gboolean      packets)
+{
+    long     cp;
+    uint64_t count;
+    int      rotate = 10000;
+
+    if (packets) {
+        count = flowtab->stats.stat_packets;
+    } else {
+        count = YF_STAT_GET(flowtab->stats.stat_flows);
+        rotate = 5000;
+    }
+
+    if (flowtab->stats.stat_packets == 1) {
+        fprintf(flowtab->pcap_meta, "%" PRIu64 "|0000000000\n", flowtab->ctime);
+        flowtab->pcap_last_time = flowtab->ctime;
+    }
+
+    if (!count) {
+        return;
+    }
+
+    if ((count % rotate) == 0) {
+        cp = ftell(flowtab->pcap_meta);
+        if (cp == 0) {
+            fprintf(flowtab->pcap_meta, "%" PRIu64 "|0000000000\n",
+                    flowtab->ctime);
+            flowtab->pcap_last_time = flowtab->ctime;
+        } else {
+            fseek(flowtab->pcap_meta, flowtab->pcap_last_offset, SEEK_SET);
+            fprintf(flowtab->pcap_meta, "%" PRIu64 "|%010ld\n",
+                    flowtab->pcap_last_time, cp);
+            fseek(flowtab->pcap_meta, cp, SEEK_SET);
+            flowtab->pcap_last_offset = cp;
+            fprintf(flowtab->pcap_meta, "%" PRIu64 "|0000000000\n",
+                    flowtab->ctime);
+            flowtab->pcap_last_time = flowtab->ctime;
+        }
+    }
+}
+
+
+/**
+ * yfWritePcapMetaFile
+ *
+ *
+ */
+static void
+yfWritePcapMetaFile(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn,
+    yfPBuf_t      *pbuf,
+    uint32_t       hash,
+    uint32_t       pcap_len)
+{
+    int rv;
+
+    if (pcap_meta_read == -1) {
+        yfWritePcapMetaIndex(flowtab, TRUE);
+        rv = fprintf(flowtab->pcap_meta, "%u|%llu|%d|%llu|%d\n",
+                     hash, (long long unsigned int)fn->f.stime,
+                     pbuf->pcap_caplist,
+                     (long long unsigned int)pbuf->pcap_offset,
+                     pcap_len);
+        if (rv < 0) {
+            if (yfRotatePcapMetaFile(flowtab)) {
+                yfWritePcapMetaIndex(flowtab, TRUE);
+                fprintf(flowtab->pcap_meta, "%u|%llu|%d|%llu|%d\n",
+                        hash, (long long unsigned int)fn->f.stime,
+                        pbuf->pcap_caplist,
+                        (long long unsigned int)pbuf->pcap_offset,
+                        pcap_len);
+            }
+        } else if ((flowtab->stats.stat_packets % YAF_PCAP_META_ROTATE) == 0) {
+            yfRotatePcapMetaFile(flowtab);
+        }
+    } else {
+        if (flowtab->pcap_index) {
+            /* print every packet */
+            yfWritePcapMetaIndex(flowtab, TRUE);
+            rv = fprintf(flowtab->pcap_meta, "%u|%llu|%s|%llu|%d\n",
+                         hash, (long long unsigned int)fn->f.stime,
+                         flowtab->pcap_roll->str,
+                         (long long unsigned int)pbuf->pcap_offset, pcap_len);
+            if (rv < 0) {
+                if (yfRotatePcapMetaFile(flowtab)) {
+                    yfWritePcapMetaIndex(flowtab, TRUE);
+                    fprintf(flowtab->pcap_meta, "%u|%llu|%s|%llu|%d\n",
+                            hash, (long long unsigned int)fn->f.stime,
+                            flowtab->pcap_roll->str,
+                            (long long unsigned int)pbuf->pcap_offset,
+                            pcap_len);
+                }
+            } else if ((flowtab->stats.stat_packets %
+                        YAF_PCAP_META_ROTATE_FP) == 0)
+            {
+                yfRotatePcapMetaFile(flowtab);
+            }
+        } else if (flowtab->pcap_file_no !=
+                   yfFlowCold(flowtab, &(fn->f))->pcap_file_no)
+        {
+            /* print when the flow rolls over multiple files */
+            yfWritePcapMetaIndex(flowtab, FALSE);
+            fprintf(flowtab->pcap_meta, "%u|%llu|%s\n",
+                    hash, (long long unsigned int)fn->f.stime,
+                    flowtab->pcap_roll->str);
+            fn->f.cold->pcap_file_no = flowtab->pcap_file_no;
+            return;
+        }
+    }
+}
+
+
+/**
+ * yfFlowPktGenericTpt
+ *
+ * generate flow information about packets that are not TCP
+ *
+ *
+ * @param flowtab
+ * @param fn
+ * @param val
+ * @param pkt
+ * @param caplen
+ *
+ */
+static void
+yfFlowPktGenericTpt(
+    yfFlowTab_t    *flowtab,
+    yfFlowNode_t   *fn,
+    yfFlowVal_t    *val,
+    const uint8_t  *pkt,
+    uint32_t        caplen)
+{
+#ifdef YAF_ENABLE_PAYLOAD
+    int p;
+
+    /* Short-circuit nth packet or no payload capture */
+    if (!fn->paymax ||
+        (val->pkt && !flowtab->udp_multipkt_payload) ||
+        !caplen)
+    {
+        return;
+    }
+
+    /* truncate capture length to payload limit */
+    if (caplen + val->paylen > fn->paymax) {
+        caplen = fn->paymax - val->paylen;
+    }
+
+    /* allocate */
+
+    if (!val->payload) {
+        val->payload = slbAlloc0(flowtab->slab, SLB_PAYLOAD, fn->paymax);
+        val->paybounds = (size_t *)slbAlloc0(
+            flowtab->slab, SLB_PAYLOAD, sizeof(size_t) * YAF_MAX_PKT_BOUNDARY);
+    }
+
+    memcpy(val->payload + val->paylen, pkt, caplen);
+
+    /* Set pointer to payload for packet boundary */
+    if (val->pkt < YAF_MAX_PKT_BOUNDARY) {
+        p = val->pkt;
+        val->paybounds[p] = val->paylen;
+    }
+
+    val->paylen += caplen;
+
+#endif /* ifdef YAF_ENABLE_PAYLOAD */
+}
+
+
+/**
+ * yfFlowPktTCP
+ *
+ * process a TCP packet into the flow table specially, capture
+ * all the special TCP information, flags, seq, etc.
+ *
+ * @param flowtab pointer to the flow table
+ * @param fn pointer to the node for the relevent flow in the flow table
+ * @param val
+ * @param pkt pointer to the packet payload
+ * @param caplen length of the capture (length of pkt)
+ * @param tcpinfo pointer to the parsed tcp information
+ * @param headerVal pointer to the full packet information, including IP & TCP
+ * @param headerLen length of headerVal
+ *
+ */
+static void
+yfFlowPktTCP(
+    yfFlowTab_t    *flowtab,
+    yfFlowNode_t   *fn,
+    yfFlowVal_t    *val,
+    const uint8_t  *pkt,
+    uint32_t        caplen,
+    yfTCPInfo_t    *tcpinfo,
+    uint8_t        *headerVal,
+    uint16_t        headerLen)
+{
+#ifdef YAF_ENABLE_PAYLOAD
+    uint32_t appdata_po;
+    uint32_t last_seq_num = val->lsn;
+    int      p;
+#endif
+
+    /*Update flags in flow record - may need to upload iflags if out of order*/
+    if (val->pkt && (tcpinfo->seq > val->isn)) {
+        /* Union flags */
+        val->uflags |= tcpinfo->flags;
+    } else {
+        if (val->pkt && (tcpinfo->seq <= val->isn)) {
+            /*if packets out of order - don't lose other flags - add to
+             * uflags*/
+            val->uflags |= val->iflags;
+        }
+        /* Initial flags */
+        val->iflags = tcpinfo->flags;
+        /* Initial sequence number */
+        val->isn = tcpinfo->seq;
+    }
+
+    val->lsn = tcpinfo->seq;
+
+    /* Update flow state for FIN flag */
+    if (val == &(fn->f.val)) {
+        if (tcpinfo->flags & YF_TF_FIN) {
+            fn->state |= YAF_STATE_FFIN;
+        }
+        if ((fn->state & YAF_STATE_RFIN) && (tcpinfo->flags & YF_TF_ACK)) {
+            fn->state |= YAF_STATE_FFINACK;
+        }
+    } else {
+        if (tcpinfo->flags & YF_TF_FIN) {
+            fn->state |= YAF_STATE_RFIN;
+        }
+        if ((fn->state & YAF_STATE_FFIN) && (tcpinfo->flags & YF_TF_ACK)) {
+            fn->state |= YAF_STATE_RFINACK;
+        }
+    }
+
+    /* Update flow state for RST flag */
+    if (tcpinfo->flags & YF_TF_RST) {
+        fn->state |= YAF_STATE_RST;
+    }
+
+    if (flowtab->flowstats_mode && (tcpinfo->flags & YF_TF_URG)) {
+        val->stats->tcpurgct++;
+    }
+
+    /** MPTCP stuff */
+    if (tcpinfo->mptcp.flags & 0x01) {
+        /* MP_CAPABLE */
+        val->attributes |= YAF_ATTR_MP_CAPABLE;
+    }
+
+    /* The MSS comes from any SYN, but is only exported with an MPTCP token
+     * and every packet overwrites it, so a flow needs no cold state for it
+     * until an MPTCP option turns up */
+    if (fn->f.cold || tcpinfo->mptcp.flags || tcpinfo->mptcp.token ||
+        tcpinfo->mptcp.idsn || tcpinfo->mptcp.addrid)
+    {
+        yfMPTCPFlow_t *mptcp = &(yfFlowCold(flowtab, &(fn->f))->mptcp);
+
+        if (tcpinfo->flags & YF_TF_SYN) {
+            if (!mptcp->token && tcpinfo->mptcp.token) {
+                mptcp->token = tcpinfo->mptcp.token;
+            }
+            /* initial priority is set in the MP_JOIN SYN or SYN/ACK */
+            if (tcpinfo->mptcp.flags & 0x02) {
+                mptcp->flags |= YF_MF_PRIORITY;
+            }
+        } else if (tcpinfo->mptcp.flags & 0x02) {
+            mptcp->flags |= YF_MF_PRIO_CHANGE;
+        }
+
+        if (!mptcp->idsn) {
+            mptcp->idsn = tcpinfo->mptcp.idsn;
+        }
+
+        mptcp->mss = tcpinfo->mptcp.mss;
+
+        mptcp->flags |= (tcpinfo->mptcp.flags & 0xFC);
+
+        if (!mptcp->addrid) {
+            mptcp->addrid = tcpinfo->mptcp.addrid;
+        }
+    }
+
+#ifdef YAF_ENABLE_P0F
+    /* run through p0f if it's enabled here */
+    if (flowtab->p0f_mode) {
+        /* do os fingerprinting if enabled */
+        if (NULL == val->osname) {
+            GError  *err = NULL;
+            struct packetDecodeDetails_st packetDetails;
+            gboolean fuzzyMatched;
+
+            /* run everything through the p0f finger printer now */
+            if (!yfpPacketParse(headerVal, headerLen, &packetDetails, &err)) {
+                g_clear_error(&err);
+            } else {
+                if (!yfpSynFindMatch(&packetDetails, TRUE, &fuzzyMatched,
+                                     &(val->osname), &(val->osver),
+                                     &(val->osFingerprint), &err))
+                {
+                    g_warning("Error finger printing packet: %s",
+                              err->message);
+                    g_clear_error(&err);
+                }
+            }
+        }
+    }
+#endif /* ifdef YAF_ENABLE_P0F */
+
+#ifdef YAF_ENABLE_FPEXPORT
+    if (flowtab->fpexport_mode && headerVal) {
+        /* Let's capture the detailed header information for the first 3
+         * packets
+         * mostly for external OS id'ing*/
+        if (&(fn->f.val) == val) {
+            if (NULL == val->firstPacket) {
+                val->firstPacket = slbAlloc0(flowtab->slab, SLB_FPEXPORT,
+                                             YFP_IPTCPHEADER_SIZE);
+                val->firstPacketLen = headerLen;
+                memcpy(val->firstPacket, headerVal, headerLen);
+            } else if (NULL == val->secondPacket) {
+                val->secondPacket = slbAlloc0(flowtab->slab, SLB_FPEXPORT,
+                                              YFP_IPTCPHEADER_SIZE);
+                val->secondPacketLen = headerLen;
+                memcpy(val->secondPacket, headerVal, headerLen);
+            }
+        } else {
+            if (NULL == val->firstPacket) {
+                val->firstPacket = slbAlloc0(flowtab->slab, SLB_FPEXPORT,
+                                             YFP_IPTCPHEADER_SIZE);
+                val->firstPacketLen = headerLen;
+                memcpy(val->firstPacket, headerVal, headerLen);
+            }
+        }
+    }
+#endif /* ifdef YAF_ENABLE_FPEXPORT */
+
+#ifdef YAF_ENABLE_PAYLOAD
+    /* short circuit no payload capture, continuation,
+     * payload full, or no payload in packet */
+    if (!fn->paymax || !(val->iflags & YF_TF_SYN) ||
+        caplen == 0)
+    {
+        return;
+    }
+
+    if (last_seq_num == (tcpinfo->seq + 1)) {
+        /* TCP KEEP ALIVE */
+        return;
+    }
+
+    /* Find app data offset in payload buffer */
+    appdata_po = tcpinfo->seq - (val->isn + 1);
+
+    /* allocate and copy */
+    if (!val->payload) {
+        val->payload = slbAlloc0(flowtab->slab, SLB_PAYLOAD, fn->paymax);
+        val->paybounds = (size_t *)slbAlloc0(
+            flowtab->slab, SLB_PAYLOAD, sizeof(size_t) * YAF_MAX_PKT_BOUNDARY);
+    }
+
+    if (val->pkt < YAF_MAX_PKT_BOUNDARY) {
+        p = val->pkt;
+        val->paybounds[p] = appdata_po;
+    }
+
+    /* leave open the case in which we receive an out of order packet */
+    if ((val->paylen == fn->paymax) && (appdata_po >= fn->paymax)) {
+        return;
+    }
+
+    /* Short circuit entire packet after capture filter */
+    if (appdata_po >= fn->paymax) {return;}
+
+    /* truncate payload copy length to capture length */
+    if ((appdata_po + caplen) > fn->paymax) {
+        caplen = fn->paymax - appdata_po;
+        if (caplen > fn->paymax) {
+            caplen = fn->paymax;
+        }
+    }
+
+    if (val->paylen < appdata_po + caplen) {
+        val->paylen = appdata_po + caplen;
+    }
+    memcpy(val->payload + appdata_po, pkt, caplen);
+#endif /* ifdef YAF_ENABLE_PAYLOAD */
+}
+
+
+static void
+yfFlowStatistics(
+    yfFlowNode_t  *fn,
+    yfFlowVal_t   *val,
+    uint64_t       ptime,
+    uint32_t       datalen)
+{
+    if (val->stats->ltime) {
+        val->stats->aitime += (ptime - val->stats->ltime);
+    }
+
+    if (val->pkt > 1 && val->pkt < 12) {
+        val->stats->iaarray[val->pkt - 2] = (ptime - val->stats->ltime);
+    }
+
+    val->stats->ltime = fn->f.etime;
+
+    if (datalen) {
+        /* that means there is some payload */
+        if (val == &(fn->f.rval)) {
+            fn->f.pktdir |= (1 << (fn->f.val.stats->nonemptypktct +
+                                   val->stats->nonemptypktct));
+        }
+        if (val->stats->nonemptypktct < 10) {
+            val->stats->pktsize[val->stats->nonemptypktct] = datalen;
+        }
+        val->stats->nonemptypktct++;
+        if (datalen < YAF_SMALL_PKT_BOUND) {
+            val->stats->smallpktct++;
+        } else if (datalen > YAF_LARGE_PKT_BOUND) {
+            val->stats->largepktct++;
+        }
+        val->stats->payoct += datalen;
+        if (val->stats->firstpktsize == 0) {
+            val->stats->firstpktsize = datalen;
+        }
+        if (datalen > val->stats->maxpktsize) {
+            val->stats->maxpktsize = datalen;
+        }
+    }
+}
+
+
+static void
+yfAddOutOfSequence(
+    yfFlowTab_t  *flowtab,
+    yfFlowKey_t  *key,
+    size_t        pbuflen,
+    yfPBuf_t     *pbuf)
+{
+    yfFlowNode_t  *fn = NULL;
+    yfFlowKey_t    rkey;
+    yfFlowVal_t   *val = NULL;
+    yfTCPInfo_t   *tcpinfo = &(pbuf->tcpinfo);
+    yfL2Info_t    *l2info = &(pbuf->l2info);
+    uint8_t       *payload = (pbuflen >= YF_PBUFLEN_BASE) ?
+        (uint8_t *)pbuf->paydata : NULL;
+    size_t         paylen = (pbuflen >= YF_PBUFLEN_BASE) ?
+        pbuf->paylen : 0;
+    uint32_t       datalen = (pbuf->iplen - pbuf->allHeaderLen +
+                              l2info->l2hlen);
+    uint32_t       pcap_len = 0;
+    gboolean       rev = FALSE;
+    yfFlowIndex_t *ht;
+    uint64_t       hash;
+
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        ht = flowtab->cur_mpls_node->tab;
+        yfMPLSGetNode(flowtab, l2info);
+    } else
+#endif /* ifdef YAF_MPLS */
+    {
+        ht = flowtab->table;
+    }
+
+    /* Count the packet and its octets */
+    YF_STAT_INC(flowtab->stats.stat_packets);
+    YF_STAT_ADD(flowtab->stats.stat_octets, pbuf->iplen);
+
+    if (payload) {
+        if (paylen >= pbuf->allHeaderLen) {
+            paylen -= pbuf->allHeaderLen;
+            payload += pbuf->allHeaderLen;
+        } else {
+            paylen = 0;
+            payload = NULL;
+        }
+    }
+
+    /* Look for flow in table, in either direction */
+    hash = yfFlowIndexHash(ht, key);
+    if ((fn = yfFlowIndexLookup(ht, key, hash, &rev)) && !rev) {
+        /* Forward flow found. */
+        val = &(fn->f.val);
+    } else {
+        /* Reverse flow found, or none: the pcap meta output below uses
+         * the reverse key */
+        yfFlowKeyReverse(key, &rkey);
+        rev = TRUE;
+        if (fn) {
+            val = &(fn->f.rval);
+        }
+    }
+
+    if (fn == NULL) {
+        /* Neither exists. Create a new flow and put it in the table. */
+#ifdef YAF_ENABLE_COMPACT_IP4
+        if (key->version == 4) {
+            fn = slbAlloc0(flowtab->slab, SLB_FLOW, YF_FLOWNODE_IPV4_SIZE);
+        } else
+#endif  /* YAF_ENABLE_COMPACT_IP4 */
+        {
+            fn = slbAlloc0(flowtab->slab, SLB_FLOW, sizeof(yfFlowNode_t));
+        }
+
+        /* Copy key */
+        yfFlowKeyCopy(key, &(fn->f.key));
+
+        /* set flow start time */
+        fn->f.stime = pbuf->ptime;
+
+        /* set flow end time as start time */
+        fn->f.etime = pbuf->ptime;
+
+        /* stuff the flow in the table */
+        yfFlowIndexInsert(ht, fn, hash);
+
+        /* and on the expiry wheel, possibly straight onto the due list */
+        fn->tprof = yfFlowTimeoutProfile(flowtab, key, 0);
+        yfFlowWheelFile(flowtab, fn);
+
+        /* This is a forward flow */
+        val = &(fn->f.val);
+
+        /* Count it */
+        ++(flowtab->count);
+#ifdef YAF_MPLS
+        if (flowtab->mpls_mode) {
+            yfFlowCold(flowtab, &(fn->f))->mpls = flowtab->cur_mpls_node;
+            ++(flowtab->cur_mpls_node->tab_count);
+        }
+#endif  /* YAF_MPLS */
+
+        if (flowtab->count > flowtab->stats.stat_peak) {
+            YF_STAT_SET(flowtab->stats.stat_peak, flowtab->count);
+        }
+
+#ifdef YAF_ENABLE_HOOKS
+        /*Let the hook allocate its context, which it keeps in the cold
+         * state */
+        if (yfHookCount()) {
+            yfFlowCold(flowtab, &(fn->f));
+        }
+        yfHookFlowAlloc(&(fn->f), flowtab->yfctx);
+#endif
+
+        /* capture and DPI for the new flow, as the memory budget allows */
+        if (yfFlowMemAdmit(flowtab, fn)) {
+#ifdef YAF_ENABLE_APPLABEL
+            ydAllocFlowContext(&(fn->f), flowtab->slab);
+#endif
+        }
+    }
+
+    if (val->pkt == 0) {
+        /* Note Mac Addr */
+        if (flowtab->macmode && (val == &(fn->f.val))) {
+            if (l2info) {
+                yfFlowCold_t *cold = yfFlowCold(flowtab, &(fn->f));
+
+                memcpy(cold->sourceMacAddr, l2info->smac,
+                       ETHERNET_MAC_ADDR_LENGTH);
+                memcpy(cold->destinationMacAddr, l2info->dmac,
+                       ETHERNET_MAC_ADDR_LENGTH);
+            }
+        }
+        /* Allocate Flow Statistics */
+        if (flowtab->flowstats_mode) {
+            val->stats = slbAlloc0(flowtab->slab, SLB_STATS,
+                                   sizeof(yfFlowStats_t));
+        }
+    }
+
+    /* packet exists now, update info */
+
+    /* Do payload and TCP stuff */
+    if (fn->f.key.proto == YF_PROTO_TCP) {
+        /* Handle TCP flows specially (flags, ISN, sequenced payload) */
+        if (datalen) {
+            if (val->appkt == 0) {
+                val->first_pkt_size = datalen;
+            } else {
+                if (datalen == val->first_pkt_size) {
+                    if (val->appkt == 1) {
+                        val->attributes |= YAF_ATTR_SAME_SIZE;
+                    }
+                } else {
+                    /* Don't consider TCP KEEP ALIVE */
+                    if (val->lsn != (tcpinfo->seq + 1)) {
+                        val->attributes &= ~YAF_ATTR_SAME_SIZE;
+                    }
+                }
+            }
+            val->appkt += 1;
+        }
+#if defined(YAF_ENABLE_P0F) || defined(YAF_ENABLE_FPEXPORT)
+        yfFlowPktTCP(flowtab, fn, val, payload, paylen, tcpinfo,
+                     pbuf->headerVal, pbuf->headerLen);
+#else
+        yfFlowPktTCP(flowtab, fn, val, payload, paylen, tcpinfo, NULL, 0);
+#endif
+    } else {
+        if (val->pkt == 0) {
+            val->first_pkt_size = pbuf->iplen;
+        } else {
+            if (pbuf->iplen == val->first_pkt_size) {
+                if (val->pkt == 1) {
+                    val->attributes |= YAF_ATTR_SAME_SIZE;
+                }
+            } else {
+                val->attributes &= ~YAF_ATTR_SAME_SIZE;
+            }
+        }
+        if ((val->pkt == 0 || flowtab->udp_multipkt_payload)) {
+            if (((flowtab->udp_uniflow_port != 1) &&
+                 (flowtab->udp_uniflow_port != fn->f.key.sp) &&
+                 (flowtab->udp_uniflow_port != fn->f.key.dp)))
+            {
+                /* Get first packet payload from non-TCP flows */
+                yfFlowPktGenericTpt(flowtab, fn, val, payload, paylen);
+            }
+        }
+    }
+
+    /* set flow attributes - this flow is out of order */
+    val->attributes |= YAF_ATTR_OUT_OF_SEQUENCE;
+
+    /* Mark if fragmented */
+    if (pbuf->frag == 1) {
+        val->attributes |= YAF_ATTR_FRAGMENTS;
+    }
+
+    /* Count packets and octets */
+    val->oct += pbuf->iplen;
+    val->pkt += 1;
+
+    /* don't update end time - stime could be greater than etime */
+
+    /* Update stats */
+    if (flowtab->flowstats_mode) {
+        yfFlowStatistics(fn, val, pbuf->ptime, datalen);
+    }
+
+#ifdef YAF_ENABLE_HOOKS
+    /* Hook Flow Processing */
+    yfHookFlowPacket(&(fn->f), val, payload,
+                     paylen, pbuf->iplen, tcpinfo, l2info);
+#endif
+
+    pcap_len = pbuf->pcap_hdr.caplen + 16;
+
+    /* Write Packet to Pcap-Per-Flow pcap file */
+    if (flowtab->pcap_dir) {
+        /* what we actually hold in yaf dependent on max-payload */
+        pbuf->pcap_hdr.caplen = (pbuflen > YF_PBUFLEN_BASE) ? pbuf->paylen : 0;
+        if (val == &(fn->f.rval)) {
+            yfFlowKeyReverse(key, &rkey);
+            yfWritePcap(flowtab, &(fn->f), &rkey, pbuf);
+        } else {
+            yfWritePcap(flowtab, &(fn->f), key, pbuf);
+        }
     }
 
-    if ((count % rotate) == 0) {
-        cp = ftell(flowtab->pcap_meta);
-        if (cp == 0) {
-            fprintf(flowtab->pcap_meta, "%" PRIu64 "|0000000000\n",
-                    flowtab->ctime);
-            flowtab->pcap_last_time = flowtab->ctime;
+    /* Write Pcap Meta Info */
+    if (flowtab->pcap_meta) {
+        if (rev) {
+            yfWritePcapMetaFile(flowtab, fn, pbuf, flowtab->hashfn(&rkey),
+                                pcap_len);
         } else {
-            fseek(flowtab->pcap_meta, flowtab->pcap_last_offset, SEEK_SET);
-            fprintf(flowtab->pcap_meta, "%" PRIu64 "|%010ld\n",
-                    flowtab->pcap_last_time, cp);
-            fseek(flowtab->pcap_meta, cp, SEEK_SET);
-            flowtab->pcap_last_offset = cp;
-            fprintf(flowtab->pcap_meta, "%" PRIu64 "|0000000000\n",
-                    flowtab->ctime);
-            flowtab->pcap_last_time = flowtab->ctime;
+            yfWritePcapMetaFile(flowtab, fn, pbuf, flowtab->hashfn(key),
+                                pcap_len);
         }
     }
-}
 
+    /* if udp-uniflow-mode, close UDP flow now */
+    if ((fn->f.key.proto == YF_PROTO_UDP) && (flowtab->udp_uniflow_port != 0)) {
+        if (((flowtab->udp_uniflow_port == 1) ||
+             (flowtab->udp_uniflow_port == fn->f.key.sp) ||
+             (flowtab->udp_uniflow_port == fn->f.key.dp)))
+        {
+            yfCloseActiveFlow(flowtab, fn, val, payload, paylen,
+                              YAF_END_UDPFORCE, pbuf->iplen);
+        }
+    }
 
-/**
- * yfWritePcapMetaFile
- *
- *
- */
-static void
-yfWritePcapMetaFile(
-    yfFlowTab_t   *flowtab,
-    yfFlowNode_t  *fn,
-    yfPBuf_t      *pbuf,
-    uint32_t       hash,
-    uint32_t       pcap_len)
-{
-    int rv;
+    /* close flow, or move it to head of queue */
+    if ((fn->state & YAF_STATE_FIN) == YAF_STATE_FIN ||
+        fn->state & YAF_STATE_RST)
+    {
+        yfFlowClose(flowtab, fn, YAF_END_CLOSED);
+        return;
+    }
 
-    if (pcap_meta_read == -1) {
-        yfWritePcapMetaIndex(flowtab, TRUE);
-        rv = fprintf(flowtab->pcap_meta, "%u|%llu|%d|%llu|%d\n",
-                     hash, (long long unsigned int)fn->f.stime,
-                     pbuf->pcap_caplist,
-                     (long long unsigned int)pbuf->pcap_offset,
-                     pcap_len);
-        if (rv < 0) {
-            if (yfRotatePcapMetaFile(flowtab)) {
-                yfWritePcapMetaIndex(flowtab, TRUE);
-                fprintf(flowtab->pcap_meta, "%u|%llu|%d|%llu|%d\n",
-                        hash, (long long unsigned int)fn->f.stime,
-                        pbuf->pcap_caplist,
-                        (long long unsigned int)pbuf->pcap_offset,
-                        pcap_len);
-            }
-        } else if ((flowtab->stats.stat_packets % YAF_PCAP_META_ROTATE) == 0) {
-            yfRotatePcapMetaFile(flowtab);
-        }
-    } else {
-        if (flowtab->pcap_index) {
-            /* print every packet */
-            yfWritePcapMetaIndex(flowtab, TRUE);
-            rv = fprintf(flowtab->pcap_meta, "%u|%llu|%s|%llu|%d\n",
-                         hash, (long long unsigned int)fn->f.stime,
-                         flowtab->pcap_roll->str,
-                         (long long unsigned int)pbuf->pcap_offset, pcap_len);
-            if (rv < 0) {
-                if (yfRotatePcapMetaFile(flowtab)) {
-                    yfWritePcapMetaIndex(flowtab, TRUE);
-                    fprintf(flowtab->pcap_meta, "%u|%llu|%s|%llu|%d\n",
-                            hash, (long long unsigned int)fn->f.stime,
-                            flowtab->pcap_roll->str,
-                            (long long unsigned int)pbuf->pcap_offset,
-                            pcap_len);
-                }
-            } else if ((flowtab->stats.stat_packets %
-                        YAF_PCAP_META_ROTATE_FP) == 0)
-            {
-                yfRotatePcapMetaFile(flowtab);
-            }
-        } else if (flowtab->pcap_file_no != fn->f.pcap_file_no) {
-            /* print when the flow rolls over multiple files */
-            yfWritePcapMetaIndex(flowtab, FALSE);
-            fprintf(flowtab->pcap_meta, "%u|%llu|%s\n",
-                    hash, (long long unsigned int)fn->f.stime,
-                    flowtab->pcap_roll->str);
-            fn->f.pcap_file_no = flowtab->pcap_file_no;
-            return;
-        }
+    /* Check for inactive timeout - this flow might be idled out on arrival */
+    if ((flowtab->ctime - pbuf->ptime) > yfFlowIdleMs(flowtab, fn)) {
+        yfFlowClose(flowtab, fn, YAF_END_IDLE);
+        return;
+    } else if (flowtab->idle_ms == 0) {
+        yfFlowClose(flowtab, fn, YAF_END_IDLE);
+        return;
     }
+
+    /* otherwise the flow stays where it is on the expiry wheel; its times
+     * did not move forward */
 }
 
 
+#ifdef YAF_ENABLE_NDPI
+
 /**
- * yfFlowPktGenericTpt
- *
- * generate flow information about packets that are not TCP
- *
+ * yfNDPIApplabel
  *
- * @param flowtab
- * @param fn
- * @param val
- * @param pkt
- * @param caplen
+ * Run nDPI on one packet of the flow.  Once it names a master or an
+ * application protocol, the flow is marked done and not looked at again.
  *
  */
 static void
-yfFlowPktGenericTpt(
-    yfFlowTab_t    *flowtab,
-    yfFlowNode_t   *fn,
-    yfFlowVal_t    *val,
-    const uint8_t  *pkt,
-    uint32_t        caplen)
+yfNDPIApplabel(
+    yfFlowTab_t  *flowtab,
+    yfFlow_t     *flow,
+    uint8_t      *payload,
+    size_t        paylen)
 {
-#ifdef YAF_ENABLE_PAYLOAD
-    int p;
+    struct ndpi_flow_struct *nflow;
+    struct ndpi_id_struct src, dst;
+    ndpi_protocol proto;
 
-    /* Short-circuit nth packet or no payload capture */
-    if (!flowtab->max_payload ||
-        (val->pkt && !flowtab->udp_multipkt_payload) ||
-        !caplen)
-    {
+    if (paylen == 0) {
         return;
     }
 
-    /* truncate capture length to payload limit */
-    if (caplen + val->paylen > flowtab->max_payload) {
-        caplen = flowtab->max_payload - val->paylen;
-    }
-
-    /* allocate */
-
-    if (!val->payload) {
-        val->payload = g_slice_alloc0(flowtab->max_payload);
-        val->paybounds = (size_t *)g_slice_alloc0(sizeof(size_t) *
-                                                  YAF_MAX_PKT_BOUNDARY);
-    }
-
-    memcpy(val->payload + val->paylen, pkt, caplen);
+    nflow = malloc(sizeof(struct ndpi_flow_struct));
+    memset(nflow, 0, sizeof(struct ndpi_flow_struct));
+    memset(&src, 0, sizeof(struct ndpi_id_struct));
+    memset(&dst, 0, sizeof(struct ndpi_id_struct));
 
-    /* Set pointer to payload for packet boundary */
-    if (val->pkt < YAF_MAX_PKT_BOUNDARY) {
-        p = val->pkt;
-        val->paybounds[p] = val->paylen;
+    proto = ndpi_detection_process_packet(flowtab->ndpi_struct, nflow, payload,
+                                          paylen, flow->etime, &src, &dst);
+    if (proto.master_protocol || proto.app_protocol || flow->cold) {
+        yfFlowCold(flowtab, flow)->ndpi_master = proto.master_protocol;
+        flow->cold->ndpi_sub = proto.app_protocol;
+        flow->cold->ndpi_done = (proto.master_protocol || proto.app_protocol);
     }
 
-    val->paylen += caplen;
-
-#endif /* ifdef YAF_ENABLE_PAYLOAD */
+    /* g_debug("proto is %d other is %d", proto.master_protocol,
+     * proto.protocol); */
+    ndpi_free_flow(nflow);
 }
 
 
+#endif /* ifdef YAF_ENABLE_NDPI */
+
 /**
- * yfFlowPktTCP
+ * yfPreFlowPromote
  *
- * process a TCP packet into the flow table specially, capture
- * all the special TCP information, flags, seq, etc.
+ * moves a pre-flow entry into the flow table, as if its packet had gone
+ * there in the first place, and empties the entry.  The flow must not be
+ * in the table yet.
  *
  * @param flowtab pointer to the flow table
- * @param fn pointer to the node for the relevent flow in the flow table
- * @param val
- * @param pkt pointer to the packet payload
- * @param caplen length of the capture (length of pkt)
- * @param tcpinfo pointer to the parsed tcp information
- * @param headerVal pointer to the full packet information, including IP & TCP
- * @param headerLen length of headerVal
+ * @param pf the entry to promote
+ * @return the new flow node
  *
  */
-static void
-yfFlowPktTCP(
-    yfFlowTab_t    *flowtab,
-    yfFlowNode_t   *fn,
-    yfFlowVal_t    *val,
-    const uint8_t  *pkt,
-    uint32_t        caplen,
-    yfTCPInfo_t    *tcpinfo,
-    uint8_t        *headerVal,
-    uint16_t        headerLen)
+static yfFlowNode_t *
+yfPreFlowPromote(
+    yfFlowTab_t  *flowtab,
+    yfPreFlow_t  *pf)
 {
-#ifdef YAF_ENABLE_PAYLOAD
-    uint32_t appdata_po;
-    uint32_t last_seq_num = val->lsn;
-    int      p;
-#endif
+    yfFlowNode_t *fn;
+    yfFlowVal_t  *val;
+    yfTCPInfo_t   tcpinfo;
 
-    /*Update flags in flow record - may need to upload iflags if out of order*/
-    if (val->pkt && (tcpinfo->seq > val->isn)) {
-        /* Union flags */
-        val->uflags |= tcpinfo->flags;
-    } else {
-        if (val->pkt && (tcpinfo->seq <= val->isn)) {
-            /*if packets out of order - don't lose other flags - add to
-             * uflags*/
-            val->uflags |= val->iflags;
-        }
-        /* Initial flags */
-        val->iflags = tcpinfo->flags;
-        /* Initial sequence number */
-        val->isn = tcpinfo->seq;
-    }
+    fn = yfFlowGetNode(flowtab, &(pf->key),
+                       yfFlowKeyHashSymmetric(&(pf->key),
+                                              flowtab->no_vlan_in_key),
+                       &val);
 
-    val->lsn = tcpinfo->seq;
+    /* it started when its packet arrived */
+    fn->f.stime = pf->ptime;
+    fn->f.etime = pf->ptime;
 
-    /* Update flow state for FIN flag */
-    if (val == &(fn->f.val)) {
-        if (tcpinfo->flags & YF_TF_FIN) {
-            fn->state |= YAF_STATE_FFIN;
-        }
-        if ((fn->state & YAF_STATE_RFIN) && (tcpinfo->flags & YF_TF_ACK)) {
-            fn->state |= YAF_STATE_FFINACK;
-        }
-    } else {
-        if (tcpinfo->flags & YF_TF_FIN) {
-            fn->state |= YAF_STATE_RFIN;
-        }
-        if ((fn->state & YAF_STATE_FFIN) && (tcpinfo->flags & YF_TF_ACK)) {
-            fn->state |= YAF_STATE_RFINACK;
-        }
-    }
+    val->vlan = pf->key.vlanId;
+    if (flowtab->macmode) {
+        yfFlowCold_t *cold = yfFlowCold(flowtab, &(fn->f));
 
-    /* Update flow state for RST flag */
-    if (tcpinfo->flags & YF_TF_RST) {
-        fn->state |= YAF_STATE_RST;
+        memcpy(cold->sourceMacAddr, pf->smac, ETHERNET_MAC_ADDR_LENGTH);
+        memcpy(cold->destinationMacAddr, pf->dmac, ETHERNET_MAC_ADDR_LENGTH);
+    }
+    if (flowtab->flowstats_mode) {
+        val->stats = slbAlloc0(flowtab->slab, SLB_STATS,
+                               sizeof(yfFlowStats_t));
     }
 
-    if (flowtab->flowstats_mode && (tcpinfo->flags & YF_TF_URG)) {
-        val->stats->tcpurgct++;
+    if (pf->key.proto == YF_PROTO_TCP) {
+        if (pf->datalen) {
+            val->first_pkt_size = pf->datalen;
+            val->appkt = 1;
+        }
+        memset(&tcpinfo, 0, sizeof(tcpinfo));
+        tcpinfo.seq = pf->seq;
+        tcpinfo.flags = pf->flags;
+        yfFlowPktTCP(flowtab, fn, val, NULL, 0, &tcpinfo, NULL, 0);
+    } else {
+        val->first_pkt_size = pf->iplen;
     }
 
-    /** MPTCP stuff */
-    if (tcpinfo->mptcp.flags & 0x01) {
-        /* MP_CAPABLE */
-        val->attributes |= YAF_ATTR_MP_CAPABLE;
+#ifdef YAF_ENABLE_SEPARATE_INTERFACES
+    val->netIf = pf->key.netIf;
+#endif
+
+    val->oct = pf->iplen;
+    val->pkt = 1;
+    if (pf->frag == 1) {
+        val->attributes |= YAF_ATTR_FRAGMENTS;
     }
 
-    if (tcpinfo->flags & YF_TF_SYN) {
-        if (!fn->f.mptcp.token && tcpinfo->mptcp.token) {
-            fn->f.mptcp.token = tcpinfo->mptcp.token;
-        }
-        /* initial priority is set in the MP_JOIN SYN or SYN/ACK */
-        if (tcpinfo->mptcp.flags & 0x02) {
-            fn->f.mptcp.flags |= YF_MF_PRIORITY;
-        }
-    } else if (tcpinfo->mptcp.flags & 0x02) {
-        fn->f.mptcp.flags |= YF_MF_PRIO_CHANGE;
+    if (flowtab->flowstats_mode) {
+        yfFlowStatistics(fn, val, pf->ptime, pf->datalen);
     }
 
-    if (!fn->f.mptcp.idsn) {
-        fn->f.mptcp.idsn = tcpinfo->mptcp.idsn;
-    }
+    /* refile it by its times and the TCP flags of its packet */
+    yfFlowWheelRemove(flowtab, fn);
+    yfFlowWheelFile(flowtab, fn);
 
-    fn->f.mptcp.mss = tcpinfo->mptcp.mss;
+    pf->used = 0;
 
-    fn->f.mptcp.flags |= (tcpinfo->mptcp.flags & 0xFC);
+    return fn;
+}
 
-    if (!fn->f.mptcp.addrid) {
-        fn->f.mptcp.addrid = tcpinfo->mptcp.addrid;
-    }
 
-#ifdef YAF_ENABLE_P0F
-    /* run through p0f if it's enabled here */
-    if (flowtab->p0f_mode) {
-        /* do os fingerprinting if enabled */
-        if (NULL == val->osname) {
-            GError  *err = NULL;
-            struct packetDecodeDetails_st packetDetails;
-            gboolean fuzzyMatched;
+/**
+ * yfPreFlowPacket
+ *
+ * runs a packet past the pre-flow table.  A packet of a flow with an entry
+ * promotes it, so that the packet finds the flow in the table.  The first
+ * packet of a flow is held in an entry instead of creating the flow, if
+ * the table has nothing else to take from it; an entry it displaces leaves
+ * as a single-packet flow.
+ *
+ * @param flowtab pointer to the flow table
+ * @param pbuf the packet
+ * @param hash flow index hash of the packet's key
+ * @param paylen payload captured from the packet
+ * @param datalen transport payload length of the packet
+ * @return TRUE if the packet was held, FALSE if it goes to the flow table
+ *
+ */
+static gboolean
+yfPreFlowPacket(
+    yfFlowTab_t  *flowtab,
+    yfPBuf_t     *pbuf,
+    uint64_t      hash,
+    size_t        paylen,
+    uint32_t      datalen)
+{
+    yfFlowKey_t *key = &(pbuf->key);
+    yfTCPInfo_t *tcpinfo = &(pbuf->tcpinfo);
+    yfPreFlow_t *bucket, *pf, *oldest;
+    gboolean     rev;
+    unsigned int i;
 
-            /* run everything through the p0f finger printer now */
-            if (!yfpPacketParse(headerVal, headerLen, &packetDetails, &err)) {
-                g_clear_error(&err);
-            } else {
-                if (!yfpSynFindMatch(&packetDetails, TRUE, &fuzzyMatched,
-                                     &(val->osname), &(val->osver),
-                                     &(val->osFingerprint), &err))
-                {
-                    g_warning("Error finger printing packet: %s",
-                              err->message);
-                    g_clear_error(&err);
-                }
-            }
-        }
+    if (yfFlowIndexLookup(flowtab->table, key, hash, &rev)) {
+        return FALSE;
     }
-#endif /* ifdef YAF_ENABLE_P0F */
 
-#ifdef YAF_ENABLE_FPEXPORT
-    if (flowtab->fpexport_mode && headerVal) {
-        /* Let's capture the detailed header information for the first 3
-         * packets
-         * mostly for external OS id'ing*/
-        if (&(fn->f.val) == val) {
-            if (NULL == val->firstPacket) {
-                val->firstPacket = g_slice_alloc0(YFP_IPTCPHEADER_SIZE);
-                val->firstPacketLen = headerLen;
-                memcpy(val->firstPacket, headerVal, headerLen);
-            } else if (NULL == val->secondPacket) {
-                val->secondPacket = g_slice_alloc0(YFP_IPTCPHEADER_SIZE);
-                val->secondPacketLen = headerLen;
-                memcpy(val->secondPacket, headerVal, headerLen);
-            }
-        } else {
-            if (NULL == val->firstPacket) {
-                val->firstPacket = g_slice_alloc0(YFP_IPTCPHEADER_SIZE);
-                val->firstPacketLen = headerLen;
-                memcpy(val->firstPacket, headerVal, headerLen);
-            }
+    bucket = flowtab->preflow + (hash & flowtab->preflow_mask) *
+        YF_PREFLOW_WAYS;
+    oldest = bucket;
+    for (i = 0; i < YF_PREFLOW_WAYS; i++) {
+        pf = bucket + i;
+        if (!pf->used) {
+            oldest = pf;
+            continue;
+        }
+        if ((flowtab->no_vlan_in_key ?
+             yfFlowKeyEqualNoVlan(key, &(pf->key)) :
+             yfFlowKeyEqual(key, &(pf->key))) ||
+            yfFlowKeyEqualReverse(key, &(pf->key), flowtab->no_vlan_in_key))
+        {
+            /* second packet: the flow goes into the table */
+            yfPreFlowPromote(flowtab, pf);
+            YF_STAT_INC(flowtab->stats.stat_preflow_promoted);
+            return FALSE;
+        }
+        if (oldest->used && pf->ptime < oldest->ptime) {
+            oldest = pf;
         }
     }
-#endif /* ifdef YAF_ENABLE_FPEXPORT */
 
-#ifdef YAF_ENABLE_PAYLOAD
-    /* short circuit no payload capture, continuation,
-     * payload full, or no payload in packet */
-    if (!flowtab->max_payload || !(val->iflags & YF_TF_SYN) ||
-        caplen == 0)
+    /* only hold a packet whose flow needs nothing but what an entry keeps:
+     * no payload, no RST to close it, no MPTCP options, and not a UDP
+     * packet the flow table will close by itself */
+    if (paylen) {
+        return FALSE;
+    }
+    if (key->proto == YF_PROTO_TCP &&
+        ((tcpinfo->flags & YF_TF_RST) || tcpinfo->mptcp.flags ||
+         tcpinfo->mptcp.token || tcpinfo->mptcp.idsn ||
+         tcpinfo->mptcp.addrid))
     {
-        return;
+        return FALSE;
     }
-
-    if (last_seq_num == (tcpinfo->seq + 1)) {
-        /* TCP KEEP ALIVE */
-        return;
+    if (key->proto == YF_PROTO_UDP && flowtab->udp_uniflow_port &&
+        ((flowtab->udp_uniflow_port == 1) ||
+         (flowtab->udp_uniflow_port == key->sp) ||
+         (flowtab->udp_uniflow_port == key->dp)))
+    {
+        return FALSE;
     }
 
-    /* Find app data offset in payload buffer */
-    appdata_po = tcpinfo->seq - (val->isn + 1);
-
-    /* allocate and copy */
-    if (!val->payload) {
-        val->payload = g_slice_alloc0(flowtab->max_payload);
-        val->paybounds = (size_t *)g_slice_alloc0(sizeof(size_t) *
-                                                  YAF_MAX_PKT_BOUNDARY);
+    /* a full bucket gives up its oldest entry */
+    if (oldest->used) {
+        yfFlowClose(flowtab, yfPreFlowPromote(flowtab, oldest),
+                    YAF_END_RESOURCE);
+        YF_STAT_INC(flowtab->stats.stat_preflow_single);
     }
 
-    if (val->pkt < YAF_MAX_PKT_BOUNDARY) {
-        p = val->pkt;
-        val->paybounds[p] = appdata_po;
-    }
+    pf = oldest;
+    memcpy(&(pf->key), key, sizeof(yfFlowKey_t));
+    pf->ptime = pbuf->ptime;
+    pf->iplen = pbuf->iplen;
+    pf->datalen = datalen;
+    pf->seq = tcpinfo->seq;
+    pf->flags = tcpinfo->flags;
+    pf->frag = pbuf->frag;
+    memcpy(pf->smac, pbuf->l2info.smac, ETHERNET_MAC_ADDR_LENGTH);
+    memcpy(pf->dmac, pbuf->l2info.dmac, ETHERNET_MAC_ADDR_LENGTH);
+    pf->used = 1;
+    YF_STAT_INC(flowtab->stats.stat_preflow_held);
 
-    /* leave open the case in which we receive an out of order packet */
-    if ((val->paylen == flowtab->max_payload) &&
-        (appdata_po >= flowtab->max_payload))
-    {
-        return;
-    }
+    return TRUE;
+}
 
-    /* Short circuit entire packet after capture filter */
-    if (appdata_po >= flowtab->max_payload) {return;}
 
-    /* truncate payload copy length to capture length */
-    if ((appdata_po + caplen) > flowtab->max_payload) {
-        caplen = flowtab->max_payload - appdata_po;
-        if (caplen > flowtab->max_payload) {
-            caplen = flowtab->max_payload;
+/**
+ * yfPreFlowIdleMs
+ *
+ * returns the idle timeout of the flow of a pre-flow entry, as
+ * yfFlowIdleMs() would once the flow is in the table.
+ *
+ */
+static uint64_t
+yfPreFlowIdleMs(
+    yfFlowTab_t  *flowtab,
+    yfPreFlow_t  *pf)
+{
+    uint64_t idle_ms;
+
+    idle_ms = flowtab->tprofs[yfFlowTimeoutProfile(flowtab, &(pf->key),
+                                                   0)].idle_ms;
+    if (pf->key.proto != YF_PROTO_TCP) {
+        return idle_ms;
+    }
+    if (pf->flags & YF_TF_FIN) {
+        if (flowtab->tcp_fin_ms && flowtab->tcp_fin_ms < idle_ms) {
+            return flowtab->tcp_fin_ms;
         }
+    } else if (flowtab->tcp_syn_ms && flowtab->tcp_syn_ms < idle_ms &&
+               (pf->flags & YF_TF_SYN) && !(pf->flags & YF_TF_ACK))
+    {
+        return flowtab->tcp_syn_ms;
     }
 
-    if (val->paylen < appdata_po + caplen) {
-        val->paylen = appdata_po + caplen;
-    }
-    memcpy(val->payload + appdata_po, pkt, caplen);
-#endif /* ifdef YAF_ENABLE_PAYLOAD */
+    return idle_ms;
 }
 
 
+/**
+ * yfPreFlowExpire
+ *
+ * sends pre-flow entries that have been idle past the idle timeout to the
+ * close queue as single-packet flows.  If `close` is set, every entry goes
+ * to the flow table to be flushed with the rest of the flows.
+ *
+ * @param flowtab pointer to the flow table
+ * @param close TRUE if the flow table is being flushed
+ *
+ */
 static void
-yfFlowStatistics(
-    yfFlowNode_t  *fn,
-    yfFlowVal_t   *val,
-    uint64_t       ptime,
-    uint32_t       datalen)
+yfPreFlowExpire(
+    yfFlowTab_t  *flowtab,
+    gboolean      close)
 {
-    if (val->stats->ltime) {
-        val->stats->aitime += (ptime - val->stats->ltime);
-    }
+    yfPreFlow_t *pf, *end;
 
-    if (val->pkt > 1 && val->pkt < 12) {
-        val->stats->iaarray[val->pkt - 2] = (ptime - val->stats->ltime);
+    /* a scan covers the whole table, so do not scan on every flush */
+    if (!close &&
+        (flowtab->ctime < flowtab->preflow_scantime + YF_FLUSH_DELAY))
+    {
+        return;
     }
+    flowtab->preflow_scantime = flowtab->ctime;
 
-    val->stats->ltime = fn->f.etime;
-
-    if (datalen) {
-        /* that means there is some payload */
-        if (val == &(fn->f.rval)) {
-            fn->f.pktdir |= (1 << (fn->f.val.stats->nonemptypktct +
-                                   val->stats->nonemptypktct));
-        }
-        if (val->stats->nonemptypktct < 10) {
-            val->stats->pktsize[val->stats->nonemptypktct] = datalen;
-        }
-        val->stats->nonemptypktct++;
-        if (datalen < YAF_SMALL_PKT_BOUND) {
-            val->stats->smallpktct++;
-        } else if (datalen > YAF_LARGE_PKT_BOUND) {
-            val->stats->largepktct++;
-        }
-        val->stats->payoct += datalen;
-        if (val->stats->firstpktsize == 0) {
-            val->stats->firstpktsize = datalen;
+    end = flowtab->preflow + (flowtab->preflow_mask + 1) * YF_PREFLOW_WAYS;
+    for (pf = flowtab->preflow; pf < end; pf++) {
+        if (!pf->used) {
+            continue;
         }
-        if (datalen > val->stats->maxpktsize) {
-            val->stats->maxpktsize = datalen;
+        if (pf->ptime + yfPreFlowIdleMs(flowtab, pf) < flowtab->ctime) {
+            yfFlowClose(flowtab, yfPreFlowPromote(flowtab, pf), YAF_END_IDLE);
+            YF_STAT_INC(flowtab->stats.stat_preflow_single);
+        } else if (close) {
+            /* closed as forced with the others */
+            yfPreFlowPromote(flowtab, pf);
+            YF_STAT_INC(flowtab->stats.stat_preflow_single);
         }
     }
 }
 
 
+/**
+ * yfFlowPBufHashed
+ *
+ * parse a packet buffer structure and turn it into a flow record
+ * this may update an existing flow record, or get a new flow record
+ * and populate it.  It calls various functions to decode the
+ * packet buffer and extract protocol details
+ *
+ * @param flowtab pointer to the flow table
+ * @param pbuflen length of the packet buffer
+ * @param pbuf pointer to the packet data
+ * @param hash flow index hash of the packet's key
+ *
+ */
 static void
-yfAddOutOfSequence(
+yfFlowPBufHashed(
     yfFlowTab_t  *flowtab,
-    yfFlowKey_t  *key,
     size_t        pbuflen,
-    yfPBuf_t     *pbuf)
+    yfPBuf_t     *pbuf,
+    uint64_t      hash)
 {
+    yfFlowKey_t *key = &(pbuf->key);
+    yfFlowKey_t rkey;
+    yfFlowVal_t *val = NULL;
     yfFlowNode_t *fn = NULL;
-    yfFlowNode_t *tn = NULL;
-    yfFlowNode_t *nfn = NULL;
-    yfFlowKey_t   rkey;
-    uint64_t      end;
-    yfFlowVal_t  *val = NULL;
-    yfTCPInfo_t  *tcpinfo = &(pbuf->tcpinfo);
-    yfL2Info_t   *l2info = &(pbuf->l2info);
-    uint8_t      *payload = (pbuflen >= YF_PBUFLEN_BASE) ?
-        pbuf->payload : NULL;
-    size_t        paylen = (pbuflen >= YF_PBUFLEN_BASE) ?
+    yfTCPInfo_t *tcpinfo = &(pbuf->tcpinfo);
+    yfL2Info_t *l2info = &(pbuf->l2info);
+    uint8_t *payload = (pbuflen >= YF_PBUFLEN_BASE) ?
+        (uint8_t *)pbuf->paydata : NULL;
+    size_t paylen = (pbuflen >= YF_PBUFLEN_BASE) ?
         pbuf->paylen : 0;
-    uint32_t      datalen = (pbuf->iplen - pbuf->allHeaderLen +
-                             l2info->l2hlen);
-    uint32_t      pcap_len = 0;
-    gboolean      rev = FALSE;
-    GHashTable   *ht;
+    uint32_t datalen = (pbuf->iplen - pbuf->allHeaderLen +
+                        l2info->l2hlen);
+    uint32_t pcap_len = 0;
+    uint8_t ostate;
+    gboolean newflow;
+#ifdef YAF_ENABLE_APPLABEL
+    uint16_t tapp = 0;
+#endif
 
-#ifdef YAF_MPLS
-    if (flowtab->mpls_mode) {
-        ht = flowtab->cur_mpls_node->tab;
-        yfMPLSGetNode(flowtab, l2info);
-    } else
-#endif /* ifdef YAF_MPLS */
-    {
-        ht = flowtab->table;
+    /* skip and count out of sequence packets */
+    if (pbuf->ptime < flowtab->ctime) {
+        if (!flowtab->force_read_all) {
+            YF_STAT_INC(flowtab->stats.stat_seqrej);
+            return;
+        } else {
+            yfAddOutOfSequence(flowtab, key, pbuflen, pbuf);
+            return;
+        }
     }
 
+    /* update flow table current time */
+    flowtab->ctime = pbuf->ptime;
+
     /* Count the packet and its octets */
-    ++(flowtab->stats.stat_packets);
-    flowtab->stats.stat_octets += pbuf->iplen;
+    YF_STAT_INC(flowtab->stats.stat_packets);
+    YF_STAT_ADD(flowtab->stats.stat_octets, pbuf->iplen);
 
     if (payload) {
         if (paylen >= pbuf->allHeaderLen) {
@@ -2312,89 +4224,96 @@ yfAddOutOfSequence(
         }
     }
 
-    /* Look for flow in table */
-    if ((fn = g_hash_table_lookup(ht, key))) {
-        /* Forward flow found. */
-        val = &(fn->f.val);
+#ifdef YAF_ENABLE_HOOKS
+    /* Run packet hook; allow it to veto continued processing of the
+     * packet.  The hook may also rewrite the key, which changes its hash */
+    rkey = *key;
+    if (!yfHookPacket(key, payload, paylen,
+                      pbuf->iplen, tcpinfo, l2info))
+    {
+        return;
     }
-
-    if (fn == NULL) {
-        /* Okay. Check for reverse flow. */
-        yfFlowKeyReverse(key, &rkey);
-        rev = TRUE;
-        if ((fn = g_hash_table_lookup(ht, &rkey))) {
-            /* Reverse flow found. */
-            val = &(fn->f.rval);
-        }
+    if (memcmp(&rkey, key, sizeof(rkey))) {
+        hash = yfFlowKeyHashSymmetric(key, flowtab->no_vlan_in_key);
     }
+#endif /* ifdef YAF_ENABLE_HOOKS */
 
-    if (fn == NULL) {
-        /* Neither exists. Create a new flow and put it in the table. */
-#ifdef YAF_ENABLE_COMPACT_IP4
-        if (key->version == 4) {
-            fn = (yfFlowNode_t *)g_slice_new0(yfFlowNodeIPv4_t);
-        } else
-#endif  /* YAF_ENABLE_COMPACT_IP4 */
-        {
-            fn = g_slice_new0(yfFlowNode_t);
-        }
-
-        /* Copy key */
-        yfFlowKeyCopy(key, &(fn->f.key));
-
-        /* set flow start time */
-        fn->f.stime = pbuf->ptime;
-
-        /* set flow end time as start time */
-        fn->f.etime = pbuf->ptime;
-
-        /* stuff the flow in the table */
-        g_hash_table_insert(ht, &(fn->f.key), fn);
-
-        /* This is a forward flow */
-        val = &(fn->f.val);
-
-        /* Count it */
-        ++(flowtab->count);
 #ifdef YAF_MPLS
-        if (flowtab->mpls_mode) {
-            fn->f.mpls = flowtab->cur_mpls_node;
-            ++(flowtab->cur_mpls_node->tab_count);
-        }
+    if (flowtab->mpls_mode) {
+        yfMPLSGetNode(flowtab, l2info);
+    }
 #endif  /* YAF_MPLS */
 
-        if (flowtab->count > flowtab->stats.stat_peak) {
-            flowtab->stats.stat_peak = flowtab->count;
-        }
+    /* Hold the first packet of a flow in the pre-flow table */
+    if (flowtab->preflow &&
+        yfPreFlowPacket(flowtab, pbuf, hash, paylen, datalen))
+    {
+        return;
+    }
 
-#ifdef YAF_ENABLE_HOOKS
-        /*Let the hook allocate its context */
-        yfHookFlowAlloc(&(fn->f), flowtab->yfctx);
+    /* Get a flow node for this flow */
+    fn = yfFlowGetNode(flowtab, key, hash, &val);
+    /* Check for active timeout or counter overflow */
+    if (((pbuf->ptime - fn->f.stime) >
+         flowtab->tprofs[fn->tprof].active_ms) ||
+        (flowtab->silkmode && (val->oct + pbuf->iplen > UINT32_MAX)))
+    {
+        yfFlowClose(flowtab, fn, YAF_END_ACTIVE);
+#ifdef YAF_ENABLE_APPLABEL
+        /* copy applabel over */
+        if (flowtab->applabelmode) {tapp = fn->f.appLabel;}
 #endif
-
+        /* get a new flow node containing this packet */
+        fn = yfFlowGetNode(flowtab, key, hash, &val);
+        /* set continuation flag in silk mode */
+        if (flowtab->silkmode) {fn->f.reason = YAF_ENDF_ISCONT;}
 #ifdef YAF_ENABLE_APPLABEL
-        ydAllocFlowContext(&(fn->f));
+        /* copy applabel into new flow, which may change its timeouts */
+        if (flowtab->applabelmode && tapp) {
+            fn->f.appLabel = tapp;
+            fn->tprof = yfFlowTimeoutProfile(flowtab, key, tapp);
+            yfFlowWheelRemove(flowtab, fn);
+            yfFlowWheelFile(flowtab, fn);
+        }
 #endif
     }
 
+    /* Check for inactive timeout - esp when reading from pcap */
+    if ((pbuf->ptime - fn->f.etime) > yfFlowIdleMs(flowtab, fn)) {
+        yfFlowClose(flowtab, fn, YAF_END_IDLE);
+        /* get a new flow node for the current packet */
+        fn = yfFlowGetNode(flowtab, key, hash, &val);
+    }
+
+    /* note what can shorten the idle timeout of a TCP flow */
+    ostate = fn->state;
+    newflow = (fn->f.val.pkt == 0 && fn->f.rval.pkt == 0);
+
+    /* First Packet? */
     if (val->pkt == 0) {
-        /* Note Mac Addr */
-        if (flowtab->macmode && (val == &(fn->f.val))) {
+        val->vlan = key->vlanId;
+        if (flowtab->macmode && val == &(fn->f.val)) {
+            /* Note Mac Addr */
             if (l2info) {
-                memcpy(fn->f.sourceMacAddr, l2info->smac,
+                yfFlowCold_t *cold = yfFlowCold(flowtab, &(fn->f));
+
+                memcpy(cold->sourceMacAddr, l2info->smac,
                        ETHERNET_MAC_ADDR_LENGTH);
-                memcpy(fn->f.destinationMacAddr, l2info->dmac,
+                memcpy(cold->destinationMacAddr, l2info->dmac,
                        ETHERNET_MAC_ADDR_LENGTH);
             }
         }
         /* Allocate Flow Statistics */
         if (flowtab->flowstats_mode) {
-            val->stats = g_slice_new0(yfFlowStats_t);
+            val->stats = slbAlloc0(flowtab->slab, SLB_STATS,
+                                   sizeof(yfFlowStats_t));
+        }
+        /* Calculate reverse RTT */
+        if (val == &(fn->f.rval)) {
+            fn->f.rdtime = pbuf->ptime - fn->f.stime;
         }
     }
 
-    /* packet exists now, update info */
-
     /* Do payload and TCP stuff */
     if (fn->f.key.proto == YF_PROTO_TCP) {
         /* Handle TCP flows specially (flags, ISN, sequenced payload) */
@@ -2444,19 +4363,34 @@ yfAddOutOfSequence(
         }
     }
 
-    /* set flow attributes - this flow is out of order */
-    val->attributes |= YAF_ATTR_OUT_OF_SEQUENCE;
+#ifdef YAF_ENABLE_SEPARATE_INTERFACES
+    val->netIf = pbuf->key.netIf;
+#endif
+
+    /* Count packets and octets */
+    val->oct += pbuf->iplen;
+    val->pkt += 1;
 
     /* Mark if fragmented */
     if (pbuf->frag == 1) {
         val->attributes |= YAF_ATTR_FRAGMENTS;
     }
 
-    /* Count packets and octets */
-    val->oct += pbuf->iplen;
-    val->pkt += 1;
+    /* update flow end time */
+    fn->f.etime = pbuf->ptime;
 
-    /* don't update end time - stime could be greater than etime */
+    /* a TCP flow that has only seen a SYN, or has just seen a FIN, may
+     * expire sooner than it was filed for, so move it on the expiry wheel;
+     * any other deadline only moves later, which the wheel picks up when
+     * the flow's slot comes around */
+    if (fn->f.key.proto == YF_PROTO_TCP &&
+        ((flowtab->tcp_syn_ms && newflow) ||
+         (flowtab->tcp_fin_ms && (fn->state & YAF_STATE_FIN) &&
+          !(ostate & YAF_STATE_FIN))))
+    {
+        yfFlowWheelRemove(flowtab, fn);
+        yfFlowWheelFile(flowtab, fn);
+    }
 
     /* Update stats */
     if (flowtab->flowstats_mode) {
@@ -2465,12 +4399,11 @@ yfAddOutOfSequence(
 
 #ifdef YAF_ENABLE_HOOKS
     /* Hook Flow Processing */
-    yfHookFlowPacket(&(fn->f), val, payload,
-                     paylen, pbuf->iplen, tcpinfo, l2info);
+    yfHookFlowPacket(&(fn->f), val, payload, paylen, pbuf->iplen,
+                     tcpinfo, l2info);
 #endif
 
     pcap_len = pbuf->pcap_hdr.caplen + 16;
-
     /* Write Packet to Pcap-Per-Flow pcap file */
     if (flowtab->pcap_dir) {
         /* what we actually hold in yaf dependent on max-payload */
@@ -2485,7 +4418,8 @@ yfAddOutOfSequence(
 
     /* Write Pcap Meta Info */
     if (flowtab->pcap_meta) {
-        if (rev) {
+        if (val == &(fn->f.rval)) {
+            yfFlowKeyReverse(key, &rkey);
             yfWritePcapMetaFile(flowtab, fn, pbuf, flowtab->hashfn(&rkey),
                                 pcap_len);
         } else {
@@ -2494,6 +4428,16 @@ yfAddOutOfSequence(
         }
     }
 
+#ifdef YAF_ENABLE_NDPI
+    if (flowtab->ndpi_struct && payload &&
+        (!fn->f.cold || !fn->f.cold->ndpi_done))
+    {
+        yfNDPIApplabel(flowtab, &(fn->f),
+                       payload - pbuf->allHeaderLen + l2info->l2hlen,
+                       paylen + pbuf->allHeaderLen - l2info->l2hlen);
+    }
+#endif /* ifdef YAF_ENABLE_NDPI */
+
     /* if udp-uniflow-mode, close UDP flow now */
     if ((fn->f.key.proto == YF_PROTO_UDP) && (flowtab->udp_uniflow_port != 0)) {
         if (((flowtab->udp_uniflow_port == 1) ||
@@ -2505,451 +4449,931 @@ yfAddOutOfSequence(
         }
     }
 
-    /* close flow, or move it to head of queue */
+    if (flowtab->idle_ms == 0) {
+        /* each pkt as a flow */
+        yfFlowClose(flowtab, fn, YAF_END_IDLE);
+        return;
+    }
+
+    /* close flow; otherwise it is left on the expiry wheel, which picks up
+     * the new end time when its slot comes around */
     if ((fn->state & YAF_STATE_FIN) == YAF_STATE_FIN ||
         fn->state & YAF_STATE_RST)
     {
         yfFlowClose(flowtab, fn, YAF_END_CLOSED);
-        return;
     }
+}
 
-    /* Check for inactive timeout - this flow might be idled out on arrival */
-    if ((flowtab->ctime - pbuf->ptime) > flowtab->idle_ms) {
-        yfFlowClose(flowtab, fn, YAF_END_IDLE);
-        return;
-    } else if (flowtab->idle_ms == 0) {
-        yfFlowClose(flowtab, fn, YAF_END_IDLE);
-        return;
-    }
+void
+yfFlowPBuf(
+    yfFlowTab_t  *flowtab,
+    size_t        pbuflen,
+    yfPBuf_t     *pbuf)
+{
+    yfFlowPBufHashed(flowtab, pbuflen, pbuf,
+                     yfFlowKeyHashSymmetric(&(pbuf->key),
+                                            flowtab->no_vlan_in_key));
+}
 
-    if (flowtab->aq.head == NULL) {
-        yfFlowTick(flowtab, fn);
-        return;
+
+void
+yfFlowPBufBatch(
+    yfFlowTab_t  *flowtab,
+    size_t        pbuflen,
+    yfPBuf_t     *pbufs[],
+    size_t        count)
+{
+    uint64_t       hash[YF_PBUF_BATCH];
+    yfFlowIndex_t *ht = flowtab->table;
+    size_t         base, n, i, next;
+
+#ifdef YAF_MPLS
+    /* the table each packet goes to is not known until it is processed */
+    if (flowtab->mpls_mode) {
+        ht = NULL;
     }
+#endif  /* YAF_MPLS */
 
-    /* rip through the active queue and put this in the right spot */
-    /* first remove the node */
-    piqPick(&flowtab->aq, fn);
-
-    for (tn = flowtab->aq.head; tn; tn = nfn) {
-        end = tn->f.etime;
-        nfn = tn->p;
-        if (end <= fn->f.etime) {
-            if (tn != flowtab->aq.head) {
-                /* nfn is previous node */
-                nfn = tn->n;
-                /* point previous (next) to new node */
-                nfn->p = fn;
-                /* point current previous to new node */
-                tn->n = fn;
-                /* point new node's next to current */
-                fn->p = tn;
-                /* point new node's previous to previous */
-                fn->n = nfn;
-                /*yfFlowTabVerifyIdleOrder(flowtab);*/
-            } else {
-                /* we're at the head */
-                /* set new node's previous to current head */
-                fn->p = tn;
-                /* set current's head next to new node */
-                tn->n = fn;
-                /* set flowtab head to new node */
-                flowtab->aq.head = fn;
+    for (base = 0; base < count; base += n) {
+        n = MIN(count - base, YF_PBUF_BATCH);
+
+        /* Hash every key and start loading the group each lookup probes
+         * first; once the group of an earlier packet has had time to
+         * arrive, start loading that packet's flow node as well */
+        for (i = 0, next = 0; i < n; i++) {
+            hash[i] = yfFlowKeyHashSymmetric(&(pbufs[base + i]->key),
+                                             flowtab->no_vlan_in_key);
+            if (ht) {
+                yfFlowIndexPrefetch(ht, hash[i]);
+                if (i >= YF_PBUF_PREFETCH_AHEAD) {
+                    yfFlowIndexPrefetchNode(ht, hash[next++]);
+                }
             }
-            return;
+        }
+
+        /* Then run each packet through the flow table in order,
+         * prefetching the nodes the loop above did not get to */
+        for (i = 0; i < n; i++) {
+            if (ht && next < n) {
+                yfFlowIndexPrefetchNode(ht, hash[next++]);
+            }
+            yfFlowPBufHashed(flowtab, pbuflen, pbufs[base + i], hash[i]);
         }
     }
+}
 
-    /* if this happens, we are at the tail */
-    if (flowtab->aq.tail) {
-        nfn = flowtab->aq.tail;
-        /* this flow's next (in non-Brian land - previous) is the tail */
-        fn->n = nfn;
-        /* the tail's previous (next) now points to new node */
-        nfn->p = fn;
-        /* tail is now new node */
-        flowtab->aq.tail = fn;
-    } else {
-        /* shouldn't get here but if we do,just get rid of this troublemaker.*/
-        yfFlowClose(flowtab, fn, YAF_END_IDLE);
+
+/**
+ * yfUniflow
+ *
+ * creates a uniflow record from a biflow record, in order to split
+ * the record into a single record for uniflow only collection systems
+ *
+ * @param bf pointer to normal biflow yaf flow record
+ * @param uf pointer to a new flow record, that will have its rev
+ *           (reverse) values NULLed
+ * @param ucold storage for the cold state of the new flow record
+ *
+ */
+static void
+yfUniflow(
+    yfFlow_t      *bf,
+    yfFlow_t      *uf,
+    yfFlowCold_t  *ucold)
+{
+#ifdef YAF_ENABLE_COMPACT_IP4
+    if (bf->key.version == 4) {
+        memcpy(uf, bf, YF_FLOW_IPV4_SIZE);
+    } else
+#endif  /* YAF_ENABLE_COMPACT_IP4 */
+    {
+        memcpy(uf, bf, sizeof(yfFlow_t));
+    }
+    memset(&(uf->rval), 0, sizeof(yfFlowVal_t));
+    uf->rdtime = 0;
+
+    /* the reverse uniflow swaps the MAC addresses, so needs its own copy
+     * of the cold state */
+    if (bf->cold) {
+        memcpy(ucold, bf->cold, sizeof(yfFlowCold_t));
+        uf->cold = ucold;
+    }
+}
+
+/**
+ * yfUniflowReverse
+ *
+ * reverses the flow information in the biflow in order to generate
+ * two uniflow outputs
+ *
+ *
+ * @param bf pointer to biflow record
+ * @param uf pointer to uniflow record to fill in
+ *
+ * @return TRUE on success, FALSE on error
+ */
+static gboolean
+yfUniflowReverse(
+    yfFlow_t  *bf,
+    yfFlow_t  *uf)
+{
+    if (!(bf->rval.pkt)) {return FALSE;}
+
+    /* calculate reverse time */
+    uf->stime = bf->stime + bf->rdtime;
+    uf->etime = bf->etime;
+    uf->rdtime = 0;
+
+    if (bf->cold) {
+        memcpy(uf->cold->sourceMacAddr, bf->cold->destinationMacAddr,
+               ETHERNET_MAC_ADDR_LENGTH);
+        memcpy(uf->cold->destinationMacAddr, bf->cold->sourceMacAddr,
+               ETHERNET_MAC_ADDR_LENGTH);
     }
+
+    /* reverse key */
+    yfFlowKeyReverse(&bf->key, &uf->key);
+
+    /* copy and reverse value */
+    memcpy(&(uf->val), &(bf->rval), sizeof(yfFlowVal_t));
+    memset(&(uf->rval), 0, sizeof(yfFlowVal_t));
+
+    /* copy reason */
+    uf->reason = bf->reason;
+    uf->key.tos = bf->rtos;
+
+    /* all done */
+    return TRUE;
 }
 
 
-#ifdef YAF_ENABLE_NDPI
+/**
+ * yfFlowWrite
+ *
+ * writes a closed flow to the output of the context, split in two
+ * in uniflow mode.
+ *
+ */
+static gboolean
+yfFlowWrite(
+    yfContext_t   *ctx,
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn,
+    GError       **err)
+{
+    yfFlow_t     uf;
+    yfFlowCold_t ucold;
+    gboolean     wok;
+
+    if (flowtab->uniflow) {
+        /* Uniflow mode. Split flow in two and write. */
+        yfUniflow(&(fn->f), &uf, &ucold);
+        wok = yfWriteFlow(ctx, &uf, err);
+        if (wok) {
+            YF_STAT_INC(flowtab->stats.stat_flows);
+        }
+        if (wok && yfUniflowReverse(&(fn->f), &uf)) {
+            wok = yfWriteFlow(ctx, &uf, err);
+            if (wok) {
+                YF_STAT_INC(flowtab->stats.stat_flows);
+            }
+        }
+    } else {
+        /* Biflow mode. Write flow whole. */
+        wok = yfWriteFlow(ctx, &(fn->f), err);
+        if (wok) {
+            YF_STAT_INC(flowtab->stats.stat_flows);
+        }
+    }
+
+    return wok;
+}
+
 
 /**
- * yfNDPIApplabel
+ * yfFlowExportQueue
+ *
+ * moves closed flows from the close queue to the export queue.  When
+ * the export queue is full the rest wait on the close queue for the
+ * next flush, unless closing or the close queue is already at its
+ * limit, in which case this waits for the export thread to make room.
  *
  */
 static void
-yfNDPIApplabel(
+yfFlowExportQueue(
+    lfqQueue_t   *exportq,
     yfFlowTab_t  *flowtab,
-    yfFlow_t     *flow,
-    uint8_t      *payload,
-    size_t        paylen)
+    gboolean      close)
 {
-    struct ndpi_flow_struct *nflow;
-    struct ndpi_id_struct src, dst;
-    ndpi_protocol proto;
+    yfFlowNode_t *fn = NULL;
+    gboolean      stalled = FALSE;
 
-    if (paylen == 0) {
-        return;
+    if (!flowtab->exdone) {
+        flowtab->exdone = lfqAlloc(YF_EXPORT_MAX);
+    }
+
+    yfFlowExportReclaim(flowtab);
+
+    while ((fn = piqDeQ(&flowtab->cq))) {
+        fn->flowtab = flowtab;
+        if (flowtab->excount < YF_EXPORT_MAX && lfqPush(exportq, fn)) {
+            /* quick accounting of asymmetric/uniflow records present */
+            if ((fn->f.rval.oct == 0) && (fn->f.rval.pkt == 0)) {
+                YF_STAT_INC(flowtab->stats.stat_uniflows);
+            }
+            ++(flowtab->excount);
+            --(flowtab->cq_count);
+            continue;
+        }
+
+        /* the export thread is behind */
+        piqUnshift(&flowtab->cq, fn);
+        if (!close && flowtab->cq_count < YF_EXPORT_CQ_LIMIT) {
+            YF_STAT_INC(flowtab->stats.stat_export_deferred);
+            break;
+        }
+        if (!stalled) {
+            YF_STAT_INC(flowtab->stats.stat_export_stalls);
+            stalled = TRUE;
+        }
+        g_usleep(YF_EXPORT_WAIT);
+        yfFlowExportReclaim(flowtab);
+    }
+}
+
+
+/**
+ * yfCheckpointHeaderInit
+ *
+ * fills in the checkpoint header a flow table writes, and expects to
+ * read, apart from its time and flow count.
+ *
+ */
+static void
+yfCheckpointHeaderInit(
+    yfCheckpointHeader_t  *hdr,
+    const yfFlowTab_t     *flowtab)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, YF_CKPT_MAGIC, sizeof(YF_CKPT_MAGIC));
+    hdr->version = YF_CKPT_VERSION;
+#ifdef YAF_ENABLE_PAYLOAD
+    hdr->build |= YF_CKPT_BUILD_PAYLOAD;
+#endif
+#ifdef YAF_ENABLE_APPLABEL
+    hdr->build |= YF_CKPT_BUILD_APPLABEL;
+#endif
+#ifdef YAF_MPLS
+    hdr->build |= YF_CKPT_BUILD_MPLS;
+#endif
+#if defined(YAF_ENABLE_DAG_SEPARATE_INTERFACES) || defined(YAF_ENABLE_SEPARATE_INTERFACES)
+    hdr->build |= YF_CKPT_BUILD_SEPIF;
+#endif
+#ifdef YAF_ENABLE_P0F
+    hdr->build |= YF_CKPT_BUILD_P0F;
+#endif
+#ifdef YAF_ENABLE_FPEXPORT
+    hdr->build |= YF_CKPT_BUILD_FPEXPORT;
+#endif
+#ifdef YAF_ENABLE_ENTROPY
+    hdr->build |= YF_CKPT_BUILD_ENTROPY;
+#endif
+#ifdef YAF_ENABLE_NDPI
+    hdr->build |= YF_CKPT_BUILD_NDPI;
+#endif
+#ifdef YAF_ENABLE_HOOKS
+    hdr->build |= YF_CKPT_BUILD_HOOKS;
+#endif
+    hdr->flow_size = sizeof(yfCheckpointFlow_t);
+    hdr->stats_size = sizeof(yfFlowStats_t);
+    hdr->bounds = YAF_MAX_PKT_BOUNDARY;
+    hdr->no_vlan_in_key = flowtab->no_vlan_in_key ? 1 : 0;
+    hdr->mpls_mode = flowtab->mpls_mode ? 1 : 0;
+}
+
+
+yfCheckpoint_t *
+yfCheckpointAlloc(
+    const char  *path)
+{
+    yfCheckpoint_t *ckpt = g_new0(yfCheckpoint_t, 1);
+
+    ckpt->path = g_strdup(path);
+    ckpt->tmppath = g_strdup_printf("%s.tmp", path);
+    pthread_mutex_init(&(ckpt->lock), NULL);
+
+    return ckpt;
+}
+
+
+void
+yfCheckpointRequest(
+    yfCheckpoint_t  *ckpt)
+{
+    ckpt->requested = 1;
+}
+
+
+gboolean
+yfCheckpointFree(
+    yfCheckpoint_t  *ckpt,
+    GError         **err)
+{
+    gboolean ok = TRUE;
+
+    if (ckpt->fp) {
+        /* the header goes in last, once the flow count is known */
+        if (!ckpt->failed &&
+            (fseeko(ckpt->fp, 0, SEEK_SET) ||
+             fwrite(&(ckpt->hdr), sizeof(ckpt->hdr), 1, ckpt->fp) != 1 ||
+             fflush(ckpt->fp) || fsync(fileno(ckpt->fp))))
+        {
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Error writing checkpoint %s: %s",
+                        ckpt->tmppath, strerror(errno));
+            ok = FALSE;
+        }
+        if (fclose(ckpt->fp) && ok && !ckpt->failed) {
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Error closing checkpoint %s: %s",
+                        ckpt->tmppath, strerror(errno));
+            ok = FALSE;
+        }
+        if (ok && !ckpt->failed) {
+            if (rename(ckpt->tmppath, ckpt->path)) {
+                g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                            "Cannot rename checkpoint %s to %s: %s",
+                            ckpt->tmppath, ckpt->path, strerror(errno));
+                ok = FALSE;
+            } else {
+                g_debug("Wrote %" PRIu64 " active flows to checkpoint %s",
+                          ckpt->hdr.count, ckpt->path);
+            }
+        }
+        if (!ok || ckpt->failed) {
+            unlink(ckpt->tmppath);
+        }
     }
 
-    nflow = malloc(sizeof(struct ndpi_flow_struct));
-    memset(nflow, 0, sizeof(struct ndpi_flow_struct));
-    memset(&src, 0, sizeof(struct ndpi_id_struct));
-    memset(&dst, 0, sizeof(struct ndpi_id_struct));
-
-    proto = ndpi_detection_process_packet(flowtab->ndpi_struct, nflow, payload,
-                                          paylen, flow->etime, &src, &dst);
-    flow->ndpi_master = proto.master_protocol;
-    flow->ndpi_sub = proto.app_protocol;
+    pthread_mutex_destroy(&(ckpt->lock));
+    g_free(ckpt->path);
+    g_free(ckpt->tmppath);
+    g_free(ckpt);
 
-    /* g_debug("proto is %d other is %d", proto.master_protocol,
-     * proto.protocol); */
-    ndpi_free_flow(nflow);
+    return ok;
 }
 
 
-#endif /* ifdef YAF_ENABLE_NDPI */
-
 /**
- * yfFlowPBuf
- *
- * parse a packet buffer structure and turn it into a flow record
- * this may update an existing flow record, or get a new flow record
- * and populate it.  It calls various functions to decode the
- * packet buffer and extract protocol details
+ * yfCheckpointOpen
  *
- * @param flowtab pointer to the flow table
- * @param pbuflen length of the packet buffer
- * @param pbuf pointer to the packet data
+ * creates the checkpoint file for the first flow table to write to it,
+ * leaving room for the header.
  *
  */
-void
-yfFlowPBuf(
-    yfFlowTab_t  *flowtab,
-    size_t        pbuflen,
-    yfPBuf_t     *pbuf)
+static gboolean
+yfCheckpointOpen(
+    yfCheckpoint_t     *ckpt,
+    const yfFlowTab_t  *flowtab,
+    GError            **err)
 {
-    yfFlowKey_t *key = &(pbuf->key);
-    yfFlowKey_t rkey;
-    yfFlowVal_t *val = NULL;
-    yfFlowNode_t *fn = NULL;
-    yfTCPInfo_t *tcpinfo = &(pbuf->tcpinfo);
-    yfL2Info_t *l2info = &(pbuf->l2info);
-    uint8_t *payload = (pbuflen >= YF_PBUFLEN_BASE) ?
-        pbuf->payload : NULL;
-    size_t paylen = (pbuflen >= YF_PBUFLEN_BASE) ?
-        pbuf->paylen : 0;
-    uint32_t datalen = (pbuf->iplen - pbuf->allHeaderLen +
-                        l2info->l2hlen);
-    uint32_t pcap_len = 0;
-#ifdef YAF_ENABLE_APPLABEL
-    uint16_t tapp = 0;
-#endif
+    yfCheckpointHeaderInit(&(ckpt->hdr), flowtab);
 
-    /* skip and count out of sequence packets */
-    if (pbuf->ptime < flowtab->ctime) {
-        if (!flowtab->force_read_all) {
-            ++(flowtab->stats.stat_seqrej);
-            return;
-        } else {
-            yfAddOutOfSequence(flowtab, key, pbuflen, pbuf);
-            return;
-        }
+    if (!(ckpt->fp = fopen(ckpt->tmppath, "w"))) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Cannot open checkpoint %s: %s",
+                    ckpt->tmppath, strerror(errno));
+        ckpt->failed = TRUE;
+        return FALSE;
     }
 
-    /* update flow table current time */
-    flowtab->ctime = pbuf->ptime;
+    if (fwrite(&(ckpt->hdr), sizeof(ckpt->hdr), 1, ckpt->fp) != 1) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Error writing checkpoint %s: %s",
+                    ckpt->tmppath, strerror(errno));
+        ckpt->failed = TRUE;
+        return FALSE;
+    }
 
-    /* Count the packet and its octets */
-    ++(flowtab->stats.stat_packets);
-    flowtab->stats.stat_octets += pbuf->iplen;
+    return TRUE;
+}
 
-    if (payload) {
-        if (paylen >= pbuf->allHeaderLen) {
-            paylen -= pbuf->allHeaderLen;
-            payload += pbuf->allHeaderLen;
-        } else {
-            paylen = 0;
-            payload = NULL;
-        }
-    }
 
-#ifdef YAF_ENABLE_HOOKS
-    /* Run packet hook; allow it to veto continued processing of the packet */
-    if (!yfHookPacket(key, payload, paylen,
-                      pbuf->iplen, tcpinfo, l2info))
+/**
+ * yfCheckpointWriteFlow
+ *
+ * writes an active flow to the checkpoint, with its captured payload and
+ * flow statistics.
+ *
+ */
+static gboolean
+yfCheckpointWriteFlow(
+    yfCheckpoint_t  *ckpt,
+    yfFlowTab_t     *flowtab,
+    yfFlowNode_t    *fn)
+{
+    yfCheckpointFlow_t rec;
+    yfFlowVal_t       *val;
+    int                i;
+
+    memset(&rec, 0, sizeof(rec));
+#ifdef YAF_ENABLE_COMPACT_IP4
+    if (fn->f.key.version == 4) {
+        memcpy(&(rec.f), &(fn->f), YF_FLOW_IPV4_SIZE);
+    } else
+#endif
     {
-        return;
+        memcpy(&(rec.f), &(fn->f), sizeof(yfFlow_t));
     }
-#endif /* ifdef YAF_ENABLE_HOOKS */
+    rec.state = fn->state;
 
+    if (fn->f.cold) {
+        rec.extra |= YF_CKPT_COLD;
+        rec.mptcp = fn->f.cold->mptcp;
+        memcpy(rec.smac, fn->f.cold->sourceMacAddr, sizeof(rec.smac));
+        memcpy(rec.dmac, fn->f.cold->destinationMacAddr, sizeof(rec.dmac));
 #ifdef YAF_MPLS
-    if (flowtab->mpls_mode) {
-        yfMPLSGetNode(flowtab, l2info);
+        if (fn->f.cold->mpls) {
+            rec.extra |= YF_CKPT_MPLS;
+            memcpy(rec.mpls_label, fn->f.cold->mpls->mpls_label,
+                   sizeof(rec.mpls_label));
+        }
+#endif
+#ifdef YAF_ENABLE_NDPI
+        if (fn->f.cold->ndpi_master || fn->f.cold->ndpi_done) {
+            rec.extra |= YF_CKPT_DPI;
+        }
+#endif
+#ifdef YAF_ENABLE_HOOKS
+        for (i = 0; i < YAF_MAX_HOOKS; i++) {
+            if (fn->f.cold->hfctx[i]) {
+                rec.extra |= YF_CKPT_HOOKS;
+                break;
+            }
+        }
+#endif
     }
-#endif  /* YAF_MPLS */
-
-    /* Get a flow node for this flow */
-    fn = yfFlowGetNode(flowtab, key, &val);
-    /* Check for active timeout or counter overflow */
-    if (((pbuf->ptime - fn->f.stime) > flowtab->active_ms) ||
-        (flowtab->silkmode && (val->oct + pbuf->iplen > UINT32_MAX)))
-    {
-        yfFlowClose(flowtab, fn, YAF_END_ACTIVE);
 #ifdef YAF_ENABLE_APPLABEL
-        /* copy applabel over */
-        if (flowtab->applabelmode) {tapp = fn->f.appLabel;}
+    if (fn->f.dpictx) {
+        rec.extra |= YF_CKPT_DPI;
+    }
 #endif
-        /* get a new flow node containing this packet */
-        fn = yfFlowGetNode(flowtab, key, &val);
-        /* set continuation flag in silk mode */
-        if (flowtab->silkmode) {fn->f.reason = YAF_ENDF_ISCONT;}
-#ifdef YAF_ENABLE_APPLABEL
-        /* copy applabel into new flow */
-        if (flowtab->applabelmode) {fn->f.appLabel = tapp;}
+#ifdef YAF_ENABLE_P0F
+    if (fn->f.val.osname || fn->f.rval.osname) {
+        rec.extra |= YF_CKPT_DPI;
+    }
+#endif
+#ifdef YAF_ENABLE_FPEXPORT
+    if (fn->f.val.firstPacket || fn->f.rval.firstPacket) {
+        rec.extra |= YF_CKPT_DPI;
+    }
 #endif
+#ifdef YAF_ENABLE_PAYLOAD
+    if (fn->f.val.payload) {
+        rec.extra |= YF_CKPT_VPAYLOAD;
     }
-
-    /* Check for inactive timeout - esp when reading from pcap */
-    if ((pbuf->ptime - fn->f.etime) > flowtab->idle_ms) {
-        yfFlowClose(flowtab, fn, YAF_END_IDLE);
-        /* get a new flow node for the current packet */
-        fn = yfFlowGetNode(flowtab, key, &val);
+    if (fn->f.rval.payload) {
+        rec.extra |= YF_CKPT_RPAYLOAD;
+    }
+#endif
+    if (fn->f.val.stats) {
+        rec.extra |= YF_CKPT_VSTATS;
+    }
+    if (fn->f.rval.stats) {
+        rec.extra |= YF_CKPT_RSTATS;
     }
 
-    /* First Packet? */
-    if (val->pkt == 0) {
-        val->vlan = key->vlanId;
-        if (flowtab->macmode && val == &(fn->f.val)) {
-            /* Note Mac Addr */
-            if (l2info) {
-                memcpy(fn->f.sourceMacAddr, l2info->smac,
-                       ETHERNET_MAC_ADDR_LENGTH);
-                memcpy(fn->f.destinationMacAddr, l2info->dmac,
-                       ETHERNET_MAC_ADDR_LENGTH);
-            }
-        }
-        /* Allocate Flow Statistics */
-        if (flowtab->flowstats_mode) {
-            val->stats = g_slice_new0(yfFlowStats_t);
-        }
-        /* Calculate reverse RTT */
-        if (val == &(fn->f.rval)) {
-            fn->f.rdtime = pbuf->ptime - fn->f.stime;
-        }
+    if (fwrite(&rec, sizeof(rec), 1, ckpt->fp) != 1) {
+        return FALSE;
     }
 
-    /* Do payload and TCP stuff */
-    if (fn->f.key.proto == YF_PROTO_TCP) {
-        /* Handle TCP flows specially (flags, ISN, sequenced payload) */
-        if (datalen) {
-            if (val->appkt == 0) {
-                val->first_pkt_size = datalen;
-            } else {
-                if (datalen == val->first_pkt_size) {
-                    if (val->appkt == 1) {
-                        val->attributes |= YAF_ATTR_SAME_SIZE;
-                    }
-                } else {
-                    /* Don't consider TCP KEEP ALIVE */
-                    if (val->lsn != (tcpinfo->seq + 1)) {
-                        val->attributes &= ~YAF_ATTR_SAME_SIZE;
-                    }
-                }
-            }
-            val->appkt += 1;
+    for (i = 0; i < 2; i++) {
+        val = i ? &(fn->f.rval) : &(fn->f.val);
+#ifdef YAF_ENABLE_PAYLOAD
+        if (val->payload &&
+            ((val->paylen &&
+              fwrite(val->payload, val->paylen, 1, ckpt->fp) != 1) ||
+             fwrite(val->paybounds, sizeof(size_t) * YAF_MAX_PKT_BOUNDARY,
+                    1, ckpt->fp) != 1))
+        {
+            return FALSE;
         }
-#if defined(YAF_ENABLE_P0F) || defined(YAF_ENABLE_FPEXPORT)
-        yfFlowPktTCP(flowtab, fn, val, payload, paylen, tcpinfo,
-                     pbuf->headerVal, pbuf->headerLen);
-#else
-        yfFlowPktTCP(flowtab, fn, val, payload, paylen, tcpinfo, NULL, 0);
 #endif
-    } else {
-        if (val->pkt == 0) {
-            val->first_pkt_size = pbuf->iplen;
-        } else {
-            if (pbuf->iplen == val->first_pkt_size) {
-                if (val->pkt == 1) {
-                    val->attributes |= YAF_ATTR_SAME_SIZE;
-                }
-            } else {
-                val->attributes &= ~YAF_ATTR_SAME_SIZE;
-            }
-        }
-        if ((val->pkt == 0 || flowtab->udp_multipkt_payload)) {
-            if (((flowtab->udp_uniflow_port != 1) &&
-                 (flowtab->udp_uniflow_port != fn->f.key.sp) &&
-                 (flowtab->udp_uniflow_port != fn->f.key.dp)))
-            {
-                /* Get first packet payload from non-TCP flows */
-                yfFlowPktGenericTpt(flowtab, fn, val, payload, paylen);
-            }
+        if (val->stats &&
+            fwrite(val->stats, sizeof(yfFlowStats_t), 1, ckpt->fp) != 1)
+        {
+            return FALSE;
         }
     }
 
-#ifdef YAF_ENABLE_SEPARATE_INTERFACES
-    val->netIf = pbuf->key.netIf;
-#endif
+    return TRUE;
+}
 
-    /* Count packets and octets */
-    val->oct += pbuf->iplen;
-    val->pkt += 1;
 
-    /* Mark if fragmented */
-    if (pbuf->frag == 1) {
-        val->attributes |= YAF_ATTR_FRAGMENTS;
+/**
+ * yfFlowDrop
+ *
+ * removes an active flow from the flow table and frees it without
+ * closing or writing it.
+ *
+ */
+static void
+yfFlowDrop(
+    yfFlowTab_t   *flowtab,
+    yfFlowNode_t  *fn)
+{
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        yfFlowIndexRemove(fn->f.cold->mpls->tab, fn);
+    } else
+#endif
+    {
+        yfFlowIndexRemove(flowtab->table, fn);
     }
+    yfFlowWheelRemove(flowtab, fn);
+    --(flowtab->count);
 
-    /* update flow end time */
-    fn->f.etime = pbuf->ptime;
-
-    /* Update stats */
-    if (flowtab->flowstats_mode) {
-        yfFlowStatistics(fn, val, pbuf->ptime, datalen);
+    if (fn->f.cold && fn->f.cold->pcap) {
+        pcap_dump_flush(fn->f.cold->pcap);
+        pcap_dump_close(fn->f.cold->pcap);
     }
 
-#ifdef YAF_ENABLE_HOOKS
-    /* Hook Flow Processing */
-    yfHookFlowPacket(&(fn->f), val, payload, paylen, pbuf->iplen,
-                     tcpinfo, l2info);
-#endif
+    yfFlowFree(flowtab, fn);
+}
 
-    pcap_len = pbuf->pcap_hdr.caplen + 16;
-    /* Write Packet to Pcap-Per-Flow pcap file */
-    if (flowtab->pcap_dir) {
-        /* what we actually hold in yaf dependent on max-payload */
-        pbuf->pcap_hdr.caplen = (pbuflen > YF_PBUFLEN_BASE) ? pbuf->paylen : 0;
-        if (val == &(fn->f.rval)) {
-            yfFlowKeyReverse(key, &rkey);
-            yfWritePcap(flowtab, &(fn->f), &rkey, pbuf);
-        } else {
-            yfWritePcap(flowtab, &(fn->f), key, pbuf);
-        }
-    }
 
-    /* Write Pcap Meta Info */
-    if (flowtab->pcap_meta) {
-        if (val == &(fn->f.rval)) {
-            yfFlowKeyReverse(key, &rkey);
-            yfWritePcapMetaFile(flowtab, fn, pbuf, flowtab->hashfn(&rkey),
-                                pcap_len);
-        } else {
-            yfWritePcapMetaFile(flowtab, fn, pbuf, flowtab->hashfn(key),
-                                pcap_len);
+/**
+ * yfFlowTabCheckpoint
+ *
+ * when a checkpoint has been requested, moves every active flow into it
+ * instead of closing it, so the next yaf can pick the flows up where
+ * this one left off.  If the checkpoint cannot be written, the flows of
+ * this flow table stay in it to be closed as usual, and the checkpoint
+ * keeps those of the flow tables written before it.
+ *
+ */
+static void
+yfFlowTabCheckpoint(
+    yfFlowTab_t     *flowtab,
+    yfCheckpoint_t  *ckpt)
+{
+    yfFlowNode_t *fn;
+    yfPreFlow_t  *pf, *end;
+    GError       *err = NULL;
+    off_t         start;
+    uint64_t      count = 0;
+    uint32_t      slot;
+    gboolean      ok = TRUE;
+
+    if (!ckpt->requested) {
+        return;
+    }
+
+    /* first packets still in the pre-flow table are flows too */
+    if (flowtab->preflow) {
+        end = flowtab->preflow + (flowtab->preflow_mask + 1) * YF_PREFLOW_WAYS;
+        for (pf = flowtab->preflow; pf < end; pf++) {
+            if (pf->used) {
+                yfPreFlowPromote(flowtab, pf);
+            }
         }
     }
 
-#ifdef YAF_ENABLE_NDPI
-    if (flowtab->ndpi_struct && payload && (fn->f.ndpi_master == 0)) {
-        yfNDPIApplabel(flowtab, &(fn->f),
-                       payload - pbuf->allHeaderLen + l2info->l2hlen,
-                       paylen + pbuf->allHeaderLen - l2info->l2hlen);
+    pthread_mutex_lock(&(ckpt->lock));
+
+    if (ckpt->failed || (!ckpt->fp && !yfCheckpointOpen(ckpt, flowtab, &err))) {
+        pthread_mutex_unlock(&(ckpt->lock));
+        if (err) {
+            g_warning("%s", err->message);
+            g_clear_error(&err);
+        }
+        return;
     }
-#endif /* ifdef YAF_ENABLE_NDPI */
 
-    /* if udp-uniflow-mode, close UDP flow now */
-    if ((fn->f.key.proto == YF_PROTO_UDP) && (flowtab->udp_uniflow_port != 0)) {
-        if (((flowtab->udp_uniflow_port == 1) ||
-             (flowtab->udp_uniflow_port == fn->f.key.sp) ||
-             (flowtab->udp_uniflow_port == fn->f.key.dp)))
+    start = ftello(ckpt->fp);
+    for (slot = 0; ok && slot <= YF_WHEEL_DUE; slot++) {
+        for (fn = flowtab->wheel[slot].head; ok && fn; fn = fn->p) {
+            ok = yfCheckpointWriteFlow(ckpt, flowtab, fn);
+            ++count;
+        }
+    }
+
+    if (ok) {
+        ckpt->hdr.count += count;
+        if (flowtab->ctime > ckpt->hdr.ctime) {
+            ckpt->hdr.ctime = flowtab->ctime;
+        }
+    } else {
+        g_warning("Error writing checkpoint %s: %s; closing flows instead",
+                  ckpt->tmppath, strerror(errno));
+        /* cut off this table's records, keeping the others' */
+        if (fflush(ckpt->fp) || ftruncate(fileno(ckpt->fp), start) ||
+            fseeko(ckpt->fp, start, SEEK_SET))
         {
-            yfCloseActiveFlow(flowtab, fn, val, payload, paylen,
-                              YAF_END_UDPFORCE, pbuf->iplen);
+            ckpt->failed = TRUE;
         }
     }
 
-    if (flowtab->idle_ms == 0) {
-        /* each pkt as a flow */
-        yfFlowClose(flowtab, fn, YAF_END_IDLE);
+    pthread_mutex_unlock(&(ckpt->lock));
+
+    if (!ok) {
         return;
     }
 
-    /* close flow, or move it to head of queue */
-    if ((fn->state & YAF_STATE_FIN) == YAF_STATE_FIN ||
-        fn->state & YAF_STATE_RST)
-    {
-        yfFlowClose(flowtab, fn, YAF_END_CLOSED);
-    } else {
-        yfFlowTick(flowtab, fn);
+    /* the flows are in the checkpoint; drop them without exporting */
+    for (slot = 0; slot <= YF_WHEEL_DUE; slot++) {
+        while ((fn = flowtab->wheel[slot].tail)) {
+            yfFlowDrop(flowtab, fn);
+        }
     }
 }
 
 
 /**
- * yfUniflow
+ * yfCheckpointSkip
  *
- * creates a uniflow record from a biflow record, in order to split
- * the record into a single record for uniflow only collection systems
+ * skips `len` bytes of the checkpoint.
  *
- * @param bf pointer to normal biflow yaf flow record
- * @param uf pointer to a new flow record, that will have its rev
- *           (reverse) values NULLed
+ */
+static gboolean
+yfCheckpointSkip(
+    FILE    *fp,
+    size_t   len)
+{
+    return (len == 0 || fseeko(fp, (off_t)len, SEEK_CUR) == 0);
+}
+
+
+/**
+ * yfCheckpointReadFlow
+ *
+ * restores a flow from a checkpoint record into the flow table, reading
+ * the payload and flow statistics that follow the record.  The flow gets
+ * the payload capture, DPI and timeout profile this flow table would
+ * give a new flow; payload beyond its capture limit is dropped, as are
+ * flow statistics if they are not enabled.
  *
  */
-static void
-yfUniflow(
-    yfFlow_t  *bf,
-    yfFlow_t  *uf)
+static gboolean
+yfCheckpointReadFlow(
+    yfFlowTab_t               *flowtab,
+    const yfCheckpointFlow_t  *rec,
+    uint64_t                   hash,
+    FILE                      *fp)
 {
+    yfFlowNode_t  *fn;
+    yfFlowIndex_t *ht;
+    yfFlowVal_t   *val;
+    yfFlowCold_t  *cold;
+    uint8_t        pflag, sflag;
+    int            i;
+#ifdef YAF_ENABLE_PAYLOAD
+    uint32_t       paylen;
+#endif
+#ifdef YAF_MPLS
+    yfL2Info_t     l2info;
+
+    if (flowtab->mpls_mode) {
+        memset(&l2info, 0, sizeof(l2info));
+        if (rec->extra & YF_CKPT_MPLS) {
+            memcpy(l2info.mpls_label, rec->mpls_label,
+                   sizeof(rec->mpls_label));
+        }
+        ht = yfMPLSGetNode(flowtab, &l2info)->tab;
+    } else
+#endif  /* YAF_MPLS */
+    {
+        ht = flowtab->table;
+    }
+
 #ifdef YAF_ENABLE_COMPACT_IP4
-    if (bf->key.version == 4) {
-        memcpy(uf, bf, sizeof(yfFlowIPv4_t));
+    if (rec->f.key.version == 4) {
+        fn = slbAlloc0(flowtab->slab, SLB_FLOW, YF_FLOWNODE_IPV4_SIZE);
+        memcpy(&(fn->f), &(rec->f), YF_FLOW_IPV4_SIZE);
     } else
 #endif  /* YAF_ENABLE_COMPACT_IP4 */
     {
-        memcpy(uf, bf, sizeof(yfFlow_t));
+        fn = slbAlloc0(flowtab->slab, SLB_FLOW, sizeof(yfFlowNode_t));
+        memcpy(&(fn->f), &(rec->f), sizeof(yfFlow_t));
     }
-    memset(&(uf->rval), 0, sizeof(yfFlowVal_t));
-    uf->rdtime = 0;
+    fn->state = rec->state;
+
+    /* none of the pointers in the record mean anything here */
+    fn->f.cold = NULL;
+#ifdef YAF_ENABLE_APPLABEL
+    fn->f.dpictx = NULL;
+#endif
+    for (i = 0; i < 2; i++) {
+        val = i ? &(fn->f.rval) : &(fn->f.val);
+#ifdef YAF_ENABLE_PAYLOAD
+        val->payload = NULL;
+        val->paybounds = NULL;
+#endif
+#ifdef YAF_ENABLE_P0F
+        val->osname = NULL;
+        val->osver = NULL;
+        val->osFingerprint = NULL;
+#endif
+#ifdef YAF_ENABLE_FPEXPORT
+        val->firstPacket = NULL;
+        val->secondPacket = NULL;
+        val->firstPacketLen = 0;
+        val->secondPacketLen = 0;
+#endif
+        val->stats = NULL;
+    }
+
+    /* the same steps as for a new flow */
+    yfFlowIndexInsert(ht, fn, hash);
+#ifdef YAF_ENABLE_APPLABEL
+    fn->tprof = yfFlowTimeoutProfile(flowtab, &(fn->f.key), fn->f.appLabel);
+#else
+    fn->tprof = yfFlowTimeoutProfile(flowtab, &(fn->f.key), 0);
+#endif
+    yfFlowWheelFile(flowtab, fn);
+
+    if (rec->extra & YF_CKPT_COLD) {
+        cold = yfFlowCold(flowtab, &(fn->f));
+        cold->mptcp = rec->mptcp;
+        memcpy(cold->sourceMacAddr, rec->smac, sizeof(rec->smac));
+        memcpy(cold->destinationMacAddr, rec->dmac, sizeof(rec->dmac));
+    }
+#ifdef YAF_MPLS
+    if (flowtab->mpls_mode) {
+        yfFlowCold(flowtab, &(fn->f))->mpls = flowtab->cur_mpls_node;
+        ++(flowtab->cur_mpls_node->tab_count);
+    }
+#endif  /* YAF_MPLS */
+
+    ++(flowtab->count);
+    if (flowtab->count > flowtab->stats.stat_peak) {
+        YF_STAT_SET(flowtab->stats.stat_peak, flowtab->count);
+    }
+
+#ifdef YAF_ENABLE_HOOKS
+    if (yfHookCount()) {
+        yfFlowCold(flowtab, &(fn->f));
+    }
+    yfHookFlowAlloc(&(fn->f), flowtab->yfctx);
+#endif
+
+    if (yfFlowMemAdmit(flowtab, fn)) {
+#ifdef YAF_ENABLE_APPLABEL
+        ydAllocFlowContext(&(fn->f), flowtab->slab);
+#endif
+    }
+
+    for (i = 0; i < 2; i++) {
+        val = i ? &(fn->f.rval) : &(fn->f.val);
+        pflag = i ? YF_CKPT_RPAYLOAD : YF_CKPT_VPAYLOAD;
+        sflag = i ? YF_CKPT_RSTATS : YF_CKPT_VSTATS;
+#ifdef YAF_ENABLE_PAYLOAD
+        paylen = val->paylen;
+        val->paylen = 0;
+        if ((rec->extra & pflag) && fn->paymax) {
+            val->payload = slbAlloc0(flowtab->slab, SLB_PAYLOAD, fn->paymax);
+            val->paybounds = (size_t *)slbAlloc0(
+                flowtab->slab, SLB_PAYLOAD,
+                sizeof(size_t) * YAF_MAX_PKT_BOUNDARY);
+            val->paylen = MIN(paylen, fn->paymax);
+            if ((val->paylen &&
+                 fread(val->payload, val->paylen, 1, fp) != 1) ||
+                !yfCheckpointSkip(fp, paylen - val->paylen) ||
+                fread(val->paybounds, sizeof(size_t) * YAF_MAX_PKT_BOUNDARY,
+                      1, fp) != 1)
+            {
+                return FALSE;
+            }
+        } else if ((rec->extra & pflag) &&
+                   !yfCheckpointSkip(fp, paylen + sizeof(size_t) *
+                                     YAF_MAX_PKT_BOUNDARY))
+        {
+            return FALSE;
+        }
+#else  /* ifdef YAF_ENABLE_PAYLOAD */
+        (void)pflag;
+#endif /* ifdef YAF_ENABLE_PAYLOAD */
+        if (!(rec->extra & sflag)) {
+            continue;
+        }
+        if (flowtab->flowstats_mode) {
+            val->stats = slbAlloc0(flowtab->slab, SLB_STATS,
+                                   sizeof(yfFlowStats_t));
+            if (fread(val->stats, sizeof(yfFlowStats_t), 1, fp) != 1) {
+                return FALSE;
+            }
+        } else if (!yfCheckpointSkip(fp, sizeof(yfFlowStats_t))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
 }
 
-/**
- * yfUniflowReverse
- *
- * reverses the flow information in the biflow in order to generate
- * two uniflow outputs
- *
- *
- * @param bf pointer to biflow record
- * @param uf pointer to uniflow record to fill in
- *
- * @return TRUE on success, FALSE on error
- */
-static gboolean
-yfUniflowReverse(
-    yfFlow_t  *bf,
-    yfFlow_t  *uf)
+
+gboolean
+yfFlowTabRestore(
+    yfFlowTab_t  **flowtabs,
+    uint32_t       count,
+    const char    *path,
+    GError       **err)
 {
-    if (!(bf->rval.pkt)) {return FALSE;}
+    yfCheckpointHeader_t hdr, want;
+    yfCheckpointFlow_t   rec;
+    yfFlowTab_t         *flowtab;
+    FILE                *fp;
+    uint64_t             hash;
+    uint64_t             n;
+    uint64_t             lost_dpi = 0, lost_hooks = 0;
+    uint32_t             i;
+
+    if (!(fp = fopen(path, "r"))) {
+        if (errno == ENOENT) {
+            /* nothing to pick up */
+            return TRUE;
+        }
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Cannot open checkpoint %s: %s", path, strerror(errno));
+        return FALSE;
+    }
 
-    /* calculate reverse time */
-    uf->stime = bf->stime + bf->rdtime;
-    uf->etime = bf->etime;
-    uf->rdtime = 0;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_HEADER,
+                    "Checkpoint %s is truncated", path);
+        fclose(fp);
+        return FALSE;
+    }
 
-    memcpy(uf->sourceMacAddr, bf->destinationMacAddr,
-           ETHERNET_MAC_ADDR_LENGTH);
-    memcpy(uf->destinationMacAddr, bf->sourceMacAddr,
-           ETHERNET_MAC_ADDR_LENGTH);
+    /* it must come from this build, with flow keys made the same way */
+    yfCheckpointHeaderInit(&want, flowtabs[0]);
+    if (memcmp(hdr.magic, want.magic, sizeof(want.magic)) ||
+        hdr.version != want.version)
+    {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_HEADER,
+                    "%s is not a version %u yaf checkpoint",
+                    path, YF_CKPT_VERSION);
+        fclose(fp);
+        return FALSE;
+    }
+    if (memcmp(&hdr, &want, offsetof(yfCheckpointHeader_t, ctime))) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_HEADER,
+                    "Checkpoint %s was written by a yaf built or configured "
+                    "differently (build %#x, flow %u bytes, no-vlan-in-key "
+                    "%u, mpls %u)", path, hdr.build, hdr.flow_size,
+                    hdr.no_vlan_in_key, hdr.mpls_mode);
+        fclose(fp);
+        return FALSE;
+    }
 
-    /* reverse key */
-    yfFlowKeyReverse(&bf->key, &uf->key);
+    /* the flows pick up at the time they were written */
+    for (i = 0; i < count; i++) {
+        if (hdr.ctime > flowtabs[i]->ctime) {
+            flowtabs[i]->ctime = hdr.ctime;
+        }
+    }
 
-    /* copy and reverse value */
-    memcpy(&(uf->val), &(bf->rval), sizeof(yfFlowVal_t));
-    memset(&(uf->rval), 0, sizeof(yfFlowVal_t));
+    for (n = 0; n < hdr.count; n++) {
+        if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+            break;
+        }
+        /* the same flow table a packet of the flow goes to */
+        hash = yfFlowKeyHashSymmetric(&(rec.f.key),
+                                      flowtabs[0]->no_vlan_in_key);
+        flowtab = flowtabs[(count > 1) ? (uint32_t)hash % count : 0];
+        if (!yfCheckpointReadFlow(flowtab, &rec, hash, fp)) {
+            break;
+        }
+        if (rec.extra & YF_CKPT_DPI) {
+            ++lost_dpi;
+        }
+        if (rec.extra & YF_CKPT_HOOKS) {
+            ++lost_hooks;
+        }
+    }
+    fclose(fp);
 
-    /* copy reason */
-    uf->reason = bf->reason;
-    uf->key.tos = bf->rtos;
+    if (n < hdr.count) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_EOF,
+                    "Checkpoint %s is truncated after %" PRIu64 " of %"
+                    PRIu64 " flows", path, n, hdr.count);
+        return FALSE;
+    }
+
+    g_debug("Restored %" PRIu64 " active flows from checkpoint %s",
+              hdr.count, path);
+    if (lost_dpi || lost_hooks) {
+        g_warning("Restored flows start over without state the checkpoint "
+                  "does not keep: DPI state of %" PRIu64 " flows, plugin "
+                  "state of %" PRIu64 " flows", lost_dpi, lost_hooks);
+    }
+
+    /* the flows are back; never restore them twice */
+    if (unlink(path)) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Cannot remove checkpoint %s: %s", path, strerror(errno));
+        return FALSE;
+    }
 
-    /* all done */
     return TRUE;
 }
 
@@ -2968,13 +5392,20 @@ yfFlowTabFlush(
 {
     gboolean wok = TRUE;
     yfFlowNode_t *fn = NULL;
-    yfFlow_t uf;
+    uint32_t i, slot;
+    uint64_t evict = 0;
+    size_t used = 0;
     yfContext_t *ctx = (yfContext_t *)yfContext;
     yfFlowTab_t *flowtab = ctx->flowtab;
 
+    if (flowtab->max_memory) {
+        used = yfFlowTabMemUsed(flowtab);
+    }
+
     if (!close && flowtab->flushtime &&
         (flowtab->ctime < flowtab->flushtime + YF_FLUSH_DELAY)
-        && (flowtab->cq_count < YF_MAX_CQ))
+        && (flowtab->cq_count < YF_MAX_CQ)
+        && (used < flowtab->mem_evict || !flowtab->max_memory))
     {
         return TRUE;
     }
@@ -2982,57 +5413,91 @@ yfFlowTabFlush(
     flowtab->flushtime = flowtab->ctime;
 
     /* Count the flush */
-    ++flowtab->stats.stat_flush;
+    YF_STAT_INC(flowtab->stats.stat_flush);
+
+    /* Verify expiry wheel */
+    /* yfFlowTabVerifyWheel(flowtab);*/
+    /* close idle and active timed out flows */
+    yfFlowWheelAdvance(flowtab, flowtab->ctime);
+    while ((fn = flowtab->wheel[YF_WHEEL_DUE].tail)) {
+        if (yfFlowDeadline(flowtab, fn) >= flowtab->ctime) {
+            /* saw packets since it was found due */
+            yfFlowWheelRemove(flowtab, fn);
+            yfFlowWheelFile(flowtab, fn);
+        } else if (fn->f.stime + flowtab->tprofs[fn->tprof].active_ms <
+                   fn->f.etime + yfFlowIdleMs(flowtab, fn))
+        {
+            yfFlowClose(flowtab, fn, YAF_END_ACTIVE);
+        } else {
+            yfFlowClose(flowtab, fn, YAF_END_IDLE);
+        }
+    }
 
-    /* Verify flow table order */
-    /* yfFlowTabVerifyIdleOrder(flowtab);*/
-    /* close idle flows */
-    while (flowtab->aq.tail &&
-           (flowtab->ctime - flowtab->aq.tail->f.etime > flowtab->idle_ms))
-    {
-        yfFlowClose(flowtab, flowtab->aq.tail, YAF_END_IDLE);
+    /* close limited flows, soonest to expire first */
+    for (i = 0; flowtab->max_flows && i <= YF_WHEEL_DUE; i++) {
+        slot = yfFlowWheelSlotAt(flowtab, i);
+        while (flowtab->wheel[slot].tail &&
+               flowtab->count >= flowtab->max_flows)
+        {
+            yfFlowClose(flowtab, flowtab->wheel[slot].tail, YAF_END_RESOURCE);
+        }
     }
 
-    /* close limited flows */
-    while (flowtab->max_flows &&
-           flowtab->aq.tail &&
-           flowtab->count >= flowtab->max_flows)
-    {
-        yfFlowClose(flowtab, flowtab->aq.tail, YAF_END_RESOURCE);
+    /* stopping for a restart, active flows go to the checkpoint instead
+     * of being closed */
+    if (close && ctx->ckpt) {
+        yfFlowTabCheckpoint(flowtab, ctx->ckpt);
+    }
+
+    /* single-packet flows the pre-flow table held */
+    if (flowtab->preflow) {
+        yfPreFlowExpire(flowtab, close);
+    }
+
+    /* over the memory budget, close flows soonest to expire first.  Their
+     * memory is not freed until they are written, so estimate how many to
+     * close from the mean usage of an open or closed flow, counting those
+     * already waiting to be written or with the export thread. */
+    if (!close && flowtab->max_memory && used >= flowtab->mem_evict) {
+        uint64_t flows = ((uint64_t)flowtab->count + flowtab->cq_count +
+                          flowtab->excount);
+        uint64_t closed = flows - flowtab->count;
+
+        if (flows) {
+            evict = (used - flowtab->mem_target) / (used / flows + 1) + 1;
+            evict = (evict > closed) ? evict - closed : 0;
+        }
+    }
+    for (i = 0; evict && i <= YF_WHEEL_DUE; i++) {
+        slot = yfFlowWheelSlotAt(flowtab, i);
+        while (evict && flowtab->wheel[slot].tail) {
+            yfFlowClose(flowtab, flowtab->wheel[slot].tail, YAF_END_RESOURCE);
+            YF_STAT_INC(flowtab->stats.stat_mem_evicted);
+            --evict;
+        }
     }
 
     /* close all flows if flushing all */
-    while (close && flowtab->aq.tail) {
-        yfFlowClose(flowtab, flowtab->aq.tail, YAF_END_FORCED);
+    for (i = 0; close && i <= YF_WHEEL_DUE; i++) {
+        slot = yfFlowWheelSlotAt(flowtab, i);
+        while (flowtab->wheel[slot].tail) {
+            yfFlowClose(flowtab, flowtab->wheel[slot].tail, YAF_END_FORCED);
+        }
+    }
+
+    /* the export thread writes them, if there is one */
+    if (ctx->exportq) {
+        yfFlowExportQueue(ctx->exportq, flowtab, close);
+        return TRUE;
     }
 
     /* flush flows from close queue */
     while ((fn = piqDeQ(&flowtab->cq))) {
         /* quick accounting of asymmetric/uniflow records present */
         if ((fn->f.rval.oct == 0) && (fn->f.rval.pkt == 0)) {
-            ++(flowtab->stats.stat_uniflows);
-        }
-        /* write flow */
-        if (flowtab->uniflow) {
-            /* Uniflow mode. Split flow in two and write. */
-            yfUniflow(&(fn->f), &uf);
-            wok = yfWriteFlow(ctx, &uf, err);
-            if (wok) {
-                ++(flowtab->stats.stat_flows);
-            }
-            if (wok && yfUniflowReverse(&(fn->f), &uf)) {
-                wok = yfWriteFlow(ctx, &uf, err);
-                if (wok) {
-                    ++(flowtab->stats.stat_flows);
-                }
-            }
-        } else {
-            /* Biflow mode. Write flow whole. */
-            wok = yfWriteFlow(ctx, &(fn->f), err);
-            if (wok) {
-                ++(flowtab->stats.stat_flows);
-            }
+            YF_STAT_INC(flowtab->stats.stat_uniflows);
         }
+        wok = yfFlowWrite(ctx, flowtab, fn, err);
         --(flowtab->cq_count);
 
         /* free it */
@@ -3046,6 +5511,95 @@ yfFlowTabFlush(
 }
 
 
+gboolean
+yfFlowTabExportFlow(
+    void      *yfContext,
+    void      *exflow,
+    gboolean   write,
+    GError   **err)
+{
+    yfContext_t  *ctx = (yfContext_t *)yfContext;
+    yfFlowNode_t *fn = (yfFlowNode_t *)exflow;
+    gboolean      ok = TRUE;
+
+    if (write) {
+        ok = yfFlowWrite(ctx, fn->flowtab, fn, err);
+    }
+
+    /* hand it back to be freed; the flow table never has more out than
+     * this queue holds */
+    if (!lfqPush(fn->flowtab->exdone, fn)) {
+        g_error("YAF internal error: export return queue overflow");
+    }
+
+    return ok;
+}
+
+
+/**
+ * yfFlowTabExportTime
+ *
+ * end time of a closed flow on an export queue, by which an export
+ * thread merges the queues of several flow tables.
+ *
+ */
+uint64_t
+yfFlowTabExportTime(
+    const void  *exflow)
+{
+    return ((const yfFlowNode_t *)exflow)->f.etime;
+}
+
+
+/**
+ * yfFlowTabAdvanceClock
+ *
+ * runs the clock of a flow table on from the monotonic system clock while
+ * no packets arrive.  The clock only ever moves by the time elapsed since
+ * packets last moved it, less YF_CLOCK_SLACK, so the offset between the
+ * capture timestamps and the system clock does not matter.
+ *
+ */
+void
+yfFlowTabAdvanceClock(
+    yfFlowTab_t  *flowtab)
+{
+    uint64_t mono = (uint64_t)(g_get_monotonic_time() / 1000);
+
+    if (flowtab->ctime != flowtab->clock_seen) {
+        /* packets moved it since the last call; run on from here */
+        flowtab->clock_ptime = flowtab->ctime;
+        flowtab->clock_mono = mono;
+    } else if (flowtab->ctime &&
+               mono > flowtab->clock_mono + YF_CLOCK_SLACK)
+    {
+        flowtab->ctime = MAX(flowtab->ctime,
+                             flowtab->clock_ptime + mono -
+                             flowtab->clock_mono - YF_CLOCK_SLACK);
+    }
+    flowtab->clock_seen = flowtab->ctime;
+}
+
+
+/**
+ * yfFlowTabAdvanceClockTo
+ *
+ * moves the clock of a flow table on to a packet time seen by another
+ * flow table, so that flows time out here as they would in one table
+ * seeing all the packets.
+ *
+ */
+void
+yfFlowTabAdvanceClockTo(
+    yfFlowTab_t  *flowtab,
+    uint64_t      ptime)
+{
+    if (ptime > flowtab->ctime) {
+        flowtab->ctime = ptime;
+    }
+}
+
+
 /**
  * yfFlowTabCurrentTime
  *
@@ -3089,11 +5643,36 @@ yfFlowDumpStats(
                 ((double)flowtab->stats.stat_packets /
                  g_timer_elapsed(timer, NULL)));
         g_debug("  Virtual bandwidth %.4f Mbps.",
-                ((((double)flowtab->stats.stat_octets * 8.0) / 1000000) /
-                 g_timer_elapsed(timer, NULL)));
+                ((((double)YF_STAT_GET(flowtab->stats.stat_octets) * 8.0) /
+                  1000000) / g_timer_elapsed(timer, NULL)));
     }
     g_debug("  Maximum flow table size %u.", flowtab->stats.stat_peak);
     g_debug("  %u flush events.", flowtab->stats.stat_flush);
+    if (YF_STAT_GET(flowtab->stats.stat_export_deferred) ||
+        YF_STAT_GET(flowtab->stats.stat_export_stalls))
+    {
+        g_debug("  Export queue full at %" PRIu64 " flushes; "
+                "waited for it at %" PRIu64 ".",
+                YF_STAT_GET(flowtab->stats.stat_export_deferred),
+                YF_STAT_GET(flowtab->stats.stat_export_stalls));
+    }
+    if (flowtab->preflow) {
+        g_debug("  Pre-flow table held %" PRIu64 " first packets; "
+                "%" PRIu64 " promoted, %" PRIu64 " single-packet flows.",
+                YF_STAT_GET(flowtab->stats.stat_preflow_held),
+                YF_STAT_GET(flowtab->stats.stat_preflow_promoted),
+                YF_STAT_GET(flowtab->stats.stat_preflow_single));
+    }
+    if (flowtab->max_memory) {
+        g_debug("  Memory budget %" PRIu64 " bytes, %zu in use; "
+                "%" PRIu64 " flows with reduced payload, %" PRIu64
+                " without DPI, %" PRIu64 " evicted.",
+                flowtab->max_memory, yfFlowTabMemUsed(flowtab),
+                flowtab->stats.stat_mem_shrunk,
+                flowtab->stats.stat_mem_nodpi,
+                flowtab->stats.stat_mem_evicted);
+    }
+    slbDumpStats(flowtab->slab);
 #ifdef YAF_MPLS
     if (flowtab->mpls_mode) {
         g_debug("  %u Max. MPLS Nodes.", flowtab->stats.max_mpls_labels);
@@ -3104,8 +5683,8 @@ yfFlowDumpStats(
                   flowtab->stats.stat_seqrej);
     }
     g_debug("  %" PRIu64 " asymmetric/unidirectional flows detected (%2.2f%%)",
-            flowtab->stats.stat_uniflows,
-            (((double)flowtab->stats.stat_uniflows) /
+            YF_STAT_GET(flowtab->stats.stat_uniflows),
+            (((double)YF_STAT_GET(flowtab->stats.stat_uniflows)) /
              ((double)flowtab->stats.stat_flows)) * 100);
 
     return flowtab->stats.stat_packets;